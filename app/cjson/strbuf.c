@@ -46,6 +46,8 @@ int strbuf_init(strbuf_t *s, int len)
     s->dynamic = 0;
     s->reallocs = 0;
     s->debug = 0;
+    s->flush = NULL;
+    s->flush_arg = NULL;
 
     s->buf = (char *)cjson_mem_malloc(size);
     if (!s->buf){
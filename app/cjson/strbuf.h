@@ -30,9 +30,11 @@
  * Length: String length, excluding optional NULL terminator.
  * Increment: Allocation increments when resizing the string buffer.
  * Dynamic: True if created via strbuf_new()
+ * Flush: Optional, called to empty a full buffer before growing it.
+ *        It must consume the contents and reset the length.
  */
 
-typedef struct {
+typedef struct strbuf_s {
     char *buf;
     int size;
     int length;
@@ -40,6 +42,8 @@ typedef struct {
     int dynamic;
     int reallocs;
     int debug;
+    void (*flush)(struct strbuf_s *s);
+    void *flush_arg;
 } strbuf_t;
 
 #ifndef STRBUF_DEFAULT_SIZE
@@ -95,8 +99,14 @@ static inline int strbuf_empty_length(strbuf_t *s)
 
 static inline void strbuf_ensure_empty_length(strbuf_t *s, int len)
 {
-    if (len > strbuf_empty_length(s))
+    if (len > strbuf_empty_length(s)) {
+        if (s->flush && s->length) {
+            s->flush(s);
+            if (len <= strbuf_empty_length(s))
+                return;
+        }
         strbuf_resize(s, s->length + len);
+    }
 }
 
 static inline char *strbuf_empty_ptr(strbuf_t *s)
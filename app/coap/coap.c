@@ -1,11 +1,24 @@
 #include "user_config.h"
 #include "c_stdio.h"
 #include "c_string.h"
+#include "c_stdlib.h"
 #include "coap.h"
+#include "hash.h"
 #include "uri.h"
 
 extern void endpoint_setup(void);
-extern const coap_endpoint_t endpoints[];
+
+typedef struct coap_resource_t
+{
+    coap_key_t key;                     /* hash of the path segments */
+    const coap_endpoint_t *ep;
+    coap_luser_entry *entry;            /* last path segment, NULL for the endpoint itself */
+    struct coap_resource_t *next;
+} coap_resource_t;
+
+static coap_resource_t *resources[COAP_RESOURCE_BUCKETS];
+
+#define COAP_RESOURCE_BUCKET(key) (((key)[0] ^ (key)[1] ^ (key)[2] ^ (key)[3]) & (COAP_RESOURCE_BUCKETS - 1))
 
 #ifdef COAP_DEBUG
 void coap_dumpHeader(coap_header_t *hdr)
@@ -217,41 +230,43 @@ int coap_parseOptionsAndPayload(coap_option_t *options, uint8_t *numOptions, coa
 
 int coap_buildOptionHeader(uint32_t optDelta, size_t length, uint8_t *buf, size_t buflen)
 {
-    int n = 0;
+    int n = 1;
     uint8_t *p = buf;
-    uint8_t len, delta = 0;
-
-    if (buflen < 5)
-        return COAP_ERR_BUFFER_TOO_SMALL;
+    uint8_t len = 0, delta = 0;
 
+    if (optDelta > 0xFFFF+269 || length > 0xFFFF+269)
+        return -COAP_ERR_OPTION_TOO_BIG;
     coap_option_nibble(optDelta, &delta);
     coap_option_nibble(length, &len);
 
+    // 13 and 14 take one and two extension bytes
+    if (delta >= 13)
+        n += delta - 12;
+    if (len >= 13)
+        n += len - 12;
+    if (buflen < (size_t)n)
+        return -COAP_ERR_BUFFER_TOO_SMALL;
+
     *p++ = (0xFF & (delta << 4 | len));
-    n++;
     if (delta == 13)
     {
         *p++ = (optDelta - 13);
-        n++;
     }
     else
     if (delta == 14)
     {
         *p++ = ((optDelta-269) >> 8);
         *p++ = (0xFF & (optDelta-269));
-        n+=2;
     }
     if (len == 13)
     {
         *p++ = (length - 13);
-        n++;
     }
     else
     if (len == 14)
     {
-        *p++ = (length >> 8);
+        *p++ = ((length-269) >> 8);
         *p++ = (0xFF & (length-269));
-        n+=2;
     }
     return n;
 }
@@ -332,31 +347,28 @@ int coap_buffer_to_string(char *strbuf, size_t strbuflen, const coap_buffer_t *b
 
 int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt)
 {
-    size_t opts_len = 0, hdr_len = 0, tok_len = 0;
     size_t i;
     uint8_t *p = buf;
     size_t left = *buflen;
     uint16_t running_delta = 0;
+    int rc;
 
-    hdr_len = coap_buildHeader(&(pkt->hdr), buf, *buflen);
-    p += hdr_len;
-    left -= hdr_len;
+    if (left < 4U + pkt->hdr.tkl)
+        return COAP_ERR_BUFFER_TOO_SMALL;
+    if ((pkt->hdr.tkl > 0) && (pkt->hdr.tkl != pkt->tok.len))
+        return COAP_ERR_UNSUPPORTED;
 
-    tok_len = coap_buildToken(&(pkt->tok), &(pkt->hdr), buf, *buflen);
-    p += tok_len;
-    left -= tok_len;
+    p += coap_buildHeader(&(pkt->hdr), buf, *buflen);
+    p += coap_buildToken(&(pkt->tok), &(pkt->hdr), buf, *buflen);
+    left -= p - buf;
 
     for (i=0;i<pkt->numopts;i++)
     {
-        uint8_t len, delta = 0;
-        uint16_t optDelta = 0;
-        int rc = 0;
-
-        if (((size_t)(p-buf)) > *buflen)
-             return COAP_ERR_BUFFER_TOO_SMALL;
-        optDelta = pkt->opts[i].num - running_delta;
+        uint16_t optDelta = pkt->opts[i].num - running_delta;
 
         rc = coap_buildOptionHeader(optDelta, pkt->opts[i].buf.len, p, left);
+        if (rc < 0 || left - rc < pkt->opts[i].buf.len)
+            return COAP_ERR_BUFFER_TOO_SMALL;
         p += rc;
         left -= rc;
 
@@ -366,18 +378,15 @@ int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt)
         running_delta = pkt->opts[i].num;
     }
 
-    opts_len = (p - buf) - 4;   // number of bytes used by options
-
     if (pkt->payload.len > 0)
     {
-        if (*buflen < 4 + 1 + pkt->payload.len + opts_len)
+        if (left < 1 + pkt->payload.len)
             return COAP_ERR_BUFFER_TOO_SMALL;
-        buf[4 + opts_len] = 0xFF;  // payload marker
-        c_memcpy(buf+5 + opts_len, pkt->payload.p, pkt->payload.len);
-        *buflen = opts_len + 5 + pkt->payload.len;
+        *p++ = 0xFF;  // payload marker
+        c_memcpy(p, pkt->payload.p, pkt->payload.len);
+        p += pkt->payload.len;
     }
-    else
-        *buflen = opts_len + 4;
+    *buflen = p - buf;
     return 0;
 }
 
@@ -405,7 +414,9 @@ int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint
     pkt->hdr.code = rspcode;
     pkt->hdr.id[0] = msgid_hi;
     pkt->hdr.id[1] = msgid_lo;
-    pkt->numopts = 1;
+    pkt->numopts = 0;
+    pkt->payload.p = content;
+    pkt->payload.len = content_len;
 
     // need token in response
     if (tok) {
@@ -413,6 +424,9 @@ int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint
         pkt->tok = *tok;
     }
 
+    if (content_type == COAP_CONTENTTYPE_NONE)
+        return 0;
+
     // safe because 1 < MAXOPT
     pkt->opts[0].num = COAP_OPTION_CONTENT_FORMAT;
     pkt->opts[0].buf.p = scratch->p;
@@ -421,11 +435,95 @@ int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint
     scratch->p[0] = ((uint16_t)content_type & 0xFF00) >> 8;
     scratch->p[1] = ((uint16_t)content_type & 0x00FF);
     pkt->opts[0].buf.len = 2;
-    pkt->payload.p = content;
-    pkt->payload.len = content_len;
+    pkt->numopts = 1;
+    // leave the rest of scratch to coap_add_option()
+    scratch->p += 2;
+    scratch->len -= 2;
     return 0;
 }
 
+// http://tools.ietf.org/html/rfc7959#section-2.4
+// Sends the block of content the request asks for in its Block2 option. Content
+// that fits one block goes out as a plain response unless a block was asked for.
+// inpkt may be NULL, the first block is sent then.
+int coap_make_block_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const coap_packet_t *inpkt, const uint8_t *content, size_t content_len, uint8_t msgid_hi, uint8_t msgid_lo, const coap_buffer_t* tok, coap_responsecode_t rspcode, coap_content_type_t content_type)
+{
+    uint32_t block_num = 0, offset;
+    uint8_t more = 0, szx = COAP_BLOCK_SZX_MAX;
+    size_t size;
+    int rc, requested = 0;
+
+    if (inpkt)
+        requested = coap_get_block(inpkt, COAP_OPTION_BLOCK2, &block_num, &more, &szx);
+    if (!requested && content_len <= COAP_BLOCK_SIZE(szx))
+        return coap_make_response(scratch, pkt, content, content_len, msgid_hi, msgid_lo, tok, rspcode, content_type);
+
+    offset = block_num << (szx + 4);
+    if (offset > content_len || (offset == content_len && offset > 0))
+        return coap_make_response(scratch, pkt, NULL, 0, msgid_hi, msgid_lo, tok, COAP_RSPCODE_BAD_OPTION, COAP_CONTENTTYPE_NONE);
+
+    size = content_len - offset;
+    more = size > COAP_BLOCK_SIZE(szx);
+    if (more)
+        size = COAP_BLOCK_SIZE(szx);
+
+    if (0 != (rc = coap_make_response(scratch, pkt, content + offset, size, msgid_hi, msgid_lo, tok, rspcode, content_type)))
+        return rc;
+    if (0 != (rc = coap_add_option(scratch, pkt, COAP_OPTION_BLOCK2, (block_num << 4) | (more << 3) | szx)))
+        return rc;
+    if (block_num == 0)
+        rc = coap_add_option(scratch, pkt, COAP_OPTION_SIZE2, content_len);
+    return rc;
+}
+
+// Adds an uint option taking its value from scratch. Options are kept sorted by
+// number, as coap_build() expects.
+int coap_add_option(coap_rw_buffer_t *scratch, coap_packet_t *pkt, uint8_t num, uint32_t value)
+{
+    int i, n;
+
+    if (pkt->numopts >= MAXOPT || scratch->len < sizeof(value))
+        return COAP_ERR_BUFFER_TOO_SMALL;
+
+    n = coap_encode_var_bytes(scratch->p, value);
+    for (i = pkt->numopts; i > 0 && pkt->opts[i-1].num > num; i--)
+        pkt->opts[i] = pkt->opts[i-1];
+    pkt->opts[i].num = num;
+    pkt->opts[i].buf.p = scratch->p;
+    pkt->opts[i].buf.len = n;
+    pkt->numopts++;
+    scratch->p += n;
+    scratch->len -= n;
+    return 0;
+}
+
+// returns 1 and the value if the packet carries the uint option
+int coap_get_option_uint(const coap_packet_t *pkt, uint8_t num, uint32_t *value)
+{
+    uint8_t count;
+    size_t i;
+    const coap_option_t *opt = coap_findOptions(pkt, num, &count);
+
+    if (NULL == opt || opt->buf.len > sizeof(*value))
+        return 0;
+    *value = 0;
+    for (i = 0; i < opt->buf.len; i++)
+        *value = (*value << 8) | opt->buf.p[i];
+    return 1;
+}
+
+// returns 1 if the packet carries a valid Block1/Block2 option
+int coap_get_block(const coap_packet_t *pkt, uint8_t num, uint32_t *block_num, uint8_t *more, uint8_t *szx)
+{
+    uint32_t value;
+
+    if (!coap_get_option_uint(pkt, num, &value) || (value & 0x07) == 7)   // szx 7 is reserved
+        return 0;
+    *block_num = value >> 4;
+    *more = (value >> 3) & 0x01;
+    *szx = value & 0x07;
+    return 1;
+}
 
 unsigned int coap_encode_var_bytes(unsigned char *buf, unsigned int val) {
   unsigned int n, i;
@@ -446,6 +544,11 @@ static uint8_t _token_data[4] = {'n','o','d','e'};
 coap_buffer_t the_token = { _token_data, 4 };
 static unsigned short message_id;
 
+uint16_t coap_new_message_id(void)
+{
+    return message_id++;
+}
+
 int coap_make_request(coap_rw_buffer_t *scratch, coap_packet_t *pkt, coap_msgtype_t t, coap_method_t m, coap_uri_t *uri, const uint8_t *payload, size_t payload_len)
 {
     int res;
@@ -505,41 +608,73 @@ int coap_make_request(coap_rw_buffer_t *scratch, coap_packet_t *pkt, coap_msgtyp
     return 0;
 }
 
-// FIXME, if this looked in the table at the path before the method then
-// it could more easily return 405 errors
-int coap_handle_req(coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt)
+int coap_resource_add(const coap_endpoint_t *ep, coap_luser_entry *entry)
 {
-    const coap_option_t *opt;
+    coap_resource_t *r;
     int i;
-    uint8_t count;
-    const coap_endpoint_t *ep = endpoints;
 
-    while(NULL != ep->handler)
+    r = (coap_resource_t *)c_zalloc(sizeof(coap_resource_t));
+    if (r == NULL)
+        return 0;
+
+    for (i = 0; i < ep->path->count; i++)
+        coap_hash_segment((const uint8_t *)ep->path->elems[i], c_strlen(ep->path->elems[i]), r->key);
+    if (entry)
+        coap_hash_segment((const uint8_t *)entry->name, c_strlen(entry->name), r->key);
+    r->ep = ep;
+    r->entry = entry;
+
+    i = COAP_RESOURCE_BUCKET(r->key);
+    r->next = resources[i];
+    resources[i] = r;
+    return 1;
+}
+
+// keys can collide, so a hit is confirmed against the path itself
+static int coap_resource_match(const coap_resource_t *r, const coap_option_t *opt, uint8_t count)
+{
+    const coap_endpoint_path_t *path = r->ep->path;
+    int i;
+
+    if (count != path->count + (r->entry ? 1 : 0))
+        return 0;
+    for (i = 0; i < path->count; i++)
+    {
+        if (opt[i].buf.len != c_strlen(path->elems[i]))
+            return 0;
+        if (0 != c_memcmp(path->elems[i], opt[i].buf.p, opt[i].buf.len))
+            return 0;
+    }
+    if (r->entry)
+        return opt[i].buf.len == c_strlen(r->entry->name) && 0 == c_memcmp(r->entry->name, opt[i].buf.p, opt[i].buf.len);
+    return 1;
+}
+
+int coap_handle_req(coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, const coap_peer_t *peer)
+{
+    const coap_option_t *opt;
+    const coap_resource_t *r;
+    coap_key_t key = {0};
+    coap_responsecode_t rspcode = COAP_RSPCODE_NOT_FOUND;
+    uint8_t i, count;
+
+    opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count);
+    for (i = 0; i < count; i++)
+        coap_hash_segment(opt[i].buf.p, opt[i].buf.len, key);
+
+    for (r = resources[COAP_RESOURCE_BUCKET(key)]; NULL != r; r = r->next)
     {
-        if (ep->method != inpkt->hdr.code)
-            goto next;
-        if (NULL != (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)))
+        if (0 != c_memcmp(r->key, key, sizeof(coap_key_t)) || !coap_resource_match(r, opt, count))
+            continue;
+        if (r->ep->method != inpkt->hdr.code)
         {
-            // if (count != ep->path->count)
-            if ((count != ep->path->count ) && (count != ep->path->count + 1)) // +1 for /f/[function], /v/[variable]
-                goto next;
-            for (i=0;i<ep->path->count;i++)
-            {
-                if (opt[i].buf.len != c_strlen(ep->path->elems[i]))
-                    goto next;
-                if (0 != c_memcmp(ep->path->elems[i], opt[i].buf.p, opt[i].buf.len))
-                    goto next;
-            }
-            // pre-path match!
-            if (count==ep->path->count+1 && ep->user_entry == NULL)
-                goto next;
-            return ep->handler(ep, scratch, inpkt, outpkt, inpkt->hdr.id[0], inpkt->hdr.id[1]);
+            rspcode = COAP_RSPCODE_METHOD_NOT_ALLOWED;
+            continue;
         }
-next:
-        ep++;
+        return r->ep->handler(r->ep, r->entry, peer, scratch, inpkt, outpkt, inpkt->hdr.id[0], inpkt->hdr.id[1]);
     }
 
-    coap_make_response(scratch, outpkt, NULL, 0, inpkt->hdr.id[0], inpkt->hdr.id[1], &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    coap_make_response(scratch, outpkt, NULL, 0, inpkt->hdr.id[0], inpkt->hdr.id[1], &inpkt->tok, rspcode, COAP_CONTENTTYPE_NONE);
 
     return 0;
 }
@@ -16,6 +16,12 @@ extern "C" {
 #define MAX_REQUEST_SIZE 576
 #define MAX_REQ_SCRATCH_SIZE 60
 
+#define COAP_RESOURCE_BUCKETS 16    // must be a power of 2
+#define COAP_MAX_OBSERVERS 8
+#define COAP_BLOCK_SZX_MAX 6        // 1024 byte blocks, the largest that fits MAX_PAYLOAD_SIZE
+#define COAP_BLOCK_SIZE(szx) (1 << ((szx) + 4))
+#define COAP_BLOCK1_MAX 4096        // largest request payload reassembled from Block1 transfers
+
 #define COAP_RESPONSE_CLASS(C) (((C) >> 5) & 0xFF)
 
 //http://tools.ietf.org/html/rfc7252#section-3
@@ -59,6 +65,16 @@ typedef struct
     coap_rw_buffer_t content;       // content->p = malloc(...) , and free it when done.
 } coap_packet_t;
 
+typedef unsigned char coap_key_t[4];
+
+/* where a request came from, notifications are sent back through conn */
+typedef struct
+{
+    uint8_t ip[4];
+    int port;
+    void *conn;
+} coap_peer_t;
+
 /////////////////////////////////////////
 
 //http://tools.ietf.org/html/rfc7252#section-12.2
@@ -77,8 +93,12 @@ typedef enum
     COAP_OPTION_URI_QUERY = 15,
     COAP_OPTION_ACCEPT = 17,
     COAP_OPTION_LOCATION_QUERY = 20,
+    COAP_OPTION_BLOCK2 = 23,    // http://tools.ietf.org/html/rfc7959#section-2.1
+    COAP_OPTION_BLOCK1 = 27,
+    COAP_OPTION_SIZE2 = 28,
     COAP_OPTION_PROXY_URI = 35,
-    COAP_OPTION_PROXY_SCHEME = 39
+    COAP_OPTION_PROXY_SCHEME = 39,
+    COAP_OPTION_SIZE1 = 60
 } coap_option_num_t;
 
 //http://tools.ietf.org/html/rfc7252#section-12.1.1
@@ -107,7 +127,13 @@ typedef enum
     COAP_RSPCODE_CONTENT = MAKE_RSPCODE(2, 5),
     COAP_RSPCODE_NOT_FOUND = MAKE_RSPCODE(4, 4),
     COAP_RSPCODE_BAD_REQUEST = MAKE_RSPCODE(4, 0),
-    COAP_RSPCODE_CHANGED = MAKE_RSPCODE(2, 4)
+    COAP_RSPCODE_CHANGED = MAKE_RSPCODE(2, 4),
+    COAP_RSPCODE_CONTINUE = MAKE_RSPCODE(2, 31),
+    COAP_RSPCODE_BAD_OPTION = MAKE_RSPCODE(4, 2),
+    COAP_RSPCODE_METHOD_NOT_ALLOWED = MAKE_RSPCODE(4, 5),
+    COAP_RSPCODE_REQUEST_ENTITY_INCOMPLETE = MAKE_RSPCODE(4, 8),
+    COAP_RSPCODE_REQUEST_ENTITY_TOO_LARGE = MAKE_RSPCODE(4, 13),
+    COAP_RSPCODE_INTERNAL_SERVER_ERROR = MAKE_RSPCODE(5, 0)
 } coap_responsecode_t;
 
 //http://tools.ietf.org/html/rfc7252#section-12.3
@@ -142,8 +168,10 @@ typedef enum
 
 ///////////////////////
 typedef struct coap_endpoint_t coap_endpoint_t;
+typedef struct coap_luser_entry coap_luser_entry;
 
-typedef int (*coap_endpoint_func)(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo);
+// entry is the user variable/function the path names, NULL for the endpoint itself
+typedef int (*coap_endpoint_func)(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo);
 #define MAX_SEGMENTS 3  // 2 = /foo/bar, 3 = /foo/bar/baz
 #define MAX_SEGMENTS_SIZE   16
 typedef struct
@@ -152,8 +180,6 @@ typedef struct
     const char *elems[MAX_SEGMENTS];
 } coap_endpoint_path_t;
 
-typedef struct coap_luser_entry coap_luser_entry;
-
 struct coap_luser_entry{
     // int ref;
     // char name[MAX_SEGMENTS_SIZE+1];         // +1 for string '\0'
@@ -185,10 +211,21 @@ const coap_option_t *coap_findOptions(const coap_packet_t *pkt, uint8_t num, uin
 int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt);
 void coap_dump(const uint8_t *buf, size_t buflen, bool bare);
 int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint8_t *content, size_t content_len, uint8_t msgid_hi, uint8_t msgid_lo, const coap_buffer_t* tok, coap_responsecode_t rspcode, coap_content_type_t content_type);
-int coap_handle_req(coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt);
+int coap_make_block_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const coap_packet_t *inpkt, const uint8_t *content, size_t content_len, uint8_t msgid_hi, uint8_t msgid_lo, const coap_buffer_t* tok, coap_responsecode_t rspcode, coap_content_type_t content_type);
+int coap_add_option(coap_rw_buffer_t *scratch, coap_packet_t *pkt, uint8_t num, uint32_t value);
+int coap_get_option_uint(const coap_packet_t *pkt, uint8_t num, uint32_t *value);
+int coap_get_block(const coap_packet_t *pkt, uint8_t num, uint32_t *block_num, uint8_t *more, uint8_t *szx);
+unsigned int coap_encode_var_bytes(unsigned char *buf, unsigned int val);
+uint16_t coap_new_message_id(void);
+int coap_resource_add(const coap_endpoint_t *ep, coap_luser_entry *entry);
+int coap_handle_req(coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, const coap_peer_t *peer);
 void coap_option_nibble(uint32_t value, uint8_t *nibble);
 void coap_setup(void);
 void endpoint_setup(void);
+int endpoint_add_entry(coap_luser_entry *head, coap_luser_entry *entry);
+void endpoint_release(void *conn);
+int coap_notify(coap_luser_entry *entry);
+void coap_observe_reset(const coap_packet_t *pkt, const coap_peer_t *peer);
 
 int coap_buildOptionHeader(uint32_t optDelta, size_t length, uint8_t *buf, size_t buflen);
 int check_token(coap_packet_t *pkt);
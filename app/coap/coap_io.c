@@ -4,7 +4,7 @@
 #include "espconn.h"
 #include "coap_timer.h"
 
-extern coap_queue_t *gQueue;
+extern coap_sendqueue_t gQueue;
 
 /* releases space allocated by PDU if free_pdu is set */
 coap_tid_t coap_send(struct espconn *pesp_conn, coap_pdu_t *pdu) {
@@ -28,7 +28,6 @@ coap_tid_t coap_send(struct espconn *pesp_conn, coap_pdu_t *pdu) {
 
 coap_tid_t coap_send_confirmed(struct espconn *pesp_conn, coap_pdu_t *pdu) {
   coap_queue_t *node;
-  coap_tick_t diff;
   uint32_t r;
 
   node = coap_new_node();
@@ -54,18 +53,7 @@ coap_tid_t coap_send_confirmed(struct espconn *pesp_conn, coap_pdu_t *pdu) {
   node->pconn = pesp_conn;
   node->pdu = pdu;
 
-  /* Set timer for pdu retransmission. If this is the first element in
-   * the retransmission queue, the base time is set to the current
-   * time and the retransmission time is node->timeout. If there is
-   * already an entry in the sendqueue, we must check if this node is
-   * to be retransmitted earlier. Therefore, node->timeout is first
-   * normalized to the timeout and then inserted into the queue with
-   * an adjusted relative time.
-   */
-  coap_timer_stop();
-  coap_timer_update(&gQueue);
-  node->t = node->timeout;  
   coap_insert_node(&gQueue, node);
-  coap_timer_start(&gQueue);
+  coap_timer_start(node);
   return node->id;
 }
@@ -5,7 +5,9 @@
 extern "C" {
 #endif
 
-size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen);
+#include "coap.h"
+
+size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen, const coap_peer_t *peer);
 
 #ifdef __cplusplus
 }
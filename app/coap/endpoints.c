@@ -10,16 +10,198 @@
 #include "os_type.h"
 #include "user_interface.h"
 #include "user_config.h"
+#include "espconn.h"
 
 void build_well_known_rsp(char *rsp, uint16_t rsplen);
 
-void endpoint_setup(void)
+/* a client observing a variable, http://tools.ietf.org/html/rfc7641 */
+typedef struct coap_observer_t
 {
-    coap_setup();
+    coap_luser_entry *entry;
+    coap_peer_t peer;
+    uint8_t token[8];
+    uint8_t tkl;
+    uint8_t id[2];                      /* message id of the last notification, a RST to it cancels */
+    struct coap_observer_t *next;
+} coap_observer_t;
+
+static coap_observer_t *observers = NULL;
+static uint32_t observe_seq = 0;
+
+/* a payload too large for one message, sent or received block by block */
+typedef struct
+{
+    coap_luser_entry *entry;
+    coap_peer_t peer;
+    uint8_t *data;
+    size_t len;
+} coap_transfer_t;
+
+static coap_transfer_t upload;          /* Block1 request being reassembled */
+static coap_transfer_t download;        /* function result the client fetches with Block2 */
+
+static bool coap_peer_equal(const coap_peer_t *a, const coap_peer_t *b)
+{
+    return a->port == b->port && 0 == c_memcmp(a->ip, b->ip, sizeof(a->ip));
+}
+
+static void coap_transfer_free(coap_transfer_t *t)
+{
+    if (t->data)
+        c_free(t->data);
+    c_memset(t, 0, sizeof(coap_transfer_t));
+}
+
+static bool coap_transfer_match(const coap_transfer_t *t, const coap_luser_entry *entry, const coap_peer_t *peer)
+{
+    return t->entry == entry && coap_peer_equal(&t->peer, peer);
+}
+
+static coap_observer_t *coap_observe_find(const coap_peer_t *peer, const coap_buffer_t *tok)
+{
+    coap_observer_t *o;
+    for (o = observers; NULL != o; o = o->next)
+    {
+        if (coap_peer_equal(&o->peer, peer) && o->tkl == tok->len && 0 == c_memcmp(o->token, tok->p, tok->len))
+            return o;
+    }
+    return NULL;
+}
+
+static void coap_observe_remove(coap_observer_t *o)
+{
+    coap_observer_t **p = &observers;
+    while (*p != o)
+        p = &(*p)->next;
+    *p = o->next;
+    c_free(o);
+}
+
+static bool coap_observe_add(coap_luser_entry *entry, const coap_peer_t *peer, const coap_buffer_t *tok)
+{
+    coap_observer_t *o;
+    int n = 0;
+
+    if (tok->len > sizeof(o->token))
+        return false;
+    if (NULL == (o = coap_observe_find(peer, tok)))
+    {
+        for (o = observers; NULL != o; o = o->next)
+            n++;
+        if (n >= COAP_MAX_OBSERVERS)
+            return false;   // the response then goes out without Observe, telling the client it is not registered
+        o = (coap_observer_t *)c_zalloc(sizeof(coap_observer_t));
+        if (NULL == o)
+            return false;
+        o->next = observers;
+        observers = o;
+    }
+    o->entry = entry;
+    o->peer = *peer;
+    o->tkl = tok->len;
+    c_memcpy(o->token, tok->p, tok->len);
+    return true;
+}
+
+void coap_observe_reset(const coap_packet_t *pkt, const coap_peer_t *peer)
+{
+    coap_observer_t *o;
+    for (o = observers; NULL != o; o = o->next)
+    {
+        if (coap_peer_equal(&o->peer, peer) && 0 == c_memcmp(o->id, pkt->hdr.id, sizeof(o->id)))
+        {
+            NODE_DBG("observer cancelled.\n");
+            coap_observe_remove(o);
+            return;
+        }
+    }
+}
+
+// Sends the current value of a variable to everyone observing it, returns the
+// number of notifications sent. Notifications are non-confirmable; a value
+// larger than one block sends its first block and the client fetches the rest.
+int coap_notify(coap_luser_entry *entry)
+{
+    lua_State *L = lua_getstate();
+    coap_observer_t *o, *next;
+    uint8_t scratch_raw[MAX_REQ_SCRATCH_SIZE];
+    uint8_t *buf;
+    const char *res = NULL;
+    size_t len = 0, rlen;
+    uint16_t id;
+    int n, sent = 0;
+
+    buf = (uint8_t *)c_malloc(MAX_MESSAGE_SIZE);
+    if (buf == NULL)
+        return 0;
+
+    n = lua_gettop(L);
+    lua_getglobal(L, entry->name);
+    if (lua_isnumber(L, -1) || lua_isstring(L, -1))
+        res = lua_tolstring(L, -1, &len);
+
+    observe_seq = (observe_seq + 1) & 0xFFFFFF;
+    for (o = observers; NULL != o; o = next)
+    {
+        coap_packet_t pkt;
+        coap_buffer_t tok = {o->token, o->tkl};
+        coap_rw_buffer_t scratch = {scratch_raw, sizeof(scratch_raw)};
+        struct espconn *conn = (struct espconn *)o->peer.conn;
+
+        next = o->next;
+        if (o->entry != entry)
+            continue;
+
+        id = coap_new_message_id();
+        o->id[0] = id >> 8;
+        o->id[1] = id & 0xFF;
+        if (res)
+        {
+            coap_make_block_response(&scratch, &pkt, NULL, (const uint8_t *)res, len, o->id[0], o->id[1], &tok, COAP_RSPCODE_CONTENT, entry->content_type);
+            coap_add_option(&scratch, &pkt, COAP_OPTION_OBSERVE, observe_seq);
+        }
+        else
+        {
+            // the variable is gone, which ends the observation
+            coap_make_response(&scratch, &pkt, NULL, 0, o->id[0], o->id[1], &tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+        }
+        pkt.hdr.t = COAP_TYPE_NONCON;
+
+        rlen = MAX_MESSAGE_SIZE;
+        if (0 == coap_build(buf, &rlen, &pkt))
+        {
+            conn->proto.udp->remote_port = o->peer.port;
+            c_memcpy(conn->proto.udp->remote_ip, o->peer.ip, sizeof(o->peer.ip));
+            espconn_sent(conn, buf, rlen);
+            sent++;
+        }
+        if (!res)
+            coap_observe_remove(o);
+    }
+
+    lua_settop(L, n);
+    c_free(buf);
+    return sent;
+}
+
+// Drops the observers and transfers of a closed server
+void endpoint_release(void *conn)
+{
+    coap_observer_t *o, *next;
+    for (o = observers; NULL != o; o = next)
+    {
+        next = o->next;
+        if (o->peer.conn == conn)
+            coap_observe_remove(o);
+    }
+    if (upload.peer.conn == conn)
+        coap_transfer_free(&upload);
+    if (download.peer.conn == conn)
+        coap_transfer_free(&download);
 }
 
 static const coap_endpoint_path_t path_well_known_core = {2, {".well-known", "core"}};
-static int handle_get_well_known_core(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+static int handle_get_well_known_core(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
     outpkt->content.p = (uint8_t *)c_zalloc(MAX_PAYLOAD_SIZE);      // this should be free-ed when outpkt is built in coap_server_respond()
     if(outpkt->content.p == NULL){
@@ -28,143 +210,180 @@ static int handle_get_well_known_core(const coap_endpoint_t *ep, coap_rw_buffer_
     }
     outpkt->content.len = MAX_PAYLOAD_SIZE;
     build_well_known_rsp(outpkt->content.p, outpkt->content.len);
-    return coap_make_response(scratch, outpkt, (const uint8_t *)outpkt->content.p, c_strlen(outpkt->content.p), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_APPLICATION_LINKFORMAT);
+    return coap_make_block_response(scratch, outpkt, inpkt, (const uint8_t *)outpkt->content.p, c_strlen(outpkt->content.p), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_APPLICATION_LINKFORMAT);
 }
 
 static const coap_endpoint_path_t path_variable = {2, {"v1", "v"}};
-static int handle_get_variable(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+static int handle_get_variable(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
-    const coap_option_t *opt;
-    uint8_t count;
-    int n;
+    uint32_t observe;
+    size_t len;
+    int n, rc;
     lua_State *L = lua_getstate();
-    if (NULL != (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)))
+
+    if (NULL == entry)
+    {
+        NODE_DBG("/v1/v match.\n");
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
+    }
+
+    NODE_DBG("/v1/v/");
+    NODE_DBG((char *)entry->name);
+    NODE_DBG(" match.\n");
+    n = lua_gettop(L);
+    lua_getglobal(L, entry->name);
+    if (!lua_isnumber(L, -1) && !lua_isstring(L, -1)) {
+        NODE_DBG ("should be a number or string.\n");
+        lua_settop(L, n);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    }
+    const char *res = lua_tolstring(L, -1, &len);
+    lua_settop(L, n);
+    rc = coap_make_block_response(scratch, outpkt, inpkt, (const uint8_t *)res, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, entry->content_type);
+
+    // http://tools.ietf.org/html/rfc7641#section-3.1
+    if (rc == 0 && outpkt->hdr.code == COAP_RSPCODE_CONTENT && coap_get_option_uint(inpkt, COAP_OPTION_OBSERVE, &observe))
     {
-        if ((count != ep->path->count ) && (count != ep->path->count + 1)) // +1 for /f/[function], /v/[variable]
+        if (observe == 0)
         {
-            NODE_DBG("should never happen.\n");
-            goto end;
+            if (coap_observe_add(entry, peer, &inpkt->tok))
+                rc = coap_add_option(scratch, outpkt, COAP_OPTION_OBSERVE, observe_seq);
         }
-        if (count == ep->path->count + 1)
+        else if (observe == 1)
         {
-            coap_luser_entry *h = ep->user_entry->next;     // ->next: skip the first entry(head)
-            while(NULL != h){
-                if (opt[count-1].buf.len != c_strlen(h->name))
-                {
-                    h = h->next;
-                    continue;
-                }
-                if (0 == c_memcmp(h->name, opt[count-1].buf.p, opt[count-1].buf.len))
-                {
-                    NODE_DBG("/v1/v/");
-                    NODE_DBG((char *)h->name);
-                    NODE_DBG(" match.\n");
-                    if(c_strlen(h->name))
-                    {
-                        n = lua_gettop(L);
-                        lua_getglobal(L, h->name);
-                        if (!lua_isnumber(L, -1) && !lua_isstring(L, -1)) {
-                            NODE_DBG ("should be a number or string.\n");
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                        } else {
-                            const char *res = lua_tostring(L,-1);
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, (const uint8_t *)res, c_strlen(res), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, h->content_type);
-                        }
-                    }
-                } else {
-                    h = h->next;
-                }
-            }
-        }else{
-            NODE_DBG("/v1/v match.\n");
-            goto end;
+            coap_observer_t *o = coap_observe_find(peer, &inpkt->tok);
+            if (o)
+                coap_observe_remove(o);
         }
     }
-    NODE_DBG("none match.\n");
-end:
-    return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
+    return rc;
 }
 
 static const coap_endpoint_path_t path_function = {2, {"v1", "f"}};
-static int handle_post_function(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+static int handle_post_function(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
-    const coap_option_t *opt;
-    uint8_t count;
-    int n;
+    const uint8_t *payload = inpkt->payload.p;
+    size_t payload_len = inpkt->payload.len;
+    uint32_t block_num;
+    uint8_t more, szx;
+    int n, rc, block1;
     lua_State *L = lua_getstate();
-    if (NULL != (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)))
+
+    if (NULL == entry)
+    {
+        NODE_DBG("/v1/f match.\n");
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    }
+
+    // the rest of a result too large for one response, the function is not called again
+    if (coap_get_block(inpkt, COAP_OPTION_BLOCK2, &block_num, &more, &szx) && block_num > 0)
     {
-        if ((count != ep->path->count ) && (count != ep->path->count + 1)) // +1 for /f/[function], /v/[variable]
+        if (!coap_transfer_match(&download, entry, peer))
+            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_BAD_OPTION, COAP_CONTENTTYPE_NONE);
+        rc = coap_make_block_response(scratch, outpkt, inpkt, download.data, download.len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, entry->content_type);
+        if (((block_num + 1) << (szx + 4)) >= download.len)
         {
-            NODE_DBG("should never happen.\n");
-            goto end;
+            // last block, coap_server_respond() frees the result once it is sent
+            outpkt->content.p = download.data;
+            outpkt->content.len = download.len;
+            download.data = NULL;
+            coap_transfer_free(&download);
         }
-        if (count == ep->path->count + 1)
+        return rc;
+    }
+
+    // http://tools.ietf.org/html/rfc7959#section-2.5
+    block1 = coap_get_block(inpkt, COAP_OPTION_BLOCK1, &block_num, &more, &szx);
+    if (block1)
+    {
+        uint8_t *data;
+        if (block_num == 0)
         {
-            coap_luser_entry *h = ep->user_entry->next;     // ->next: skip the first entry(head)
-            while(NULL != h){
-                if (opt[count-1].buf.len != c_strlen(h->name))
-                {
-                    h = h->next;
-                    continue;
-                }
-                if (0 == c_memcmp(h->name, opt[count-1].buf.p, opt[count-1].buf.len))
-                {
-                    NODE_DBG("/v1/f/");
-                    NODE_DBG((char *)h->name);
-                    NODE_DBG(" match.\n");
-
-                    if(c_strlen(h->name))
-                    {
-                        n = lua_gettop(L);
-                        lua_getglobal(L, h->name);
-                        if (lua_type(L, -1) != LUA_TFUNCTION) {
-                            NODE_DBG ("should be a function\n");
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                        } else {
-                            lua_pushlstring(L, inpkt->payload.p, inpkt->payload.len);     // make sure payload.p is filled with '\0' after payload.len, or use lua_pushlstring
-                            lua_call(L, 1, 1);
-                            if (!lua_isnil(L, -1)){  /* get return? */
-                                if( lua_isstring(L, -1) )   // deal with the return string
-                                {
-                                    size_t len = 0;
-                                    const char *ret = luaL_checklstring( L, -1, &len );
-                                    if(len > MAX_PAYLOAD_SIZE){
-                                        lua_settop(L, n);
-                                        luaL_error( L, "return string:<MAX_PAYLOAD_SIZE" );
-                                        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                                    }
-                                    NODE_DBG((char *)ret);
-                                    NODE_DBG("\n");
-                                    lua_settop(L, n);
-                                    return coap_make_response(scratch, outpkt, ret, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
-                                } 
-                            } else {
-                                lua_settop(L, n);
-                                return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
-                            }
-                        }
-                    }
-                } else {
-                    h = h->next;
-                }
+            coap_transfer_free(&upload);
+            upload.entry = entry;
+            upload.peer = *peer;
+        }
+        else if (!coap_transfer_match(&upload, entry, peer) || (block_num << (szx + 4)) != upload.len)
+        {
+            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_REQUEST_ENTITY_INCOMPLETE, COAP_CONTENTTYPE_NONE);
+        }
+        if (upload.len + payload_len > COAP_BLOCK1_MAX)
+        {
+            coap_transfer_free(&upload);
+            rc = coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_REQUEST_ENTITY_TOO_LARGE, COAP_CONTENTTYPE_NONE);
+            return rc ? rc : coap_add_option(scratch, outpkt, COAP_OPTION_SIZE1, COAP_BLOCK1_MAX);
+        }
+        if (payload_len > 0)
+        {
+            data = (uint8_t *)c_realloc(upload.data, upload.len + payload_len);
+            if (NULL == data)
+            {
+                coap_transfer_free(&upload);
+                return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_INTERNAL_SERVER_ERROR, COAP_CONTENTTYPE_NONE);
             }
-        }else{
-            NODE_DBG("/v1/f match.\n");
-            goto end;
+            c_memcpy(data + upload.len, payload, payload_len);
+            upload.data = data;
+            upload.len += payload_len;
+        }
+        if (more)
+        {
+            rc = coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTINUE, COAP_CONTENTTYPE_NONE);
+            return rc ? rc : coap_add_option(scratch, outpkt, COAP_OPTION_BLOCK1, (block_num << 4) | (1 << 3) | szx);
         }
+        payload = upload.data;
+        payload_len = upload.len;
+    }
+
+    NODE_DBG("/v1/f/");
+    NODE_DBG((char *)entry->name);
+    NODE_DBG(" match.\n");
+    n = lua_gettop(L);
+    lua_getglobal(L, entry->name);
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        NODE_DBG ("should be a function\n");
+        lua_settop(L, n);
+        if (block1)
+            coap_transfer_free(&upload);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
     }
-    NODE_DBG("none match.\n");    
-end:
-    return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    lua_pushlstring(L, payload, payload_len);
+    if (block1)
+        coap_transfer_free(&upload);    // Lua has its own copy now
+    lua_call(L, 1, 1);
+    if (lua_isstring(L, -1))   // deal with the return string
+    {
+        size_t len = 0;
+        const char *ret = lua_tolstring(L, -1, &len);
+        if (len > COAP_BLOCK_SIZE(COAP_BLOCK_SZX_MAX))
+        {
+            // keep a copy so the following blocks are served without calling the function again
+            coap_transfer_free(&download);
+            download.data = (uint8_t *)c_malloc(len);
+            if (NULL == download.data)
+            {
+                lua_settop(L, n);
+                return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_INTERNAL_SERVER_ERROR, COAP_CONTENTTYPE_NONE);
+            }
+            c_memcpy(download.data, ret, len);
+            download.len = len;
+            download.entry = entry;
+            download.peer = *peer;
+            ret = download.data;
+        }
+        lua_settop(L, n);
+        rc = coap_make_block_response(scratch, outpkt, inpkt, (const uint8_t *)ret, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, entry->content_type);
+    } else {
+        lua_settop(L, n);
+        rc = coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, entry->content_type);
+    }
+    if (rc == 0 && block1)
+        rc = coap_add_option(scratch, outpkt, COAP_OPTION_BLOCK1, (block_num << 4) | szx);
+    return rc;
 }
 
 extern lua_Load gLoad;
 static const coap_endpoint_path_t path_command = {2, {"v1", "c"}};
-static int handle_post_command(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+static int handle_post_command(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
     if (inpkt->payload.len == 0)
         return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_BAD_REQUEST, COAP_CONTENTTYPE_TEXT_PLAIN);
@@ -189,7 +408,7 @@ static int handle_post_command(const coap_endpoint_t *ep, coap_rw_buffer_t *scra
 
 static uint32_t id = 0;
 static const coap_endpoint_path_t path_id = {2, {"v1", "id"}};
-static int handle_get_id(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+static int handle_get_id(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
     id = system_get_chip_id();
     return coap_make_response(scratch, outpkt, (const uint8_t *)(&id), sizeof(uint32_t), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
@@ -211,6 +430,28 @@ const coap_endpoint_t endpoints[] =
     {(coap_method_t)0, NULL, NULL, NULL, NULL}
 };
 
+void endpoint_setup(void)
+{
+    const coap_endpoint_t *ep;
+
+    coap_setup();
+    for (ep = endpoints; NULL != ep->handler; ep++)
+        coap_resource_add(ep, NULL);
+}
+
+// Makes a newly registered variable/function reachable, head is the list it was added to
+int endpoint_add_entry(coap_luser_entry *head, coap_luser_entry *entry)
+{
+    const coap_endpoint_t *ep;
+
+    for (ep = endpoints; NULL != ep->handler; ep++)
+    {
+        if (ep->user_entry == head)
+            return coap_resource_add(ep, entry);
+    }
+    return 0;
+}
+
 void build_well_known_rsp(char *rsp, uint16_t rsplen)
 {
     const coap_endpoint_t *ep = endpoints;
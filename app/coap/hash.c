@@ -18,6 +18,11 @@ void coap_hash(const unsigned char *s, unsigned int len, coap_key_t h) {
   }
 }
 
+void coap_hash_segment(const uint8_t *s, size_t len, coap_key_t h) {
+  coap_hash((const unsigned char *)"/", 1, h);
+  coap_hash((const unsigned char *)s, len, h);
+}
+
 void coap_transaction_id(const uint32_t ip, const uint32_t port, const coap_packet_t *pkt, coap_tid_t *id) {
   coap_key_t h;
   c_memset(h, 0, sizeof(coap_key_t));
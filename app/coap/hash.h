@@ -7,13 +7,16 @@ extern "C" {
 
 #include "coap.h"
 
-typedef unsigned char coap_key_t[4];
-
 /* CoAP transaction id */
 /*typedef unsigned short coap_tid_t; */
 typedef int coap_tid_t;
 #define COAP_INVALID_TID -1
 
+void coap_hash(const unsigned char *s, unsigned int len, coap_key_t h);
+
+/* hashes one Uri-Path segment into h, a path is hashed segment by segment */
+void coap_hash_segment(const uint8_t *s, size_t len, coap_key_t h);
+
 void coap_transaction_id(const uint32_t ip, const uint32_t port, const coap_packet_t *pkt, coap_tid_t *id);
 
 #ifdef __cplusplus
@@ -2,6 +2,8 @@
 #include "c_stdlib.h"
 #include "node.h"
 
+#define COAP_QUEUE_BUCKET(id) ((id) & (COAP_QUEUE_BUCKETS - 1))
+
 static inline coap_queue_t *
 coap_malloc_node(void) {
   return (coap_queue_t *)c_zalloc(sizeof(coap_queue_t));
@@ -11,58 +13,59 @@ void coap_free_node(coap_queue_t *node) {
   c_free(node);
 }
 
-int coap_insert_node(coap_queue_t **queue, coap_queue_t *node) {
-  coap_queue_t *p, *q;
+int coap_insert_node(coap_sendqueue_t *queue, coap_queue_t *node) {
+  coap_queue_t **bucket;
   if ( !queue || !node )
     return 0;
 
-  /* set queue head if empty */
-  if ( !*queue ) {
-    *queue = node;
-    return 1;
-  }
-
-  /* replace queue head if PDU's time is less than head's time */
-  q = *queue;
-  if (node->t < q->t) {
-    node->next = q;
-    *queue = node;
-    q->t -= node->t;		/* make q->t relative to node->t */
-    return 1;
-  }
+  bucket = &queue->buckets[COAP_QUEUE_BUCKET(node->id)];
+  node->next = *bucket;
+  node->queue = queue;
+  *bucket = node;
+  queue->count++;
+  return 1;
+}
 
-  /* search for right place to insert */
-  do {
-    node->t -= q->t;		/* make node-> relative to q->t */
-    p = q;
-    q = q->next;
-  } while (q && q->t <= node->t);
+int coap_unlink_node(coap_queue_t *node) {
+  coap_queue_t **p;
+  if ( !node || !node->queue )
+    return 0;
 
-  /* insert new item */
-  if (q) {
-    q->t -= node->t;		/* make q->t relative to node->t */
+  for (p = &node->queue->buckets[COAP_QUEUE_BUCKET(node->id)]; *p; p = &(*p)->next) {
+    if (*p == node) {
+      *p = node->next;
+      node->queue->count--;
+      node->queue = NULL;
+      node->next = NULL;
+      return 1;
+    }
   }
-  node->next = q;
-  p->next = node;
-  return 1;
+  return 0;
 }
 
 int coap_delete_node(coap_queue_t *node) {
   if ( !node )
     return 0;
 
+  timerwheel_cancel(&node->timer);
   coap_delete_pdu(node->pdu);
   coap_free_node(node);
 
   return 1;
 }
 
-void coap_delete_all(coap_queue_t *queue) {
+void coap_delete_all(coap_sendqueue_t *queue) {
+  coap_queue_t *node;
+  int i;
   if ( !queue )
     return;
 
-  coap_delete_all( queue->next );
-  coap_delete_node( queue );
+  for (i = 0; i < COAP_QUEUE_BUCKETS; i++) {
+    while ((node = queue->buckets[i]) != NULL) {
+      coap_unlink_node(node);
+      coap_delete_node(node);
+    }
+  }
 }
 
 coap_queue_t * coap_new_node(void) {
@@ -77,65 +80,24 @@ coap_queue_t * coap_new_node(void) {
   return node;
 }
 
-coap_queue_t * coap_peek_next( coap_queue_t *queue ) {
+coap_queue_t * coap_find_node(coap_sendqueue_t *queue, const coap_tid_t id) {
+  coap_queue_t *node;
   if ( !queue )
     return NULL;
 
-  return queue;
-}
-
-coap_queue_t * coap_pop_next( coap_queue_t **queue ) {		// this function is called inside timeout callback only.
-  coap_queue_t *next;
-
-  if ( !(*queue) )
-    return NULL;
-
-  next = *queue;
-  *queue = (*queue)->next;
-  // if (queue) {
-  //   queue->t += next->t;
-  // }
-  next->next = NULL;
-  return next;
+  for (node = queue->buckets[COAP_QUEUE_BUCKET(id)]; node; node = node->next) {
+    if (node->id == id)
+      return node;
+  }
+  return NULL;
 }
 
-int coap_remove_node( coap_queue_t **queue, const coap_tid_t id){
-  coap_queue_t *p, *q, *node;
-  if ( !queue ) 
-    return 0;
-  if ( !*queue )  // if empty
+int coap_remove_node(coap_sendqueue_t *queue, const coap_tid_t id) {
+  coap_queue_t *node = coap_find_node(queue, id);
+  if ( !node )
     return 0;
 
-  q = *queue;
-  if (q->id == id) {
-    node = q;
-    *queue = q->next;
-    node->next = NULL;
-    if(*queue){
-      (*queue)->t += node->t;
-    }
-    coap_delete_node(node);
-    return 1;
-  }
-
-  /* search for right node to remove */
-  while (q && q->id != id) {
-    p = q;
-    q = q->next;
-  }
-
-  /* find the node */
-  if (q) {
-    node = q; /* save the node */
-    p->next = q->next;  /* remove the node */
-    q = q->next;
-    node->next = NULL;
-    if (q)   // add node->t to the node after.
-    {
-      q->t += node->t;
-    }
-    coap_delete_node(node);
-    return 1;
-  }
-  return 0;
+  coap_unlink_node(node);
+  coap_delete_node(node);
+  return 1;
 }
@@ -8,21 +8,17 @@ extern "C" {
 #include "hash.h"
 #include "pdu.h"
 
-struct coap_queue_t;
-typedef uint32_t coap_tick_t;
+#include "task/timerwheel.h"
 
-/*
-1. queue(first)->t store when to send PDU for the next time, it's a base(absolute) time
-2. queue->next->t store the delta between time and base-time.  queue->next->t = timeout + now - basetime
-3. node->next->t store the delta between time and previous->t.  node->next->t = timeout + now - node->t - basetime
-4. time to fire:   10,   15,    18,    25
-		node->t:   10,   5,     3,     7
-*/
+#define COAP_QUEUE_BUCKETS 16   // must be a power of 2
+
+struct coap_sendqueue_t;
 
 typedef struct coap_queue_t {
-  struct coap_queue_t *next;
+  struct coap_queue_t *next;	/**< next node in the same bucket */
+  struct coap_sendqueue_t *queue;
 
-  coap_tick_t t;	        /**< when to send PDU for the next time */
+  timerwheel_timer_t timer;	/**< fires the next retransmission */
   unsigned char retransmit_cnt;	/**< retransmission counter, will be removed when zero */
   unsigned int timeout;		/**< the randomized timeout value */
 
@@ -33,23 +29,33 @@ typedef struct coap_queue_t {
   struct espconn *pconn;
 } coap_queue_t;
 
+/** Confirmable messages waiting for their ACK, hashed by transaction id. */
+typedef struct coap_sendqueue_t {
+  coap_queue_t *buckets[COAP_QUEUE_BUCKETS];
+  unsigned int count;
+} coap_sendqueue_t;
+
 void coap_free_node(coap_queue_t *node);
 
-/** Adds node to given queue, ordered by node->t. */
-int coap_insert_node(coap_queue_t **queue, coap_queue_t *node);
+/** Adds node to given queue. */
+int coap_insert_node(coap_sendqueue_t *queue, coap_queue_t *node);
+
+/** Takes node out of its queue without destroying it. */
+int coap_unlink_node(coap_queue_t *node);
 
-/** Destroys specified node. */
+/** Destroys specified node, stopping its timer. */
 int coap_delete_node(coap_queue_t *node);
 
 /** Removes all items from given queue and frees the allocated storage. */
-void coap_delete_all(coap_queue_t *queue);
+void coap_delete_all(coap_sendqueue_t *queue);
 
 /** Creates a new node suitable for adding to the CoAP sendqueue. */
 coap_queue_t *coap_new_node(void);
 
-coap_queue_t *coap_pop_next( coap_queue_t **queue );
+coap_queue_t *coap_find_node(coap_sendqueue_t *queue, const coap_tid_t id);
 
-int coap_remove_node( coap_queue_t **queue, const coap_tid_t id);
+/** Removes and destroys the node of transaction id, e.g. once it was acknowledged. */
+int coap_remove_node(coap_sendqueue_t *queue, const coap_tid_t id);
 
 #ifdef __cplusplus
 }
@@ -249,7 +249,7 @@ int check_segment(const unsigned char *s, size_t length) {
 int make_decoded_option(const unsigned char *s, size_t length, 
 		    unsigned char *buf, size_t buflen) {
   int res;
-  size_t written;
+  int written;
 
   if (!buflen) {
     NODE_DBG("make_decoded_option(): buflen is 0!\n");
@@ -264,9 +264,7 @@ int make_decoded_option(const unsigned char *s, size_t length,
   // written = coap_opt_setheader(buf, buflen, 0, res);
   written = coap_buildOptionHeader(0, res, buf, buflen);
 
-  assert(written <= buflen);
-
-  if (!written)			/* encoding error */
+  if (written <= 0)		/* encoding error */
     return -1;
 
   buf += written;		/* advance past option type/length */
@@ -0,0 +1,319 @@
+/*
+ * Base64, base64url and hex codecs shared by the crypto and encoder
+ * modules, the websocket client and enduser setup.
+ *
+ * The lookup tables live in flash, which only allows aligned 32-bit
+ * reads. They are therefore stored as words and read with TABLE_BYTE,
+ * instead of as byte arrays that would trap on every access.
+ */
+#include "codec.h"
+#include "user_config.h"
+
+#define TABLE_BYTE(t, i)  ((uint8_t)((t)[(i) >> 2] >> (((i) & 3) << 3)))
+#define INVALID           0xff
+
+/* "A-Za-z0-9+/" and "A-Za-z0-9-_" */
+static const uint32_t b64_chars[2][16] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+  {
+  0x44434241, 0x48474645, 0x4c4b4a49, 0x504f4e4d, 0x54535251, 0x58575655,
+  0x62615a59, 0x66656463, 0x6a696867, 0x6e6d6c6b, 0x7271706f, 0x76757473,
+  0x7a797877, 0x33323130, 0x37363534, 0x2f2b3938,
+  },
+  {
+  0x44434241, 0x48474645, 0x4c4b4a49, 0x504f4e4d, 0x54535251, 0x58575655,
+  0x62615a59, 0x66656463, 0x6a696867, 0x6e6d6c6b, 0x7271706f, 0x76757473,
+  0x7a797877, 0x33323130, 0x37363534, 0x5f2d3938,
+  }
+};
+
+/* "0123456789abcdef" */
+static const uint32_t hex_chars[4] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+  0x33323130, 0x37363534, 0x62613938, 0x66656463,
+};
+
+/* values of the ASCII characters in base64 and base64url, INVALID if none */
+static const uint32_t b64_values[32] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+  0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+  0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0x3effffff, 0x3fff3eff,
+  0x37363534, 0x3b3a3938, 0xffff3d3c, 0xffffffff, 0x020100ff, 0x06050403,
+  0x0a090807, 0x0e0d0c0b, 0x1211100f, 0x16151413, 0xff191817, 0x3fffffff,
+  0x1c1b1aff, 0x201f1e1d, 0x24232221, 0x28272625, 0x2c2b2a29, 0x302f2e2d,
+  0xff333231, 0xffffffff,
+};
+
+/* values of the ASCII hex digits, INVALID if none */
+static const uint32_t hex_values[32] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+  0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+  0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+  0x03020100, 0x07060504, 0xffff0908, 0xffffffff, 0x0c0b0aff, 0xff0f0e0d,
+  0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+  0x0c0b0aff, 0xff0f0e0d, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+  0xffffffff, 0xffffffff,
+};
+
+static inline uint8_t char_value (const uint32_t *table, uint8_t c)
+{
+  return c < 128 ? TABLE_BYTE(table, c) : INVALID;
+}
+
+
+size_t ICACHE_FLASH_ATTR codec_encoded_len (int alphabet, size_t len)
+{
+  return alphabet == CODEC_HEX ? 2 * len : (len + 2) / 3 * 4;
+}
+
+
+size_t ICACHE_FLASH_ATTR codec_decoded_len (int alphabet, size_t len)
+{
+  return alphabet == CODEC_HEX ? (len + 1) / 2 : (len + 3) / 4 * 3;
+}
+
+
+void ICACHE_FLASH_ATTR codec_init (codec_ctx_t *ctx, int alphabet)
+{
+  ctx->alphabet = alphabet;
+  ctx->n = 0;
+  ctx->pad = 0;
+  ctx->acc = 0;
+}
+
+
+size_t ICACHE_FLASH_ATTR codec_encode_update (codec_ctx_t *ctx, const uint8_t *in, size_t len, char *out)
+{
+  char *o = out;
+
+  if (ctx->alphabet == CODEC_HEX)
+  {
+    for (; len; --len)
+    {
+      uint8_t b = *in++;
+      *o++ = TABLE_BYTE(hex_chars, b >> 4);
+      *o++ = TABLE_BYTE(hex_chars, b & 0xf);
+    }
+    return o - out;
+  }
+
+  const uint32_t *tab = b64_chars[ctx->alphabet];
+  uint32_t acc = ctx->acc;
+  unsigned n = ctx->n;
+
+  // complete the group left over from the previous chunk
+  while (n && n < 3 && len)
+  {
+    acc = (acc << 8) | *in++;
+    ++n;
+    --len;
+  }
+  if (n == 3)
+  {
+    *o++ = TABLE_BYTE(tab, acc >> 18);
+    *o++ = TABLE_BYTE(tab, (acc >> 12) & 63);
+    *o++ = TABLE_BYTE(tab, (acc >> 6) & 63);
+    *o++ = TABLE_BYTE(tab, acc & 63);
+    n = 0;
+    acc = 0;
+  }
+
+  for (; len >= 3; len -= 3, in += 3)
+  {
+    uint32_t g = (in[0] << 16) | (in[1] << 8) | in[2];
+    o[0] = TABLE_BYTE(tab, g >> 18);
+    o[1] = TABLE_BYTE(tab, (g >> 12) & 63);
+    o[2] = TABLE_BYTE(tab, (g >> 6) & 63);
+    o[3] = TABLE_BYTE(tab, g & 63);
+    o += 4;
+  }
+
+  for (; len; --len, ++n)
+    acc = (acc << 8) | *in++;
+
+  ctx->acc = acc;
+  ctx->n = n;
+  return o - out;
+}
+
+
+size_t ICACHE_FLASH_ATTR codec_encode_final (codec_ctx_t *ctx, char *out)
+{
+  char *o = out;
+  uint32_t acc = ctx->acc;
+
+  if (ctx->alphabet != CODEC_HEX && ctx->n)
+  {
+    const uint32_t *tab = b64_chars[ctx->alphabet];
+    if (ctx->n == 1)
+    {
+      *o++ = TABLE_BYTE(tab, acc >> 2);
+      *o++ = TABLE_BYTE(tab, (acc & 3) << 4);
+    }
+    else
+    {
+      *o++ = TABLE_BYTE(tab, acc >> 10);
+      *o++ = TABLE_BYTE(tab, (acc >> 4) & 63);
+      *o++ = TABLE_BYTE(tab, (acc & 15) << 2);
+    }
+    if (ctx->alphabet == CODEC_BASE64)
+      while ((o - out) < 4)
+        *o++ = '=';
+  }
+
+  codec_init (ctx, ctx->alphabet);
+  return o - out;
+}
+
+
+static int ICACHE_FLASH_ATTR hex_decode_update (codec_ctx_t *ctx, const uint8_t *in, size_t len, uint8_t *out)
+{
+  uint8_t *o = out;
+  const uint8_t *end = in + len;
+
+  while (in < end)
+  {
+    if (ctx->n == 0)
+    {
+      // whole pairs
+      for (; end - in >= 2; in += 2)
+      {
+        uint8_t hi = char_value (hex_values, in[0]);
+        uint8_t lo = char_value (hex_values, in[1]);
+        if ((hi | lo) & 0x80)
+          return -1;
+        *o++ = (hi << 4) | lo;
+      }
+      if (in == end)
+        break;
+    }
+    uint8_t v = char_value (hex_values, *in++);
+    if (v == INVALID)
+      return -1;
+    if (ctx->n)
+    {
+      *o++ = (ctx->acc << 4) | v;
+      ctx->n = 0;
+    }
+    else
+    {
+      ctx->acc = v;
+      ctx->n = 1;
+    }
+  }
+  return o - out;
+}
+
+
+int ICACHE_FLASH_ATTR codec_decode_update (codec_ctx_t *ctx, const char *in_chars, size_t len, uint8_t *out)
+{
+  const uint8_t *in = (const uint8_t *)in_chars;
+  const uint8_t *end = in + len;
+  uint8_t *o = out;
+
+  if (ctx->alphabet == CODEC_HEX)
+    return hex_decode_update (ctx, in, len, out);
+
+  uint32_t acc = ctx->acc;
+  unsigned n = ctx->n;
+
+  while (in < end)
+  {
+    if (n == 0 && !ctx->pad)
+    {
+      // whole groups, padding and errors are left to the loop below
+      for (; end - in >= 4; in += 4)
+      {
+        uint8_t a = char_value (b64_values, in[0]);
+        uint8_t b = char_value (b64_values, in[1]);
+        uint8_t c = char_value (b64_values, in[2]);
+        uint8_t d = char_value (b64_values, in[3]);
+        if ((a | b | c | d) & 0x80)
+          break;
+        uint32_t g = (a << 18) | (b << 12) | (c << 6) | d;
+        o[0] = g >> 16;
+        o[1] = g >> 8;
+        o[2] = g;
+        o += 3;
+      }
+      if (in == end)
+        break;
+    }
+
+    uint8_t ch = *in++;
+    uint8_t v = char_value (b64_values, ch);
+    if (v == INVALID)
+    {
+      // padding may only fill up a group of at least two characters
+      if (ch != '=' || n < 2 || n + ctx->pad >= 4)
+        return -1;
+      ctx->pad++;
+      continue;
+    }
+    if (ctx->pad)
+      return -1;  // data after the padding
+    acc = (acc << 6) | v;
+    if (++n == 4)
+    {
+      *o++ = acc >> 16;
+      *o++ = acc >> 8;
+      *o++ = acc;
+      n = 0;
+      acc = 0;
+    }
+  }
+
+  ctx->acc = acc;
+  ctx->n = n;
+  return o - out;
+}
+
+
+int ICACHE_FLASH_ATTR codec_decode_final (codec_ctx_t *ctx, uint8_t *out)
+{
+  int ret = 0;
+  uint32_t acc = ctx->acc;
+
+  if (ctx->alphabet == CODEC_HEX)
+    ret = ctx->n ? -1 : 0;
+  else if (ctx->n == 1 || (ctx->pad && ctx->n + ctx->pad != 4))
+    ret = -1;
+  else if (ctx->n == 2)
+  {
+    out[0] = acc >> 4;
+    ret = 1;
+  }
+  else if (ctx->n == 3)
+  {
+    out[0] = acc >> 10;
+    out[1] = acc >> 2;
+    ret = 2;
+  }
+
+  codec_init (ctx, ctx->alphabet);
+  return ret;
+}
+
+
+size_t ICACHE_FLASH_ATTR codec_encode (int alphabet, const uint8_t *in, size_t len, char *out)
+{
+  codec_ctx_t ctx;
+  codec_init (&ctx, alphabet);
+  size_t n = codec_encode_update (&ctx, in, len, out);
+  return n + codec_encode_final (&ctx, out + n);
+}
+
+
+int ICACHE_FLASH_ATTR codec_decode (int alphabet, const char *in, size_t len, uint8_t *out)
+{
+  codec_ctx_t ctx;
+  codec_init (&ctx, alphabet);
+  int n = codec_decode_update (&ctx, in, len, out);
+  if (n < 0)
+    return -1;
+  int f = codec_decode_final (&ctx, out + n);
+  return f < 0 ? -1 : n + f;
+}
+
+
+int ICACHE_FLASH_ATTR codec_hex_value (int c)
+{
+  uint8_t v = (c >= 0 && c < 128) ? TABLE_BYTE(hex_values, c) : INVALID;
+  return v == INVALID ? -1 : v;
+}
@@ -0,0 +1,97 @@
+#ifndef _CRYPTO_CODEC_H_
+#define _CRYPTO_CODEC_H_
+
+#include <c_types.h>
+
+/**
+ * Base64, base64url and hex encoding and decoding.
+ *
+ * Typical usage on data that arrives in chunks:
+ *   codec_ctx_t ctx;
+ *   codec_init (&ctx, CODEC_BASE64);
+ *   n = codec_encode_update (&ctx, chunk, chunk_len, out);
+ *   ...
+ *   n = codec_encode_final (&ctx, out);
+ *
+ * Decoding works the same way with codec_decode_update() and
+ * codec_decode_final(), which return -1 on invalid input. For data held
+ * in one buffer codec_encode() and codec_decode() do all of this.
+ */
+
+#define CODEC_BASE64     0  /* RFC 4648 base64, padded with '=' */
+#define CODEC_BASE64URL  1  /* URL and filename safe base64, not padded */
+#define CODEC_HEX        2  /* lower case hex */
+
+typedef struct
+{
+  uint8_t  alphabet;  /* one of the CODEC_xxx above */
+  uint8_t  n;         /* bytes (encoding) or characters (decoding) in acc */
+  uint8_t  pad;       /* padding characters seen while decoding */
+  uint32_t acc;       /* bits carried over to the next chunk */
+} codec_ctx_t;
+
+/**
+ * Largest number of characters encoding @c len bytes produces, also
+ * the output size needed for one codec_encode_update() call on
+ * @c len bytes.
+ */
+size_t codec_encoded_len (int alphabet, size_t len);
+
+/**
+ * Largest number of bytes decoding @c len characters produces, also
+ * the output size needed for one codec_decode_update() call on
+ * @c len characters.
+ */
+size_t codec_decoded_len (int alphabet, size_t len);
+
+/** Prepares @c ctx for encoding or decoding with @c alphabet. */
+void codec_init (codec_ctx_t *ctx, int alphabet);
+
+/**
+ * Encodes a chunk of data. Bytes not making up a complete group are
+ * kept in @c ctx for the next call.
+ * @returns the number of characters written to @c out.
+ */
+size_t codec_encode_update (codec_ctx_t *ctx, const uint8_t *in, size_t len, char *out);
+
+/**
+ * Encodes the bytes kept in @c ctx and adds the padding.
+ * @param out Output buffer, must hold at least 4 characters.
+ * @returns the number of characters written to @c out.
+ */
+size_t codec_encode_final (codec_ctx_t *ctx, char *out);
+
+/**
+ * Decodes a chunk of characters. Base64 decoding accepts the characters
+ * of both base64 and base64url.
+ * @returns the number of bytes written to @c out, or -1 if @c in holds
+ *          an invalid character.
+ */
+int codec_decode_update (codec_ctx_t *ctx, const char *in, size_t len, uint8_t *out);
+
+/**
+ * Decodes the characters kept in @c ctx.
+ * @param out Output buffer, must hold at least 2 bytes.
+ * @returns the number of bytes written to @c out, or -1 if the input
+ *          was truncated or wrongly padded.
+ */
+int codec_decode_final (codec_ctx_t *ctx, uint8_t *out);
+
+/**
+ * Encodes @c len bytes in one go.
+ * @param out Output buffer of at least codec_encoded_len() characters.
+ * @returns the number of characters written to @c out.
+ */
+size_t codec_encode (int alphabet, const uint8_t *in, size_t len, char *out);
+
+/**
+ * Decodes @c len characters in one go.
+ * @param out Output buffer of at least codec_decoded_len() bytes.
+ * @returns the number of bytes written to @c out, or -1 on invalid input.
+ */
+int codec_decode (int alphabet, const char *in, size_t len, uint8_t *out);
+
+/** Returns the value of the hex digit @c c, or -1 if it isn't one. */
+int codec_hex_value (int c);
+
+#endif
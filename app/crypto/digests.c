@@ -33,6 +33,7 @@
 #include "rom.h"
 #include "osapi.h"
 #include "mem.h"
+#include "platform.h"
 #include <string.h>
 #include <c_errno.h>
 
@@ -156,6 +157,44 @@ int ICACHE_FLASH_ATTR crypto_fhash (const digest_mech_info_t *mi,
 }
 
 
+int ICACHE_FLASH_ATTR crypto_flash_hash_update (const digest_mech_info_t *mi,
+  void *ctx, uint32_t addr, size_t len)
+{
+  uint32_t buffer[64]; // word aligned, as the flash reads want
+
+  while (len)
+  {
+    size_t n = len < sizeof (buffer) ? len : sizeof (buffer);
+    if (platform_flash_read (buffer, addr, n) != n)
+      return EIO;
+    mi->update (ctx, (const uint8_t *)buffer, n);
+    addr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+int ICACHE_FLASH_ATTR crypto_flash_hash (const digest_mech_info_t *mi,
+  uint32_t addr, size_t len,
+  uint8_t *digest)
+{
+  if (!mi)
+    return EINVAL;
+
+  void *ctx = (void *)os_malloc (mi->ctx_size);
+  if (!ctx)
+    return ENOMEM;
+
+  mi->create (ctx);
+  int ret = crypto_flash_hash_update (mi, ctx, addr, len);
+  mi->finalize (digest, ctx);
+
+  os_free (ctx);
+  return ret;
+}
+
+
 void crypto_hmac_begin (void *ctx, const digest_mech_info_t *mi,
   const char *key, size_t key_len, uint8_t *k_opad)
 {
@@ -65,6 +65,29 @@ int crypto_hash (const digest_mech_info_t *mi, const char *data, size_t data_len
  */
 int crypto_fhash (const digest_mech_info_t *mi, read_fn read, int readarg, uint8_t *digest);
 
+/**
+ * Adds a region of the flash to a hash, reading it through a small buffer
+ * on the stack rather than the heap.
+ * @param mi       A mech from @c crypto_digest_mech().
+ * @param ctx      A created context for the given mech @c mi.
+ * @param addr     Flash address of the first byte to hash.
+ * @param len      Number of bytes to hash.
+ * @return 0 on success, non-zero if the flash could not be read.
+ */
+int crypto_flash_hash_update (const digest_mech_info_t *mi, void *ctx, uint32_t addr, size_t len);
+
+/**
+ * Wrapper function for performing a one-in-all hashing operation of a
+ * region of the flash.
+ * @param mi       A mech from @c crypto_digest_mech(). A null pointer @c mi
+ *                 is harmless, but will of course result in an error return.
+ * @param addr     Flash address of the first byte to hash.
+ * @param len      Number of bytes to hash.
+ * @param digest   Output buffer, must be at least @c mi->digest_size in size.
+ * @return 0 on success, non-zero on error.
+ */
+int crypto_flash_hash (const digest_mech_info_t *mi, uint32_t addr, size_t len, uint8_t *digest);
+
 /**
  * Commence calculating a HMAC signature.
  *
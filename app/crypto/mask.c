@@ -0,0 +1,48 @@
+#include "mask.h"
+#include <string.h>
+
+void ICACHE_FLASH_ATTR crypto_xor_mask (uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask, unsigned int offset)
+{
+  // bytes up to the first aligned word of the output
+  while (len && ((uint32_t)dst & 3))
+  {
+    *dst++ = *src++ ^ mask[offset++ & 3];
+    --len;
+  }
+
+  if (len >= 4)
+  {
+    // the mask as a word, starting with the byte for the current offset
+    uint8_t rot[4] = {
+      mask[offset & 3], mask[(offset + 1) & 3],
+      mask[(offset + 2) & 3], mask[(offset + 3) & 3]
+    };
+    uint32_t m;
+    memcpy (&m, rot, 4);
+
+    uint32_t *d = (uint32_t *)dst;
+    size_t i, words = len >> 2;
+    if (((uint32_t)src & 3) == 0)
+    {
+      const uint32_t *s = (const uint32_t *)src;
+      for (i = 0; i < words; ++i)
+        d[i] = s[i] ^ m;
+    }
+    else
+    {
+      // unaligned input: byte loads, but still word stores
+      for (i = 0; i < words; ++i)
+      {
+        uint32_t w;
+        memcpy (&w, src + 4 * i, 4);
+        d[i] = w ^ m;
+      }
+    }
+    src += 4 * words;
+    dst += 4 * words;
+    len &= 3;
+  }
+
+  while (len--)
+    *dst++ = *src++ ^ mask[offset++ & 3];
+}
@@ -0,0 +1,22 @@
+#ifndef _CRYPTO_MASK_H_
+#define _CRYPTO_MASK_H_
+
+#include <c_types.h>
+
+/**
+ * XORs data with a repeating 4-byte mask, as websocket frames and
+ * crypto.mask() need. Works a 32-bit word at a time wherever the
+ * destination is word aligned, with the unaligned head and tail done
+ * byte by byte.
+ *
+ * @param dst    Output buffer of @c len bytes. May be the same as @c src
+ *               to mask in place.
+ * @param src    The data to mask.
+ * @param len    Number of bytes at @c src.
+ * @param mask   The 4 mask bytes.
+ * @param offset Position of @c src in the masked stream, i.e. which
+ *               mask byte applies to its first byte.
+ */
+void crypto_xor_mask (uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask, unsigned int offset);
+
+#endif
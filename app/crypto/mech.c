@@ -32,11 +32,22 @@
  */
 
 #include "mech.h"
-#include "sdk-aes.h"
 #include "c_string.h"
 
 /* ----- AES ---------------------------------------------------------- */
 
+static const struct
+{
+  const char *name;
+  uint8_t mode;
+} cipher_modes[] =
+{
+  { "AES-ECB", CRYPTO_MODE_ECB },
+  { "AES-CBC", CRYPTO_MODE_CBC },
+  { "AES-CTR", CRYPTO_MODE_CTR },
+  { "AES-GCM", CRYPTO_MODE_GCM }
+};
+
 static const struct aes_funcs
 {
   void *(*init) (const char *key, size_t keylen);
@@ -48,64 +59,313 @@ static const struct aes_funcs
   { aes_decrypt_init, aes_decrypt, aes_decrypt_deinit }
 };
 
-static bool do_aes (crypto_op_t *co, bool with_cbc)
+/* CTR and GCM only ever run AES forwards */
+static inline const struct aes_funcs *cipher_funcs (const crypto_cipher_t *c)
+{
+  bool forward = c->mode == CRYPTO_MODE_CTR || c->mode == CRYPTO_MODE_GCM;
+  return &aes_funcs[forward ? OP_ENCRYPT : c->op];
+}
+
+static inline void xor_block (uint8_t *dst, const uint8_t *src)
+{
+  int i;
+  for (i = 0; i < AES_BLOCKSIZE; ++i)
+    dst[i] ^= src[i];
+}
+
+
+/* x = x * h in GF(2^128), as defined for GCM */
+static void gf_mult (uint8_t *x, const uint8_t *h)
+{
+  uint32_t z[4] = { 0, 0, 0, 0 }, v[4];
+  int i, j;
+  for (i = 0; i < 4; ++i)
+    v[i] = ((uint32_t)h[4*i] << 24) | (h[4*i+1] << 16) | (h[4*i+2] << 8) | h[4*i+3];
+
+  for (i = 0; i < 128; ++i)
+  {
+    if (x[i >> 3] & (0x80 >> (i & 7)))
+    {
+      z[0] ^= v[0]; z[1] ^= v[1]; z[2] ^= v[2]; z[3] ^= v[3];
+    }
+    uint32_t lsb = v[3] & 1;
+    v[3] = (v[3] >> 1) | (v[2] << 31);
+    v[2] = (v[2] >> 1) | (v[1] << 31);
+    v[1] = (v[1] >> 1) | (v[0] << 31);
+    v[0] = (v[0] >> 1) ^ (lsb ? 0xe1000000 : 0);
+  }
+
+  for (i = 0; i < 4; ++i)
+    for (j = 0; j < 4; ++j)
+      x[4*i+j] = z[i] >> (24 - 8*j);
+}
+
+static void ghash_block (crypto_cipher_t *c)
+{
+  xor_block (c->ghash, c->ghash_block);
+  gf_mult (c->ghash, c->h);
+  c->ghash_n = 0;
+}
+
+static void ghash_update (crypto_cipher_t *c, const uint8_t *data, size_t len)
 {
-  const struct aes_funcs *funcs = &aes_funcs[co->op];
+  while (len--)
+  {
+    c->ghash_block[c->ghash_n++] = *data++;
+    if (c->ghash_n == AES_BLOCKSIZE)
+      ghash_block (c);
+  }
+}
 
-  void *ctx = funcs->init (co->key, co->keylen);
-  if (!ctx)
+/* completes a partial block with zeros */
+static void ghash_pad (crypto_cipher_t *c)
+{
+  if (c->ghash_n)
+  {
+    c_memset (c->ghash_block + c->ghash_n, 0, AES_BLOCKSIZE - c->ghash_n);
+    ghash_block (c);
+  }
+}
+
+static void ghash_lengths (crypto_cipher_t *c, uint32_t alen, uint32_t clen)
+{
+  uint8_t lens[AES_BLOCKSIZE] = { 0 };
+  int i;
+  uint64_t abits = (uint64_t)alen << 3, cbits = (uint64_t)clen << 3;
+  for (i = 0; i < 8; ++i)
+  {
+    lens[7 - i] = abits >> (8 * i);
+    lens[15 - i] = cbits >> (8 * i);
+  }
+  ghash_update (c, lens, AES_BLOCKSIZE);
+}
+
+/* increments the last 'bytes' bytes of the counter */
+static void counter_inc (uint8_t *ctr, int bytes)
+{
+  int i;
+  for (i = AES_BLOCKSIZE - 1; i >= AES_BLOCKSIZE - bytes; --i)
+    if (++ctr[i])
+      break;
+}
+
+
+bool crypto_cipher_init (crypto_cipher_t *c, const char *name, int op, const char *key, size_t keylen, const char *iv, size_t ivlen)
+{
+  size_t i;
+  c_memset (c, 0, sizeof (*c));
+  for (i = 0; i < sizeof (cipher_modes) / sizeof (cipher_modes[0]); ++i)
+    if (strcasecmp (name, cipher_modes[i].name) == 0)
+      break;
+  if (i == sizeof (cipher_modes) / sizeof (cipher_modes[0]))
     return false;
 
-  char iv[AES_BLOCKSIZE] = { 0 };
-  if (with_cbc && co->ivlen)
-    c_memcpy (iv, co->iv, co->ivlen < AES_BLOCKSIZE ? co->ivlen : AES_BLOCKSIZE);
+  c->mode = cipher_modes[i].mode;
+  c->op = op;
+  // a repeated counter repeats the keystream, so CTR and GCM take no default
+  if ((c->mode == CRYPTO_MODE_CTR && ivlen != AES_BLOCKSIZE) ||
+      (c->mode == CRYPTO_MODE_GCM && ivlen == 0))
+    return false;
+  c->aes = cipher_funcs (c)->init (key, keylen);
+  if (!c->aes)
+    return false;
+
+  if (c->mode == CRYPTO_MODE_GCM)
+  {
+    aes_encrypt (c->aes, (const char *)c->h, (char *)c->h);  // H = E(0)
+    if (ivlen == 12)
+    {
+      c_memcpy (c->j0, iv, 12);
+      c->j0[15] = 1;
+    }
+    else
+    {
+      ghash_update (c, (const uint8_t *)iv, ivlen);
+      ghash_pad (c);
+      ghash_lengths (c, 0, ivlen);
+      c_memcpy (c->j0, c->ghash, AES_BLOCKSIZE);
+      c_memset (c->ghash, 0, AES_BLOCKSIZE);
+    }
+    c_memcpy (c->iv, c->j0, AES_BLOCKSIZE);
+    counter_inc (c->iv, 4);
+  }
+  else if (c->mode != CRYPTO_MODE_ECB && ivlen)
+    c_memcpy (c->iv, iv, ivlen < AES_BLOCKSIZE ? ivlen : AES_BLOCKSIZE);
+
+  if (c->mode == CRYPTO_MODE_CTR || c->mode == CRYPTO_MODE_GCM)
+    c->n = AES_BLOCKSIZE;  // no keystream yet
+  return true;
+}
 
-  const char *src = co->data;
-  char *dst = co->out;
 
-  size_t left = co->datalen;
-  while (left)
+bool crypto_cipher_aad (crypto_cipher_t *c, const char *aad, size_t len)
+{
+  if (c->mode != CRYPTO_MODE_GCM || c->gcm_data)
+    return false;
+  ghash_update (c, (const uint8_t *)aad, len);
+  c->aad_len += len;
+  return true;
+}
+
+
+static void block_crypt (crypto_cipher_t *c, const uint8_t *in, uint8_t *out)
+{
+  const struct aes_funcs *funcs = cipher_funcs (c);
+  if (c->mode == CRYPTO_MODE_ECB)
+    funcs->crypt (c->aes, (const char *)in, (char *)out);
+  else if (c->op == OP_ENCRYPT)
+  {
+    uint8_t block[AES_BLOCKSIZE];
+    c_memcpy (block, in, AES_BLOCKSIZE);
+    xor_block (block, c->iv);
+    funcs->crypt (c->aes, (const char *)block, (char *)out);
+    c_memcpy (c->iv, out, AES_BLOCKSIZE);
+  }
+  else
+  {
+    uint8_t prev[AES_BLOCKSIZE];
+    c_memcpy (prev, in, AES_BLOCKSIZE);
+    funcs->crypt (c->aes, (const char *)in, (char *)out);
+    xor_block (out, c->iv);
+    c_memcpy (c->iv, prev, AES_BLOCKSIZE);
+  }
+}
+
+
+static void stream_crypt (crypto_cipher_t *c, const uint8_t *in, size_t len, uint8_t *out)
+{
+  int ctr_bytes = c->mode == CRYPTO_MODE_GCM ? 4 : AES_BLOCKSIZE;
+  if (c->mode == CRYPTO_MODE_GCM)
+  {
+    if (!c->gcm_data)
+    {
+      ghash_pad (c);  // end of the additional data
+      c->gcm_data = true;
+    }
+    if (c->op == OP_DECRYPT)
+      ghash_update (c, in, len);
+    c->data_len += len;
+  }
+
+  uint8_t *o = out;
+  size_t i;
+  for (i = 0; i < len; ++i)
+  {
+    if (c->n == AES_BLOCKSIZE)
+    {
+      aes_encrypt (c->aes, (const char *)c->iv, (char *)c->block);
+      counter_inc (c->iv, ctr_bytes);
+      c->n = 0;
+    }
+    *o++ = in[i] ^ c->block[c->n++];
+  }
+
+  if (c->mode == CRYPTO_MODE_GCM && c->op == OP_ENCRYPT)
+    ghash_update (c, out, len);
+}
+
+
+size_t crypto_cipher_update (crypto_cipher_t *c, const char *in_chars, size_t len, char *out_chars)
+{
+  const uint8_t *in = (const uint8_t *)in_chars;
+  uint8_t *out = (uint8_t *)out_chars;
+
+  if (c->mode == CRYPTO_MODE_CTR || c->mode == CRYPTO_MODE_GCM)
   {
-    char block[AES_BLOCKSIZE] = { 0 };
-    size_t n = left > AES_BLOCKSIZE ? AES_BLOCKSIZE : left;
-    c_memcpy (block, src, n);
+    stream_crypt (c, in, len, out);
+    return len;
+  }
 
-    if (with_cbc && co->op == OP_ENCRYPT)
+  uint8_t *o = out;
+  while (len)
+  {
+    if (c->n == 0 && len >= AES_BLOCKSIZE)
+    {
+      block_crypt (c, in, o);
+      in += AES_BLOCKSIZE;
+      len -= AES_BLOCKSIZE;
+    }
+    else
     {
-      const char *xor = (src == co->data) ? iv : dst - AES_BLOCKSIZE;
-      int i;
-      for (i = 0; i < AES_BLOCKSIZE; ++i)
-        block[i] ^= xor[i];
+      size_t n = AES_BLOCKSIZE - c->n;
+      if (n > len)
+        n = len;
+      c_memcpy (c->block + c->n, in, n);
+      c->n += n;
+      in += n;
+      len -= n;
+      if (c->n < AES_BLOCKSIZE)
+        break;
+      block_crypt (c, c->block, o);
+      c->n = 0;
     }
+    o += AES_BLOCKSIZE;
+  }
+  return o - out;
+}
 
-    funcs->crypt (ctx, block, dst);
 
-    if (with_cbc && co->op == OP_DECRYPT)
+size_t crypto_cipher_finalize (crypto_cipher_t *c, char *out, uint8_t *tag)
+{
+  size_t n = 0;
+
+  if (c->mode == CRYPTO_MODE_GCM)
+  {
+    ghash_pad (c);  // of the data, or of the additional data if none
+    ghash_lengths (c, c->aad_len, c->data_len);
+    if (tag)
     {
-      const char *xor = (src == co->data) ? iv : src - AES_BLOCKSIZE;
-      int i;
-      for (i = 0; i < AES_BLOCKSIZE; ++i)
-        dst[i] ^= xor[i];
+      aes_encrypt (c->aes, (const char *)c->j0, (char *)tag);
+      xor_block (tag, c->ghash);
     }
+  }
+  else if ((c->mode == CRYPTO_MODE_ECB || c->mode == CRYPTO_MODE_CBC) && c->n)
+  {
+    c_memset (c->block + c->n, 0, AES_BLOCKSIZE - c->n);
+    block_crypt (c, c->block, (uint8_t *)out);
+    c->n = 0;
+    n = AES_BLOCKSIZE;
+  }
+  return n;
+}
 
-    left -= n;
-    src += n;
-    dst += n;
+
+void crypto_cipher_deinit (crypto_cipher_t *c)
+{
+  if (c->aes)
+  {
+    cipher_funcs (c)->deinit (c->aes);
+    c->aes = NULL;
   }
+}
+
 
-  funcs->deinit (ctx);
+static bool do_aes (crypto_op_t *co, const char *name)
+{
+  crypto_cipher_t c;
+  if (!crypto_cipher_init (&c, name, co->op, co->key, co->keylen, co->iv, co->ivlen))
+    return false;
+
+  size_t n = crypto_cipher_update (&c, co->data, co->datalen, co->out);
+  crypto_cipher_finalize (&c, co->out + n, NULL);
+  crypto_cipher_deinit (&c);
   return true;
 }
 
 
 static bool do_aes_ecb (crypto_op_t *co)
 {
-  return do_aes (co, false);
+  return do_aes (co, "AES-ECB");
 }
 
 static bool do_aes_cbc (crypto_op_t *co)
 {
-  return do_aes (co, true);
+  return do_aes (co, "AES-CBC");
+}
+
+static bool do_aes_ctr (crypto_op_t *co)
+{
+  return do_aes (co, "AES-CTR");
 }
 
 
@@ -114,7 +374,8 @@ static bool do_aes_cbc (crypto_op_t *co)
 static const crypto_mech_t mechs[] =
 {
   { "AES-ECB",  do_aes_ecb, AES_BLOCKSIZE },
-  { "AES-CBC",  do_aes_cbc, AES_BLOCKSIZE }
+  { "AES-CBC",  do_aes_cbc, AES_BLOCKSIZE },
+  { "AES-CTR",  do_aes_ctr, 1 }
 };
 
 
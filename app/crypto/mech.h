@@ -2,6 +2,7 @@
 #define _MECH_H_
 
 #include "c_types.h"
+#include "sdk-aes.h"
 
 typedef struct
 {
@@ -27,4 +28,79 @@ typedef struct
 
 const crypto_mech_t *crypto_encryption_mech (const char *name);
 
+
+/**
+ * Context for encrypting or decrypting data in chunks.
+ *
+ * Typical usage:
+ *   crypto_cipher_t c;
+ *   if (!crypto_cipher_init (&c, "AES-CBC", OP_ENCRYPT, key, 16, iv, 16))
+ *     ...
+ *   n = crypto_cipher_update (&c, chunk, chunk_len, out);
+ *   ...
+ *   n = crypto_cipher_finalize (&c, out, tag);
+ *   crypto_cipher_deinit (&c);
+ *
+ * ECB and CBC zero-pad the last block, like the one-shot mechs. CTR
+ * increments the whole IV as a 128-bit big endian counter. GCM
+ * authenticates the data and any additional data given to
+ * crypto_cipher_aad() before the first update.
+ */
+enum { CRYPTO_MODE_ECB, CRYPTO_MODE_CBC, CRYPTO_MODE_CTR, CRYPTO_MODE_GCM };
+
+typedef struct
+{
+  void    *aes;                         /* SDK AES context */
+  uint8_t  mode;                        /* CRYPTO_MODE_xxx */
+  uint8_t  op;                          /* OP_ENCRYPT or OP_DECRYPT */
+  uint8_t  n;                           /* bytes in block, or keystream used */
+  uint8_t  ghash_n;                     /* bytes in ghash_block */
+  bool     gcm_data;                    /* GCM past the additional data */
+  uint8_t  iv[AES_BLOCKSIZE];           /* CBC chain value, CTR/GCM counter */
+  uint8_t  block[AES_BLOCKSIZE];        /* partial block, or keystream */
+  /* GCM only */
+  uint8_t  h[AES_BLOCKSIZE];
+  uint8_t  j0[AES_BLOCKSIZE];
+  uint8_t  ghash[AES_BLOCKSIZE];
+  uint8_t  ghash_block[AES_BLOCKSIZE];
+  uint32_t aad_len;
+  uint32_t data_len;
+} crypto_cipher_t;
+
+#define CRYPTO_GCM_TAG_SIZE AES_BLOCKSIZE
+#define CRYPTO_GCM_TAG_MIN  12          /* shortest tag accepted when decrypting */
+
+/**
+ * Sets up a context for the cipher @c name, one of "AES-ECB", "AES-CBC",
+ * "AES-CTR" and "AES-GCM". For ECB and CBC an IV shorter than a block is
+ * zero-filled. CTR needs a full block as the initial counter, GCM an IV of
+ * any length but 0, 12 bytes being recommended.
+ * @returns false for an unknown cipher, a bad key or a missing IV.
+ */
+bool crypto_cipher_init (crypto_cipher_t *c, const char *name, int op, const char *key, size_t keylen, const char *iv, size_t ivlen);
+
+/**
+ * Adds additional data to be authenticated, GCM only.
+ * @returns false if the cipher isn't GCM or data was already processed.
+ */
+bool crypto_cipher_aad (crypto_cipher_t *c, const char *aad, size_t len);
+
+/**
+ * Processes a chunk of data. Block modes keep an incomplete block back.
+ * @param out Output buffer of at least @c len + AES_BLOCKSIZE - 1 bytes.
+ * @returns the number of bytes written to @c out.
+ */
+size_t crypto_cipher_update (crypto_cipher_t *c, const char *in, size_t len, char *out);
+
+/**
+ * Processes the kept back block and, for GCM, computes the tag.
+ * @param out Output buffer of at least AES_BLOCKSIZE bytes.
+ * @param tag For GCM, buffer of CRYPTO_GCM_TAG_SIZE bytes for the tag.
+ * @returns the number of bytes written to @c out.
+ */
+size_t crypto_cipher_finalize (crypto_cipher_t *c, char *out, uint8_t *tag);
+
+/** Releases the AES context held by @c c. */
+void crypto_cipher_deinit (crypto_cipher_t *c);
+
 #endif
@@ -57,7 +57,29 @@
  *
  *   #define SHA2_UNROLL_TRANSFORM
  *
+ * NodeMCU: unrolled unless SHA2_ROLLED_TRANSFORM is defined, which the host
+ * benchmark in tools/hosttest does to compare the two.
  */
+#ifndef SHA2_ROLLED_TRANSFORM
+#define SHA2_UNROLL_TRANSFORM
+#endif
+
+/*
+ * With SHA2_IRAM defined (see user_config.h) the SHA-256 transform and
+ * its constants are placed in RAM, so hashing large amounts of data
+ * doesn't run through the flash cache.
+ */
+#ifdef SHA2_IRAM
+#define SHA256_TRANSFORM_ATTR	ICACHE_RAM_ATTR
+#define SHA256_CONST
+#else
+#define SHA256_TRANSFORM_ATTR	ICACHE_FLASH_ATTR
+#define SHA256_CONST		const
+#define SHA256_CONST_ATTR	ICACHE_RODATA_ATTR
+#endif
+#ifndef SHA256_CONST_ATTR
+#define SHA256_CONST_ATTR
+#endif
 
 
 typedef uint8_t  sha2_byte;	/* Exactly 1 byte */
@@ -172,7 +194,7 @@ void SHA512_Transform(SHA512_CTX*, const sha2_word64*);
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
 /* Hash constant words K for SHA-256: */
-const static sha2_word32 K256[64] ICACHE_RODATA_ATTR = {
+SHA256_CONST static sha2_word32 K256[64] SHA256_CONST_ATTR = {
 	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
 	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
 	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
@@ -286,7 +308,7 @@ void ICACHE_FLASH_ATTR SHA256_Init(SHA256_CTX* context) {
 
 /* Unrolled SHA-256 round macros: */
 
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 
 #define ROUND256_0_TO_15(a,b,c,d,e,f,g,h)	\
 	REVERSE32(*data++, W256[j]); \
@@ -297,7 +319,7 @@ void ICACHE_FLASH_ATTR SHA256_Init(SHA256_CTX* context) {
 	j++
 
 
-#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 
 #define ROUND256_0_TO_15(a,b,c,d,e,f,g,h)	\
 	T1 = (h) + Sigma1_256(e) + Ch((e), (f), (g)) + \
@@ -306,7 +328,7 @@ void ICACHE_FLASH_ATTR SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 
 #define ROUND256(a,b,c,d,e,f,g,h)	\
 	s0 = W256[(j+1)&0x0f]; \
@@ -319,7 +341,7 @@ void ICACHE_FLASH_ATTR SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void ICACHE_FLASH_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+void SHA256_TRANSFORM_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -377,7 +399,7 @@ void ICACHE_FLASH_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32*
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void ICACHE_FLASH_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+void SHA256_TRANSFORM_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -401,10 +423,10 @@ void ICACHE_FLASH_ATTR SHA256_Transform(SHA256_CTX* context, const sha2_word32*
 		REVERSE32(*data++,W256[j]);
 		/* Apply the SHA-256 compression function to update a..h */
 		T1 = h + Sigma1_256(e) + Ch(e, f, g) + K256[j] + W256[j];
-#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 		/* Apply the SHA-256 compression function to update a..h with copy */
 		T1 = h + Sigma1_256(e) + Ch(e, f, g) + K256[j] + (W256[j] = *data++);
-#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 		T2 = Sigma0_256(a) + Maj(a, b, c);
 		h = g;
 		g = f;
@@ -491,7 +513,13 @@ void ICACHE_FLASH_ATTR SHA256_Update(SHA256_CTX* context, const sha2_byte *data,
 	}
 	while (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA256_Transform(context, (sha2_word32*)data);
+		if ((uint32_t)data & 3) {
+			/* Word loads need aligned data */
+			MEMCPY_BCOPY(context->buffer, data, SHA256_BLOCK_LENGTH);
+			SHA256_Transform(context, (sha2_word32*)context->buffer);
+		} else {
+			SHA256_Transform(context, (sha2_word32*)data);
+		}
 		context->bitcount += SHA256_BLOCK_LENGTH << 3;
 		len -= SHA256_BLOCK_LENGTH;
 		data += SHA256_BLOCK_LENGTH;
@@ -582,7 +610,7 @@ void ICACHE_FLASH_ATTR SHA512_Init(SHA512_CTX* context) {
 #ifdef SHA2_UNROLL_TRANSFORM
 
 /* Unrolled SHA-512 round macros: */
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 
 #define ROUND512_0_TO_15(a,b,c,d,e,f,g,h)	\
 	REVERSE64(*data++, W512[j]); \
@@ -593,7 +621,7 @@ void ICACHE_FLASH_ATTR SHA512_Init(SHA512_CTX* context) {
 	j++
 
 
-#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 
 #define ROUND512_0_TO_15(a,b,c,d,e,f,g,h)	\
 	T1 = (h) + Sigma1_512(e) + Ch((e), (f), (g)) + \
@@ -602,7 +630,7 @@ void ICACHE_FLASH_ATTR SHA512_Init(SHA512_CTX* context) {
 	(h) = T1 + Sigma0_512(a) + Maj((a), (b), (c)); \
 	j++
 
-#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 
 #define ROUND512(a,b,c,d,e,f,g,h)	\
 	s0 = W512[(j+1)&0x0f]; \
@@ -692,10 +720,10 @@ void ICACHE_FLASH_ATTR SHA512_Transform(SHA512_CTX* context, const sha2_word64*
 		REVERSE64(*data++, W512[j]);
 		/* Apply the SHA-512 compression function to update a..h */
 		T1 = h + Sigma1_512(e) + Ch(e, f, g) + K512[j] + W512[j];
-#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#else /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 		/* Apply the SHA-512 compression function to update a..h with copy */
 		T1 = h + Sigma1_512(e) + Ch(e, f, g) + K512[j] + (W512[j] = *data++);
-#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN_ */
+#endif /* __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ */
 		T2 = Sigma0_512(a) + Maj(a, b, c);
 		h = g;
 		g = f;
@@ -782,7 +810,13 @@ void ICACHE_FLASH_ATTR SHA512_Update(SHA512_CTX* context, const sha2_byte *data,
 	}
 	while (len >= SHA512_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA512_Transform(context, (sha2_word64*)data);
+		if ((uint32_t)data & (sizeof(sha2_word64) - 1)) {
+			/* Word loads need aligned data */
+			MEMCPY_BCOPY(context->buffer, data, SHA512_BLOCK_LENGTH);
+			SHA512_Transform(context, (sha2_word64*)context->buffer);
+		} else {
+			SHA512_Transform(context, (sha2_word64*)data);
+		}
 		ADDINC128(context->bitcount, SHA512_BLOCK_LENGTH << 3);
 		len -= SHA512_BLOCK_LENGTH;
 		data += SHA512_BLOCK_LENGTH;
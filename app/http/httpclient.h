@@ -38,6 +38,7 @@ static const char log_prefix[] = "HTTP client: ";
 
 /*
  * Size of http responses that will cause an error.
+ * In streaming mode this only limits the size of the response headers.
  */
 #define BUFFER_SIZE_MAX            (0x2000)
 
@@ -46,6 +47,17 @@ static const char log_prefix[] = "HTTP client: ";
  */
 #define HTTP_REQUEST_TIMEOUT_MS    (10000)
 
+/*
+ * Persistent connections: number of idle connections kept open in total and per server.
+ */
+#define HTTP_POOL_SIZE             (4)
+#define HTTP_POOL_PER_HOST         (2)
+
+/*
+ * Maximum number of idempotent requests in flight on one connection.
+ */
+#define HTTP_PIPELINE_MAX          (4)
+
 /*
  * "full_response" is a string containing all response headers and the response body.
  * "response_body and "http_status" are extracted from "full_response" for convenience.
@@ -55,6 +67,43 @@ static const char log_prefix[] = "HTTP client: ";
  */
 typedef void (* http_callback_t)(char * response_body, int http_status, char * full_response);
 
+/*
+ * Same as http_callback_t, "arg" is the value passed to http_request_arg().
+ */
+typedef void (* http_arg_callback_t)(char * response_body, int http_status, char * full_response, void * arg);
+
+/*
+ * Where the time of a request went, in microseconds.
+ * "dns_us" and "connect_us" are 0 when an open connection was reused.
+ */
+typedef struct {
+	uint32_t	dns_us;         /* Resolving the hostname. */
+	uint32_t	connect_us;     /* Establishing the connection, including the TLS handshake. */
+	uint32_t	wait_us;        /* From sending the request to the first byte of the response. */
+	uint32_t	total_us;       /* From the call to the end of the response. */
+	bool		reused;         /* The request was sent on an already open connection. */
+} http_timing_t;
+
+/*
+ * Streaming mode: the response is not buffered. "headers_cb" is called once with
+ * the status code and the raw response headers, "data_cb" is called with each piece of
+ * the body as it arrives (chunked transfer encoding is already decoded), and
+ * "complete_cb" is called at the end with the status code, or HTTP_STATUS_GENERIC_ERROR
+ * if the request failed or the body is incomplete.
+ * Returning false from "data_cb" aborts the transfer.
+ * All callbacks are optional, "arg" is passed to each of them.
+ */
+typedef void (* http_headers_callback_t)(int http_status, char * headers, void * arg);
+typedef bool (* http_data_callback_t)(char * data, int len, void * arg);
+typedef void (* http_complete_callback_t)(int http_status, void * arg);
+
+typedef struct {
+	http_headers_callback_t		headers_cb;
+	http_data_callback_t		data_cb;
+	http_complete_callback_t	complete_cb;
+	void				* arg;
+} http_stream_handler_t;
+
 /*
  * Call this function to skip URL parsing if the arguments are already in separate variables.
  */
@@ -68,6 +117,20 @@ void ICACHE_FLASH_ATTR http_raw_request(const char * hostname, int port, bool se
  */
 void ICACHE_FLASH_ATTR http_request(const char * url, const char * method, const char * headers, const char * post_data, http_callback_t callback_handle, int redirect_follow_count);
 
+/*
+ * Same as http_request(), passing "arg" on to the callback so that several requests
+ * can be in flight at the same time.
+ */
+void ICACHE_FLASH_ATTR http_request_arg(const char * url, const char * method, const char * headers, const char * post_data, http_arg_callback_t callback_handle, void * arg);
+
+/*
+ * Request data from URL and stream the response to "handler" instead of buffering it.
+ * Memory use does not depend on the size of the response body.
+ * Try:
+ * http_stream_request("http://example.com/firmware.bin", "GET", NULL, NULL, &handler);
+ */
+void ICACHE_FLASH_ATTR http_stream_request(const char * url, const char * method, const char * headers, const char * post_data, const http_stream_handler_t * handler);
+
 /*
  * Post data to a web form.
  * The data should be encoded as any format.
@@ -96,6 +159,19 @@ void ICACHE_FLASH_ATTR http_delete(const char * url, const char * headers, const
  */
 void ICACHE_FLASH_ATTR http_put(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle);
 
+/*
+ * Keep connections open for "idle_ms" after a response so that further requests to the
+ * same server skip DNS, TCP connect and TLS handshake. Idempotent requests (GET, HEAD,
+ * PUT, DELETE, OPTIONS) to a busy server are pipelined on an open connection.
+ * 0 (the default) closes the connection after each response.
+ */
+void ICACHE_FLASH_ATTR http_set_keepalive(uint32_t idle_ms);
+
+/*
+ * Timing of the request that is being completed, valid inside the callbacks.
+ */
+const http_timing_t * ICACHE_FLASH_ATTR http_last_timing(void);
+
 /*
  * Output on the UART.
  */
@@ -103,10 +103,22 @@ struct local_hostlist_entry {
 */
 typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr, void *callback_arg);
 
+/** Resolver cache counters, see dns_getstats() */
+struct dns_stats {
+  u32_t hits;           /* lookups answered from the cache */
+  u32_t misses;         /* lookups that needed a query */
+  u32_t negative_hits;  /* lookups answered by a cached "no such name" */
+  u32_t coalesced;      /* lookups that joined a query in progress */
+  u32_t queries;        /* query packets sent */
+  u32_t timeouts;       /* queries no server answered */
+  u32_t cached;         /* names currently cached */
+};
+
 void           dns_init(void);
 void           dns_tmr(void);
 void           dns_setserver(u8_t numdns, ip_addr_t *dnsserver);
 ip_addr_t      dns_getserver(u8_t numdns);
+void           dns_getstats(struct dns_stats *stats);
 err_t          dns_gethostbyname(const char *hostname, ip_addr_t *addr,
                                  dns_found_callback found, void *callback_arg);
 
@@ -84,8 +84,13 @@ extern const u32_t memp_sizes[MEMP_MAX];
 #include "mem.h"
 
 #define memp_init()
+#if MEMP_STATS
+void *memp_malloc(memp_t type)ICACHE_FLASH_ATTR;
+void  memp_free(memp_t type, void *mem)ICACHE_FLASH_ATTR;
+#else
 #define memp_malloc(type)     mem_malloc(memp_sizes[type])
 #define memp_free(type, mem)  mem_free(mem)
+#endif /* MEMP_STATS */
 
 #else /* MEMP_MEM_MALLOC */
 
@@ -1178,6 +1178,11 @@
  * be needed without this flag! Use this only if you need to!
  *
  * @todo: TCP and IP-frag do not work with this, yet:
+ *
+ * NodeMCU: kept on, since the SDK's WiFi driver is only known to work with
+ * single pbufs. It makes tcp_write() copy all data whatever the flags, so
+ * there is no zero-copy TCP send: PBUF_REF/PBUF_ROM segments would need
+ * this off and a driver that takes chained pbufs.
  */
 #ifndef LWIP_NETIF_TX_SINGLE_PBUF
 #define LWIP_NETIF_TX_SINGLE_PBUF             1
@@ -1474,13 +1479,27 @@
 */
 /**
  * LWIP_STATS==1: Enable statistics collection in lwip_stats.
+ * Collected whenever the lwipstats Lua module is built in.
  */
 #ifndef LWIP_STATS
+#include "user_modules.h"
+#ifdef LUA_USE_MODULES_LWIPSTATS
+#define LWIP_STATS                      1
+#else
 #define LWIP_STATS                      0
 #endif
+#endif
 
 #if LWIP_STATS
 
+/**
+ * LWIP_STATS_LARGE==1: Use 32 bit counters, 16 bit ones wrap within minutes
+ * under load.
+ */
+#ifndef LWIP_STATS_LARGE
+#define LWIP_STATS_LARGE                1
+#endif
+
 /**
  * LWIP_STATS_DISPLAY==1: Compile in the statistics output functions.
  */
@@ -1555,10 +1574,11 @@
 #endif
 
 /**
- * MEMP_STATS==1: Enable memp.c pool stats.
+ * MEMP_STATS==1: Enable memp.c pool stats. With MEMP_MEM_MALLOC the pools
+ * come from the heap and only their use is counted.
  */
 #ifndef MEMP_STATS
-#define MEMP_STATS                      (MEMP_MEM_MALLOC == 0)
+#define MEMP_STATS                      1
 #endif
 
 /**
@@ -9,8 +9,22 @@ struct nodemcu_mdns_info {
 	const char *txt_data[10];
 };
 
+// An instance found by browsing, only valid during the callback
+struct nodemcu_mdns_result {
+	const char *instance;
+	const char *host_name;		// NULL if the responder didn't send it
+	struct ip_addr ip;		// 0 if the responder didn't send it
+	uint16 port;
+	const char *txt_data[10];
+};
+
+typedef void (*nodemcu_mdns_browse_cb)(const struct nodemcu_mdns_result *, void *);
+
 void nodemcu_mdns_close(void);
 bool nodemcu_mdns_init(struct nodemcu_mdns_info *);
 
+bool nodemcu_mdns_browse(const char *service, nodemcu_mdns_browse_cb, void *);
+void nodemcu_mdns_browse_stop(void);
+
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+
+/*
+* A hashed timer wheel: timers hash into TIMERWHEEL_SLOTS slots by their expiry
+* tick, so adding and cancelling a timer is O(1) however many are pending. One
+* OS timer drives the whole wheel and only runs while timers are pending.
+*
+* Timers are embedded in the caller's own structures and are never allocated by
+* the wheel. Callbacks run from the OS timer and may add or cancel any timer,
+* including the one firing.
+*/
+
+#define TIMERWHEEL_SLOTS 64   // must be a power of 2
+
+struct timerwheel;
+struct timerwheel_timer;
+
+typedef void (*timerwheel_callback_t)(struct timerwheel_timer *timer, void *arg);
+
+typedef struct timerwheel_timer {
+  struct timerwheel_timer *next;
+  struct timerwheel_timer **pprev;   // link pointing at this timer, NULL when not pending
+  struct timerwheel *wheel;
+  uint32 expires;                    // tick the timer fires at
+  timerwheel_callback_t callback;
+  void *arg;
+} timerwheel_timer_t;
+
+typedef struct timerwheel {
+  timerwheel_timer_t *slots[TIMERWHEEL_SLOTS];
+  timerwheel_timer_t *expiring;      // slot being processed
+  uint32 now;                        // current tick
+  uint32 last_us;                    // system_get_time() at the current tick
+  uint32 resolution;                 // ms per tick
+  uint32 pending;
+  os_timer_t timer;
+} timerwheel_t;
+
+void timerwheel_init(timerwheel_t *wheel, uint32 resolution_ms);
+
+/* (re)schedules timer to fire once, delay_ms from now */
+void timerwheel_add(timerwheel_t *wheel, timerwheel_timer_t *timer, uint32 delay_ms, timerwheel_callback_t callback, void *arg);
+
+/* a timer that is not pending is ignored */
+void timerwheel_cancel(timerwheel_timer_t *timer);
+
+#define timerwheel_pending(timer) ((timer)->pprev != NULL)
+
+#endif
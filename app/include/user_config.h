@@ -67,6 +67,7 @@ extern void luaL_assertfail(const char *file, int line, const char *message);
 //#define CLIENT_SSL_ENABLE
 //#define MD2_ENABLE
 #define SHA2_ENABLE
+//#define SHA2_IRAM   // SHA-256 transform in IRAM: faster, but uses IRAM
 
 #define BUILD_SPIFFS
 #define SPIFFS_CACHE 1
@@ -116,6 +117,6 @@ extern void luaL_assertfail(const char *file, int line, const char *message);
 #define WIFI_SDK_EVENT_MONITOR_ENABLE
 #define WIFI_EVENT_MONITOR_DISCONNECT_REASON_LIST_ENABLE
 
-#define STRBUF_DEFAULT_INCREMENT 32
+#define STRBUF_DEFAULT_INCREMENT -2    // double the size when growing
 
 #endif	/* __USER_CONFIG_H__ */
@@ -24,6 +24,7 @@
 #define LUA_USE_MODULES_BIT
 //#define LUA_USE_MODULES_BMP085
 //#define LUA_USE_MODULES_BME280
+//#define LUA_USE_MODULES_CBOR
 //#define LUA_USE_MODULES_CJSON
 //#define LUA_USE_MODULES_COAP
 //#define LUA_USE_MODULES_CRYPTO
@@ -35,9 +36,11 @@
 #define LUA_USE_MODULES_GPIO
 //#define LUA_USE_MODULES_HMC5883L
 //#define LUA_USE_MODULES_HTTP
+//#define LUA_USE_MODULES_HTTPD
 //#define LUA_USE_MODULES_HX711
 #define LUA_USE_MODULES_I2C
 //#define LUA_USE_MODULES_L3G4200D
+//#define LUA_USE_MODULES_LWIPSTATS
 //#define LUA_USE_MODULES_MDNS
 #define LUA_USE_MODULES_MQTT
 #define LUA_USE_MODULES_NET
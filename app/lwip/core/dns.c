@@ -107,6 +107,11 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 #define DNS_MAX_TTL               604800
 #endif
 
+/** How long a name the server reported as nonexistent is remembered (seconds) */
+#ifndef DNS_NEGATIVE_TTL
+#define DNS_NEGATIVE_TTL          30
+#endif
+
 /* DNS protocol flags */
 #define DNS_FLAG1_RESPONSE        0x80
 #define DNS_FLAG1_OPCODE_STATUS   0x10
@@ -168,20 +173,28 @@ struct dns_answer {
 };
 #define SIZEOF_DNS_ANSWER 10
 
+/** Further callers waiting for a name already being resolved */
+struct dns_waiter {
+  dns_found_callback found;
+  void *arg;
+  struct dns_waiter *next;
+};
+
 /** DNS table entry */
 struct dns_table_entry {
   u8_t  state;
-  u8_t  numdns;
   u8_t  tmr;
   u8_t  retries;
   u8_t  seqno;
-  u8_t  err;
+  u8_t  err;                /* != 0 in a DONE entry caches a failure */
+  u16_t txid;               /* transaction ID of the query */
   u32_t ttl;
   char name[DNS_MAX_NAME_LENGTH];
   ip_addr_t ipaddr;
   /* pointer to callback on DNS query done */
   dns_found_callback found;
   void *arg;
+  struct dns_waiter *waiters;
 };
 
 #if DNS_LOCAL_HOSTLIST
@@ -227,7 +240,9 @@ static ip_addr_t              dns_servers[DNS_MAX_SERVERS];
 /** Contiguous buffer for processing responses */
 //static u8_t                   dns_payload_buffer[LWIP_MEM_ALIGN_BUFFER(DNS_MSG_SIZE)];
 static u8_t*                  dns_payload;
-static u16_t					  dns_random;
+static struct dns_stats       dns_stats;
+/* entry whose callbacks run, its name and address must stay put meanwhile */
+static struct dns_table_entry *dns_calling;
 /**
  * Initialize the resolver: set up the UDP pcb and configure the default server
  * (DNS_SERVER_ADDRESS).
@@ -307,6 +322,25 @@ dns_getserver(u8_t numdns)
   }
 }
 
+/**
+ * Obtain the resolver cache counters.
+ *
+ * @param stats where to copy the counters to
+ */
+void ICACHE_FLASH_ATTR
+dns_getstats(struct dns_stats *stats)
+{
+  u8_t i;
+
+  *stats = dns_stats;
+  stats->cached = 0;
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    if (dns_table[i].state == DNS_STATE_DONE) {
+      stats->cached++;
+    }
+  }
+}
+
 /**
  * The DNS resolver client timer - handle retries and timeouts and should
  * be called every DNS_TMR_INTERVAL milliseconds (every second by default).
@@ -483,6 +517,11 @@ dns_lookup(const char *name)
       LWIP_DEBUGF(DNS_DEBUG, ("dns_lookup: \"%s\": found = ", name));
       ip_addr_debug_print(DNS_DEBUG, &(dns_table[i].ipaddr));
       LWIP_DEBUGF(DNS_DEBUG, ("\n"));
+      if (dns_table[i].err != 0) {
+        /* cached failure, dns_enqueue() reports it */
+        return IPADDR_NONE;
+      }
+      dns_stats.hits++;
       return ip4_addr_get_u32(&dns_table[i].ipaddr);
     }
   }
@@ -559,17 +598,32 @@ dns_parse_name(unsigned char *query)
   return query + 1;
 }
 
+/**
+ * Count the configured DNS servers.
+ */
+static u8_t ICACHE_FLASH_ATTR
+dns_numservers(void)
+{
+  u8_t numdns, n = 0;
+
+  for (numdns = 0; numdns < DNS_MAX_SERVERS; ++numdns) {
+    if (!ip_addr_isany(&dns_servers[numdns])) {
+      n++;
+    }
+  }
+  return n;
+}
+
 /**
  * Send a DNS query packet.
  *
  * @param numdns index of the DNS server in the dns_servers table
  * @param name hostname to query
- * @param id index of the hostname in dns_table, used as transaction ID in the
- *        DNS query packet
+ * @param id transaction ID of the DNS query packet
  * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
  */
 static err_t ICACHE_FLASH_ATTR
-dns_send(u8_t numdns, const char* name, u8_t id)
+dns_send(u8_t numdns, const char* name, u16_t id)
 {
   err_t err;
   struct dns_hdr *hdr;
@@ -578,7 +632,6 @@ dns_send(u8_t numdns, const char* name, u8_t id)
   char *query, *nptr;
   const char *pHostname;
   u8_t n;
-  dns_random = (u16_t)os_random();
   LWIP_DEBUGF(DNS_DEBUG, ("dns_send: dns_servers[%"U16_F"] \"%s\": request\n",
               (u16_t)(numdns), name));
   LWIP_ASSERT("dns server out of array", numdns < DNS_MAX_SERVERS);
@@ -592,7 +645,7 @@ dns_send(u8_t numdns, const char* name, u8_t id)
     /* fill dns header */
     hdr = (struct dns_hdr*)p->payload;
     os_memset(hdr, 0, SIZEOF_DNS_HDR);
-    hdr->id = htons(id + dns_random);
+    hdr->id = htons(id);
     hdr->flags1 = DNS_FLAG1_RD;
     hdr->numquestions = PP_HTONS(1);
     query = (char*)hdr + SIZEOF_DNS_HDR;
@@ -621,13 +674,13 @@ dns_send(u8_t numdns, const char* name, u8_t id)
     /* resize pbuf to the exact dns query */
     pbuf_realloc(p, (u16_t)((query + SIZEOF_DNS_QUERY) - ((char*)(p->payload))));
 
-    /* connect to the server for faster receiving */
-    udp_connect(dns_pcb, &dns_servers[numdns], DNS_SERVER_PORT);
-    /* send dns packet */
+    /* send dns packet; the pcb stays unconnected, so answers from all
+       servers asked in parallel get through */
     err = udp_sendto(dns_pcb, p, &dns_servers[numdns], DNS_SERVER_PORT);
 
     /* free pbuf */
     pbuf_free(p);
+    dns_stats.queries++;
   } else {
     err = ERR_MEM;
   }
@@ -635,6 +688,61 @@ dns_send(u8_t numdns, const char* name, u8_t id)
   return err;
 }
 
+/**
+ * Send the query of an entry to all configured DNS servers at once, the first
+ * answer wins.
+ *
+ * @param pEntry the dns_table entry to query
+ */
+static void ICACHE_FLASH_ATTR
+dns_send_all(struct dns_table_entry *pEntry)
+{
+  err_t err;
+  u8_t numdns;
+
+  for (numdns = 0; numdns < DNS_MAX_SERVERS; ++numdns) {
+    if (ip_addr_isany(&dns_servers[numdns])) {
+      continue;
+    }
+    err = dns_send(numdns, pEntry->name, pEntry->txid);
+    if (err != ERR_OK) {
+      LWIP_DEBUGF(DNS_DEBUG | LWIP_DBG_LEVEL_WARNING,
+                  ("dns_send returned error: %s\n", lwip_strerr(err)));
+    }
+  }
+}
+
+/**
+ * Call everyone waiting for an entry. The entry must already be in its final
+ * state, as callbacks may start new lookups.
+ *
+ * @param pEntry the dns_table entry that completed
+ * @param ipaddr the address found, NULL on failure
+ */
+static void ICACHE_FLASH_ATTR
+dns_call_found(struct dns_table_entry *pEntry, ip_addr_t *ipaddr)
+{
+  dns_found_callback found = pEntry->found;
+  void *arg = pEntry->arg;
+  struct dns_waiter *waiter = pEntry->waiters;
+  struct dns_waiter *next;
+  struct dns_table_entry *calling = dns_calling;
+
+  pEntry->found = NULL;
+  pEntry->waiters = NULL;
+  dns_calling = pEntry;
+  if (found) {
+    (*found)(pEntry->name, ipaddr, arg);
+  }
+  while (waiter != NULL) {
+    next = waiter->next;
+    (*waiter->found)(pEntry->name, ipaddr, waiter->arg);
+    os_free(waiter);
+    waiter = next;
+  }
+  dns_calling = calling;
+}
+
 /**
  * dns_check_entry() - see if pEntry has not yet been queried and, if so, sends out a query.
  * Check an entry in the dns_table:
@@ -647,70 +755,67 @@ dns_send(u8_t numdns, const char* name, u8_t id)
 static void ICACHE_FLASH_ATTR
 dns_check_entry(u8_t i)
 {
-  err_t err;
   struct dns_table_entry *pEntry = &dns_table[i];
+  u8_t j;
 
   LWIP_ASSERT("array index out of bounds", i < DNS_TABLE_SIZE);
 
   switch(pEntry->state) {
 
     case DNS_STATE_NEW: {
-      /* initialize new entry */
+      /* initialize new entry, with a transaction ID no other query uses */
+      do {
+        pEntry->txid = (u16_t)os_random();
+        for (j = 0; j < DNS_TABLE_SIZE; ++j) {
+          if ((j != i) && (dns_table[j].state == DNS_STATE_ASKING) && (dns_table[j].txid == pEntry->txid)) {
+            break;
+          }
+        }
+      } while (j < DNS_TABLE_SIZE);
       pEntry->state   = DNS_STATE_ASKING;
-      pEntry->numdns  = 0;
       pEntry->tmr     = 1;
       pEntry->retries = 0;
-      
+      pEntry->err     = 0;
+
       /* send DNS packet for this entry */
-      err = dns_send(pEntry->numdns, pEntry->name, i);
-      if (err != ERR_OK) {
-        LWIP_DEBUGF(DNS_DEBUG | LWIP_DBG_LEVEL_WARNING,
-                    ("dns_send returned error: %s\n", lwip_strerr(err)));
-      }
+      dns_send_all(pEntry);
       break;
     }
 
     case DNS_STATE_ASKING: {
       if (--pEntry->tmr == 0) {
         if (++pEntry->retries == DNS_MAX_RETRIES) {
-          if ((pEntry->numdns+1<DNS_MAX_SERVERS) && !ip_addr_isany(&dns_servers[pEntry->numdns+1])) {
-            /* change of server */
-            pEntry->numdns++;
-            pEntry->tmr     = 1;
-            pEntry->retries = 0;
-            break;
-          } else {
-            LWIP_DEBUGF(DNS_DEBUG, ("dns_check_entry: \"%s\": timeout\n", pEntry->name));
-            /* call specified callback function if provided */
-            if (pEntry->found)
-              (*pEntry->found)(pEntry->name, NULL, pEntry->arg);
-            /* flush this entry */
-            pEntry->state   = DNS_STATE_UNUSED;
-            pEntry->found   = NULL;
-            break;
-          }
+          LWIP_DEBUGF(DNS_DEBUG, ("dns_check_entry: \"%s\": timeout\n", pEntry->name));
+          dns_stats.timeouts++;
+          /* flush this entry, then call the callbacks */
+          pEntry->state = DNS_STATE_UNUSED;
+          dns_call_found(pEntry, NULL);
+          break;
         }
 
         /* wait longer for the next retry */
         pEntry->tmr = pEntry->retries;
 
         /* send DNS packet for this entry */
-        err = dns_send(pEntry->numdns, pEntry->name, i);
-        if (err != ERR_OK) {
-          LWIP_DEBUGF(DNS_DEBUG | LWIP_DBG_LEVEL_WARNING,
-                      ("dns_send returned error: %s\n", lwip_strerr(err)));
-        }
+        dns_send_all(pEntry);
       }
       break;
     }
 
     case DNS_STATE_DONE: {
       /* if the time to live is nul */
-      if (--pEntry->ttl == 0) {
+      if (pEntry->ttl > 0) {
+        --pEntry->ttl;
+      }
+      if (pEntry->ttl == 0) {
         LWIP_DEBUGF(DNS_DEBUG, ("dns_check_entry: \"%s\": flush\n", pEntry->name));
         /* flush this entry */
         pEntry->state = DNS_STATE_UNUSED;
-        pEntry->found = NULL;
+      }
+      if (pEntry->err != 0) {
+        /* callers that found a cached failure learn about it here, never from
+           within dns_gethostbyname() */
+        dns_call_found(pEntry, NULL);
       }
       break;
     }
@@ -750,6 +855,7 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
   struct dns_answer ans;
   struct dns_table_entry *pEntry;
   u16_t nquestions, nanswers;
+  u8_t err;
 
   u8_t* dns_payload_buffer = (u8_t* )os_zalloc(LWIP_MEM_ALIGN_BUFFER(DNS_MSG_SIZE));
   dns_payload = (u8_t *)LWIP_MEM_ALIGN(dns_payload_buffer);
@@ -775,16 +881,26 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
 
   /* copy dns payload inside static buffer for processing */ 
   if (pbuf_copy_partial(p, dns_payload, p->tot_len, 0) == p->tot_len) {
-    /* The ID in the DNS header should be our entry into the name table. */
+    /* The ID in the DNS header finds the entry in the name table. */
     hdr = (struct dns_hdr*)dns_payload;
-    i = htons(hdr->id);
-    i = i - dns_random;
+    for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+      if ((dns_table[i].state == DNS_STATE_ASKING) && (dns_table[i].txid == htons(hdr->id))) {
+        break;
+      }
+    }
     if (i < DNS_TABLE_SIZE) {
       pEntry = &dns_table[i];
       if(pEntry->state == DNS_STATE_ASKING) {
+        err = hdr->flags2 & DNS_FLAG2_ERR_MASK;
+        if ((err != 0) && (err != DNS_FLAG2_ERR_NAME) && (dns_numservers() > 1)) {
+          /* a server failing, another one may still answer */
+          LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": server error %"U16_F"\n", pEntry->name, (u16_t)err));
+          goto memerr;
+        }
+
         /* This entry is now completed. */
         pEntry->state = DNS_STATE_DONE;
-        pEntry->err   = hdr->flags2 & DNS_FLAG2_ERR_MASK;
+        pEntry->err   = err;
 
         /* We only care about the question(s) and the answers. The authrr
            and the extrarr are simply discarded. */
@@ -828,10 +944,12 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
             LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": response = ", pEntry->name));
             ip_addr_debug_print(DNS_DEBUG, (&(pEntry->ipaddr)));
             LWIP_DEBUGF(DNS_DEBUG, ("\n"));
-            /* call specified callback function if provided */
-            if (pEntry->found) {
-              (*pEntry->found)(pEntry->name, &pEntry->ipaddr, pEntry->arg);
+            if (pEntry->ttl == 0) {
+              /* not to be cached */
+              pEntry->state = DNS_STATE_UNUSED;
             }
+            /* call specified callback functions */
+            dns_call_found(pEntry, &pEntry->ipaddr);
             /* deallocate memory and return */
             goto memerr;
           } else {
@@ -850,13 +968,15 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
   goto memerr;
 
 responseerr:
-  /* ERROR: call specified callback function with NULL as name to indicate an error */
-  if (pEntry->found) {
-    (*pEntry->found)(pEntry->name, NULL, pEntry->arg);
+  if (pEntry->err == DNS_FLAG2_ERR_NAME) {
+    /* remember the name doesn't exist (negative caching) */
+    pEntry->ttl = DNS_NEGATIVE_TTL;
+  } else {
+    /* flush this entry */
+    pEntry->state = DNS_STATE_UNUSED;
   }
-  /* flush this entry */
-  pEntry->state = DNS_STATE_UNUSED;
-  pEntry->found = NULL;
+  /* ERROR: call specified callback function with NULL as name to indicate an error */
+  dns_call_found(pEntry, NULL);
 
 memerr:
   /* free pbuf */
@@ -879,18 +999,52 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
   u8_t i;
   u8_t lseq, lseqi;
   struct dns_table_entry *pEntry = NULL;
+  struct dns_waiter *waiter;
   size_t namelen;
 
+  /* join a lookup of the same name in progress, or a cached failure */
+  for (i = 0; i < DNS_TABLE_SIZE; ++i) {
+    pEntry = &dns_table[i];
+    if ((pEntry->state == DNS_STATE_ASKING) ||
+        ((pEntry->state == DNS_STATE_DONE) && (pEntry->err != 0))) {
+      if (strcmp(name, pEntry->name) != 0) {
+        continue;
+      }
+      if (found == NULL) {
+        return ERR_INPROGRESS;
+      }
+      if (pEntry->found == NULL) {
+        pEntry->found = found;
+        pEntry->arg   = callback_arg;
+      } else {
+        waiter = (struct dns_waiter *)os_zalloc(sizeof(struct dns_waiter));
+        if (waiter == NULL) {
+          return ERR_MEM;
+        }
+        waiter->found = found;
+        waiter->arg   = callback_arg;
+        waiter->next  = pEntry->waiters;
+        pEntry->waiters = waiter;
+      }
+      if (pEntry->state == DNS_STATE_ASKING) {
+        dns_stats.coalesced++;
+      } else {
+        dns_stats.negative_hits++;
+      }
+      return ERR_INPROGRESS;
+    }
+  }
+
   /* search an unused entry, or the oldest one */
   lseq = lseqi = 0;
   for (i = 0; i < DNS_TABLE_SIZE; ++i) {
     pEntry = &dns_table[i];
     /* is it an unused entry ? */
-    if (pEntry->state == DNS_STATE_UNUSED)
+    if ((pEntry->state == DNS_STATE_UNUSED) && (pEntry != dns_calling))
       break;
 
-    /* check if this is the oldest completed entry */
-    if (pEntry->state == DNS_STATE_DONE) {
+    /* check if this is the oldest completed entry nobody waits for */
+    if ((pEntry->state == DNS_STATE_DONE) && (pEntry->found == NULL) && (pEntry != dns_calling)) {
       if ((dns_seqno - pEntry->seqno) > lseq) {
         lseq = dns_seqno - pEntry->seqno;
         lseqi = i;
@@ -900,7 +1054,8 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
 
   /* if we don't have found an unused entry, use the oldest completed one */
   if (i == DNS_TABLE_SIZE) {
-    if ((lseqi >= DNS_TABLE_SIZE) || (dns_table[lseqi].state != DNS_STATE_DONE)) {
+    if ((lseqi >= DNS_TABLE_SIZE) || (dns_table[lseqi].state != DNS_STATE_DONE) ||
+        (dns_table[lseqi].found != NULL) || (&dns_table[lseqi] == dns_calling)) {
       /* no entry can't be used now, table is full */
       LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": DNS entries table is full\n", name));
       return ERR_MEM;
@@ -915,6 +1070,7 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
   LWIP_DEBUGF(DNS_DEBUG, ("dns_enqueue: \"%s\": use DNS entry %"U16_F"\n", name, (u16_t)(i)));
 
   /* fill the entry */
+  dns_stats.misses++;
   pEntry->state = DNS_STATE_NEW;
   pEntry->seqno = dns_seqno++;
   pEntry->found = found;
@@ -973,7 +1129,7 @@ dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback foun
   ipaddr = ipaddr_addr(hostname);
   if (ipaddr == IPADDR_NONE) {
     /* already have this address cached? */
-//    ipaddr = dns_lookup(hostname);
+    ipaddr = dns_lookup(hostname);
   }
   if (ipaddr != IPADDR_NONE) {
     ip4_addr_set_u32(addr, ipaddr);
@@ -61,6 +61,10 @@
 
 #include <string.h>
 
+#if MEMP_MEM_MALLOC && MEMP_STATS && defined(MEMLEAK_DEBUG)
+static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
+#endif
+
 #if !MEMP_MEM_MALLOC /* don't build if not configured for use in lwipopts.h */
 
 struct memp {
@@ -470,6 +474,35 @@ memp_free(memp_t type, void *mem)
   SYS_ARCH_UNPROTECT(old_level);
 }
 
+#elif MEMP_STATS /* MEMP_MEM_MALLOC */
+
+/**
+ * The pools come from the heap, only count their use for the stats.
+ */
+void *
+memp_malloc(memp_t type)
+{
+  void *mem;
+  LWIP_ERROR("memp_malloc: type < MEMP_MAX", (type < MEMP_MAX), return NULL;);
+  mem = mem_malloc(memp_sizes[type]);
+  if (mem != NULL) {
+    MEMP_STATS_INC_USED(used, type);
+  } else {
+    MEMP_STATS_INC(err, type);
+  }
+  return mem;
+}
+
+void
+memp_free(memp_t type, void *mem)
+{
+  if (mem == NULL) {
+    return;
+  }
+  MEMP_STATS_DEC(used, type);
+  mem_free(mem);
+}
+
 #endif /* MEMP_MEM_MALLOC */
 #if 0
 void memp_dump(void)
@@ -0,0 +1,608 @@
+// Module for CBOR (RFC 7049) encoding and decoding
+
+#include "module.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "c_string.h"
+#include "c_math.h"
+#include "c_types.h"
+
+#include "strbuf.h"
+
+#define DEFAULT_SPARSE_CONVERT 0
+#define DEFAULT_SPARSE_RATIO   2
+#define DEFAULT_SPARSE_SAFE    10
+// each level of nesting takes a C stack frame, of which there is little
+#define DEFAULT_MAX_DEPTH      32
+#define STREAM_DEFAULT_SIZE    256
+#define STREAM_MIN_SIZE        16
+
+// initial byte: major type in the upper 3 bits
+#define MT_UINT   0
+#define MT_NINT   1
+#define MT_BYTES  2
+#define MT_TEXT   3
+#define MT_ARRAY  4
+#define MT_MAP    5
+#define MT_TAG    6
+#define MT_SIMPLE 7
+
+#define AI_INDEFINITE 31
+#define CBOR_FALSE    0xf4
+#define CBOR_TRUE     0xf5
+#define CBOR_NULL     0xf6
+#define CBOR_FLOAT32  0xfa
+#define CBOR_FLOAT64  0xfb
+#define CBOR_BREAK    0xff
+
+typedef struct {
+  int sparse_convert;
+  int sparse_ratio;
+  int sparse_safe;
+  int encode_max_depth;
+  int decode_max_depth;
+  int keep_buffer;
+  strbuf_t buf;       // kept between calls when keep_buffer is set
+} cbor_config_t;
+
+static cbor_config_t cfg = {
+  DEFAULT_SPARSE_CONVERT, DEFAULT_SPARSE_RATIO, DEFAULT_SPARSE_SAFE,
+  DEFAULT_MAX_DEPTH, DEFAULT_MAX_DEPTH, 0
+};
+
+typedef struct {
+  lua_State *L;
+  int index;          // stack index of the sink
+} cbor_sink_t;
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  uint8_t ib;         // initial byte of the last head read
+  int depth;
+} cbor_parse_t;
+
+/* ===== ENCODING ===== */
+
+static void cbor_encode_error(lua_State *L, strbuf_t *b, const char *msg)
+{
+  if (b != &cfg.buf)
+    strbuf_free(b);
+  luaL_error(L, "cbor: %s", msg);
+}
+
+static void cbor_put_head(strbuf_t *b, uint8_t major, uint64_t n)
+{
+  uint8_t h[9];
+  int len, i;
+
+  if (n < 24) {
+    h[0] = (major << 5) | n;
+    len = 1;
+  } else if (n <= 0xff) {
+    h[0] = (major << 5) | 24;
+    len = 2;
+  } else if (n <= 0xffff) {
+    h[0] = (major << 5) | 25;
+    len = 3;
+  } else if (n <= 0xffffffffULL) {
+    h[0] = (major << 5) | 26;
+    len = 5;
+  } else {
+    h[0] = (major << 5) | 27;
+    len = 9;
+  }
+  for (i = len - 1; i > 0; i--, n >>= 8)
+    h[i] = n & 0xff;
+  strbuf_append_mem(b, (const char *)h, len);
+}
+
+static void cbor_put_number(strbuf_t *b, lua_Number num)
+{
+#if !defined LUA_NUMBER_INTEGRAL
+  double v = num;
+
+  if (v == floor(v) && v > -9223372036854775808.0 && v < 9223372036854775808.0) {
+    if (v >= 0)
+      cbor_put_head(b, MT_UINT, (uint64_t)v);
+    else
+      cbor_put_head(b, MT_NINT, (uint64_t)(-1 - (int64_t)v));
+    return;
+  }
+
+  uint8_t h[9];
+  int len, i;
+  float f = (float)v;
+  if ((double)f == v) {
+    // no precision lost, half the size
+    union { float f; uint32_t u; } bits;
+    bits.f = f;
+    h[0] = CBOR_FLOAT32;
+    for (i = 4; i > 0; i--, bits.u >>= 8)
+      h[i] = bits.u & 0xff;
+    len = 5;
+  } else {
+    union { double d; uint64_t u; } bits;
+    bits.d = v;
+    h[0] = CBOR_FLOAT64;
+    for (i = 8; i > 0; i--, bits.u >>= 8)
+      h[i] = bits.u & 0xff;
+    len = 9;
+  }
+  strbuf_append_mem(b, (const char *)h, len);
+#else
+  if (num >= 0)
+    cbor_put_head(b, MT_UINT, (uint64_t)num);
+  else
+    cbor_put_head(b, MT_NINT, (uint64_t)(-1 - (int64_t)num));
+#endif
+}
+
+static void cbor_put_string(lua_State *L, strbuf_t *b, int index)
+{
+  size_t len;
+  const char *s = lua_tolstring(L, index, &len);
+
+  cbor_put_head(b, MT_TEXT, len);
+  // a streamed buffer keeps its size, long strings go in pieces
+  while (len) {
+    size_t n = len;
+    if (b->flush && n > (size_t)strbuf_empty_length(b)) {
+      n = b->size - 1;
+      if (n > len)
+        n = len;
+    }
+    strbuf_append_mem(b, s, n);
+    s += n;
+    len -= n;
+  }
+}
+
+/* Returns the length of the array on top of the stack, or -1 for a
+ * table to encode as a map. Same rules as cjson */
+static int cbor_array_length(lua_State *L, strbuf_t *b)
+{
+  lua_Number k;
+  int max = 0, items = 0;
+
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    if (lua_type(L, -2) == LUA_TNUMBER && (k = lua_tonumber(L, -2)) >= 1 &&
+        floor(k) == k) {
+      if (k > max)
+        max = k;
+      items++;
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_pop(L, 2);
+    return -1;
+  }
+
+  if (cfg.sparse_ratio > 0 && max > items * cfg.sparse_ratio &&
+      max > cfg.sparse_safe) {
+    if (!cfg.sparse_convert)
+      cbor_encode_error(L, b, "excessively sparse array");
+    return -1;
+  }
+  return max;
+}
+
+static void cbor_put_value(lua_State *L, strbuf_t *b, int depth)
+{
+  int len, i;
+
+  switch (lua_type(L, -1)) {
+  case LUA_TNIL:
+    strbuf_append_char(b, CBOR_NULL);
+    break;
+  case LUA_TBOOLEAN:
+    strbuf_append_char(b, lua_toboolean(L, -1) ? CBOR_TRUE : CBOR_FALSE);
+    break;
+  case LUA_TNUMBER:
+    cbor_put_number(b, lua_tonumber(L, -1));
+    break;
+  case LUA_TSTRING:
+    cbor_put_string(L, b, -1);
+    break;
+  case LUA_TLIGHTUSERDATA:
+    // cjson's null
+    if (lua_touserdata(L, -1) == NULL) {
+      strbuf_append_char(b, CBOR_NULL);
+      break;
+    }
+    cbor_encode_error(L, b, "type not supported");
+  case LUA_TTABLE:
+    if (++depth > cfg.encode_max_depth || !lua_checkstack(L, 3))
+      cbor_encode_error(L, b, "excessive nesting");
+    len = cbor_array_length(L, b);
+    if (len > 0) {
+      cbor_put_head(b, MT_ARRAY, len);
+      for (i = 1; i <= len; i++) {
+        lua_rawgeti(L, -1, i);
+        cbor_put_value(L, b, depth);
+        lua_pop(L, 1);
+      }
+    } else {
+      // counting first keeps the map definite length
+      len = 0;
+      lua_pushnil(L);
+      while (lua_next(L, -2) != 0) {
+        len++;
+        lua_pop(L, 1);
+      }
+      cbor_put_head(b, MT_MAP, len);
+      lua_pushnil(L);
+      while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);
+        cbor_put_value(L, b, depth);
+        lua_pop(L, 1);
+        cbor_put_value(L, b, depth);
+        lua_pop(L, 1);
+      }
+    }
+    break;
+  default:
+    cbor_encode_error(L, b, "type not supported");
+  }
+}
+
+static void cbor_sink_flush(strbuf_t *s)
+{
+  cbor_sink_t *sink = (cbor_sink_t *)s->flush_arg;
+  lua_State *L = sink->L;
+  int nargs = 1;
+
+  if (lua_isfunction(L, sink->index)) {
+    lua_pushvalue(L, sink->index);
+  } else {
+    lua_getfield(L, sink->index, "write");
+    lua_pushvalue(L, sink->index);
+    nargs++;
+  }
+  lua_pushlstring(L, s->buf, s->length);
+  if (lua_pcall(L, nargs, 0, 0) != 0) {
+    strbuf_free(s);
+    lua_error(L);
+  }
+  strbuf_reset(s);
+}
+
+// Lua: cbor.encode(value[, sink[, size]])
+static int cbor_encode(lua_State *L)
+{
+  strbuf_t local_buf, *b;
+  cbor_sink_t sink;
+
+  luaL_argcheck(L, lua_gettop(L) >= 1 && lua_gettop(L) <= 3, 1, "expected 1 to 3 arguments");
+
+  if (!lua_isnoneornil(L, 2)) {
+    int size = luaL_optint(L, 3, STREAM_DEFAULT_SIZE);
+    luaL_argcheck(L, size >= STREAM_MIN_SIZE, 3, "chunk size too small");
+    if (!lua_isfunction(L, 2)) {
+      luaL_argcheck(L, lua_istable(L, 2) || lua_isuserdata(L, 2), 2, "function or object expected");
+      lua_getfield(L, 2, "write");
+      luaL_argcheck(L, lua_isfunction(L, -1), 2, "object without write()");
+      lua_pop(L, 1);
+    }
+    b = &local_buf;
+    if (strbuf_init(b, size) == -1)
+      return luaL_error(L, "not enough memory");
+    sink.L = L;
+    sink.index = 2;
+    b->flush = cbor_sink_flush;
+    b->flush_arg = &sink;
+  } else if (cfg.keep_buffer) {
+    b = &cfg.buf;
+    if (!strbuf_allocated(b) && strbuf_init(b, 0) == -1)
+      return luaL_error(L, "not enough memory");
+    strbuf_reset(b);
+  } else {
+    b = &local_buf;
+    if (strbuf_init(b, 0) == -1)
+      return luaL_error(L, "not enough memory");
+  }
+
+  lua_settop(L, 2);
+  lua_pushvalue(L, 1);
+  cbor_put_value(L, b, 0);
+
+  if (b->flush) {
+    if (strbuf_length(b))
+      cbor_sink_flush(b);
+    strbuf_free(b);
+    return 0;
+  }
+
+  lua_pushlstring(L, b->buf, b->length);
+  if (b != &cfg.buf)
+    strbuf_free(b);
+  return 1;
+}
+
+/* ===== DECODING ===== */
+
+static void cbor_get_value(lua_State *L, cbor_parse_t *d);
+
+static void cbor_truncated(lua_State *L)
+{
+  luaL_error(L, "cbor: truncated data");
+}
+
+/* Reads an initial byte and its argument. Returns the major type, the
+ * argument in *n, and sets *indefinite for indefinite lengths */
+static int cbor_get_head(lua_State *L, cbor_parse_t *d, uint64_t *n, int *indefinite)
+{
+  uint8_t ib, ai;
+  int len;
+
+  if (d->p >= d->end)
+    cbor_truncated(L);
+  ib = d->ib = *d->p++;
+  ai = ib & 0x1f;
+  *indefinite = 0;
+
+  if (ai < 24) {
+    *n = ai;
+    return ib >> 5;
+  }
+  if (ai == AI_INDEFINITE) {
+    *indefinite = 1;
+    *n = 0;
+    return ib >> 5;
+  }
+  if (ai > 27)
+    luaL_error(L, "cbor: invalid initial byte 0x%x", ib);
+
+  len = 1 << (ai - 24);
+  if (d->end - d->p < len)
+    cbor_truncated(L);
+  *n = 0;
+  while (len--)
+    *n = (*n << 8) | *d->p++;
+  return ib >> 5;
+}
+
+static lua_Number cbor_half(uint16_t h)
+{
+  uint32_t e = (h >> 10) & 0x1f;
+  uint32_t m = h & 0x3ff;
+  union { float f; uint32_t u; } bits;
+
+  if (e == 0) {
+    // subnormal, m * 2^-24
+    bits.f = (float)m / 16777216.0f;
+    bits.u |= (uint32_t)(h & 0x8000) << 16;
+  } else {
+    // rebias the exponent for a float, 31 stays infinity/NaN
+    bits.u = ((uint32_t)(h & 0x8000) << 16) |
+             ((e == 31 ? 0xff : e - 15 + 127) << 23) | (m << 13);
+  }
+  return bits.f;
+}
+
+static void cbor_get_string(lua_State *L, cbor_parse_t *d, int major, uint64_t n, int indefinite)
+{
+  if (!indefinite) {
+    if ((uint64_t)(d->end - d->p) < n)
+      cbor_truncated(L);
+    lua_pushlstring(L, (const char *)d->p, n);
+    d->p += n;
+    return;
+  }
+
+  // chunks of definite strings of the same type, up to a break
+  luaL_Buffer buf;
+  luaL_buffinit(L, &buf);
+  while (1) {
+    int chunk_indefinite;
+    if (d->p >= d->end)
+      cbor_truncated(L);
+    if (*d->p == CBOR_BREAK) {
+      d->p++;
+      break;
+    }
+    if (cbor_get_head(L, d, &n, &chunk_indefinite) != major || chunk_indefinite)
+      luaL_error(L, "cbor: invalid string chunk");
+    if ((uint64_t)(d->end - d->p) < n)
+      cbor_truncated(L);
+    luaL_addlstring(&buf, (const char *)d->p, n);
+    d->p += n;
+  }
+  luaL_pushresult(&buf);
+}
+
+/* Decodes items into the table on top of the stack, pairs of them for a
+ * map. Stops after n, or at a break if indefinite */
+static void cbor_get_container(lua_State *L, cbor_parse_t *d, int map, uint64_t n, int indefinite)
+{
+  uint64_t i;
+
+  if (++d->depth > cfg.decode_max_depth || !lua_checkstack(L, 3))
+    luaL_error(L, "cbor: excessive nesting");
+  // every item takes at least a byte
+  if (!indefinite && n > (uint64_t)(d->end - d->p))
+    cbor_truncated(L);
+
+  if (map)
+    lua_createtable(L, 0, indefinite ? 0 : n);
+  else
+    lua_createtable(L, indefinite ? 0 : n, 0);
+
+  for (i = 1; indefinite || i <= n; i++) {
+    if (indefinite) {
+      if (d->p >= d->end)
+        cbor_truncated(L);
+      if (*d->p == CBOR_BREAK) {
+        d->p++;
+        break;
+      }
+    }
+    if (map) {
+      cbor_get_value(L, d);
+      if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+        luaL_error(L, "cbor: invalid map key");
+      cbor_get_value(L, d);
+      lua_rawset(L, -3);
+    } else {
+      cbor_get_value(L, d);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  d->depth--;
+}
+
+static void cbor_get_value(lua_State *L, cbor_parse_t *d)
+{
+  uint64_t n;
+  int indefinite;
+  int major;
+
+  // tags only annotate the item that follows, skipped in a loop so that a
+  // run of them can't exhaust the C stack
+  do
+    major = cbor_get_head(L, d, &n, &indefinite);
+  while (major == MT_TAG && !indefinite);
+  if (indefinite && (major < MT_BYTES || major == MT_TAG))
+    luaL_error(L, "cbor: invalid indefinite length");
+
+  switch (major) {
+  case MT_UINT:
+    lua_pushnumber(L, (lua_Number)n);
+    break;
+  case MT_NINT:
+    lua_pushnumber(L, -1 - (lua_Number)n);
+    break;
+  case MT_BYTES:
+  case MT_TEXT:
+    cbor_get_string(L, d, major, n, indefinite);
+    break;
+  case MT_ARRAY:
+    cbor_get_container(L, d, 0, n, indefinite);
+    break;
+  case MT_MAP:
+    cbor_get_container(L, d, 1, n, indefinite);
+    break;
+  default:
+    switch (d->ib) {
+    case CBOR_FALSE:
+      lua_pushboolean(L, 0);
+      break;
+    case CBOR_TRUE:
+      lua_pushboolean(L, 1);
+      break;
+    case CBOR_NULL:
+    case CBOR_NULL + 1:   // undefined
+      lua_pushlightuserdata(L, NULL);
+      break;
+    case CBOR_FLOAT32 - 1:
+      lua_pushnumber(L, cbor_half(n));
+      break;
+    case CBOR_FLOAT32: {
+      union { float f; uint32_t u; } bits;
+      bits.u = n;
+      lua_pushnumber(L, bits.f);
+      break;
+    }
+    case CBOR_FLOAT64: {
+      union { double d; uint64_t u; } bits;
+      bits.u = n;
+      lua_pushnumber(L, bits.d);
+      break;
+    }
+    case CBOR_BREAK:
+      luaL_error(L, "cbor: unexpected break");
+    default:
+      luaL_error(L, "cbor: unsupported simple value");
+    }
+  }
+}
+
+// Lua: value = cbor.decode(string)
+static int cbor_decode(lua_State *L)
+{
+  size_t len;
+  cbor_parse_t d;
+
+  d.p = (const uint8_t *)luaL_checklstring(L, 1, &len);
+  d.end = d.p + len;
+  d.depth = 0;
+
+  cbor_get_value(L, &d);
+  if (d.p != d.end)
+    return luaL_error(L, "cbor: trailing data");
+  return 1;
+}
+
+/* ===== CONFIGURATION ===== */
+
+// Lua: convert, ratio, safe = cbor.encode_sparse_array([convert[, ratio[, safe]]])
+static int cbor_encode_sparse_array(lua_State *L)
+{
+  if (!lua_isnoneornil(L, 1))
+    cfg.sparse_convert = lua_toboolean(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    int ratio = luaL_checkint(L, 2);
+    luaL_argcheck(L, ratio >= 0, 2, "expected integer >= 0");
+    cfg.sparse_ratio = ratio;
+  }
+  if (!lua_isnoneornil(L, 3)) {
+    int safe = luaL_checkint(L, 3);
+    luaL_argcheck(L, safe >= 0, 3, "expected integer >= 0");
+    cfg.sparse_safe = safe;
+  }
+  lua_pushboolean(L, cfg.sparse_convert);
+  lua_pushinteger(L, cfg.sparse_ratio);
+  lua_pushinteger(L, cfg.sparse_safe);
+  return 3;
+}
+
+static int cbor_depth_option(lua_State *L, int *setting)
+{
+  if (!lua_isnoneornil(L, 1)) {
+    int depth = luaL_checkint(L, 1);
+    luaL_argcheck(L, depth >= 1, 1, "expected integer >= 1");
+    *setting = depth;
+  }
+  lua_pushinteger(L, *setting);
+  return 1;
+}
+
+// Lua: depth = cbor.encode_max_depth([depth])
+static int cbor_encode_max_depth(lua_State *L)
+{
+  return cbor_depth_option(L, &cfg.encode_max_depth);
+}
+
+// Lua: depth = cbor.decode_max_depth([depth])
+static int cbor_decode_max_depth(lua_State *L)
+{
+  return cbor_depth_option(L, &cfg.decode_max_depth);
+}
+
+// Lua: keep = cbor.encode_keep_buffer([keep])
+static int cbor_encode_keep_buffer(lua_State *L)
+{
+  if (!lua_isnoneornil(L, 1)) {
+    cfg.keep_buffer = lua_toboolean(L, 1);
+    if (!cfg.keep_buffer && strbuf_allocated(&cfg.buf))
+      strbuf_free(&cfg.buf);
+  }
+  lua_pushboolean(L, cfg.keep_buffer);
+  return 1;
+}
+
+// Module function map
+static const LUA_REG_TYPE cbor_map[] = {
+  { LSTRKEY( "encode" ),              LFUNCVAL( cbor_encode ) },
+  { LSTRKEY( "decode" ),              LFUNCVAL( cbor_decode ) },
+  { LSTRKEY( "encode_sparse_array" ), LFUNCVAL( cbor_encode_sparse_array ) },
+  { LSTRKEY( "encode_max_depth" ),    LFUNCVAL( cbor_encode_max_depth ) },
+  { LSTRKEY( "decode_max_depth" ),    LFUNCVAL( cbor_decode_max_depth ) },
+  { LSTRKEY( "encode_keep_buffer" ),  LFUNCVAL( cbor_encode_keep_buffer ) },
+  { LSTRKEY( "null" ),                LUDATA( NULL ) },
+  { LNILKEY, LNILVAL }
+};
+
+NODEMCU_MODULE(CBOR, "cbor", cbor_map, NULL);
@@ -74,6 +74,8 @@
 #define DEFAULT_DECODE_INVALID_NUMBERS 1
 #define DEFAULT_ENCODE_KEEP_BUFFER 0
 #define DEFAULT_ENCODE_NUMBER_PRECISION 14
+#define JSON_STREAM_DEFAULT_SIZE 256
+#define JSON_STREAM_MIN_SIZE 64
 
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
@@ -612,16 +614,26 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
     const char *str;
     size_t len;
 
+    int step, left;
+
     str = lua_tolstring(l, lindex, &len);
 
     /* Worst case is len * 6 (all unicode escapes).
      * This buffer is reused constantly for small strings
      * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(json, len * 6 + 2);
+     * This gains ~5% speedup.
+     * A streamed buffer keeps its size, long strings go in pieces. */
+    step = len;
+    if (json->flush && len * 6 + 2 > json->size - 1)
+        step = (json->size - 3) / 6;
+    strbuf_ensure_empty_length(json, step * 6 + 2);
 
     strbuf_append_char_unsafe(json, '\"');
-    for (i = 0; i < len; i++) {
+    for (i = 0, left = step; i < len; i++, left--) {
+        if (!left) {
+            strbuf_ensure_empty_length(json, step * 6 + 1);
+            left = step;
+        }
         escstr = char2escape((unsigned char)str[i]);
         if (escstr){
             int i;
@@ -739,6 +751,159 @@ static void json_append_array(lua_State *l, json_config_t *cfg, int current_dept
     strbuf_append_char(json, ']');
 }
 
+/* Exact powers of ten, the largest a double holds exactly is 1e22 */
+static const double json_pow10[23] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define JSON_NUMBER_DIGITS 14   /* as "%.14g" */
+#define JSON_ROUND_MARGIN  1e-15 /* about 8 units in the last place */
+
+/* Writes the decimal digits of v backwards from end, returns the start */
+static char *json_format_uint(char *end, uint64_t v)
+{
+    uint32_t v32;
+
+    while (v > 0xffffffffULL) {
+        *--end = '0' + (int)(v % 10);
+        v /= 10;
+    }
+    v32 = (uint32_t)v;
+    do {
+        *--end = '0' + v32 % 10;
+        v32 /= 10;
+    } while (v32);
+    return end;
+}
+
+/* Formats num like c_sprintf("%.14g") does, without its digit by digit
+ * floating point loop. Integers, the most common numbers, only take
+ * integer arithmetic. Others are scaled to a 14 digit integer with one
+ * or a few multiplications. buf needs FPCONV_G_FMT_BUFSIZE bytes.
+ * Returns the length written. */
+static int json_format_number(char *buf, double num)
+{
+    union { double d; uint64_t u; } bits;
+    char digits[24], *d, *p = buf;
+    uint64_t m;
+    double orig, frac;
+    int e10, k, nd, i;
+
+    bits.d = num;
+    if (bits.u >> 63) {
+        *p++ = '-';
+        num = -num;
+    }
+
+    if (num < 1e14 && (double)(m = (uint64_t)num) == num) {
+        d = json_format_uint(digits + sizeof(digits), m);
+        nd = digits + sizeof(digits) - d;
+        c_memcpy(p, d, nd);
+        return p + nd - buf;
+    }
+
+    orig = num;
+
+    /* estimate the decimal exponent from the binary one, log10(2) ~ 78913 / 2^18 */
+    bits.d = num;
+    e10 = (((int)((bits.u >> 52) & 0x7ff) - 1023) * 78913) >> 18;
+
+    /* scale to [1e13, 1e14) */
+    k = JSON_NUMBER_DIGITS - 1 - e10;
+    for (; k > 22; k -= 22)
+        num *= 1e22;
+    for (; k < -22; k += 22)
+        num /= 1e22;
+    if (k > 0)
+        num *= json_pow10[k];
+    else if (k < 0)
+        num /= json_pow10[-k];
+    /* the estimate is off by one at most, more for denormals */
+    while (num < 1e13) {
+        num *= 10;
+        e10--;
+    }
+    while (num >= 1e14) {
+        num /= 10;
+        e10++;
+    }
+    /* fixed point values such as 23.45 keep their integer part exact,
+     * only the fraction is rounded when scaled */
+    k = JSON_NUMBER_DIGITS - 1 - e10;
+    if (k > 0 && k <= JSON_NUMBER_DIGITS - 1) {
+        m = (uint64_t)orig;
+        num = (orig - (double)m) * json_pow10[k];
+        m = m * (uint64_t)json_pow10[k];
+    } else {
+        m = 0;
+    }
+    /* the scaling above is off by a few units in the last place, so a
+     * fraction that close to one half may round the wrong way. Leave those
+     * few numbers to c_sprintf() */
+    frac = num - (double)(uint64_t)num - 0.5;
+    if ((frac < 0 ? -frac : frac) < num * JSON_ROUND_MARGIN) {
+        c_sprintf(p, LUA_NUMBER_FMT, (LUA_NUMBER)orig);
+        return p + c_strlen(p) - buf;
+    }
+    m += (uint64_t)(num + 0.5);
+    if (m >= 100000000000000ULL) {
+        m /= 10;
+        e10++;
+    }
+
+    /* drop trailing zeros */
+    nd = JSON_NUMBER_DIGITS;
+    while (m % 10 == 0) {
+        m /= 10;
+        nd--;
+    }
+    d = json_format_uint(digits + sizeof(digits), m);
+
+    if (e10 < -4 || e10 >= JSON_NUMBER_DIGITS) {
+        /* d.ddde+XX */
+        *p++ = d[0];
+        if (nd > 1) {
+            *p++ = '.';
+            c_memcpy(p, d + 1, nd - 1);
+            p += nd - 1;
+        }
+        *p++ = 'e';
+        if (e10 < 0) {
+            *p++ = '-';
+            e10 = -e10;
+        } else {
+            *p++ = '+';
+        }
+        if (e10 < 10)
+            *p++ = '0';
+        d = json_format_uint(digits + sizeof(digits), e10);
+        nd = digits + sizeof(digits) - d;
+        c_memcpy(p, d, nd);
+        return p + nd - buf;
+    }
+
+    if (e10 < 0) {
+        /* 0.000ddd */
+        *p++ = '0';
+        *p++ = '.';
+        for (i = -1; i > e10; i--)
+            *p++ = '0';
+        c_memcpy(p, d, nd);
+        return p + nd - buf;
+    }
+
+    /* ddd.ddd, or ddd000 */
+    for (i = 0; i < nd; i++) {
+        if (i == e10 + 1)
+            *p++ = '.';
+        *p++ = d[i];
+    }
+    for (; i <= e10; i++)
+        *p++ = '0';
+    return p - buf;
+}
+
 static void json_append_number(lua_State *l, json_config_t *cfg,
                                strbuf_t *json, int lindex)
 {
@@ -774,8 +939,7 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
 
     strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
     // len = fpconv_g_fmt(strbuf_empty_ptr(json), num, cfg->encode_number_precision);
-    c_sprintf(strbuf_empty_ptr(json), LUA_NUMBER_FMT, (LUA_NUMBER)num);
-    len = c_strlen(strbuf_empty_ptr(json));
+    len = json_format_number(strbuf_empty_ptr(json), num);
 
     strbuf_extend_length(json, len);
 }
@@ -865,6 +1029,69 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
     }
 }
 
+typedef struct {
+    lua_State *l;
+    int index;          /* stack index of the sink */
+} json_sink_t;
+
+/* Hands the buffered JSON text to the sink, a function or an object
+ * with a write() method such as a file object */
+static void json_sink_flush(strbuf_t *s)
+{
+    json_sink_t *sink = (json_sink_t *)s->flush_arg;
+    lua_State *l = sink->l;
+    int nargs = 1;
+
+    if (lua_isfunction(l, sink->index)) {
+        lua_pushvalue(l, sink->index);
+    } else {
+        lua_getfield(l, sink->index, "write");
+        lua_pushvalue(l, sink->index);
+        nargs++;
+    }
+    lua_pushlstring(l, s->buf, s->length);
+    if (lua_pcall(l, nargs, 0, 0) != 0) {
+        strbuf_free(s);
+        lua_error(l);
+    }
+    strbuf_reset(s);
+}
+
+/* Encodes the value at index 1 in chunks of at most size bytes, the
+ * buffer is flushed to the sink instead of growing */
+static int json_encode_stream(lua_State *l, json_config_t *cfg)
+{
+    strbuf_t stream_buf;
+    json_sink_t sink;
+    int size = luaL_optint(l, 3, JSON_STREAM_DEFAULT_SIZE);
+
+    luaL_argcheck(l, size >= JSON_STREAM_MIN_SIZE, 3, "chunk size too small");
+    if (!lua_isfunction(l, 2)) {
+        luaL_argcheck(l, lua_istable(l, 2) || lua_isuserdata(l, 2), 2,
+                      "function or object expected");
+        lua_getfield(l, 2, "write");
+        luaL_argcheck(l, lua_isfunction(l, -1), 2, "object without write()");
+        lua_pop(l, 1);
+    }
+
+    sink.l = l;
+    sink.index = 2;
+    if(-1==strbuf_init(&stream_buf, size))
+        return luaL_error(l, "not enough memory");
+    stream_buf.flush = json_sink_flush;
+    stream_buf.flush_arg = &sink;
+
+    lua_settop(l, 2);
+    lua_pushvalue(l, 1);
+    json_append_data(l, cfg, 0, &stream_buf);
+    if (strbuf_length(&stream_buf))
+        json_sink_flush(&stream_buf);
+
+    strbuf_free(&stream_buf);
+
+    return 0;
+}
+
 static int json_encode(lua_State *l)
 {
     json_config_t *cfg = json_fetch_config(l);
@@ -873,7 +1100,11 @@ static int json_encode(lua_State *l)
     char *json;
     int len;
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    luaL_argcheck(l, lua_gettop(l) >= 1 && lua_gettop(l) <= 3, 1,
+                  "expected 1 to 3 arguments");
+    if (!lua_isnoneornil(l, 2))
+        return json_encode_stream(l, cfg);
+    lua_settop(l, 1);
 
     if (!cfg->encode_keep_buffer) {
         /* Use private buffer */
@@ -1170,11 +1401,69 @@ static int json_is_invalid_number(json_parse_t *json)
     return 0;
 }
 
+/* Decodes the common short numbers exactly without c_strtod(): up to 19
+ * digits that fit a double's mantissa, scaled by a power of ten a double
+ * holds exactly, take one multiplication or division.
+ * Returns 0 to leave the number to c_strtod() */
+static int json_fast_number(const char *p, double *num, const char **endptr)
+{
+    uint64_t m = 0;
+    int neg = 0, digits = 0, e10 = 0, exp = 0, expneg = 0;
+    double v;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (*p < '0' || *p > '9')
+        return 0;
+    for (; *p >= '0' && *p <= '9'; p++, digits++)
+        m = m * 10 + (*p - '0');
+    if (*p == '.') {
+        p++;
+        if (*p < '0' || *p > '9')
+            return 0;
+        for (; *p >= '0' && *p <= '9'; p++, digits++, e10--)
+            m = m * 10 + (*p - '0');
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '-' || *p == '+')
+            expneg = *p++ == '-';
+        if (*p < '0' || *p > '9')
+            return 0;
+        for (; *p >= '0' && *p <= '9'; p++)
+            if (exp < 1000)
+                exp = exp * 10 + (*p - '0');
+        e10 += expneg ? -exp : exp;
+    }
+
+    if (digits > 19 || m > (1ULL << 53))
+        return 0;
+
+    v = (double)m;
+    if (e10 > 0) {
+        if (e10 > 22)
+            return 0;
+        v *= json_pow10[e10];
+    } else if (e10 < 0) {
+        if (e10 < -22)
+            return 0;
+        v /= json_pow10[-e10];
+    }
+
+    *num = neg ? -v : v;
+    *endptr = p;
+    return 1;
+}
+
 static void json_next_number_token(json_parse_t *json, json_token_t *token)
 {
     char *endptr;
 
     token->type = T_NUMBER;
+    if (json_fast_number(json->ptr, &token->value.number, &json->ptr))
+        return;
     token->value.number = fpconv_strtod(json->ptr, &endptr);
     if (json->ptr == endptr)
         json_set_token_error(token, json, "invalid number");
@@ -1273,6 +1562,25 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
  * json->tmp struct.
  * json and token should exist on the stack somewhere.
  * luaL_error() will long_jmp and release the stack */
+/* Returns the error or the name of the token found, token names are
+ * copied out of flash into temp (16 bytes) */
+static const char *json_token_found(json_token_t *token, char *temp)
+{
+    const char *found;
+
+    if (token->type == T_ERROR)
+        return token->value.string;
+
+    found = json_token_type_name[token->type];
+    int i;
+    for (i=0; i < 16; ++i)
+    {
+        temp[i] = byte_of_aligned_array(found, i);
+        if(temp[i]==0) break;
+    }
+    return temp;
+}
+
 static void json_throw_parse_error(lua_State *l, json_parse_t *json,
                                    const char *exp, json_token_t *token)
 {
@@ -1281,19 +1589,7 @@ static void json_throw_parse_error(lua_State *l, json_parse_t *json,
 
     strbuf_free(json->tmp);
 
-    if (token->type == T_ERROR)
-        found = token->value.string;
-    else
-    {
-        found = json_token_type_name[token->type];
-        int i;
-        for (i=0; i < 16; ++i)
-        {
-            temp[i] = byte_of_aligned_array(found, i);
-            if(temp[i]==0) break;
-        }
-        found = temp;
-    }
+    found = json_token_found(token, temp);
 
     /* Note: token->index is 0 based, display starting from 1 */
     luaL_error(l, "Expected %s but found %s at character %d",
@@ -1480,6 +1776,546 @@ static int json_decode(lua_State *l)
     return 1;
 }
 
+/* ===== STREAMING DECODER ===== */
+
+/* The decoder takes the document in chunks and only ever holds the
+ * unconsumed end of the input (at most one partial token) and a stack
+ * with one frame per open object/array. Tokens are lexed with the same
+ * functions as json_decode(); a token running into the end of a chunk
+ * is kept back until the next chunk completes it.
+ *
+ * Values are either reported to an event callback, or stored into Lua
+ * tables. With a filter only the selected parts of the document are
+ * stored, everything else is skipped as it streams past. */
+
+#define JSON_DECODER_MT "cjson.decoder"
+
+typedef enum {
+    KEEP_NONE,          /* skipped */
+    KEEP_FILTER,        /* container stored, children selected by a filter */
+    KEEP_ALL            /* stored entirely */
+} json_keep_t;
+
+typedef enum {
+    S_VALUE,
+    S_VALUE_OR_END,     /* after '[' */
+    S_KEY,
+    S_KEY_OR_END,       /* after '{' */
+    S_COLON,
+    S_COMMA_OR_END,
+    S_DONE              /* top level value complete */
+} json_expect_t;
+
+static const char json_expect_name[7][32] ICACHE_STORE_ATTR ICACHE_RODATA_ATTR = {
+    "value",
+    "value or array end",
+    "object key string",
+    "object key string or object end",
+    "colon",
+    "comma or container end",
+    "the end"
+};
+
+typedef struct {
+    uint8_t type;       /* T_OBJ_BEGIN or T_ARR_BEGIN */
+    uint8_t keep;
+    int index;          /* elements seen so far in an array */
+} json_frame_t;
+
+typedef struct {
+    strbuf_t buf;       /* input not consumed yet */
+    strbuf_t tmp;       /* decoded string token */
+    json_frame_t *frames;
+    int max_frames;
+    int depth;
+    int expect;
+    int offset;         /* input consumed before buf, for error positions */
+    int events_ref;
+    int filter_ref;
+    int stack_ref;      /* the result, and per depth: container, filter, key */
+    int failed;
+} json_decoder_t;
+
+#define SLOT_RESULT         1
+#define SLOT_CONTAINER(d)   (3 * (d) - 1)
+#define SLOT_FILTER(d)      (3 * (d))
+#define SLOT_KEY(d)         (3 * (d) + 1)
+
+static void json_decoder_free(lua_State *l, json_decoder_t *dec)
+{
+    strbuf_free(&dec->buf);
+    strbuf_free(&dec->tmp);
+    if (dec->frames) {
+        c_free(dec->frames);
+        dec->frames = NULL;
+    }
+    luaL_unref(l, LUA_REGISTRYINDEX, dec->events_ref);
+    luaL_unref(l, LUA_REGISTRYINDEX, dec->filter_ref);
+    luaL_unref(l, LUA_REGISTRYINDEX, dec->stack_ref);
+    dec->events_ref = dec->filter_ref = dec->stack_ref = LUA_NOREF;
+}
+
+static void json_decoder_error(lua_State *l, json_decoder_t *dec,
+                               json_token_t *token)
+{
+    const char *found;
+    char temp[16];
+    char exp[32];
+    int i;
+
+    for (i = 0; i < 32; ++i)
+    {
+        exp[i] = byte_of_aligned_array(json_expect_name[dec->expect], i);
+        if(exp[i]==0) break;
+    }
+    found = json_token_found(token, temp);
+
+    luaL_error(l, "Expected %s but found %s at character %d",
+               exp, found, dec->offset + token->index + 1);
+}
+
+/* Calls the event callback with the event name and, if has_value, the
+ * value on top of the stack, which is popped */
+static void json_decoder_event(lua_State *l, json_decoder_t *dec,
+                               const char *event, int has_value)
+{
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->events_ref);
+    lua_pushstring(l, event);
+    if (has_value) {
+        lua_pushvalue(l, -3);
+        lua_remove(l, -4);
+    }
+    lua_call(l, has_value ? 2 : 1, 0);
+}
+
+/* Decides what to do with the next value at the current depth. For
+ * KEEP_FILTER the filter of the value is left on the stack */
+static json_keep_t json_decoder_child_keep(lua_State *l, json_decoder_t *dec)
+{
+    json_frame_t *frame;
+    json_keep_t keep = KEEP_NONE;
+
+    if (dec->depth == 0) {
+        if (dec->events_ref != LUA_NOREF)
+            return KEEP_NONE;
+        if (dec->filter_ref == LUA_NOREF)
+            return KEEP_ALL;
+        lua_rawgeti(l, LUA_REGISTRYINDEX, dec->filter_ref);
+        return KEEP_FILTER;
+    }
+
+    frame = &dec->frames[dec->depth - 1];
+    if (frame->keep != KEEP_FILTER)
+        return frame->keep;
+
+    /* .., stack, filter */
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+    lua_rawgeti(l, -1, SLOT_FILTER(dec->depth));
+    if (frame->type == T_OBJ_BEGIN)
+        lua_rawgeti(l, -2, SLOT_KEY(dec->depth));
+    else
+        lua_pushinteger(l, frame->index);
+    lua_rawget(l, -2);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        lua_pushliteral(l, "*");
+        lua_rawget(l, -2);
+    }
+
+    if (lua_istable(l, -1)) {
+        lua_replace(l, -3);
+        lua_pop(l, 1);
+        return KEEP_FILTER;
+    }
+    if (lua_toboolean(l, -1))
+        keep = KEEP_ALL;
+    lua_pop(l, 3);
+    return keep;
+}
+
+/* Stores the value on top of the stack into the container at the current
+ * depth, or as the result at the top level. Pops the value */
+static void json_decoder_store(lua_State *l, json_decoder_t *dec)
+{
+    json_frame_t *frame;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+    if (dec->depth == 0) {
+        lua_pushvalue(l, -2);
+        lua_rawseti(l, -2, SLOT_RESULT);
+        lua_pop(l, 2);
+        return;
+    }
+
+    frame = &dec->frames[dec->depth - 1];
+    lua_rawgeti(l, -1, SLOT_CONTAINER(dec->depth));
+    if (frame->type == T_OBJ_BEGIN) {
+        lua_rawgeti(l, -2, SLOT_KEY(dec->depth));
+        lua_pushvalue(l, -4);
+        lua_rawset(l, -3);
+    } else {
+        lua_pushvalue(l, -3);
+        lua_rawseti(l, -2, frame->index);
+    }
+    lua_pop(l, 3);
+}
+
+static inline void json_decoder_value_done(json_decoder_t *dec)
+{
+    dec->expect = dec->depth ? S_COMMA_OR_END : S_DONE;
+}
+
+static void json_decoder_open(lua_State *l, json_decoder_t *dec,
+                              json_token_t *token, json_keep_t keep)
+{
+    json_frame_t *frame;
+
+    if (dec->depth >= json_fetch_config(l)->decode_max_depth) {
+        luaL_error(l, "Found too many nested data structures (%d) at character %d",
+                   dec->depth + 1, dec->offset + token->index + 1);
+    }
+
+    if (dec->depth == dec->max_frames) {
+        int n = dec->max_frames ? dec->max_frames * 2 : 8;
+        dec->frames = (json_frame_t *)cjson_mem_realloc(dec->frames, n * sizeof(json_frame_t));
+        dec->max_frames = n;
+    }
+
+    frame = &dec->frames[dec->depth++];
+    frame->type = token->type;
+    frame->keep = keep;
+    frame->index = 0;
+
+    if (keep != KEEP_NONE) {
+        lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+        lua_newtable(l);
+        lua_rawseti(l, -2, SLOT_CONTAINER(dec->depth));
+        if (keep == KEEP_FILTER) {
+            lua_pushvalue(l, -2);
+            lua_rawseti(l, -2, SLOT_FILTER(dec->depth));
+            lua_remove(l, -2);
+        }
+        lua_pop(l, 1);
+    }
+
+    if (dec->events_ref != LUA_NOREF)
+        json_decoder_event(l, dec, token->type == T_OBJ_BEGIN ? "object" : "array", 0);
+
+    dec->expect = token->type == T_OBJ_BEGIN ? S_KEY_OR_END : S_VALUE_OR_END;
+}
+
+static void json_decoder_close(lua_State *l, json_decoder_t *dec)
+{
+    json_frame_t *frame = &dec->frames[dec->depth - 1];
+
+    if (frame->keep != KEEP_NONE) {
+        /* .., container */
+        lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+        lua_rawgeti(l, -1, SLOT_CONTAINER(dec->depth));
+        lua_pushnil(l);
+        lua_rawseti(l, -3, SLOT_CONTAINER(dec->depth));
+        lua_pushnil(l);
+        lua_rawseti(l, -3, SLOT_FILTER(dec->depth));
+        lua_pushnil(l);
+        lua_rawseti(l, -3, SLOT_KEY(dec->depth));
+        lua_remove(l, -2);
+        dec->depth--;
+        json_decoder_store(l, dec);
+    } else {
+        dec->depth--;
+    }
+
+    if (dec->events_ref != LUA_NOREF)
+        json_decoder_event(l, dec, "end", 0);
+
+    json_decoder_value_done(dec);
+}
+
+static void json_decoder_push_scalar(lua_State *l, json_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+        lua_pushlstring(l, token->value.string, token->string_len);
+        break;
+    case T_NUMBER:
+        lua_pushnumber(l, token->value.number);
+        break;
+    case T_BOOLEAN:
+        lua_pushboolean(l, token->value.boolean);
+        break;
+    default:
+        lua_pushlightuserdata(l, NULL);
+        break;
+    }
+}
+
+static void json_decoder_value(lua_State *l, json_decoder_t *dec,
+                               json_token_t *token)
+{
+    json_keep_t keep;
+
+    switch (token->type) {
+    case T_STRING:
+    case T_NUMBER:
+    case T_BOOLEAN:
+    case T_NULL:
+    case T_OBJ_BEGIN:
+    case T_ARR_BEGIN:
+        break;
+    default:
+        json_decoder_error(l, dec, token);
+    }
+
+    if (dec->depth && dec->frames[dec->depth - 1].type == T_ARR_BEGIN)
+        dec->frames[dec->depth - 1].index++;
+
+    keep = json_decoder_child_keep(l, dec);
+
+    if (token->type == T_OBJ_BEGIN || token->type == T_ARR_BEGIN) {
+        json_decoder_open(l, dec, token, keep);
+        return;
+    }
+
+    if (keep == KEEP_FILTER)
+        lua_pop(l, 1);      /* a filter selecting a scalar keeps it */
+    if (keep != KEEP_NONE) {
+        json_decoder_push_scalar(l, token);
+        json_decoder_store(l, dec);
+    }
+    if (dec->events_ref != LUA_NOREF) {
+        json_decoder_push_scalar(l, token);
+        json_decoder_event(l, dec, "value", 1);
+    }
+    json_decoder_value_done(dec);
+}
+
+static void json_decoder_token(lua_State *l, json_decoder_t *dec,
+                               json_token_t *token)
+{
+    json_frame_t *frame = dec->depth ? &dec->frames[dec->depth - 1] : NULL;
+
+    switch (dec->expect) {
+    case S_VALUE_OR_END:
+        if (token->type == T_ARR_END) {
+            json_decoder_close(l, dec);
+            return;
+        }
+        /* fall through */
+    case S_VALUE:
+        json_decoder_value(l, dec, token);
+        return;
+    case S_KEY_OR_END:
+        if (token->type == T_OBJ_END) {
+            json_decoder_close(l, dec);
+            return;
+        }
+        /* fall through */
+    case S_KEY:
+        if (token->type != T_STRING)
+            break;
+        if (frame->keep != KEEP_NONE || dec->events_ref != LUA_NOREF)
+            lua_pushlstring(l, token->value.string, token->string_len);
+        if (frame->keep != KEEP_NONE) {
+            lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+            lua_pushvalue(l, -2);
+            lua_rawseti(l, -2, SLOT_KEY(dec->depth));
+            lua_pop(l, 1);
+        }
+        if (dec->events_ref != LUA_NOREF)
+            json_decoder_event(l, dec, "key", 1);
+        else if (frame->keep != KEEP_NONE)
+            lua_pop(l, 1);
+        dec->expect = S_COLON;
+        return;
+    case S_COLON:
+        if (token->type != T_COLON)
+            break;
+        dec->expect = S_VALUE;
+        return;
+    case S_COMMA_OR_END:
+        if (token->type == T_COMMA) {
+            dec->expect = frame->type == T_OBJ_BEGIN ? S_KEY : S_VALUE;
+            return;
+        }
+        if (token->type == (frame->type == T_OBJ_BEGIN ? T_OBJ_END : T_ARR_END)) {
+            json_decoder_close(l, dec);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    json_decoder_error(l, dec, token);
+}
+
+/* Returns 0 if the token at p may continue past end */
+static int json_token_complete(const char *p, const char *end)
+{
+    json_token_type_t type;
+
+    if (*p == '"') {
+        for (p++; p < end; p++) {
+            if (*p == '"')
+                return 1;
+            if (*p == '\\')
+                p++;
+        }
+        return 0;
+    }
+
+    if (ch2token((unsigned char)*p) != T_UNKNOWN)
+        return 1;
+
+    /* numbers and literals end at the next delimiter */
+    for (p++; p < end; p++) {
+        type = ch2token((unsigned char)*p);
+        if (type != T_UNKNOWN && type != T_ERROR)
+            return 1;
+    }
+    return 0;
+}
+
+/* Consumes all complete tokens in dec->buf. With final set, the end of
+ * the buffer ends the document */
+static void json_decoder_feed(lua_State *l, json_decoder_t *dec, int final)
+{
+    json_parse_t json;
+    json_token_t token;
+    const char *end;
+    char *buf;
+    int len, used, i;
+
+    buf = strbuf_string(&dec->buf, &len);
+    strbuf_ensure_null(&dec->buf);
+    end = buf + len;
+
+    json.cfg = json_fetch_config(l);
+    json.data = buf;
+    json.ptr = buf;
+    json.current_depth = dec->depth;
+    json.tmp = &dec->tmp;
+
+    /* a decoded string is never longer than its JSON text */
+    strbuf_reset(&dec->tmp);
+    strbuf_ensure_empty_length(&dec->tmp, len);
+
+    while (1) {
+        while (json.ptr < end && ch2token((unsigned char)*json.ptr) == T_WHITESPACE)
+            json.ptr++;
+        if (json.ptr == end)
+            break;
+        if (!final && !json_token_complete(json.ptr, end))
+            break;
+
+        json_next_token(&json, &token);
+        if (token.type == T_ERROR || token.type == T_END)
+            json_decoder_error(l, dec, &token);
+        json_decoder_token(l, dec, &token);
+    }
+
+    if (final && dec->expect != S_DONE) {
+        token.type = T_END;
+        token.index = len;
+        json_decoder_error(l, dec, &token);
+    }
+
+    /* keep the partial token for the next chunk */
+    used = json.ptr - buf;
+    for (i = 0; i < len - used; i++)
+        buf[i] = buf[used + i];
+    dec->buf.length = len - used;
+    dec->offset += used;
+}
+
+static json_decoder_t *json_decoder_check(lua_State *l)
+{
+    json_decoder_t *dec = (json_decoder_t *)luaL_checkudata(l, 1, JSON_DECODER_MT);
+
+    if (dec->failed)
+        luaL_error(l, "decoder failed");
+    if (!strbuf_allocated(&dec->buf))
+        luaL_error(l, "decoder finished");
+    return dec;
+}
+
+/* Lua: decoder = cjson.decoder([events_fn | filter]) */
+static int json_decoder_new(lua_State *l)
+{
+    json_decoder_t *dec;
+
+    if (!lua_isnoneornil(l, 1) && !lua_isfunction(l, 1) && !lua_istable(l, 1))
+        return luaL_argerror(l, 1, "function or table expected");
+
+    dec = (json_decoder_t *)lua_newuserdata(l, sizeof(json_decoder_t));
+    c_memset(dec, 0, sizeof(json_decoder_t));
+    dec->events_ref = dec->filter_ref = dec->stack_ref = LUA_NOREF;
+    luaL_getmetatable(l, JSON_DECODER_MT);
+    lua_setmetatable(l, -2);
+
+    strbuf_init(&dec->buf, 0);
+    strbuf_init(&dec->tmp, 0);
+
+    if (lua_isfunction(l, 1)) {
+        lua_pushvalue(l, 1);
+        dec->events_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+    } else if (lua_istable(l, 1)) {
+        lua_pushvalue(l, 1);
+        dec->filter_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+    }
+    lua_newtable(l);
+    dec->stack_ref = luaL_ref(l, LUA_REGISTRYINDEX);
+
+    return 1;
+}
+
+/* Lua: decoder:write(chunk) */
+static int json_decoder_write(lua_State *l)
+{
+    json_decoder_t *dec = json_decoder_check(l);
+    size_t len;
+    const char *chunk = luaL_checklstring(l, 2, &len);
+
+    /* the decoder can't resume from errors, including callback errors */
+    dec->failed = 1;
+    strbuf_append_mem(&dec->buf, chunk, len);
+    json_decoder_feed(l, dec, 0);
+    dec->failed = 0;
+
+    return 0;
+}
+
+/* Lua: value = decoder:result() */
+static int json_decoder_result(lua_State *l)
+{
+    json_decoder_t *dec = json_decoder_check(l);
+
+    dec->failed = 1;
+    json_decoder_feed(l, dec, 1);
+    dec->failed = 0;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, dec->stack_ref);
+    lua_rawgeti(l, -1, SLOT_RESULT);
+    json_decoder_free(l, dec);
+
+    return 1;
+}
+
+static int json_decoder_gc(lua_State *l)
+{
+    json_decoder_t *dec = (json_decoder_t *)luaL_checkudata(l, 1, JSON_DECODER_MT);
+
+    json_decoder_free(l, dec);
+    return 0;
+}
+
+static const LUA_REG_TYPE json_decoder_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( json_decoder_write ) },
+  { LSTRKEY( "result" ),  LFUNCVAL( json_decoder_result ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( json_decoder_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( json_decoder_map ) },
+  { LNILKEY, LNILVAL }
+};
+
 /* ===== INITIALISATION ===== */
 #if 0
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
@@ -1604,6 +2440,7 @@ int luaopen_cjson_safe(lua_State *l)
 static const LUA_REG_TYPE cjson_map[] = {
   { LSTRKEY( "encode" ),                  LFUNCVAL( json_encode ) },
   { LSTRKEY( "decode" ),                  LFUNCVAL( json_decode ) },
+  { LSTRKEY( "decoder" ),                 LFUNCVAL( json_decoder_new ) },
 //{ LSTRKEY( "encode_sparse_array" ),     LFUNCVAL( json_cfg_encode_sparse_array ) },
 //{ LSTRKEY( "encode_max_depth" ),        LFUNCVAL( json_cfg_encode_max_depth ) },
 //{ LSTRKEY( "decode_max_depth" ),        LFUNCVAL( json_cfg_decode_max_depth ) },
@@ -1622,6 +2459,7 @@ int luaopen_cjson( lua_State *L )
   if(-1==cfg_init(&_cfg)){
     return luaL_error(L, "BUG: Unable to init config for cjson");;
   }
+  luaL_rometatable(L, JSON_DECODER_MT, (void *)json_decoder_map);  // create metatable for cjson.decoder
   return 0;
 }
 
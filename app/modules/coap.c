@@ -20,7 +20,7 @@
 #include "coap_io.h"
 #include "coap_server.h"
 
-coap_queue_t *gQueue = NULL;
+coap_sendqueue_t gQueue;
 
 typedef struct lcoap_userdata
 {
@@ -42,18 +42,23 @@ static void coap_received(void *arg, char *pdata, unsigned short len)
     NODE_DBG("Request Entity Too Large.\n"); // NOTE: should response 4.13 to client...
     return;
   }
-  // c_memcpy(buf, pdata, len);
-
-  size_t rsplen = coap_server_respond(pdata, len, buf, MAX_MESSAGE_SIZE+1);
-
   // SDK 1.4.0 changed behaviour, for UDP server need to look up remote ip/port
   remot_info *pr = 0;
   if (espconn_get_connection_info (pesp_conn, &pr, 0) != ESPCONN_OK)
     return;
-  pesp_conn->proto.udp->remote_port = pr->remote_port;
-  os_memmove (pesp_conn->proto.udp->remote_ip, pr->remote_ip, 4);
   // The remot_info apparently should *not* be os_free()d, fyi
+  coap_peer_t peer;
+  os_memmove (peer.ip, pr->remote_ip, 4);
+  peer.port = pr->remote_port;
+  peer.conn = pesp_conn;
+
+  size_t rsplen = coap_server_respond(pdata, len, buf, MAX_MESSAGE_SIZE+1, &peer);
+  if (rsplen == 0)
+    return;
 
+  // set the remote only now, a notification sent while handling changes it
+  pesp_conn->proto.udp->remote_port = peer.port;
+  os_memmove (pesp_conn->proto.udp->remote_ip, peer.ip, 4);
   espconn_sent(pesp_conn, (unsigned char *)buf, rsplen);
 
   // c_memset(buf, 0, sizeof(buf));
@@ -129,6 +134,7 @@ static int coap_delete( lua_State* L, const char* mt )
 
   if(cud->pesp_conn)
   {
+    endpoint_release(cud->pesp_conn);
     if(cud->pesp_conn->proto.udp->remote_port || cud->pesp_conn->proto.udp->local_port)
       espconn_delete(cud->pesp_conn);
     c_free(cud->pesp_conn->proto.udp);
@@ -205,6 +211,7 @@ static int coap_close( lua_State* L, const char* mt )
 
   if(cud->pesp_conn)
   {
+    endpoint_release(cud->pesp_conn);
     if(cud->pesp_conn->proto.udp->remote_port || cud->pesp_conn->proto.udp->local_port)
       espconn_delete(cud->pesp_conn);
   }
@@ -277,13 +284,7 @@ static void coap_response_handler(void *arg, char *pdata, unsigned short len)
     coap_transaction_id(ip, port, &pkt, &id);
 
     /* transaction done, remove the node from queue */
-    // stop timer
-    coap_timer_stop();
-    // remove the node
     coap_remove_node(&gQueue, id);
-    // calculate time elapsed
-    coap_timer_update(&gQueue);
-    coap_timer_start(&gQueue);
 
     if (COAP_RESPONSE_CLASS(pkt.hdr.code) == 2)
     {
@@ -299,7 +300,7 @@ static void coap_response_handler(void *arg, char *pdata, unsigned short len)
   }
 
 end:
-  if(!gQueue){ // if there is no node pending in the queue, disconnect from host.
+  if(!gQueue.count){ // if there is no node pending in the queue, disconnect from host.
     if(pesp_conn->proto.udp->remote_port || pesp_conn->proto.udp->local_port)
       espconn_delete(pesp_conn);
   }
@@ -439,13 +440,14 @@ static int coap_regist( lua_State* L, const char* mt, int isvar )
   if (name == NULL)
     return luaL_error( L, "name must be set." );
 
-  coap_luser_entry *h = NULL;
+  coap_luser_entry *head, *h;
   // if(lua_isstring(L, 3))
   if(isvar)
-    h = variable_entry;
+    head = variable_entry;
   else
-    h = function_entry;
+    head = function_entry;
 
+  h = head;
   while(NULL!=h->next){  // goto the end of the list
     if(h->name!= NULL && c_strcmp(h->name, name)==0)  // key exist, override it
       break;
@@ -453,21 +455,48 @@ static int coap_regist( lua_State* L, const char* mt, int isvar )
   }
 
   if(h->name==NULL || c_strcmp(h->name, name)!=0){   // not exists. make a new one.
-    h->next = (coap_luser_entry *)c_zalloc(sizeof(coap_luser_entry));
-    h = h->next;
-    if(h == NULL)
+    // only linked once complete, dispatch and notify expect every entry to have a name
+    coap_luser_entry *e = (coap_luser_entry *)c_zalloc(sizeof(coap_luser_entry));
+    if(e == NULL)
+      return luaL_error(L, "not enough memory");
+    e->next = NULL;
+    e->name = c_strdup(name);  // the Lua string may be collected
+    if(e->name == NULL || !endpoint_add_entry(head, e)){
+      if(e->name)
+        c_free((void *)e->name);
+      c_free(e);
       return luaL_error(L, "not enough memory");
-    h->next = NULL;
-    h->name = NULL;
-  }  
+    }
+    h->next = e;
+    h = e;
+  }
 
-  h->name = name;
   h->content_type = content_type;
 
   NODE_DBG("coap_regist is called.\n");
   return 0;  
 }
 
+// Lua: n = server:notify( "name" )
+static int coap_server_notify( lua_State* L )
+{
+  const char *mt = "coap_server";
+  const char *name;
+  coap_luser_entry *h;
+  int sent = 0;
+
+  luaL_checkudata(L, 1, mt);
+  name = luaL_checkstring( L, 2 );
+  for(h = variable_entry->next; NULL != h; h = h->next){
+    if(c_strcmp(h->name, name)==0){
+      sent = coap_notify(h);
+      break;
+    }
+  }
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
 // Lua: s = coap.createServer(function(conn))
 static int coap_createServer( lua_State* L )
 {
@@ -561,6 +590,7 @@ static const LUA_REG_TYPE coap_server_map[] = {
   { LSTRKEY( "close" ),   LFUNCVAL( coap_server_close ) },
   { LSTRKEY( "var" ),     LFUNCVAL( coap_server_var ) },
   { LSTRKEY( "func" ),    LFUNCVAL( coap_server_func ) },
+  { LSTRKEY( "notify" ),  LFUNCVAL( coap_server_notify ) },
   { LSTRKEY( "__gc" ),    LFUNCVAL( coap_server_delete ) },
   { LSTRKEY( "__index" ), LROVAL( coap_server_map ) },
   { LNILKEY, LNILVAL }
@@ -6,10 +6,14 @@
 #include "platform.h"
 #include "c_types.h"
 #include "c_stdlib.h"
+#include "c_string.h"
 #include "vfs.h"
 #include "../crypto/digests.h"
 #include "../crypto/mech.h"
+#include "../crypto/codec.h"
+#include "../crypto/mask.h"
 #include "lmem.h"
+#include "task/task.h"
 
 #include "user_interface.h"
 
@@ -44,54 +48,89 @@ static int crypto_sha1( lua_State* L )
   return 1;
 }
 
-#ifdef LUA_USE_MODULES_ENCODER
-static int call_encoder( lua_State* L, const char *function ) {
-  if (lua_gettop(L) != 1) { 
-    luaL_error(L, "%s must have one argument", function);
-  }
-  lua_getfield(L, LUA_GLOBALSINDEX, "encoder");
-  if (!lua_istable(L, -1) && !lua_isrotable(L, -1)) { // also need table just in case encoder has been overloaded
-    luaL_error(L, "Cannot find encoder.%s", function); 
+typedef struct {
+  codec_ctx_t ctx;
+  bool decode;
+} codec_user_datum_t;
+
+static const char *codec_name (int alphabet)
+{
+  return alphabet == CODEC_HEX ? "hex" : "base64";
+}
+
+/* Adds the encoding/decoding of 'in' to the buffer, in steps whose output
+ * fits into one luaL_Buffer block. */
+static void codec_add (lua_State *L, luaL_Buffer *b, codec_ctx_t *ctx, bool decode, const char *in, size_t len)
+{
+  size_t step;
+  if (ctx->alphabet == CODEC_HEX)
+    step = decode ? LUAL_BUFFERSIZE * 2 : LUAL_BUFFERSIZE / 2;
+  else
+    step = decode ? LUAL_BUFFERSIZE / 3 * 4 : LUAL_BUFFERSIZE / 4 * 3;
+
+  while (len)
+  {
+    size_t l = len < step ? len : step;
+    char *out = luaL_prepbuffer (b);
+    int n;
+    if (decode)
+      n = codec_decode_update (ctx, in, l, (uint8_t *)out);
+    else
+      n = codec_encode_update (ctx, (const uint8_t *)in, l, out);
+    if (n < 0)
+      luaL_error (L, "invalid %s string", codec_name (ctx->alphabet));
+    luaL_addsize (b, n);
+    in += l;
+    len -= l;
   }
-  lua_getfield(L, -1, function);
-  lua_insert(L, 1);    //move function below the argument
-  lua_pop(L, 1);       //and dump the encoder rotable from stack.
-  lua_call(L,1,1);     // call encoder.xxx(string)
-  return 1;
 }
 
-static int crypto_base64_encode (lua_State* L) { 
-  return call_encoder(L, "toBase64"); 
+static void codec_add_final (lua_State *L, luaL_Buffer *b, codec_ctx_t *ctx, bool decode)
+{
+  char tail[4];
+  int n;
+  if (decode)
+    n = codec_decode_final (ctx, (uint8_t *)tail);
+  else
+    n = codec_encode_final (ctx, tail);
+  if (n < 0)
+    luaL_error (L, "invalid %s string", codec_name (ctx->alphabet));
+  luaL_addlstring (b, tail, n);
 }
-static int crypto_hex_encode (lua_State* L) { 
-  return call_encoder(L, "toHex"); 
+
+static int crypto_codec (lua_State *L, int alphabet, bool decode)
+{
+  size_t len;
+  const char *in = luaL_checklstring (L, 1, &len);
+  codec_ctx_t ctx;
+  luaL_Buffer b;
+
+  codec_init (&ctx, alphabet);
+  luaL_buffinit (L, &b);
+  codec_add (L, &b, &ctx, decode, in, len);
+  codec_add_final (L, &b, &ctx, decode);
+  luaL_pushresult (&b);
+  return 1;
 }
-#else
-static const char* bytes64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
 /**
-  * encoded = crypto.toBase64(raw)
+  * encoded = crypto.toBase64(raw[, url])
   *
-  * Encodes raw binary string as base64 string.
+  * Encodes raw binary string as base64 string, or base64url if url is true.
   */
 static int crypto_base64_encode( lua_State* L )
 {
-  int len;
-  const char* msg = luaL_checklstring(L, 1, &len);
-  int blen = (len + 2) / 3 * 4;
-  char* out = (char*)c_malloc(blen);
-  int j = 0, i;
-  for (i = 0; i < len; i += 3) {
-    int a = msg[i];
-    int b = (i + 1 < len) ? msg[i + 1] : 0;
-    int c = (i + 2 < len) ? msg[i + 2] : 0;
-    out[j++] = bytes64[a >> 2];
-    out[j++] = bytes64[((a & 3) << 4) | (b >> 4)];
-    out[j++] = (i + 1 < len) ? bytes64[((b & 15) << 2) | (c >> 6)] : 61;
-    out[j++] = (i + 2 < len) ? bytes64[(c & 63)] : 61;
-  }
-  lua_pushlstring(L, out, j);
-  c_free(out);
-  return 1;
+  return crypto_codec (L, lua_toboolean (L, 2) ? CODEC_BASE64URL : CODEC_BASE64, false);
+}
+
+/**
+  * raw = crypto.fromBase64(encoded)
+  *
+  * Decodes a base64 or base64url string.
+  */
+static int crypto_base64_decode( lua_State* L )
+{
+  return crypto_codec (L, CODEC_BASE64, true);
 }
 
 /**
@@ -101,36 +140,109 @@ static int crypto_base64_encode( lua_State* L )
   */
 static int crypto_hex_encode( lua_State* L)
 {
-  int len;
-  const char* msg = luaL_checklstring(L, 1, &len);
-  char* out = (char*)c_malloc(len * 2);
-  int i, j = 0;
-  for (i = 0; i < len; i++) {
-    out[j++] = crypto_hexbytes[msg[i] >> 4];
-    out[j++] = crypto_hexbytes[msg[i] & 0xf];
-  }
-  lua_pushlstring(L, out, len*2);
-  c_free(out);
+  return crypto_codec (L, CODEC_HEX, false);
+}
+
+/**
+  * raw = crypto.fromHex(encoded)
+  *
+  * Decodes a hex string.
+  */
+static int crypto_hex_decode( lua_State* L)
+{
+  return crypto_codec (L, CODEC_HEX, true);
+}
+
+/* General Usage for encoding or decoding data in chunks:
+ * enc = crypto.new_encoder("base64")
+ * s = enc:update("Data") .. enc:update("Data2") .. enc:finalize()
+ */
+static int crypto_new_codec (lua_State *L, bool decode)
+{
+  static const char * const alphabets[] = { "base64", "base64url", "hex", NULL };
+  int alphabet = luaL_checkoption (L, 1, NULL, alphabets);
+
+  codec_user_datum_t *cudat = (codec_user_datum_t *)lua_newuserdata(L, sizeof(codec_user_datum_t));
+  luaL_getmetatable(L, "crypto.codec");
+  lua_setmetatable(L, -2);
+
+  codec_init (&cudat->ctx, alphabet);
+  cudat->decode = decode;
+  return 1;
+}
+
+/* crypto.new_encoder("base64" | "base64url" | "hex") */
+static int crypto_new_encoder (lua_State *L)
+{
+  return crypto_new_codec (L, false);
+}
+
+/* crypto.new_decoder("base64" | "base64url" | "hex") */
+static int crypto_new_decoder (lua_State *L)
+{
+  return crypto_new_codec (L, true);
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - next chunk of input
+   Returns the output for as much of the input as is complete. */
+static int crypto_codec_update (lua_State *L)
+{
+  codec_user_datum_t *cudat = (codec_user_datum_t *)luaL_checkudata(L, 1, "crypto.codec");
+  size_t len;
+  const char *in = luaL_checklstring (L, 2, &len);
+  luaL_Buffer b;
+
+  luaL_buffinit (L, &b);
+  codec_add (L, &b, &cudat->ctx, cudat->decode, in, len);
+  luaL_pushresult (&b);
   return 1;
 }
-#endif
+
+/* Called as object, no params. Returns the rest of the output and resets
+   the object for reuse. */
+static int crypto_codec_finalize (lua_State *L)
+{
+  codec_user_datum_t *cudat = (codec_user_datum_t *)luaL_checkudata(L, 1, "crypto.codec");
+  luaL_Buffer b;
+
+  luaL_buffinit (L, &b);
+  codec_add_final (L, &b, &cudat->ctx, cudat->decode);
+  luaL_pushresult (&b);
+  return 1;
+}
+
 /**
   * masked = crypto.mask(message, mask)
   *
   * Apply a mask (repeated if shorter than message) as XOR to each byte.
   */
-static int crypto_mask( lua_State* L )
+static int crypto_lmask( lua_State* L )
 {
-  int len, mask_len;
+  size_t len, mask_len;
   const char* msg = luaL_checklstring(L, 1, &len);
   const char* mask = luaL_checklstring(L, 2, &mask_len);
-  int i;
-  char* copy = (char*)c_malloc(len);
-  for (i = 0; i < len; i++) {
-    copy[i] = msg[i] ^ mask[i % 4];
+  luaL_argcheck(L, mask_len > 0, 2, "empty mask");
+  luaL_Buffer b;
+  size_t i, n;
+
+  luaL_buffinit(L, &b);
+  if (mask_len == 1 || mask_len == 2 || mask_len == 4) {
+    // masks repeating every 4 bytes go through the word-wise kernel
+    uint8_t mask4[4];
+    for (i = 0; i < 4; i++)
+      mask4[i] = mask[i % mask_len];
+    for (i = 0; i < len; i += n) {
+      n = len - i < LUAL_BUFFERSIZE ? len - i : LUAL_BUFFERSIZE;
+      crypto_xor_mask((uint8_t *)luaL_prepbuffer(&b), (const uint8_t *)msg + i, n, mask4, i);
+      luaL_addsize(&b, n);
+    }
+  } else {
+    for (i = 0; i < len; i++)
+      luaL_addchar(&b, msg[i] ^ mask[i % mask_len]);
   }
-  lua_pushlstring(L, copy, len);
-  c_free(copy);
+  luaL_pushresult(&b);
   return 1;
 }
 
@@ -273,6 +385,146 @@ static int crypto_hash_gcdelete (lua_State *L)
 }
 
 
+/* Hashing of a file or a flash region in the background. The data is
+ * hashed one slice per task, so that a large file or firmware image does
+ * not hold up the network stack or trip the watchdog.
+ */
+#define ASYNC_HASH_SLICE 4096
+
+typedef struct {
+  const digest_mech_info_t *mech_info;
+  void *ctx;
+  int cb_ref;
+  int fd;         // file being hashed, 0 when hashing the flash
+  uint32_t addr;  // next flash address to hash
+  uint32_t left;  // flash bytes still to hash
+} async_hash_t;
+
+static task_handle_t async_hash_task_handle;
+
+/* Frees the state and calls the callback with the digest, or with nil and
+ * the error message if err is set.
+ */
+static void async_hash_done (async_hash_t *ah, const char *err)
+{
+  lua_State *L = lua_getstate ();
+  const digest_mech_info_t *mi = ah->mech_info;
+  int cb_ref = ah->cb_ref;
+
+  uint8_t digest[mi->digest_size];
+  if (!err)
+    mi->finalize (digest, ah->ctx);
+  if (ah->fd)
+    vfs_close (ah->fd);
+  os_free (ah->ctx);
+  os_free (ah);
+
+  lua_rawgeti (L, LUA_REGISTRYINDEX, cb_ref);
+  luaL_unref (L, LUA_REGISTRYINDEX, cb_ref);
+  if (err)
+  {
+    lua_pushnil (L);
+    lua_pushstring (L, err);
+    lua_call (L, 2, 0);
+  }
+  else
+  {
+    lua_pushlstring (L, digest, sizeof (digest));
+    lua_call (L, 1, 0);
+  }
+}
+
+static void async_hash_task (task_param_t param, uint8_t prio)
+{
+  async_hash_t *ah = (async_hash_t *)param;
+  const digest_mech_info_t *mi = ah->mech_info;
+  bool finished;
+  (void)prio;
+
+  if (ah->fd)
+  {
+    uint32_t buffer[64];
+    sint32_t n = 0;
+    for (size_t done = 0; done < ASYNC_HASH_SLICE; done += n)
+    {
+      n = vfs_read (ah->fd, buffer, sizeof (buffer));
+      if (n <= 0)
+        break;
+      mi->update (ah->ctx, (const uint8_t *)buffer, n);
+    }
+    if (n < 0)
+    {
+      async_hash_done (ah, "file read failed");
+      return;
+    }
+    finished = (n == 0);
+  }
+  else
+  {
+    uint32_t n = ah->left < ASYNC_HASH_SLICE ? ah->left : ASYNC_HASH_SLICE;
+    if (crypto_flash_hash_update (mi, ah->ctx, ah->addr, n))
+    {
+      async_hash_done (ah, "flash read failed");
+      return;
+    }
+    ah->addr += n;
+    ah->left -= n;
+    finished = (ah->left == 0);
+  }
+
+  if (finished)
+    async_hash_done (ah, NULL);
+  else if (!task_post_low (async_hash_task_handle, param))
+    async_hash_done (ah, "task queue overflow");
+}
+
+/* Starts hashing the open file fd, or len bytes of the flash at addr if fd
+ * is 0, and returns at once. The function at index cb is called with the
+ * digest when done. Closes fd, also on errors.
+ */
+static int crypto_async_hash (lua_State *L, const digest_mech_info_t *mi, int fd, uint32_t addr, uint32_t len, int cb)
+{
+  async_hash_t *ah = (async_hash_t *)os_malloc (sizeof (async_hash_t));
+  void *ctx = ah ? os_malloc (mi->ctx_size) : NULL;
+  if (!ctx)
+  {
+    os_free (ah);
+    if (fd)
+      vfs_close (fd);
+    return bad_mem (L);
+  }
+
+  mi->create (ctx);
+  ah->mech_info = mi;
+  ah->ctx       = ctx;
+  ah->fd        = fd;
+  ah->addr      = addr;
+  ah->left      = len;
+  lua_pushvalue (L, cb);
+  ah->cb_ref    = luaL_ref (L, LUA_REGISTRYINDEX);
+
+  if (!async_hash_task_handle)  // bind the task handle on 1st call
+    async_hash_task_handle = task_get_id (async_hash_task);
+
+  if (!task_post_low (async_hash_task_handle, (task_param_t)ah))
+  {
+    luaL_unref (L, LUA_REGISTRYINDEX, ah->cb_ref);
+    if (fd)
+      vfs_close (fd);
+    os_free (ctx);
+    os_free (ah);
+    return luaL_error (L, "Task queue overflow. Task not posted");
+  }
+  return 0;
+}
+
+static bool is_callback (lua_State *L, int idx)
+{
+  int type = lua_type (L, idx);
+  return type == LUA_TFUNCTION || type == LUA_TLIGHTFUNCTION;
+}
+
+
 static sint32_t vfs_read_wrap (int fd, void *ptr, size_t len)
 {
   return vfs_read (fd, ptr, len);
@@ -280,6 +532,7 @@ static sint32_t vfs_read_wrap (int fd, void *ptr, size_t len)
 
 /* rawdigest = crypto.hash("MD5", filename)
  * strdigest = crypto.toHex(rawdigest)
+ * crypto.fhash("MD5", filename, function(rawdigest, err) ... end)
  */
 static int crypto_flhash (lua_State *L)
 {
@@ -287,6 +540,9 @@ static int crypto_flhash (lua_State *L)
   if (!mi)
     return bad_mech (L);
   const char *filename = luaL_checkstring (L, 2);
+  bool async = !lua_isnoneornil (L, 3);
+  if (async)
+    luaL_argcheck (L, is_callback (L, 3), 3, "invalid function");
 
   // Open the file
   int file_fd = vfs_open (filename, "r");
@@ -294,6 +550,9 @@ static int crypto_flhash (lua_State *L)
     return bad_file(L);
   }
 
+  if (async)
+    return crypto_async_hash (L, mi, file_fd, 0, 0, 3);
+
   // Compute hash
   uint8_t digest[mi->digest_size];
   int returncode = crypto_fhash (mi, &vfs_read_wrap, file_fd, digest);
@@ -312,6 +571,38 @@ static int crypto_flhash (lua_State *L)
 }
 
 
+/* rawdigest = crypto.flash_hash("SHA256", address, length)
+ * strdigest = crypto.toHex(rawdigest)
+ * crypto.flash_hash("SHA256", address, length, function(rawdigest, err) ... end)
+ */
+static int crypto_flash_lhash (lua_State *L)
+{
+  const digest_mech_info_t *mi = crypto_digest_mech (luaL_checkstring (L, 1));
+  if (!mi)
+    return bad_mech (L);
+  uint32_t addr = luaL_checkinteger (L, 2);
+  uint32_t len = luaL_checkinteger (L, 3);
+  uint32_t flash_size = platform_flash_get_num_sectors () * INTERNAL_FLASH_SECTOR_SIZE;
+  luaL_argcheck (L, addr <= flash_size && len <= flash_size - addr, 3, "beyond the end of the flash");
+
+  if (!lua_isnoneornil (L, 4))
+  {
+    luaL_argcheck (L, is_callback (L, 4), 4, "invalid function");
+    return crypto_async_hash (L, mi, 0, addr, len, 4);
+  }
+
+  uint8_t digest[mi->digest_size];
+  int returncode = crypto_flash_hash (mi, addr, len, digest);
+  if (returncode == ENOMEM)
+    return bad_mem (L);
+  else if (returncode)
+    return luaL_error (L, "flash read failed");
+
+  lua_pushlstring (L, digest, sizeof (digest));
+  return 1;
+}
+
+
 /* rawsignature = crypto.hmac("SHA1", str, key)
  * strsignature = crypto.toHex(rawsignature)
  */
@@ -347,6 +638,16 @@ static const crypto_mech_t *get_mech (lua_State *L, int idx)
   __builtin_unreachable ();
 }
 
+// CTR and GCM repeat their keystream when a counter is reused, so unlike
+// ECB and CBC they get no all-zero default
+static void check_iv (lua_State *L, const char *name, size_t ivlen, int idx)
+{
+  if (strcasecmp (name, "AES-CTR") == 0)
+    luaL_argcheck (L, ivlen == AES_BLOCKSIZE, idx, "AES-CTR needs a 16 byte initial counter");
+  else if (strcasecmp (name, "AES-GCM") == 0)
+    luaL_argcheck (L, ivlen > 0, idx, "AES-GCM needs an IV, 12 bytes recommended");
+}
+
 static int crypto_encdec (lua_State *L, bool enc)
 {
   const crypto_mech_t *mech = get_mech (L, 1);
@@ -357,6 +658,7 @@ static int crypto_encdec (lua_State *L, bool enc)
 
   size_t ivlen;
   const char *iv = luaL_optlstring (L, 4, "", &ivlen);
+  check_iv (L, mech->name, ivlen, 4);
 
   size_t bs = mech->block_size;
   size_t outlen = ((dlen + bs -1) / bs) * bs;
@@ -396,6 +698,123 @@ static int lcrypto_decrypt (lua_State *L)
   return crypto_encdec (L, false);
 }
 
+/* General Usage for encrypting or decrypting data in chunks:
+ * c = crypto.new_cipher("AES-CBC", "encrypt", key, iv)
+ * out = c:update("Data") .. c:update("Data2") .. c:finalize()
+ */
+static int crypto_new_cipher (lua_State *L)
+{
+  static const char * const ops[] = { "encrypt", "decrypt", NULL };
+  const char *name = luaL_checkstring (L, 1);
+  int op = luaL_checkoption (L, 2, NULL, ops);
+  size_t klen;
+  const char *key = luaL_checklstring (L, 3, &klen);
+  size_t ivlen;
+  const char *iv = luaL_optlstring (L, 4, "", &ivlen);
+  check_iv (L, name, ivlen, 4);
+
+  crypto_cipher_t *c = (crypto_cipher_t *)lua_newuserdata(L, sizeof(crypto_cipher_t));
+  c->aes = NULL;
+  luaL_getmetatable(L, "crypto.cipher");
+  lua_setmetatable(L, -2);
+
+  if (!crypto_cipher_init (c, name, op == 0 ? OP_ENCRYPT : OP_DECRYPT, key, klen, iv, ivlen))
+    return luaL_error (L, "unknown cipher or bad key: %s", name);
+  return 1;
+}
+
+static crypto_cipher_t *get_cipher (lua_State *L)
+{
+  crypto_cipher_t *c = (crypto_cipher_t *)luaL_checkudata(L, 1, "crypto.cipher");
+  if (!c->aes)
+    luaL_error (L, "cipher finalized");
+  return c;
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - additional data to authenticate, before any update() */
+static int crypto_cipher_laad (lua_State *L)
+{
+  crypto_cipher_t *c = get_cipher (L);
+  size_t len;
+  const char *aad = luaL_checklstring (L, 2, &len);
+
+  if (!crypto_cipher_aad (c, aad, len))
+    return luaL_error (L, "additional data only for GCM, before update");
+  return 0;
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - next chunk of data
+   Returns the processed data, block modes keep an incomplete block back. */
+static int crypto_cipher_lupdate (lua_State *L)
+{
+  crypto_cipher_t *c = get_cipher (L);
+  size_t len;
+  const char *data = luaL_checklstring (L, 2, &len);
+  // input per step so that the output fits in a luaL_Buffer block
+  const size_t step = LUAL_BUFFERSIZE - (AES_BLOCKSIZE - 1);
+  luaL_Buffer b;
+
+  luaL_buffinit (L, &b);
+  while (len)
+  {
+    size_t n = len < step ? len : step;
+    luaL_addsize (&b, crypto_cipher_update (c, data, n, luaL_prepbuffer (&b)));
+    data += n;
+    len -= n;
+  }
+  luaL_pushresult (&b);
+  return 1;
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - the tag, when decrypting with GCM
+   Returns the rest of the data, and the tag when encrypting with GCM. */
+static int crypto_cipher_lfinalize (lua_State *L)
+{
+  crypto_cipher_t *c = get_cipher (L);
+  bool check = c->op == OP_DECRYPT && c->mode == CRYPTO_MODE_GCM;
+  size_t tlen = 0;
+  const char *expected = check ? luaL_checklstring (L, 2, &tlen) : NULL;
+  luaL_argcheck (L, !check || (tlen >= CRYPTO_GCM_TAG_MIN && tlen <= CRYPTO_GCM_TAG_SIZE), 2, "bad tag length");
+
+  char out[AES_BLOCKSIZE];
+  uint8_t tag[CRYPTO_GCM_TAG_SIZE];
+  size_t n = crypto_cipher_finalize (c, out, tag);
+  crypto_cipher_deinit (c);
+
+  if (check)
+  {
+    // compare in constant time
+    uint8_t diff = 0;
+    size_t i;
+    for (i = 0; i < tlen; ++i)
+      diff |= tag[i] ^ (uint8_t)expected[i];
+    if (diff)
+      return luaL_error (L, "authentication failed");
+  }
+
+  lua_pushlstring (L, out, n);
+  if (c->mode == CRYPTO_MODE_GCM && c->op == OP_ENCRYPT)
+  {
+    lua_pushlstring (L, (const char *)tag, sizeof (tag));
+    return 2;
+  }
+  return 1;
+}
+
+/* Frees the AES context */
+static int crypto_cipher_gcdelete (lua_State *L)
+{
+  crypto_cipher_t *c = (crypto_cipher_t *)luaL_checkudata(L, 1, "crypto.cipher");
+  crypto_cipher_deinit (c);
+  return 0;
+}
+
 // Hash function map
 static const LUA_REG_TYPE crypto_hash_map[] = {
   { LSTRKEY( "update" ),  LFUNCVAL( crypto_hash_update ) },
@@ -406,25 +825,53 @@ static const LUA_REG_TYPE crypto_hash_map[] = {
 };
 
 
+// Cipher function map
+static const LUA_REG_TYPE crypto_cipher_map[] = {
+  { LSTRKEY( "aad" ),      LFUNCVAL( crypto_cipher_laad ) },
+  { LSTRKEY( "update" ),   LFUNCVAL( crypto_cipher_lupdate ) },
+  { LSTRKEY( "finalize" ), LFUNCVAL( crypto_cipher_lfinalize ) },
+  { LSTRKEY( "__gc" ),     LFUNCVAL( crypto_cipher_gcdelete ) },
+  { LSTRKEY( "__index" ),  LROVAL( crypto_cipher_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+
+// Encoder/decoder function map
+static const LUA_REG_TYPE crypto_codec_map[] = {
+  { LSTRKEY( "update" ),   LFUNCVAL( crypto_codec_update ) },
+  { LSTRKEY( "finalize" ), LFUNCVAL( crypto_codec_finalize ) },
+  { LSTRKEY( "__index" ),  LROVAL( crypto_codec_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+
 // Module function map
 static const LUA_REG_TYPE crypto_map[] = {
   { LSTRKEY( "sha1" ),     LFUNCVAL( crypto_sha1 ) },
   { LSTRKEY( "toBase64" ), LFUNCVAL( crypto_base64_encode ) },
+  { LSTRKEY( "fromBase64" ), LFUNCVAL( crypto_base64_decode ) },
   { LSTRKEY( "toHex" ),    LFUNCVAL( crypto_hex_encode ) },
-  { LSTRKEY( "mask" ),     LFUNCVAL( crypto_mask ) },
+  { LSTRKEY( "fromHex" ),  LFUNCVAL( crypto_hex_decode ) },
+  { LSTRKEY( "new_encoder" ), LFUNCVAL( crypto_new_encoder ) },
+  { LSTRKEY( "new_decoder" ), LFUNCVAL( crypto_new_decoder ) },
+  { LSTRKEY( "mask" ),     LFUNCVAL( crypto_lmask ) },
   { LSTRKEY( "hash"   ),   LFUNCVAL( crypto_lhash ) },
   { LSTRKEY( "fhash"  ),   LFUNCVAL( crypto_flhash ) },
+  { LSTRKEY( "flash_hash" ), LFUNCVAL( crypto_flash_lhash ) },
   { LSTRKEY( "new_hash"   ),   LFUNCVAL( crypto_new_hash ) },
   { LSTRKEY( "hmac"   ),   LFUNCVAL( crypto_lhmac ) },
   { LSTRKEY( "new_hmac"   ),   LFUNCVAL( crypto_new_hmac ) },
   { LSTRKEY( "encrypt" ),  LFUNCVAL( lcrypto_encrypt ) },
   { LSTRKEY( "decrypt" ),  LFUNCVAL( lcrypto_decrypt ) },
+  { LSTRKEY( "new_cipher" ), LFUNCVAL( crypto_new_cipher ) },
   { LNILKEY, LNILVAL }
 };
 
 int luaopen_crypto ( lua_State *L )
 {
   luaL_rometatable(L, "crypto.hash", (void *)crypto_hash_map);  // create metatable for crypto.hash
+  luaL_rometatable(L, "crypto.codec", (void *)crypto_codec_map);  // create metatable for crypto.codec
+  luaL_rometatable(L, "crypto.cipher", (void *)crypto_cipher_map);  // create metatable for crypto.cipher
   return 0;
 }
 
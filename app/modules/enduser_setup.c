@@ -48,6 +48,7 @@
 #include "lwip/pbuf.h"
 #include "vfs.h"
 #include "task/task.h"
+#include "../crypto/codec.h"
 
 #define MIN(x, y)  (((x) < (y)) ? (x) : (y))
 #define LITLEN(strliteral) (sizeof (strliteral) -1)
@@ -504,36 +505,12 @@ static int enduser_setup_http_urldecode(char *dst, const char *src, int src_len,
 
   char *dst_start = dst;
   char *dst_last = dst + dst_len - 1; /* -1 to reserve space for last \0 */
-  char a, b;
+  int a, b;
   int i;
   for (i = 0; i < src_len && *src && dst < dst_last; ++i)
   {
-    if ((*src == '%') && ((a = src[1]) && (b = src[2])) && (isxdigit(a) && isxdigit(b)))
+    if ((*src == '%') && src[1] && (a = codec_hex_value(src[1])) >= 0 && (b = codec_hex_value(src[2])) >= 0)
     {
-      if (a >= 'a')
-      {
-        a -= 'a'-'A';
-      }
-      if (a >= 'A')
-      {
-        a -= ('A' - 10);
-      }
-      else
-      {
-        a -= '0';
-      }
-      if (b >= 'a')
-      {
-        b -= 'a'-'A';
-      }
-      if (b >= 'A')
-      {
-        b -= ('A' - 10);
-      }
-      else
-      {
-        b -= '0';
-      }
       *dst++ = 16 * a + b;
       src += 3;
       i += 2;
@@ -7,12 +7,39 @@
 #include "lauxlib.h"
 #include "platform.h"
 #include "cpu_esp8266.h"
+#include "c_stdlib.h"
 #include "httpclient.h"
+#include "vfs.h"
+
+// State of a streamed request, passed to the stream callbacks
+typedef struct {
+  int headers_ref;
+  int data_ref;
+  int complete_ref;
+  int fd;
+  int size;
+} http_stream_t;
+
+// Push the timing of the request being completed as a table
+static void http_push_timing( lua_State *L )
+{
+  const http_timing_t *t = http_last_timing();
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, t->dns_us);
+  lua_setfield(L, -2, "dns");
+  lua_pushnumber(L, t->connect_us);
+  lua_setfield(L, -2, "connect");
+  lua_pushnumber(L, t->wait_us);
+  lua_setfield(L, -2, "wait");
+  lua_pushnumber(L, t->total_us);
+  lua_setfield(L, -2, "total");
+  lua_pushboolean(L, t->reused);
+  lua_setfield(L, -2, "reused");
+}
 
-static int http_callback_registry  = LUA_NOREF;
-
-static void http_callback( char * response, int http_status, char * full_response )
+static void http_callback( char * response, int http_status, char * full_response, void * arg )
 {
+  int callback_ref = (int)arg;
 #if defined(HTTPCLIENT_DEBUG_ON)
   dbg_printf( "http_status=%d\n", http_status );
   if ( http_status != HTTP_STATUS_GENERIC_ERROR )
@@ -23,11 +50,12 @@ static void http_callback( char * response, int http_status, char * full_respons
     dbg_printf( "response=%s<EOF>\n", response );
   }
 #endif
-  if (http_callback_registry != LUA_NOREF)
+  if (callback_ref != LUA_NOREF)
   {
     lua_State *L = lua_getstate();
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, http_callback_registry);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, callback_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, callback_ref);
 
     lua_pushnumber(L, http_status);
     if ( http_status != HTTP_STATUS_GENERIC_ERROR && response)
@@ -38,11 +66,19 @@ static void http_callback( char * response, int http_status, char * full_respons
     {
       lua_pushnil(L);
     }
-    lua_call(L, 2, 0); // With 2 arguments and 0 result
+    http_push_timing(L);
+    lua_call(L, 3, 0); // With 3 arguments and 0 result
+  }
+}
 
-    luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = LUA_NOREF;
+// Reference the callback function at index n, if any
+static int http_callback_ref( lua_State *L, int n )
+{
+  if (lua_type(L, n) == LUA_TFUNCTION || lua_type(L, n) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue(L, n);  // copy argument (func) to the top of stack
+    return luaL_ref(L, LUA_REGISTRYINDEX);
   }
+  return LUA_NOREF;
 }
 
 // Lua: http.request( url, method, header, body, function(status, reponse) end )
@@ -69,14 +105,9 @@ static int http_lapi_request( lua_State *L )
     body = luaL_checklstring(L, 4, &length);
   }
 
-  if (lua_type(L, 5) == LUA_TFUNCTION || lua_type(L, 5) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 5);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  int callback_ref = http_callback_ref(L, 5);
 
-  http_request(url, method, headers, body, http_callback, 0);
+  http_request_arg(url, method, headers, body, http_callback, (void *)callback_ref);
   return 0;
 }
 
@@ -103,14 +134,9 @@ static int http_lapi_post( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  int callback_ref = http_callback_ref(L, 4);
 
-  http_post(url, headers, body, http_callback);
+  http_request_arg(url, "POST", headers, body, http_callback, (void *)callback_ref);
   return 0;
 }
 
@@ -137,14 +163,9 @@ static int http_lapi_put( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  int callback_ref = http_callback_ref(L, 4);
 
-  http_put(url, headers, body, http_callback);
+  http_request_arg(url, "PUT", headers, body, http_callback, (void *)callback_ref);
   return 0;
 }
 
@@ -171,14 +192,9 @@ static int http_lapi_delete( lua_State *L )
     body = luaL_checklstring(L, 3, &length);
   }
 
-  if (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 4);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  int callback_ref = http_callback_ref(L, 4);
 
-  http_delete(url, headers, body, http_callback);
+  http_request_arg(url, "DELETE", headers, body, http_callback, (void *)callback_ref);
   return 0;
 }
 
@@ -200,14 +216,129 @@ static int http_lapi_get( lua_State *L )
     headers = luaL_checklstring(L, 2, &length);
   }
 
-  if (lua_type(L, 3) == LUA_TFUNCTION || lua_type(L, 3) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
-    if (http_callback_registry != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
-    http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
+  int callback_ref = http_callback_ref(L, 3);
+
+  http_request_arg(url, "GET", headers, NULL, http_callback, (void *)callback_ref);
+  return 0;
+}
+
+static void http_stream_headers( int http_status, char * headers, void * arg )
+{
+  http_stream_t *st = (http_stream_t *)arg;
+  if (st->headers_ref != LUA_NOREF)
+  {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->headers_ref);
+    lua_pushnumber(L, http_status);
+    lua_pushstring(L, headers);
+    lua_call(L, 2, 0);
   }
+}
+
+static bool http_stream_data( char * data, int len, void * arg )
+{
+  http_stream_t *st = (http_stream_t *)arg;
+  st->size += len;
+  if (st->fd)
+  {
+    return vfs_write(st->fd, data, len) == len;
+  }
+  if (st->data_ref != LUA_NOREF)
+  {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->data_ref);
+    lua_pushlstring(L, data, len);
+    lua_call(L, 1, 0);
+  }
+  return true;
+}
+
+static void http_stream_complete( int http_status, void * arg )
+{
+  http_stream_t *st = (http_stream_t *)arg;
+  lua_State *L = lua_getstate();
+  if (st->fd)
+  {
+    vfs_close(st->fd);
+  }
+  if (st->complete_ref != LUA_NOREF)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->complete_ref);
+    lua_pushnumber(L, http_status);
+    lua_pushnumber(L, st->size);
+    http_push_timing(L);
+    lua_call(L, 3, 0);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, st->headers_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, st->data_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, st->complete_ref);
+  c_free(st);
+}
 
-  http_get(url, headers, http_callback);
+static int http_stream_ref_field( lua_State *L, int idx, const char *name )
+{
+  lua_getfield(L, idx, name);
+  if (lua_type(L, -1) == LUA_TFUNCTION || lua_type(L, -1) == LUA_TLIGHTFUNCTION)
+  {
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pop(L, 1);
+  return LUA_NOREF;
+}
+
+// Lua: http.stream( url, method, header, body, { headers = function(status, headers) end,
+//                   data = function(chunk) end, complete = function(status, size) end, file = "name" } )
+static int http_lapi_stream( lua_State *L )
+{
+  int length;
+  const char * url     = luaL_checklstring(L, 1, &length);
+  const char * method  = luaL_checklstring(L, 2, &length);
+  const char * headers = NULL;
+  const char * body    = NULL;
+
+  if (lua_isstring(L, 3))
+  {
+    headers = luaL_checklstring(L, 3, &length);
+  }
+  if (lua_isstring(L, 4))
+  {
+    body = luaL_checklstring(L, 4, &length);
+  }
+  luaL_checktype(L, 5, LUA_TTABLE);
+
+  http_stream_t *st = (http_stream_t *)c_zalloc(sizeof(http_stream_t));
+  if (!st)
+  {
+    return luaL_error( L, "out of memory" );
+  }
+
+  lua_getfield(L, 5, "file");
+  if (lua_isstring(L, -1))
+  {
+    st->fd = vfs_open(lua_tostring(L, -1), "w");
+    if (!st->fd)
+    {
+      c_free(st);
+      return luaL_error( L, "cannot open file" );
+    }
+  }
+  lua_pop(L, 1);
+
+  st->headers_ref  = http_stream_ref_field(L, 5, "headers");
+  st->data_ref     = http_stream_ref_field(L, 5, "data");
+  st->complete_ref = http_stream_ref_field(L, 5, "complete");
+
+  http_stream_handler_t handler = {
+    http_stream_headers, http_stream_data, http_stream_complete, st
+  };
+  http_stream_request(url, method, headers, body, &handler);
+  return 0;
+}
+
+// Lua: http.keepalive( idle_ms )
+static int http_lapi_keepalive( lua_State *L )
+{
+  http_set_keepalive(luaL_checkinteger(L, 1));
   return 0;
 }
 
@@ -218,6 +349,8 @@ static const LUA_REG_TYPE http_map[] = {
   { LSTRKEY( "put" ),             LFUNCVAL( http_lapi_put ) },
   { LSTRKEY( "delete" ),          LFUNCVAL( http_lapi_delete ) },
   { LSTRKEY( "get" ),             LFUNCVAL( http_lapi_get ) },
+  { LSTRKEY( "stream" ),          LFUNCVAL( http_lapi_stream ) },
+  { LSTRKEY( "keepalive" ),       LFUNCVAL( http_lapi_keepalive ) },
 
   { LSTRKEY( "OK" ),              LNUMVAL( 0 ) },
   { LSTRKEY( "ERROR" ),           LNUMVAL( HTTP_STATUS_GENERIC_ERROR ) },
@@ -0,0 +1,794 @@
+// Module for a HTTP/1.1 server
+
+// Example usage:
+// httpd.route("GET", "/status", function(req) return 200, '{"up":true}', "application/json" end)
+// httpd.static("/", "www/")
+// httpd.start(80)
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+
+#include "c_string.h"
+#include "c_stdlib.h"
+
+#include "c_types.h"
+#include "osapi.h"
+#include "mem.h"
+#include "espconn.h"
+#include "vfs.h"
+
+#define HTTPD_HEADER_MAX      1024    // request line and headers
+#define HTTPD_SEND_CHUNK      1460    // one TCP segment
+#define HTTPD_DEFAULT_TIMEOUT 30      // seconds of inactivity before a connection is closed
+#define HTTPD_DEFAULT_MAXBODY 2048    // largest request body accepted
+#define HTTPD_CTYPE_MAX       128     // longest Content-Type a handler may set
+#define HTTPD_EXTRA_MAX       1024    // most bytes of headers a handler may add
+
+typedef struct httpd_route
+{
+  char *method;       // NULL matches any method
+  char *path;
+  bool prefix;        // path ended in '*'
+  int func_ref;
+  struct httpd_route *next;
+} httpd_route;
+
+typedef struct httpd_conn
+{
+  struct espconn *pesp_conn;
+  char *rx;           // received data not yet handled
+  uint32_t rx_len;
+  uint32_t rx_size;
+  uint32_t head_len;  // length of request line and headers, 0 until complete
+  uint32_t body_len;  // Content-Length of the request being received
+  bool busy;          // a response is being sent
+  bool close;         // close the connection after the response
+  bool closing;       // disconnecting, nothing more is sent or handled
+  // espconn_sent keeps pointing into this until httpd_sent, so each
+  // connection has its own, allocated with its first response
+  char *tx;
+  // body of the response being sent, from a Lua string or a file
+  int body_ref;
+  const char *body;
+  int fd;
+  uint32_t body_pos;
+  uint32_t body_size;
+} httpd_conn;
+
+static struct espconn *httpd_server = NULL;
+static httpd_route *httpd_routes = NULL;
+static char *httpd_static_prefix = NULL;
+static char *httpd_static_dir = NULL;
+static uint32_t httpd_maxbody = HTTPD_DEFAULT_MAXBODY;
+static uint16_t httpd_timeout = HTTPD_DEFAULT_TIMEOUT;
+
+static struct {
+  uint32_t requests;
+  uint32_t connections;
+  uint32_t active;
+  uint32_t errors;
+} httpd_stats;
+
+static void httpd_process(httpd_conn *conn);
+
+static const char *httpd_status_text(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default:  return status < 400 ? "OK" : "Error";
+  }
+}
+
+static const char *httpd_content_type(const char *name)
+{
+  static const struct { const char *ext; const char *type; } types[] = {
+    { ".html", "text/html" },
+    { ".htm",  "text/html" },
+    { ".css",  "text/css" },
+    { ".js",   "application/javascript" },
+    { ".json", "application/json" },
+    { ".png",  "image/png" },
+    { ".jpg",  "image/jpeg" },
+    { ".gif",  "image/gif" },
+    { ".svg",  "image/svg+xml" },
+    { ".ico",  "image/x-icon" },
+    { ".txt",  "text/plain" },
+  };
+  const char *ext = c_strrchr(name, '.');
+  unsigned i;
+  if (ext)
+  {
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+      if (c_strcmp(ext, types[i].ext) == 0)
+        return types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+// Find a header in the NUL-terminated header block, the name must be lower case
+static const char *httpd_find_header(const char *headers, const char *name)
+{
+  size_t name_len = c_strlen(name);
+  const char *line = headers;
+  while (line && *line)
+  {
+    size_t i;
+    for (i = 0; i < name_len && line[i] && (line[i] | 0x20) == name[i]; i++)
+      ;
+    if (i == name_len && line[i] == ':')
+    {
+      const char *value = line + i + 1;
+      while (*value == ' ' || *value == '\t')
+        value++;
+      return value;
+    }
+    line = c_strstr(line, "\r\n");
+    if (line)
+      line += 2;
+  }
+  return NULL;
+}
+
+static void httpd_close(httpd_conn *conn)
+{
+  if (conn->closing)
+    return;
+  conn->closing = true;
+  espconn_disconnect(conn->pesp_conn);
+}
+
+static void httpd_send(httpd_conn *conn, const char *data, uint32_t len)
+{
+  if (espconn_sent(conn->pesp_conn, (unsigned char *)data, len) != ESPCONN_OK)
+  {
+    // there will be no sent callback to carry on with, give up on the connection
+    NODE_ERR("httpd: send failed\n");
+    httpd_stats.errors++;
+    httpd_close(conn);
+  }
+}
+
+// Fill the transmit buffer with the next piece of the body and send it.
+// Returns false when there is nothing left to send.
+static bool httpd_send_body(httpd_conn *conn, uint32_t offset)
+{
+  uint32_t n = conn->body_size - conn->body_pos;
+  uint32_t room = offset < HTTPD_SEND_CHUNK ? HTTPD_SEND_CHUNK - offset : 0;
+  if (n > room)
+    n = room;
+  if (n > 0)
+  {
+    if (conn->fd)
+    {
+      sint32_t got = vfs_read(conn->fd, conn->tx + offset, n);
+      if (got <= 0)
+      {
+        // the file shrank under us, the Content-Length can't be met anymore
+        conn->close = true;
+        conn->body_pos = conn->body_size;
+        n = 0;
+      }
+      else
+        n = got;
+    }
+    else
+      c_memcpy(conn->tx + offset, conn->body + conn->body_pos, n);
+    conn->body_pos += n;
+  }
+  if (offset + n == 0)
+    return false;
+  httpd_send(conn, conn->tx, offset + n);
+  return true;
+}
+
+// Start sending a response. The body is either body/body_ref (a Lua string,
+// kept referenced until sent) or the file fd of body_size bytes.
+static void httpd_respond(httpd_conn *conn, int status, const char *content_type,
+                          const char *extra_headers, bool head)
+{
+  if (!conn->tx)
+  {
+    conn->tx = (char *)c_malloc(HTTPD_SEND_CHUNK);
+    if (!conn->tx)
+    {
+      NODE_ERR("httpd: out of memory\n");
+      httpd_stats.errors++;
+      httpd_close(conn);
+      return;
+    }
+  }
+  if (content_type && c_strlen(content_type) > HTTPD_CTYPE_MAX)
+    content_type = NULL;    // would not fit the buffer, drop it like too many headers
+  int len = c_sprintf(conn->tx,
+    "HTTP/1.1 %d %s\r\n"
+    "Content-Length: %u\r\n"
+    "%s%s%s"
+    "Connection: %s\r\n",
+    status, httpd_status_text(status), conn->body_size,
+    content_type ? "Content-Type: " : "", content_type ? content_type : "", content_type ? "\r\n" : "",
+    conn->close ? "close" : "keep-alive");
+  if (extra_headers)
+  {
+    size_t extra_len = c_strlen(extra_headers);
+    if (len + extra_len + 2 > HTTPD_SEND_CHUNK)
+      extra_len = 0;    // doesn't fit, drop rather than overflow
+    c_memcpy(conn->tx + len, extra_headers, extra_len);
+    len += extra_len;
+  }
+  conn->tx[len++] = '\r';
+  conn->tx[len++] = '\n';
+
+  if (head)
+    conn->body_pos = conn->body_size;   // headers only
+  conn->busy = true;
+  httpd_stats.requests++;
+  if (status >= 500)
+    httpd_stats.errors++;
+  // the headers share the first segment with as much of the body as fits
+  httpd_send_body(conn, len);
+}
+
+static void httpd_response_done(httpd_conn *conn)
+{
+  lua_State *L = lua_getstate();
+  if (conn->body_ref != LUA_NOREF)
+  {
+    luaL_unref(L, LUA_REGISTRYINDEX, conn->body_ref);
+    conn->body_ref = LUA_NOREF;
+  }
+  if (conn->fd)
+  {
+    vfs_close(conn->fd);
+    conn->fd = 0;
+  }
+  conn->body = NULL;
+  conn->body_pos = conn->body_size = 0;
+  conn->busy = false;
+}
+
+static void httpd_respond_error(httpd_conn *conn, int status)
+{
+  conn->body = httpd_status_text(status);
+  conn->body_size = c_strlen(conn->body);
+  httpd_respond(conn, status, "text/plain", NULL, false);
+}
+
+// Try to serve path from the file system, preferring a pre-compressed .gz version
+static bool httpd_serve_static(httpd_conn *conn, const char *path, const char *headers, bool head)
+{
+  size_t prefix_len = c_strlen(httpd_static_prefix);
+  if (c_strncmp(path, httpd_static_prefix, prefix_len) != 0 || c_strstr(path, ".."))
+    return false;
+  path += prefix_len;
+  while (*path == '/')
+    path++;
+
+  char name[c_strlen(httpd_static_dir) + c_strlen(path) + sizeof("index.html.gz")];
+  c_strcpy(name, httpd_static_dir);
+  c_strcat(name, path);
+  if (*path == '\0' || path[c_strlen(path) - 1] == '/')
+    c_strcat(name, "index.html");
+  size_t name_len = c_strlen(name);
+
+  const char *accept = httpd_find_header(headers, "accept-encoding");
+  bool gzip = false;
+  int fd = 0;
+  if (accept && c_strstr(accept, "gzip"))
+  {
+    c_strcpy(name + name_len, ".gz");
+    fd = vfs_open(name, "r");
+    gzip = fd != 0;
+    name[name_len] = '\0';
+  }
+  if (!fd)
+    fd = vfs_open(name, "r");
+  if (!fd)
+    return false;
+
+  conn->fd = fd;
+  conn->body_size = vfs_size(fd);
+  httpd_respond(conn, 200, httpd_content_type(name), gzip ? "Content-Encoding: gzip\r\n" : NULL, head);
+  return true;
+}
+
+// Call the route handler: status, body, content type or header table = handler(req)
+static void httpd_call_handler(httpd_conn *conn, httpd_route *route, char *method,
+                               char *path, char *query, char *headers, bool head)
+{
+  lua_State *L = lua_getstate();
+  int top = lua_gettop(L);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, route->func_ref);
+  lua_createtable(L, 0, 5);
+  lua_pushstring(L, method);
+  lua_setfield(L, -2, "method");
+  lua_pushstring(L, path);
+  lua_setfield(L, -2, "path");
+  if (query)
+  {
+    lua_pushstring(L, query);
+    lua_setfield(L, -2, "query");
+  }
+  // header names are lower case, values as received
+  lua_newtable(L);
+  char *line = headers;
+  while (line && *line)
+  {
+    char *eol = c_strstr(line, "\r\n");
+    char *colon = c_strchr(line, ':');
+    if (!eol)
+      break;
+    if (colon && colon < eol)
+    {
+      char *c;
+      for (c = line; c < colon; c++)
+        if (*c >= 'A' && *c <= 'Z')
+          *c += 'a' - 'A';
+      lua_pushlstring(L, line, colon - line);
+      colon++;
+      while (*colon == ' ' || *colon == '\t')
+        colon++;
+      lua_pushlstring(L, colon, eol - colon);
+      lua_settable(L, -3);
+    }
+    line = eol + 2;
+  }
+  lua_setfield(L, -2, "headers");
+  if (conn->body_len)
+  {
+    lua_pushlstring(L, conn->rx + conn->head_len, conn->body_len);
+    lua_setfield(L, -2, "body");
+  }
+
+  if (lua_pcall(L, 1, 3, 0) != 0)
+  {
+    NODE_ERR("httpd handler: %s\n", lua_tostring(L, -1));
+    lua_settop(L, top);
+    httpd_respond_error(conn, 500);
+    return;
+  }
+
+  // the handler is untrusted: anything unexpected is answered with 500, as an
+  // error raised here would not be caught
+  int status = 200;
+  if (lua_isnumber(L, top + 1))
+    status = lua_tointeger(L, top + 1);
+  else if (!lua_isnil(L, top + 1))
+    status = 0;
+  if (status < 100 || status > 999)
+  {
+    NODE_ERR("httpd handler: bad status\n");
+    lua_settop(L, top);
+    httpd_respond_error(conn, 500);
+    return;
+  }
+
+  const char *content_type = "text/html";
+  if (lua_type(L, top + 3) == LUA_TSTRING)
+    content_type = lua_tostring(L, top + 3);
+  // the extra headers are collected at top + 4, so that lua_next always finds
+  // its key on top of the stack
+  lua_pushliteral(L, "");
+  if (lua_type(L, top + 3) == LUA_TTABLE)
+  {
+    content_type = NULL;
+    lua_pushnil(L);
+    while (lua_next(L, top + 3) != 0)
+    {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1) &&
+          lua_strlen(L, top + 4) + lua_strlen(L, -2) + lua_strlen(L, -1) + 4 <= HTTPD_EXTRA_MAX)
+      {
+        lua_pushvalue(L, top + 4);
+        lua_pushvalue(L, -3);
+        lua_pushliteral(L, ": ");
+        lua_pushvalue(L, -4);
+        lua_pushliteral(L, "\r\n");
+        lua_concat(L, 5);
+        lua_replace(L, top + 4);
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  if (lua_isstring(L, top + 2))
+  {
+    size_t len;
+    lua_pushvalue(L, top + 2);
+    conn->body = lua_tolstring(L, -1, &len);
+    conn->body_size = len;
+    conn->body_ref = luaL_ref(L, LUA_REGISTRYINDEX);    // keep it alive until sent
+  }
+  httpd_respond(conn, status, content_type, lua_tostring(L, top + 4), head);
+  lua_settop(L, top);
+}
+
+// Parse the complete request at the start of the receive buffer and answer it
+static void httpd_handle(httpd_conn *conn)
+{
+  char *method = conn->rx;
+  char *path = c_strchr(method, ' ');
+  char *version = path ? c_strchr(path + 1, ' ') : NULL;
+  char *headers = c_strstr(method, "\r\n");
+  if (!path || !version || !headers || version > headers)
+  {
+    conn->close = true;
+    httpd_respond_error(conn, 400);
+    return;
+  }
+  *path++ = '\0';
+  *version++ = '\0';
+  *headers = '\0';
+  headers += 2;
+  conn->rx[conn->head_len - 2] = '\0';  // terminate the header block after the last CRLF
+
+  // HTTP/1.1 connections are persistent unless told otherwise, HTTP/1.0 ones are not
+  const char *connection = httpd_find_header(headers, "connection");
+  if (c_strcmp(version, "HTTP/1.1") == 0)
+    conn->close = connection && (connection[0] | 0x20) == 'c';
+  else
+    conn->close = !connection || (connection[0] | 0x20) != 'k';
+
+  char *query = c_strchr(path, '?');
+  if (query)
+    *query++ = '\0';
+  bool head = c_strcmp(method, "HEAD") == 0;
+
+  httpd_route *route;
+  for (route = httpd_routes; route; route = route->next)
+  {
+    if (route->method && c_strcmp(route->method, method) != 0 && !(head && c_strcmp(route->method, "GET") == 0))
+      continue;
+    if (route->prefix ? c_strncmp(path, route->path, c_strlen(route->path)) == 0 : c_strcmp(path, route->path) == 0)
+      break;
+  }
+  if (route)
+  {
+    httpd_call_handler(conn, route, method, path, query, headers, head);
+    return;
+  }
+  if (httpd_static_prefix && (head || c_strcmp(method, "GET") == 0) &&
+      httpd_serve_static(conn, path, headers, head))
+    return;
+  httpd_respond_error(conn, 404);
+}
+
+// Handle as many complete requests as have arrived, one response at a time
+static void httpd_process(httpd_conn *conn)
+{
+  while (!conn->busy && !conn->closing && conn->rx_len > 0)
+  {
+    if (conn->head_len == 0)
+    {
+      conn->rx[conn->rx_len] = '\0';
+      char *end = c_strstr(conn->rx, "\r\n\r\n");
+      if (!end)
+      {
+        if (conn->rx_len >= HTTPD_HEADER_MAX)
+        {
+          conn->close = true;
+          conn->rx_len = 0;
+          httpd_respond_error(conn, 431);
+        }
+        return;
+      }
+      conn->head_len = end + 4 - conn->rx;
+      end[2] = '\0';
+      const char *length = httpd_find_header(conn->rx, "content-length");
+      end[2] = '\r';
+      conn->body_len = length ? c_strtol(length, NULL, 10) : 0;
+      if (conn->body_len > httpd_maxbody)
+      {
+        conn->close = true;
+        conn->rx_len = 0;
+        conn->head_len = 0;
+        httpd_respond_error(conn, 413);
+        return;
+      }
+    }
+    uint32_t total = conn->head_len + conn->body_len;
+    if (conn->rx_len < total)
+      return;     // wait for the rest of the body
+
+    httpd_handle(conn);
+
+    // drop the handled request, keep what arrived after it (pipelining)
+    os_memmove(conn->rx, conn->rx + total, conn->rx_len - total);
+    conn->rx_len -= total;
+    conn->head_len = 0;
+    conn->body_len = 0;
+  }
+}
+
+static void httpd_free_conn(httpd_conn *conn)
+{
+  httpd_response_done(conn);
+  if (conn->rx)
+    c_free(conn->rx);
+  if (conn->tx)
+    c_free(conn->tx);
+  c_free(conn);
+}
+
+static void httpd_received(void *arg, char *pdata, unsigned short len)
+{
+  struct espconn *pesp_conn = arg;
+  httpd_conn *conn = (httpd_conn *)pesp_conn->reverse;
+  if (conn == NULL || conn->closing)
+    return;
+
+  uint32_t needed = conn->rx_len + len + 1;
+  if (needed > HTTPD_HEADER_MAX + httpd_maxbody + 1)
+  {
+    // more than one request can be, the client doesn't wait for answers
+    conn->rx_len = 0;
+    if (!conn->busy)
+    {
+      conn->close = true;
+      httpd_respond_error(conn, 413);
+    }
+    else
+      httpd_close(conn);
+    return;
+  }
+  if (needed > conn->rx_size)
+  {
+    uint32_t size = conn->rx_size ? conn->rx_size * 2 : 256;
+    if (size < needed)
+      size = needed;
+    char *rx = (char *)c_realloc(conn->rx, size);
+    if (!rx)
+    {
+      NODE_ERR("httpd: out of memory\n");
+      httpd_close(conn);
+      return;
+    }
+    conn->rx = rx;
+    conn->rx_size = size;
+  }
+  c_memcpy(conn->rx + conn->rx_len, pdata, len);
+  conn->rx_len += len;
+  httpd_process(conn);
+}
+
+static void httpd_sent(void *arg)
+{
+  struct espconn *pesp_conn = arg;
+  httpd_conn *conn = (httpd_conn *)pesp_conn->reverse;
+  if (conn == NULL || !conn->busy || conn->closing)
+    return;
+  if (httpd_send_body(conn, 0))
+    return;
+
+  httpd_response_done(conn);
+  if (conn->close)
+  {
+    httpd_close(conn);
+    return;
+  }
+  httpd_process(conn);
+}
+
+static void httpd_disconnected(void *arg)
+{
+  struct espconn *pesp_conn = arg;
+  httpd_conn *conn = (httpd_conn *)pesp_conn->reverse;
+  if (conn == NULL)
+    return;
+  pesp_conn->reverse = NULL;  // the espconn is made by the sdk, it frees it
+  httpd_stats.active--;
+  httpd_free_conn(conn);
+}
+
+static void httpd_reconnected(void *arg, sint8_t err)
+{
+  httpd_disconnected(arg);
+}
+
+static void httpd_connected(void *arg)
+{
+  struct espconn *pesp_conn = arg;
+  httpd_conn *conn = (httpd_conn *)c_zalloc(sizeof(httpd_conn));
+  if (conn == NULL)
+  {
+    pesp_conn->reverse = NULL;
+    espconn_disconnect(pesp_conn);
+    return;
+  }
+  conn->pesp_conn = pesp_conn;
+  conn->body_ref = LUA_NOREF;
+  pesp_conn->reverse = conn;
+  httpd_stats.connections++;
+  httpd_stats.active++;
+
+  espconn_regist_recvcb(pesp_conn, httpd_received);
+  espconn_regist_sentcb(pesp_conn, httpd_sent);
+  espconn_regist_disconcb(pesp_conn, httpd_disconnected);
+  espconn_regist_reconcb(pesp_conn, httpd_reconnected);
+}
+
+static char *httpd_strdup(const char *s)
+{
+  char *copy = (char *)c_malloc(c_strlen(s) + 1);
+  if (copy)
+    c_strcpy(copy, s);
+  return copy;
+}
+
+// Lua: httpd.route(method, path, function(req) return status, body, content_type end)
+static int httpd_lapi_route(lua_State *L)
+{
+  const char *method = lua_isnil(L, 1) ? NULL : luaL_checkstring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  size_t path_len = c_strlen(path);
+  bool prefix = path_len > 0 && path[path_len - 1] == '*';
+  if (prefix)
+    path_len--;
+
+  // replace or remove an existing route
+  httpd_route **p;
+  for (p = &httpd_routes; *p; p = &(*p)->next)
+  {
+    httpd_route *route = *p;
+    if (route->prefix == prefix && c_strlen(route->path) == path_len &&
+        c_strncmp(route->path, path, path_len) == 0 &&
+        ((!method && !route->method) || (method && route->method && c_strcmp(method, route->method) == 0)))
+    {
+      *p = route->next;
+      luaL_unref(L, LUA_REGISTRYINDEX, route->func_ref);
+      if (route->method)
+        c_free(route->method);
+      c_free(route->path);
+      c_free(route);
+      break;
+    }
+  }
+  if (lua_isnoneornil(L, 3))
+    return 0;
+  luaL_checkanyfunction(L, 3);
+
+  httpd_route *route = (httpd_route *)c_zalloc(sizeof(httpd_route));
+  if (!route)
+    return luaL_error(L, "out of memory");
+  route->method = method ? httpd_strdup(method) : NULL;
+  route->path = (char *)c_malloc(path_len + 1);
+  if ((method && !route->method) || !route->path)
+  {
+    if (route->method)
+      c_free(route->method);
+    if (route->path)
+      c_free(route->path);
+    c_free(route);
+    return luaL_error(L, "out of memory");
+  }
+  c_memcpy(route->path, path, path_len);
+  route->path[path_len] = '\0';
+  route->prefix = prefix;
+  lua_pushvalue(L, 3);
+  route->func_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  // routes are matched in the order they were added
+  for (p = &httpd_routes; *p; p = &(*p)->next)
+    ;
+  *p = route;
+  return 0;
+}
+
+// Lua: httpd.static(prefix[, dir])
+static int httpd_lapi_static(lua_State *L)
+{
+  if (httpd_static_prefix)
+    c_free(httpd_static_prefix);
+  if (httpd_static_dir)
+    c_free(httpd_static_dir);
+  httpd_static_prefix = httpd_static_dir = NULL;
+  if (lua_isnoneornil(L, 1))
+    return 0;
+
+  httpd_static_prefix = httpd_strdup(luaL_checkstring(L, 1));
+  httpd_static_dir = httpd_strdup(luaL_optstring(L, 2, ""));
+  if (!httpd_static_prefix || !httpd_static_dir)
+    return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// Lua: httpd.start(port[, { timeout = s, maxbody = bytes, maxconn = n }])
+static int httpd_lapi_start(lua_State *L)
+{
+  int port = luaL_checkinteger(L, 1);
+  int maxconn = 0;
+  if (httpd_server)
+    return luaL_error(L, "already started");
+
+  httpd_timeout = HTTPD_DEFAULT_TIMEOUT;
+  httpd_maxbody = HTTPD_DEFAULT_MAXBODY;
+  if (lua_istable(L, 2))
+  {
+    lua_getfield(L, 2, "timeout");
+    httpd_timeout = luaL_optinteger(L, -1, HTTPD_DEFAULT_TIMEOUT);
+    lua_getfield(L, 2, "maxbody");
+    httpd_maxbody = luaL_optinteger(L, -1, HTTPD_DEFAULT_MAXBODY);
+    lua_getfield(L, 2, "maxconn");
+    maxconn = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 3);
+  }
+
+  httpd_server = (struct espconn *)c_zalloc(sizeof(struct espconn));
+  if (httpd_server)
+    httpd_server->proto.tcp = (esp_tcp *)c_zalloc(sizeof(esp_tcp));
+  if (!httpd_server || !httpd_server->proto.tcp)
+  {
+    if (httpd_server)
+      c_free(httpd_server);
+    httpd_server = NULL;
+    return luaL_error(L, "out of memory");
+  }
+  httpd_server->type = ESPCONN_TCP;
+  httpd_server->state = ESPCONN_NONE;
+  httpd_server->proto.tcp->local_port = port;
+
+  espconn_regist_connectcb(httpd_server, httpd_connected);
+  if (espconn_accept(httpd_server) != ESPCONN_OK)
+  {
+    c_free(httpd_server->proto.tcp);
+    c_free(httpd_server);
+    httpd_server = NULL;
+    return luaL_error(L, "listen failed");
+  }
+  espconn_regist_time(httpd_server, httpd_timeout, 0);
+  if (maxconn > 0)
+    espconn_tcp_set_max_con_allow(httpd_server, maxconn);
+  return 0;
+}
+
+// Lua: httpd.stop()
+static int httpd_lapi_stop(lua_State *L)
+{
+  if (!httpd_server)
+    return 0;
+  // routes and static settings are kept for the next start()
+  espconn_delete(httpd_server);
+  c_free(httpd_server->proto.tcp);
+  c_free(httpd_server);
+  httpd_server = NULL;
+  return 0;
+}
+
+// Lua: requests, connections, active, errors = httpd.stats()
+static int httpd_lapi_stats(lua_State *L)
+{
+  lua_pushinteger(L, httpd_stats.requests);
+  lua_pushinteger(L, httpd_stats.connections);
+  lua_pushinteger(L, httpd_stats.active);
+  lua_pushinteger(L, httpd_stats.errors);
+  return 4;
+}
+
+// Module function map
+static const LUA_REG_TYPE httpd_map[] = {
+  { LSTRKEY( "start" ),  LFUNCVAL( httpd_lapi_start ) },
+  { LSTRKEY( "stop" ),   LFUNCVAL( httpd_lapi_stop ) },
+  { LSTRKEY( "route" ),  LFUNCVAL( httpd_lapi_route ) },
+  { LSTRKEY( "static" ), LFUNCVAL( httpd_lapi_static ) },
+  { LSTRKEY( "stats" ),  LFUNCVAL( httpd_lapi_stats ) },
+  { LNILKEY, LNILVAL }
+};
+
+NODEMCU_MODULE(HTTPD, "httpd", httpd_map, NULL);
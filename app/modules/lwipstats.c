@@ -0,0 +1,231 @@
+// Module for lwIP statistics and boot time tuning profiles
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+
+#include "c_string.h"
+#include "c_stdlib.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "vfs.h"
+
+#include "lwip/opt.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+#include "lwipstats.h"
+
+#define LWIPSTATS_PROFILE_FILE "lwip.cfg"
+
+/* pools are allocated from the heap (MEMP_MEM_MALLOC), so there is nothing to
+ * size up front. What limits a loaded node is the TCP receive window and the
+ * number of TCP connections, both of which the SDK sets at run time. */
+typedef struct {
+  const char *name;
+  uint8_t wnd;      // TCP receive window, in multiples of TCP_MSS
+  uint8_t maxcon;   // TCP connections at the same time
+} lwipstats_profile_t;
+
+static const lwipstats_profile_t profiles[] = {
+  { "default",     4,  5 },
+  { "throughput",  8,  5 },
+  { "connections", 2, 10 },
+  { "lowmem",      1,  3 }
+};
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+static const char *const memp_names[] = {
+#define LWIP_MEMPOOL(name,num,size,desc,...) desc,
+#include "lwip/memp_std.h"
+};
+
+static const lwipstats_profile_t *lwipstats_find_profile (const char *name, size_t len)
+{
+  unsigned i;
+  for (i = 0; i < NUM_PROFILES; i++)
+    if (c_strlen(profiles[i].name) == len && c_strncmp(profiles[i].name, name, len) == 0)
+      return &profiles[i];
+  return NULL;
+}
+
+static void lwipstats_apply (const lwipstats_profile_t *p)
+{
+  espconn_tcp_set_wnd(p->wnd);
+  espconn_tcp_set_max_con(p->maxcon);
+}
+
+// called from nodemcu_init() once the file system is mounted
+void lwipstats_boot_profile (void)
+{
+  char name[16];
+  int fd = vfs_open(LWIPSTATS_PROFILE_FILE, "r");
+  if (!fd)
+    return;
+  sint32_t n = vfs_read(fd, name, sizeof(name));
+  vfs_close(fd);
+  if (n <= 0)
+    return;
+  while (n > 0 && (name[n-1] == '\n' || name[n-1] == '\r' || name[n-1] == ' '))
+    n--;
+  const lwipstats_profile_t *p = lwipstats_find_profile(name, n);
+  if (p)
+    lwipstats_apply(p);
+  else
+    NODE_ERR("unknown lwip profile\n");
+}
+
+static void add_proto (lua_State *L, const char *name, struct stats_proto *s, bool tcp)
+{
+  lua_createtable(L, 0, tcp ? 12 : 11);
+#define PROTO_FIELD(f) lua_pushinteger(L, s->f); lua_setfield(L, -2, #f)
+  PROTO_FIELD(xmit);
+  PROTO_FIELD(recv);
+  PROTO_FIELD(fw);
+  PROTO_FIELD(drop);
+  PROTO_FIELD(chkerr);
+  PROTO_FIELD(lenerr);
+  PROTO_FIELD(memerr);
+  PROTO_FIELD(rterr);
+  PROTO_FIELD(proterr);
+  PROTO_FIELD(opterr);
+  PROTO_FIELD(err);
+  if (tcp) {
+    PROTO_FIELD(rexmit);
+  }
+#undef PROTO_FIELD
+  lua_setfield(L, -2, name);
+}
+
+// Lua: lwipstats.get()
+static int lwipstats_get (lua_State *L)
+{
+  int i;
+  lua_createtable(L, 0, 8);
+
+#if LINK_STATS
+  add_proto(L, "link", &lwip_stats.link, false);
+#endif
+#if ETHARP_STATS
+  add_proto(L, "etharp", &lwip_stats.etharp, false);
+#endif
+#if IP_STATS
+  add_proto(L, "ip", &lwip_stats.ip, false);
+#endif
+#if ICMP_STATS
+  add_proto(L, "icmp", &lwip_stats.icmp, false);
+#endif
+#if UDP_STATS
+  add_proto(L, "udp", &lwip_stats.udp, false);
+#endif
+#if TCP_STATS
+  add_proto(L, "tcp", &lwip_stats.tcp, true);
+#endif
+
+#if MEMP_STATS
+  lua_createtable(L, 0, MEMP_MAX);
+  for (i = 0; i < MEMP_MAX; i++) {
+    struct stats_mem *m = &lwip_stats.memp[i];
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, m->used);
+    lua_setfield(L, -2, "used");
+    lua_pushinteger(L, m->max);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, m->err);
+    lua_setfield(L, -2, "err");
+    lua_setfield(L, -2, memp_names[i]);
+  }
+  lua_setfield(L, -2, "memp");
+#endif
+
+  // lwIP's mem_malloc is the system heap
+  lua_pushinteger(L, system_get_free_heap_size());
+  lua_setfield(L, -2, "heap");
+  return 1;
+}
+
+// Lua: lwipstats.reset()
+static int lwipstats_reset (lua_State *L)
+{
+  int i;
+#if MEMP_STATS
+  // elements in use stay in use
+  for (i = 0; i < MEMP_MAX; i++) {
+    lwip_stats.memp[i].max = lwip_stats.memp[i].used;
+    lwip_stats.memp[i].err = 0;
+  }
+#endif
+#define RESET_PROTO(p) c_memset(&lwip_stats.p, 0, sizeof(lwip_stats.p))
+#if LINK_STATS
+  RESET_PROTO(link);
+#endif
+#if ETHARP_STATS
+  RESET_PROTO(etharp);
+#endif
+#if IP_STATS
+  RESET_PROTO(ip);
+#endif
+#if ICMP_STATS
+  RESET_PROTO(icmp);
+#endif
+#if UDP_STATS
+  RESET_PROTO(udp);
+#endif
+#if TCP_STATS
+  RESET_PROTO(tcp);
+#endif
+#undef RESET_PROTO
+  return 0;
+}
+
+// Lua: name, wnd, maxcon = lwipstats.profile([name [, now]])
+static int lwipstats_profile (lua_State *L)
+{
+  const lwipstats_profile_t *p;
+  unsigned i;
+
+  if (!lua_isnoneornil(L, 1)) {
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    if ((p = lwipstats_find_profile(name, len)) == NULL)
+      return luaL_error(L, "unknown profile");
+
+    // remembered for the next boot, the default needs no file
+    if (p == &profiles[0]) {
+      vfs_remove(LWIPSTATS_PROFILE_FILE);
+    } else {
+      int fd = vfs_open(LWIPSTATS_PROFILE_FILE, "w");
+      if (!fd)
+        return luaL_error(L, "can't save profile");
+      sint32_t n = vfs_write(fd, name, len);
+      vfs_close(fd);
+      if (n != len)
+        return luaL_error(L, "can't save profile");
+    }
+    if (lua_toboolean(L, 2))
+      lwipstats_apply(p);
+  }
+
+  // report the profile in effect
+  uint8_t wnd = espconn_tcp_get_wnd();
+  uint8_t maxcon = espconn_tcp_get_max_con();
+  for (i = 0; i < NUM_PROFILES; i++)
+    if (profiles[i].wnd == wnd && profiles[i].maxcon == maxcon)
+      break;
+  if (i < NUM_PROFILES)
+    lua_pushstring(L, profiles[i].name);
+  else
+    lua_pushnil(L);
+  lua_pushinteger(L, wnd);
+  lua_pushinteger(L, maxcon);
+  return 3;
+}
+
+// Module function map
+static const LUA_REG_TYPE lwipstats_map[] = {
+  { LSTRKEY( "get" ),     LFUNCVAL( lwipstats_get ) },
+  { LSTRKEY( "reset" ),   LFUNCVAL( lwipstats_reset ) },
+  { LSTRKEY( "profile" ), LFUNCVAL( lwipstats_profile ) },
+  { LNILKEY, LNILVAL }
+};
+
+NODEMCU_MODULE(LWIPSTATS, "lwipstats", lwipstats_map, NULL);
@@ -0,0 +1,7 @@
+#ifndef APP_MODULES_LWIPSTATS_H_
+#define APP_MODULES_LWIPSTATS_H_
+
+// applies the TCP tuning profile saved by lwipstats.profile()
+void lwipstats_boot_profile(void);
+
+#endif /* APP_MODULES_LWIPSTATS_H_ */
@@ -12,8 +12,10 @@
 #include "nodemcu_mdns.h"
 #include "user_interface.h"
 
+static int browse_ref = LUA_NOREF;
+
 //
-// mdns.close()
+// Stops the responder, used by mdns.register() and mdns.close()
 // 
 static int mdns_close(lua_State *L)
 {
@@ -21,6 +23,88 @@ static int mdns_close(lua_State *L)
   return 0;
 }
 
+static void mdns_browse_stop(lua_State *L)
+{
+  nodemcu_mdns_browse_stop();
+  luaL_unref(L, LUA_REGISTRYINDEX, browse_ref);
+  browse_ref = LUA_NOREF;
+}
+
+static void mdns_browse_found(const struct nodemcu_mdns_result *result, void *arg)
+{
+  lua_State *L = lua_getstate();
+  int i;
+
+  if (browse_ref == LUA_NOREF) {
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, browse_ref);
+  lua_pushstring(L, result->instance);
+
+  lua_createtable(L, 0, 4);
+  if (result->host_name) {
+    lua_pushstring(L, result->host_name);
+    lua_setfield(L, -2, "hostname");
+  }
+  if (result->ip.addr) {
+    char temp[20];
+    c_sprintf(temp, IPSTR, IP2STR(&result->ip.addr));
+    lua_pushstring(L, temp);
+    lua_setfield(L, -2, "ipv4");
+  }
+  if (result->port) {
+    lua_pushinteger(L, result->port);
+    lua_setfield(L, -2, "port");
+  }
+  lua_newtable(L);
+  for (i = 0; i < sizeof(result->txt_data) / sizeof(result->txt_data[0]) && result->txt_data[i]; i++) {
+    const char *eq = c_strchr(result->txt_data[i], '=');
+    if (eq) {
+      lua_pushlstring(L, result->txt_data[i], eq - result->txt_data[i]);
+      lua_pushstring(L, eq + 1);
+    } else {
+      lua_pushstring(L, result->txt_data[i]);
+      lua_pushboolean(L, 1);
+    }
+    lua_rawset(L, -3);
+  }
+  lua_setfield(L, -2, "txt");
+
+  lua_call(L, 2, 0);
+}
+
+//
+// mdns.browse([service, function(name, info)])
+//
+static int mdns_browse(lua_State *L)
+{
+  mdns_browse_stop(L);
+
+  if (lua_isnoneornil(L, 1)) {
+    return 0;
+  }
+  const char *service = luaL_checkstring(L, 1);
+  luaL_checkanyfunction(L, 2);
+
+  struct ip_info ipconfig;
+
+  uint8_t mode = wifi_get_opmode();
+
+  if (!wifi_get_ip_info((mode == 2) ? SOFTAP_IF : STATION_IF, &ipconfig) || !ipconfig.ip.addr) {
+    return luaL_error(L, "No network connection");
+  }
+
+  lua_pushvalue(L, 2);
+  browse_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (!nodemcu_mdns_browse(service, mdns_browse_found, NULL)) {
+    mdns_browse_stop(L);
+    return luaL_error(L, "Unable to start mDns browsing");
+  }
+
+  return 0;
+}
+
 //
 // mdns.register(hostname [, { attributes} ])
 //
@@ -87,10 +171,20 @@ static int mdns_register(lua_State *L)
   return 0;
 }
 
+//
+// mdns.close()
+//
+static int mdns_close_all(lua_State *L)
+{
+  mdns_browse_stop(L);
+  return mdns_close(L);
+}
+
 // Module function map
 static const LUA_REG_TYPE mdns_map[] = {
   { LSTRKEY("register"),  LFUNCVAL(mdns_register)  },
-  { LSTRKEY("close"),     LFUNCVAL(mdns_close)     },
+  { LSTRKEY("close"),     LFUNCVAL(mdns_close_all) },
+  { LSTRKEY("browse"),    LFUNCVAL(mdns_browse)    },
   { LNILKEY, LNILVAL }
 };
 
@@ -10,9 +10,11 @@
 
 #include "c_types.h"
 #include "mem.h"
+#include "../crypto/codec.h"
 #include "lwip/ip_addr.h"
 #include "espconn.h"
 #include "lwip/dns.h" 
+#include "lwip/tcp_impl.h"
 
 #define TCP ESPCONN_TCP
 #define UDP ESPCONN_UDP
@@ -30,16 +32,53 @@ __attribute__((section(".clientcert.flash"))) unsigned char net_client_cert_area
 #if 0
 static int expose_array(lua_State* L, char *array, unsigned short len);
 #endif
+static int net_rxbuf_new(lua_State* L);
 
-#define MAX_SOCKET 5
+// the tcp server's clients live in a fixed pool of slots, free ones on a stack
+#define MAX_SOCKET 15         // linkMax of espconn
+#define DEFAULT_MAX_CONN 5
 static int socket_num = 0;
 static int socket[MAX_SOCKET];
+static uint8_t socket_free[MAX_SOCKET];
+static int socket_free_num = 0;
+static int tcp_server_maxconn = DEFAULT_MAX_CONN;
 static int tcpserver_cb_connect_ref = LUA_NOREF;  // for tcp server connected callback
 static uint16_t tcp_server_timeover = 30;
 
 static struct espconn *pTcpServer = NULL;
+static uint32_t tcpserver_accepted = 0;
+static uint32_t tcpserver_dropped = 0;  // refused for lack of a slot, or aborted
 static struct espconn *pUdpServer = NULL;
 
+#define NET_BATCH_MAX 32
+
+// a received datagram held back for batched delivery, see udp:batch()
+typedef struct lnet_datagram
+{
+  char *data;
+  uint16_t len;
+  uint16_t port;
+  uint8_t ip[4];
+} lnet_datagram;
+
+typedef struct lnet_batch
+{
+  os_timer_t timer;
+  int cb_ref;
+  uint16_t interval;  // ms after the first datagram, 0 to deliver only when full
+  uint8_t count;      // deliver as soon as this many are held
+  uint8_t held;
+  lnet_datagram datagrams[];
+} lnet_batch;
+
+// read-only view of received data, see socket:on("receive", fn, "buffer")
+typedef struct lnet_rxbuf
+{
+  const char *data;   // NULL once released
+  size_t len;
+  uint8_t owned;      // data is a private copy made by retain()
+} lnet_rxbuf;
+
 typedef struct lnet_userdata
 {
   struct espconn *pesp_conn;
@@ -50,11 +89,102 @@ typedef struct lnet_userdata
   int cb_receive_ref;
   int cb_send_ref;
   int cb_dns_found_ref;
+  lnet_batch *batch;
+  int rxbuf_ref;      // buffer reused for every receive, LUA_NOREF when strings are passed
+  int cb_watermark_ref;
+  int8_t slot;        // index in socket[] for a tcp server's client, -1 otherwise
+  uint16_t wm_low, wm_high;   // send queue thresholds in bytes, see socket:watermark()
+  uint8_t wm_above;           // high was reached and low not yet
 #ifdef CLIENT_SSL_ENABLE
   uint8_t secure;
 #endif
 }lnet_userdata;
 
+// hand all datagrams held to the batch callback at once
+static void net_batch_flush(lnet_userdata *nud)
+{
+  lnet_batch *b = nud->batch;
+  int i, held;
+  if(b == NULL || b->held == 0)
+    return;
+  os_timer_disarm(&b->timer);
+  held = b->held;
+  b->held = 0;    // the callback may receive more or reconfigure
+
+  lua_State *L = lua_getstate();
+  if(b->cb_ref == LUA_NOREF || nud->self_ref == LUA_NOREF){
+    for(i=0;i<held;i++)
+      c_free(b->datagrams[i].data);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, b->cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);
+  lua_createtable(L, held, 0);    // datagrams
+  lua_createtable(L, held, 0);    // ips
+  lua_createtable(L, held, 0);    // ports
+  for(i=0;i<held;i++){
+    lnet_datagram *d = &b->datagrams[i];
+    char temp[20] = {0};
+    lua_pushlstring(L, d->data, d->len);
+    lua_rawseti(L, -4, i+1);
+    c_free(d->data);
+    d->data = NULL;
+    c_sprintf(temp, IPSTR, IP2STR(d->ip));
+    lua_pushstring(L, temp);
+    lua_rawseti(L, -3, i+1);
+    lua_pushinteger(L, d->port);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_call(L, 4, 0);
+}
+
+static void net_batch_timeout(void *arg)
+{
+  net_batch_flush((lnet_userdata *)arg);
+}
+
+static void net_batch_free(lua_State *L, lnet_userdata *nud)
+{
+  lnet_batch *b = nud->batch;
+  int i;
+  if(b == NULL)
+    return;
+  os_timer_disarm(&b->timer);
+  for(i=0;i<b->held;i++)
+    c_free(b->datagrams[i].data);
+  if(b->cb_ref != LUA_NOREF)
+    luaL_unref(L, LUA_REGISTRYINDEX, b->cb_ref);
+  c_free(b);
+  nud->batch = NULL;
+}
+
+static void net_batch_add(lnet_userdata *nud, char *pdata, unsigned short len)
+{
+  lnet_batch *b = nud->batch;
+  lnet_datagram *d = &b->datagrams[b->held];
+  remot_info *pr = NULL;
+
+  d->data = (char *)c_malloc(len);
+  if(d->data == NULL){
+    NODE_ERR("datagram dropped\n");
+    return;
+  }
+  c_memcpy(d->data, pdata, len);
+  d->len = len;
+  if(espconn_get_connection_info(nud->pesp_conn, &pr, 0) == ESPCONN_OK){
+    d->port = pr->remote_port;
+    c_memcpy(d->ip, pr->remote_ip, 4);
+  } else {
+    d->port = 0;
+    c_memset(d->ip, 0, 4);
+  }
+
+  if(++b->held >= b->count)
+    net_batch_flush(nud);
+  else if(b->held == 1 && b->interval)
+    os_timer_arm(&b->timer, b->interval, 0);
+}
+
 static void net_server_disconnected(void *arg)    // for tcp server only
 {
   NODE_DBG("net_server_disconnected is called.\n");
@@ -80,19 +210,18 @@ static void net_server_disconnected(void *arg)    // for tcp server only
     lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);  // pass the userdata(client) to callback func in lua
     lua_call(L, 1, 0);
   }
-  int i;
+  int i = nud->slot;
   lua_gc(L, LUA_GCSTOP, 0);
-  for(i=0;i<MAX_SOCKET;i++){
-    if( (LUA_NOREF!=socket[i]) && (socket[i] == nud->self_ref) ){
-      // found the saved client
-      nud->pesp_conn->reverse = NULL;
-      nud->pesp_conn = NULL;    // the espconn is made by low level sdk, do not need to free, delete() will not free it.
-      nud->self_ref = LUA_NOREF;   // unref this, and the net.socket userdata will delete it self
-      luaL_unref(L, LUA_REGISTRYINDEX, socket[i]);
-      socket[i] = LUA_NOREF;
-      socket_num--;
-      break;
-    }
+  if( i >= 0 && (LUA_NOREF!=socket[i]) && (socket[i] == nud->self_ref) ){
+    // release the saved client's slot
+    nud->pesp_conn->reverse = NULL;
+    nud->pesp_conn = NULL;    // the espconn is made by low level sdk, do not need to free, delete() will not free it.
+    nud->self_ref = LUA_NOREF;   // unref this, and the net.socket userdata will delete it self
+    nud->slot = -1;
+    luaL_unref(L, LUA_REGISTRYINDEX, socket[i]);
+    socket[i] = LUA_NOREF;
+    socket_free[socket_free_num++] = i;
+    socket_num--;
   }
   lua_gc(L, LUA_GCRESTART, 0);
 }
@@ -131,6 +260,7 @@ static void net_socket_disconnected(void *arg)    // tcp only
 static void net_server_reconnected(void *arg, sint8_t err)
 {
   NODE_DBG("net_server_reconnected is called.\n");
+  tcpserver_dropped++;
   net_server_disconnected(arg);
 }
 
@@ -149,22 +279,93 @@ static void net_socket_received(void *arg, char *pdata, unsigned short len)
   lnet_userdata *nud = (lnet_userdata *)pesp_conn->reverse;
   if(nud == NULL)
     return;
+  if(nud->batch){
+    net_batch_add(nud, pdata, len);
+    return;
+  }
   if(nud->cb_receive_ref == LUA_NOREF)
     return;
   if(nud->self_ref == LUA_NOREF)
     return;
   lua_State *L = lua_getstate();
+  if(nud->rxbuf_ref != LUA_NOREF){
+    // lend the SDK's buffer to lua for the duration of the callback only.
+    // the socket and the buffer stay on the stack until we are done with them:
+    // the callback may drop their refs by closing the socket or switching the
+    // receive mode back to strings, and a collection would then free them
+    int ref = nud->rxbuf_ref;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lnet_rxbuf *buf = (lnet_rxbuf *)lua_touserdata(L, -1);
+    buf->data = pdata;
+    buf->len = len;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, nud->cb_receive_ref);
+    lua_pushvalue(L, -3);  // pass the userdata(server) to callback func in lua
+    lua_pushvalue(L, -3);
+    lua_call(L, 2, 0);
+    if(buf->owned){
+      // retained, lua holds it now. the next receive needs a fresh one
+      if(nud->rxbuf_ref == ref){
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        nud->rxbuf_ref = net_rxbuf_new(L);
+      }
+    }else{
+      buf->data = NULL;
+      buf->len = 0;
+    }
+    lua_pop(L, 2);
+    return;
+  }
   lua_rawgeti(L, LUA_REGISTRYINDEX, nud->cb_receive_ref);
   lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);  // pass the userdata(server) to callback func in lua
-  // expose_array(L, pdata, len);
-  // *(pdata+len) = 0;
-  // NODE_DBG(pdata);
-  // NODE_DBG("\n");
   lua_pushlstring(L, pdata, len);
-  // lua_pushinteger(L, len);
   lua_call(L, 2, 0);
 }
 
+// the lwIP connection behind a tcp espconn, NULL when not connected.
+// espconn keeps its pcb private, so match the connection's addresses instead
+static struct tcp_pcb *net_tcp_pcb(struct espconn *pesp_conn)
+{
+  struct tcp_pcb *pcb;
+  esp_tcp *tcp;
+  if(pesp_conn == NULL || pesp_conn->type != ESPCONN_TCP || pesp_conn->proto.tcp == NULL)
+    return NULL;
+  tcp = pesp_conn->proto.tcp;
+  for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next){
+    if(pcb->local_port == tcp->local_port && pcb->remote_port == tcp->remote_port &&
+       c_memcmp(&pcb->remote_ip.addr, tcp->remote_ip, 4) == 0)
+      return pcb;
+  }
+  return NULL;
+}
+
+// bytes handed to lwIP but not acknowledged by the peer yet
+#define net_tcp_queued(pcb) ((uint32_t)((pcb)->snd_lbb - (pcb)->lastack))
+
+// call the watermark callback when the send queue crosses high, or drains to low
+static void net_watermark_check(lnet_userdata *nud)
+{
+  struct tcp_pcb *pcb;
+  uint32_t queued;
+  if(nud->cb_watermark_ref == LUA_NOREF || nud->self_ref == LUA_NOREF)
+    return;
+  if((pcb = net_tcp_pcb(nud->pesp_conn)) == NULL)
+    return;
+  queued = net_tcp_queued(pcb);
+  if(!nud->wm_above && queued >= nud->wm_high)
+    nud->wm_above = 1;
+  else if(nud->wm_above && queued <= nud->wm_low)
+    nud->wm_above = 0;
+  else
+    return;
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, nud->cb_watermark_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);
+  lua_pushboolean(L, nud->wm_above);
+  lua_pushinteger(L, queued);
+  lua_call(L, 3, 0);
+}
+
 static void net_socket_sent(void *arg)
 {
   // NODE_DBG("net_socket_sent is called.\n");
@@ -174,6 +375,7 @@ static void net_socket_sent(void *arg)
   lnet_userdata *nud = (lnet_userdata *)pesp_conn->reverse;
   if(nud == NULL)
     return;
+  net_watermark_check(nud);
   if(nud->cb_send_ref == LUA_NOREF)
     return;
   if(nud->self_ref == LUA_NOREF)
@@ -261,16 +463,11 @@ static void net_server_connected(void *arg) // for tcp only
   NODE_DBG(" connected.\n");
 #endif
 
-  for(i=0;i<MAX_SOCKET;i++){
-    if(socket[i] == LUA_NOREF)  // found empty slot
-    {
-      break;
-    }
-  }
-  if(i>=MAX_SOCKET) // can't create more socket
+  if(socket_num >= tcp_server_maxconn || socket_free_num == 0) // can't create more socket
   {
     NODE_ERR("MAX_SOCKET\n");
-    pesp_conn->reverse = NULL;    // not accept this conn
+    tcpserver_dropped++;
+    pesp_conn->reverse = NULL;    // not accept this conn, close it in order rather than reset it
     if(pesp_conn->proto.tcp->remote_port || pesp_conn->proto.tcp->local_port)
       espconn_disconnect(pesp_conn);
     return;
@@ -296,8 +493,11 @@ static void net_server_connected(void *arg) // for tcp only
   skt->self_ref = LUA_NOREF;
   lua_pushvalue(L, -1);  // copy the top of stack
   skt->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);    // ref to it self, for module api to find the userdata
+  i = socket_free[--socket_free_num];
   socket[i] = skt->self_ref;  // save to socket array
+  skt->slot = i;
   socket_num++;
+  tcpserver_accepted++;
   skt->cb_connect_ref = LUA_NOREF;  // this socket already connected
   skt->cb_reconnect_ref = LUA_NOREF;
   skt->cb_disconnect_ref = LUA_NOREF;
@@ -305,6 +505,10 @@ static void net_server_connected(void *arg) // for tcp only
   skt->cb_receive_ref = LUA_NOREF;
   skt->cb_send_ref = LUA_NOREF;
   skt->cb_dns_found_ref = LUA_NOREF;
+  skt->batch = NULL;
+  skt->rxbuf_ref = LUA_NOREF;
+  skt->cb_watermark_ref = LUA_NOREF;
+  skt->wm_above = 0;
 
 #ifdef CLIENT_SSL_ENABLE
   skt->secure = 0;    // as a server SSL is not supported.
@@ -400,6 +604,17 @@ static int net_create( lua_State* L, const char* mt )
     } else {
       tcp_server_timeover = 30; // default to 30
     }
+    if ( lua_isnumber(L, stack) )
+    {
+      unsigned maxconn = lua_tointeger(L, stack);
+      stack++;
+      if ( maxconn < 1 || maxconn > MAX_SOCKET ){
+        return luaL_error( L, "wrong arg range" );
+      }
+      tcp_server_maxconn = maxconn;
+    } else {
+      tcp_server_maxconn = DEFAULT_MAX_CONN;
+    }
   }
 
   // create a object
@@ -412,6 +627,11 @@ static int net_create( lua_State* L, const char* mt )
   nud->cb_receive_ref = LUA_NOREF;
   nud->cb_send_ref = LUA_NOREF;
   nud->cb_dns_found_ref = LUA_NOREF;
+  nud->batch = NULL;
+  nud->rxbuf_ref = LUA_NOREF;
+  nud->cb_watermark_ref = LUA_NOREF;
+  nud->slot = -1;
+  nud->wm_above = 0;
   nud->pesp_conn = NULL;
 #ifdef CLIENT_SSL_ENABLE
   nud->secure = secure;
@@ -556,6 +776,15 @@ static int net_delete( lua_State* L, const char* mt )
     luaL_unref(L, LUA_REGISTRYINDEX, nud->cb_dns_found_ref);
     nud->cb_dns_found_ref = LUA_NOREF;
   }
+  net_batch_free(L, nud);
+  if(LUA_NOREF!=nud->rxbuf_ref){
+    luaL_unref(L, LUA_REGISTRYINDEX, nud->rxbuf_ref);
+    nud->rxbuf_ref = LUA_NOREF;
+  }
+  if(LUA_NOREF!=nud->cb_watermark_ref){
+    luaL_unref(L, LUA_REGISTRYINDEX, nud->cb_watermark_ref);
+    nud->cb_watermark_ref = LUA_NOREF;
+  }
   lua_gc(L, LUA_GCSTOP, 0);
   if(LUA_NOREF!=nud->self_ref){
     luaL_unref(L, LUA_REGISTRYINDEX, nud->self_ref);
@@ -770,6 +999,8 @@ static int net_start( lua_State* L, const char* mt )
   if( pesp_conn->type == ESPCONN_TCP )
   {
     if(isserver){   // no secure server support for now
+      tcpserver_accepted = 0;
+      tcpserver_dropped = 0;
       espconn_regist_connectcb(pesp_conn, net_server_connected);
       // tcp server, SSL is not supported
 #ifdef CLIENT_SSL_ENABLE
@@ -779,6 +1010,12 @@ static int net_start( lua_State* L, const char* mt )
 #endif
         espconn_accept(pesp_conn);    // if it's a server, no need to dns.
         espconn_regist_time(pesp_conn, tcp_server_timeover, 0);
+        // let espconn accept one more than the limit, so that one is refused in order
+        // by net_server_connected instead of being reset by lwIP
+        int allow = tcp_server_maxconn < MAX_SOCKET ? tcp_server_maxconn + 1 : MAX_SOCKET;
+        if(espconn_tcp_get_max_con() < allow)
+          espconn_tcp_set_max_con(allow);
+        espconn_tcp_set_max_con_allow(pesp_conn, allow);
     }
     else{
       espconn_regist_connectcb(pesp_conn, net_socket_connected);
@@ -908,6 +1145,10 @@ static int net_close( lua_State* L, const char* mt )
         if(skt->pesp_conn->proto.tcp->remote_port || skt->pesp_conn->proto.tcp->local_port)
           espconn_delete(skt->pesp_conn);
 
+        // deliver what was held back while self is still referenced
+        net_batch_flush(skt);
+        net_batch_free(L, skt);
+
         // a udp server/socket unref it self here. not in disconnect.
         if(LUA_NOREF!=skt->self_ref){    // for a udp self_ref is NOREF
           luaL_unref(L, LUA_REGISTRYINDEX, skt->self_ref);
@@ -984,6 +1225,18 @@ static int net_on( lua_State* L, const char* mt )
     if(nud->cb_receive_ref != LUA_NOREF)
       luaL_unref(L, LUA_REGISTRYINDEX, nud->cb_receive_ref);
     nud->cb_receive_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    // optional 4th argument "buffer" passes a net.rxbuf instead of a string
+    const char *mode = luaL_optstring( L, 4, "string" );
+    if(c_strcmp(mode, "buffer") == 0){
+      if(nud->rxbuf_ref == LUA_NOREF)
+        nud->rxbuf_ref = net_rxbuf_new(L);
+    }else if(c_strcmp(mode, "string") == 0){
+      if(nud->rxbuf_ref != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, nud->rxbuf_ref);
+      nud->rxbuf_ref = LUA_NOREF;
+    }else{
+      return luaL_error( L, "wrong receive mode" );
+    }
   }else if((!isserver || nud->pesp_conn->type == ESPCONN_UDP) && sl == 4 && c_strcmp(method, "sent") == 0){
     if(nud->cb_send_ref != LUA_NOREF)
       luaL_unref(L, LUA_REGISTRYINDEX, nud->cb_send_ref);
@@ -1073,9 +1326,250 @@ static int net_send( lua_State* L, const char* mt )
 #endif
     espconn_sent(pesp_conn, (unsigned char *)payload, l);
 
+  if(pesp_conn->type == ESPCONN_TCP)
+    net_watermark_check(nud);
   return 0;  
 }
 
+// Lua: socket:stats()
+static int net_socket_stats( lua_State* L )
+{
+  lnet_userdata *nud;
+  struct tcp_pcb *pcb;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, "net.socket");
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  if(nud->pesp_conn->type != ESPCONN_TCP)
+    return luaL_error( L, "tcp only" );
+  if((pcb = net_tcp_pcb(nud->pesp_conn)) == NULL)
+    return 0;
+
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, tcp_sndbuf(pcb));
+  lua_setfield(L, -2, "sndbuf");
+  lua_pushinteger(L, pcb->snd_queuelen);
+  lua_setfield(L, -2, "sndqueue");
+  lua_pushinteger(L, net_tcp_queued(pcb));
+  lua_setfield(L, -2, "queued");
+  lua_pushinteger(L, pcb->snd_nxt - pcb->lastack);
+  lua_setfield(L, -2, "unacked");
+  lua_pushinteger(L, pcb->nrtx);
+  lua_setfield(L, -2, "retransmits");
+  // sa and sv hold the smoothed rtt and its deviation scaled by 8 and 4, in slow timer ticks
+  lua_pushinteger(L, (pcb->sa >> 3) * TCP_SLOW_INTERVAL);
+  lua_setfield(L, -2, "rtt");
+  lua_pushinteger(L, (pcb->sv >> 2) * TCP_SLOW_INTERVAL);
+  lua_setfield(L, -2, "rttvar");
+  lua_pushinteger(L, pcb->rto * TCP_SLOW_INTERVAL);
+  lua_setfield(L, -2, "rto");
+  lua_pushinteger(L, pcb->rtime >= 0 ? pcb->rtime * TCP_SLOW_INTERVAL : -1);
+  lua_setfield(L, -2, "rtime");
+  return 1;
+}
+
+// Lua: socket:settimeout( seconds )
+static int net_socket_settimeout( lua_State* L )
+{
+  lnet_userdata *nud;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, "net.socket");
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  if(nud->slot < 0)
+    return luaL_error( L, "server connections only" );
+
+  unsigned to = luaL_checkinteger( L, 2 );
+  if ( to < 1 || to > 28800 )
+    return luaL_error( L, "wrong arg range" );
+  // espconn checks the idle time of all server connections from the lwIP slow timer
+  espconn_regist_time(nud->pesp_conn, to, 1);
+  return 0;
+}
+
+// Lua: socket:watermark( low, high, function(socket, above, queued) )
+// Lua: socket:watermark()
+static int net_socket_watermark( lua_State* L )
+{
+  lnet_userdata *nud;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, "net.socket");
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  if(nud->pesp_conn->type != ESPCONN_TCP)
+    return luaL_error( L, "tcp only" );
+
+  if(nud->cb_watermark_ref != LUA_NOREF)
+    luaL_unref(L, LUA_REGISTRYINDEX, nud->cb_watermark_ref);
+  nud->cb_watermark_ref = LUA_NOREF;
+  nud->wm_above = 0;
+  if(lua_isnoneornil(L, 2))
+    return 0;
+
+  unsigned low = luaL_checkinteger( L, 2 );
+  unsigned high = luaL_checkinteger( L, 3 );
+  if ( low >= high || high > 0xffff )
+    return luaL_error( L, "wrong arg range" );
+  luaL_checkanyfunction(L, 4);
+  lua_pushvalue(L, 4);
+  nud->cb_watermark_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  nud->wm_low = low;
+  nud->wm_high = high;
+
+  net_watermark_check(nud);
+  return 0;
+}
+
+// Lua: server:stats()
+static int net_server_stats( lua_State* L )
+{
+  lnet_userdata *nud;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, "net.server");
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  if(nud->pesp_conn->type != ESPCONN_TCP)
+    return luaL_error( L, "tcp only" );
+
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, tcpserver_accepted);
+  lua_setfield(L, -2, "accepted");
+  lua_pushinteger(L, socket_num);
+  lua_setfield(L, -2, "active");
+  lua_pushinteger(L, tcpserver_dropped);
+  lua_setfield(L, -2, "dropped");
+  return 1;
+}
+
+// Lua: udpserver/udpsocket:sendto( { {port, ip, string} or string, ... } )
+static int net_sendto( lua_State* L, const char* mt )
+{
+  struct espconn *pesp_conn = NULL;
+  lnet_userdata *nud;
+  int n, i, sent = 0;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, mt);
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  pesp_conn = nud->pesp_conn;
+  if(pesp_conn->type != ESPCONN_UDP)
+    return luaL_error( L, "udp only" );
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  // plain strings go to the current peer
+  esp_udp *udp = pesp_conn->proto.udp;
+  int peer_port = udp->remote_port;
+  uint8_t peer_ip[4];
+  c_memcpy(peer_ip, udp->remote_ip, 4);
+  if (c_strcmp(mt, "net.server") == 0)
+  {
+    remot_info *pr = 0;
+    if (espconn_get_connection_info (pesp_conn, &pr, 0) == ESPCONN_OK) {
+      peer_port = pr->remote_port;
+      c_memcpy(peer_ip, pr->remote_ip, 4);
+    } else {
+      peer_port = 0;
+    }
+  }
+
+  // one sent callback for the whole batch
+  espconn_regist_sentcb(pesp_conn, NULL);
+  n = lua_objlen(L, 2);
+  for(i=1;i<=n;i++){
+    const char *payload;
+    size_t l = 0;
+    lua_rawgeti(L, 2, i);
+    if(lua_istable(L, -1)){
+      lua_rawgeti(L, -1, 1);
+      int port = lua_tointeger(L, -1);
+      lua_rawgeti(L, -2, 2);
+      const char *ip = lua_tostring(L, -1);
+      ip_addr_t ipaddr;
+      ipaddr.addr = ip ? ipaddr_addr(ip) : IPADDR_NONE;
+      if(ipaddr.addr == IPADDR_NONE && (ip == NULL || c_strcmp(ip, "255.255.255.255") != 0))
+        port = 0;    // not an address
+      lua_rawgeti(L, -3, 3);
+      payload = lua_tolstring(L, -1, &l);
+      udp->remote_port = port;
+      c_memcpy(udp->remote_ip, &ipaddr.addr, 4);
+    } else {
+      payload = lua_tolstring(L, -1, &l);
+      udp->remote_port = peer_port;
+      c_memcpy(udp->remote_ip, peer_ip, 4);
+    }
+    if(payload && l > 0 && l <= 1460 && udp->remote_port != 0 &&
+       espconn_sent(pesp_conn, (unsigned char *)payload, l) == ESPCONN_OK)
+      sent++;
+    lua_settop(L, 2);
+  }
+  udp->remote_port = peer_port;
+  c_memcpy(udp->remote_ip, peer_ip, 4);
+  espconn_regist_sentcb(pesp_conn, net_socket_sent);
+
+  if(sent && nud->cb_send_ref != LUA_NOREF && nud->self_ref != LUA_NOREF){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, nud->cb_send_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, nud->self_ref);
+    lua_call(L, 1, 0);
+  }
+  lua_pushinteger(L, sent);
+  return 1;
+}
+
+// Lua: udpserver/udpsocket:batch( count, interval, function(s, datagrams, ips, ports) )
+// Lua: udpserver/udpsocket:batch()
+static int net_batch( lua_State* L, const char* mt )
+{
+  lnet_userdata *nud;
+  lnet_batch *b;
+
+  nud = (lnet_userdata *)luaL_checkudata(L, 1, mt);
+  luaL_argcheck(L, nud, 1, "Server/Socket expected");
+  if(nud==NULL || nud->pesp_conn == NULL){
+    NODE_DBG("nud->pesp_conn is NULL.\n");
+    return 0;
+  }
+  if(nud->pesp_conn->type != ESPCONN_UDP)
+    return luaL_error( L, "udp only" );
+
+  net_batch_flush(nud);
+  net_batch_free(L, nud);
+  if(lua_isnoneornil(L, 2))
+    return 0;
+
+  unsigned count = luaL_checkinteger( L, 2 );
+  unsigned interval = luaL_checkinteger( L, 3 );
+  if ( count < 1 || count > NET_BATCH_MAX || interval > 60000 )
+    return luaL_error( L, "wrong arg range" );
+  luaL_checkanyfunction(L, 4);
+
+  b = (lnet_batch *)c_zalloc(sizeof(lnet_batch) + count * sizeof(lnet_datagram));
+  if(!b)
+    return luaL_error(L, "not enough memory");
+  b->count = count;
+  b->interval = interval;
+  lua_pushvalue(L, 4);
+  b->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  os_timer_setfn(&b->timer, net_batch_timeout, nud);
+  nud->batch = b;
+
+  return 0;
+}
+
 // Lua: socket:dns( string, function(socket, ip) )
 static int net_dns( lua_State* L, const char* mt )
 {
@@ -1243,6 +1737,20 @@ static int net_udpserver_send( lua_State* L )
   return net_send(L, mt);;
 }
 
+// Lua: udpserver:sendto( { {port, ip, string} or string, ... } )
+static int net_udpserver_sendto( lua_State* L )
+{
+  const char *mt = "net.server";
+  return net_sendto(L, mt);
+}
+
+// Lua: udpserver:batch( count, interval, function(s, datagrams, ips, ports) )
+static int net_udpserver_batch( lua_State* L )
+{
+  const char *mt = "net.server";
+  return net_batch(L, mt);
+}
+
 // Lua: s = net.createConnection(type, function(conn))
 static int net_createConnection( lua_State* L )
 {
@@ -1358,6 +1866,20 @@ static int net_socket_getpeer( lua_State* L )
   return 2;
 }
 
+// Lua: socket:sendto( { {port, ip, string} or string, ... } )
+static int net_socket_sendto( lua_State* L )
+{
+  const char *mt = "net.socket";
+  return net_sendto(L, mt);
+}
+
+// Lua: socket:batch( count, interval, function(s, datagrams, ips, ports) )
+static int net_socket_batch( lua_State* L )
+{
+  const char *mt = "net.socket";
+  return net_batch(L, mt);
+}
+
 // Lua: socket:dns( string, function(ip) )
 static int net_socket_dns( lua_State* L )
 {
@@ -1415,13 +1937,6 @@ static int net_multicastLeave( lua_State* L )
 
 // Returns NULL on success, error message otherwise
 static const char *append_pem_blob(const char *pem, const char *type, uint8_t **buffer_p, uint8_t *buffer_limit, const char *name) {
-  char unb64[256];
-  memset(unb64, 0xff, sizeof(unb64));
-  int i;
-  for (i = 0; i < 64; i++) {
-    unb64["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
-  }
-
   if (!pem) {
     return "No PEM blob";
   }
@@ -1449,36 +1964,34 @@ static const char *append_pem_blob(const char *pem, const char *type, uint8_t **
   uint8_t *buffer = *buffer_p;
 
   uint8_t *dest = buffer + 32 + 2;  // Leave space for name and length
-  int bitcount = 0;
-  int accumulator = 0;
-  for (; *pem && dest < buffer_limit; pem++) {
-    int val = unb64[*(uint8_t*) pem];
-    if (val & 0xC0) {
-      // not a base64 character
-      if (isspace(*(uint8_t*) pem)) {
-	continue;
-      }
-      if (*pem == '=') {
-	// just ignore -- at the end
-	bitcount = 0;
-	continue;
-      }
-      if (*pem == '-') {
-	break;
-      }
+  codec_ctx_t ctx;
+  codec_init(&ctx, CODEC_BASE64);
+  for (;;) {
+    // decode a line at a time, up to the "-----END" line
+    while (isspace(*(uint8_t*) pem)) {
+      pem++;
+    }
+    const char *line = pem;
+    while (*pem && *pem != '-' && !isspace(*(uint8_t*) pem)) {
+      pem++;
+    }
+    if (pem == line) {
+      break;
+    }
+    if (dest + codec_decoded_len(CODEC_BASE64, pem - line) + 2 >= buffer_limit) {
+      return "Invalid PEM format data";
+    }
+    int n = codec_decode_update(&ctx, line, pem - line, dest);
+    if (n < 0) {
       return "Invalid character in PEM";
-    } else {
-      bitcount += 6;
-      accumulator = (accumulator << 6) + val;
-      if (bitcount >= 8) {
-	bitcount -= 8;
-	*dest++ = accumulator >> bitcount;
-      }
     }
+    dest += n;
   }
-  if (dest >= buffer_limit || strncmp(pem, "-----END ", 9) || strncmp(pem + 9, type, strlen(type)) || bitcount) {
+  int n = codec_decode_final(&ctx, dest);
+  if (n < 0 || strncmp(pem, "-----END ", 9) || strncmp(pem + 9, type, strlen(type))) {
     return "Invalid PEM format data";
   }
+  dest += n;
   size_t len = dest - (buffer + 32 + 2);
 
   memset(buffer, 0, 32);
@@ -1653,6 +2166,30 @@ static int net_getdnsserver( lua_State* L )
   return 1;
 }
 
+// Lua: s = net.dns.stats()
+static int net_dns_stats( lua_State* L )
+{
+  struct dns_stats stats;
+  dns_getstats(&stats);
+
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, stats.negative_hits);
+  lua_setfield(L, -2, "negative_hits");
+  lua_pushinteger(L, stats.coalesced);
+  lua_setfield(L, -2, "coalesced");
+  lua_pushinteger(L, stats.queries);
+  lua_setfield(L, -2, "queries");
+  lua_pushinteger(L, stats.timeouts);
+  lua_setfield(L, -2, "timeouts");
+  lua_pushinteger(L, stats.cached);
+  lua_setfield(L, -2, "cached");
+  return 1;
+}
+
 #if 0
 static int net_array_index( lua_State* L )
 {
@@ -1681,12 +2218,148 @@ static int expose_array(lua_State* L, char *array, unsigned short len) {
 }
 #endif
 
+// create an empty net.rxbuf and return a registry reference to it
+static int net_rxbuf_new(lua_State* L)
+{
+  lnet_rxbuf *buf = (lnet_rxbuf *)lua_newuserdata(L, sizeof(lnet_rxbuf));
+  buf->data = NULL;
+  buf->len = 0;
+  buf->owned = 0;
+  luaL_getmetatable(L, "net.rxbuf");
+  lua_setmetatable(L, -2);
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static lnet_rxbuf *net_rxbuf_check(lua_State* L)
+{
+  lnet_rxbuf *buf = (lnet_rxbuf *)luaL_checkudata(L, 1, "net.rxbuf");
+  luaL_argcheck(L, buf, 1, "net.rxbuf expected");
+  if(buf->data == NULL)
+    luaL_error(L, "buffer released");
+  return buf;
+}
+
+// translate a relative position the way string functions do
+static ptrdiff_t net_rxbuf_pos(ptrdiff_t pos, size_t len)
+{
+  if(pos < 0) pos += (ptrdiff_t)len + 1;
+  return (pos >= 0) ? pos : 0;
+}
+
+// Lua: buf:len(), #buf
+static int net_rxbuf_len( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  lua_pushinteger(L, buf->len);
+  return 1;
+}
+
+// Lua: buf:tostring(), tostring(buf)
+static int net_rxbuf_tostring( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  lua_pushlstring(L, buf->data, buf->len);
+  return 1;
+}
+
+// Lua: buf:byte([i [, j]])
+static int net_rxbuf_byte( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  ptrdiff_t i = net_rxbuf_pos(luaL_optinteger(L, 2, 1), buf->len);
+  ptrdiff_t j = net_rxbuf_pos(luaL_optinteger(L, 3, i), buf->len);
+  int n;
+  if(i <= 0) i = 1;
+  if((size_t)j > buf->len) j = buf->len;
+  if(i > j) return 0;
+  n = (int)(j - i + 1);
+  luaL_checkstack(L, n, "buffer slice too long");
+  for(; i <= j; i++)
+    lua_pushinteger(L, (uint8_t)buf->data[i-1]);
+  return n;
+}
+
+// Lua: buf:sub(i [, j])
+static int net_rxbuf_sub( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  ptrdiff_t i = net_rxbuf_pos(luaL_checkinteger(L, 2), buf->len);
+  ptrdiff_t j = net_rxbuf_pos(luaL_optinteger(L, 3, -1), buf->len);
+  if(i < 1) i = 1;
+  if((size_t)j > buf->len) j = buf->len;
+  if(i <= j)
+    lua_pushlstring(L, buf->data + i - 1, j - i + 1);
+  else
+    lua_pushliteral(L, "");
+  return 1;
+}
+
+// Lua: buf:find(string [, init]), plain text only
+static int net_rxbuf_find( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  size_t sl;
+  const char *s = luaL_checklstring(L, 2, &sl);
+  ptrdiff_t init = net_rxbuf_pos(luaL_optinteger(L, 3, 1), buf->len) - 1;
+  const char *p, *end;
+  if(init < 0) init = 0;
+  if((size_t)init > buf->len || sl > buf->len - init){
+    lua_pushnil(L);
+    return 1;
+  }
+  if(sl == 0){
+    lua_pushinteger(L, init + 1);
+    lua_pushinteger(L, init);
+    return 2;
+  }
+  end = buf->data + buf->len - sl;
+  for(p = buf->data + init; p <= end; p++){
+    if(*p == s[0] && c_memcmp(p, s, sl) == 0){
+      lua_pushinteger(L, p - buf->data + 1);
+      lua_pushinteger(L, p - buf->data + sl);
+      return 2;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+// Lua: buf:retain(), keeps the data past the receive callback
+static int net_rxbuf_retain( lua_State* L )
+{
+  lnet_rxbuf *buf = net_rxbuf_check(L);
+  if(!buf->owned){
+    char *copy = (char *)c_malloc(buf->len ? buf->len : 1);
+    if(copy == NULL)
+      return luaL_error(L, "not enough memory");
+    c_memcpy(copy, buf->data, buf->len);
+    buf->data = copy;
+    buf->owned = 1;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int net_rxbuf_delete( lua_State* L )
+{
+  lnet_rxbuf *buf = (lnet_rxbuf *)luaL_checkudata(L, 1, "net.rxbuf");
+  if(buf && buf->owned){
+    c_free((char *)buf->data);
+    buf->data = NULL;
+    buf->owned = 0;
+  }
+  return 0;
+}
+
 // Module function map
 static const LUA_REG_TYPE net_server_map[] = {
   { LSTRKEY( "listen" ),  LFUNCVAL( net_server_listen ) },
   { LSTRKEY( "close" ),   LFUNCVAL( net_server_close ) },
   { LSTRKEY( "on" ),      LFUNCVAL( net_udpserver_on ) },
   { LSTRKEY( "send" ),    LFUNCVAL( net_udpserver_send ) },
+  { LSTRKEY( "sendto" ),  LFUNCVAL( net_udpserver_sendto ) },
+  { LSTRKEY( "batch" ),   LFUNCVAL( net_udpserver_batch ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( net_server_stats ) },
 //{ LSTRKEY( "delete" ),  LFUNCVAL( net_server_delete ) },
   { LSTRKEY( "__gc" ),    LFUNCVAL( net_server_delete ) },
   { LSTRKEY( "__index" ), LROVAL( net_server_map ) },
@@ -1698,6 +2371,11 @@ static const LUA_REG_TYPE net_socket_map[] = {
   { LSTRKEY( "close" ),   LFUNCVAL( net_socket_close ) },
   { LSTRKEY( "on" ),      LFUNCVAL( net_socket_on ) },
   { LSTRKEY( "send" ),    LFUNCVAL( net_socket_send ) },
+  { LSTRKEY( "sendto" ),  LFUNCVAL( net_socket_sendto ) },
+  { LSTRKEY( "batch" ),   LFUNCVAL( net_socket_batch ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( net_socket_stats ) },
+  { LSTRKEY( "watermark" ), LFUNCVAL( net_socket_watermark ) },
+  { LSTRKEY( "settimeout" ), LFUNCVAL( net_socket_settimeout ) },
   { LSTRKEY( "hold" ),    LFUNCVAL( net_socket_hold ) },
   { LSTRKEY( "unhold" ),  LFUNCVAL( net_socket_unhold ) },
   { LSTRKEY( "dns" ),     LFUNCVAL( net_socket_dns ) },
@@ -1707,6 +2385,20 @@ static const LUA_REG_TYPE net_socket_map[] = {
   { LSTRKEY( "__index" ), LROVAL( net_socket_map ) },
   { LNILKEY, LNILVAL }
 };
+static const LUA_REG_TYPE net_rxbuf_map[] = {
+  { LSTRKEY( "byte" ),       LFUNCVAL( net_rxbuf_byte ) },
+  { LSTRKEY( "find" ),       LFUNCVAL( net_rxbuf_find ) },
+  { LSTRKEY( "sub" ),        LFUNCVAL( net_rxbuf_sub ) },
+  { LSTRKEY( "len" ),        LFUNCVAL( net_rxbuf_len ) },
+  { LSTRKEY( "tostring" ),   LFUNCVAL( net_rxbuf_tostring ) },
+  { LSTRKEY( "retain" ),     LFUNCVAL( net_rxbuf_retain ) },
+  { LSTRKEY( "__len" ),      LFUNCVAL( net_rxbuf_len ) },
+  { LSTRKEY( "__tostring" ), LFUNCVAL( net_rxbuf_tostring ) },
+  { LSTRKEY( "__gc" ),       LFUNCVAL( net_rxbuf_delete ) },
+  { LSTRKEY( "__index" ),    LROVAL( net_rxbuf_map ) },
+  { LNILKEY, LNILVAL }
+};
+
 #if 0
 static const LUA_REG_TYPE net_array_map[] = {
   { LSTRKEY( "__index" ),    LFUNCVAL( net_array_index ) },
@@ -1727,6 +2419,7 @@ static const LUA_REG_TYPE net_dns_map[] = {
   { LSTRKEY( "setdnsserver" ), LFUNCVAL( net_setdnsserver ) },  
   { LSTRKEY( "getdnsserver" ), LFUNCVAL( net_getdnsserver ) }, 
   { LSTRKEY( "resolve" ),      LFUNCVAL( net_dns_static ) },  
+  { LSTRKEY( "stats" ),        LFUNCVAL( net_dns_stats ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -1750,10 +2443,13 @@ int luaopen_net( lua_State *L ) {
   for(i=0;i<MAX_SOCKET;i++)
   {
     socket[i] = LUA_NOREF;
+    socket_free[i] = MAX_SOCKET - 1 - i;
   }
+  socket_free_num = MAX_SOCKET;
 
   luaL_rometatable(L, "net.server", (void *)net_server_map);  // create metatable for net.server
   luaL_rometatable(L, "net.socket", (void *)net_socket_map);  // create metatable for net.socket
+  luaL_rometatable(L, "net.rxbuf", (void *)net_rxbuf_map);    // create metatable for net.rxbuf
   #if 0
   luaL_rometatable(L, "net.array", (void *)net_array_map);    // create metatable for net.array
   #endif
@@ -25,6 +25,9 @@
 ** f - float
 ** d - double
 ** ' ' - ignored
+**
+** struct.compile(fmt) parses a format once into a "struct.fmt" object
+** that the functions below accept instead of the format string.
 */
 
 
@@ -93,6 +96,25 @@ typedef struct Header {
 } Header;
 
 
+/* one option of a compiled format */
+typedef struct Field {
+  char opt;
+  unsigned char endian;
+  unsigned char align;  /* alignment of the field, 1 for none */
+  size_t size;
+} Field;
+
+typedef struct Compiled {
+  int nfields;
+  int fixed;            /* no 's' or 'c0', so 'size' is the total size */
+  size_t size;
+  size_t maxalign;
+  Field fields[1];
+} Compiled;
+
+#define COMPILED_MT "struct.fmt"
+
+
 static int getnum (const char **fmt, int df) {
   if (!isdigit(**fmt))  /* no number? */
     return df;  /* return default value */
@@ -134,15 +156,42 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
 }
 
 
+/*
+** return the alignment of an element of size 'size'
+*/
+static size_t getalign (Header *h, int opt, size_t size) {
+  if (size == 0 || opt == 'c') return 1;
+  if (size > (size_t)h->align)
+    size = h->align;  /* respect max. alignment */
+  return size;
+}
+
+
+#define padding(len, align)  (((align) - ((len) & ((align) - 1))) & ((align) - 1))
+
+
 /*
 ** return number of bytes needed to align an element of size 'size'
 ** at current position 'len'
 */
 static int gettoalign (size_t len, Header *h, int opt, size_t size) {
-  if (size == 0 || opt == 'c') return 0;
-  if (size > (size_t)h->align)
-    size = h->align;  /* respect max. alignment */
-  return (size - (len & (size - 1))) & (size - 1);
+  size_t align = getalign(h, opt, size);
+  return padding(len, align);
+}
+
+
+/* does 'opt' produce or take a value (or padding)? */
+static int isfield (int opt) {
+  switch (opt) {
+    case 'b': case 'B': case 'h': case 'H': case 'l': case 'L':
+    case 'T': case 'i': case 'I': case 'x': case 'c': case 's':
+#ifndef LUA_NUMBER_INTEGRAL
+    case 'f': case 'd':
+#endif
+      return 1;
+    default:
+      return 0;
+  }
 }
 
 
@@ -209,12 +258,81 @@ static void correctbytes (char *b, int size, int endian) {
 }
 
 
+/*
+** pack one field from argument 'arg', returns its packed size
+*/
+static size_t packfield (lua_State *L, luaL_Buffer *b, int opt, size_t size,
+                         int endian, int arg) {
+  switch (opt) {
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'T': case 'i': case 'I': {  /* integer types */
+      putinteger(L, b, arg, endian, size);
+      break;
+    }
+    case 'x': {
+      luaL_addchar(b, '\0');
+      break;
+    }
+#ifndef LUA_NUMBER_INTEGRAL
+    case 'f': {
+      float f = (float)luaL_checknumber(L, arg);
+      correctbytes((char *)&f, size, endian);
+      luaL_addlstring(b, (char *)&f, size);
+      break;
+    }
+    case 'd': {
+      double d = luaL_checknumber(L, arg);
+      correctbytes((char *)&d, size, endian);
+      luaL_addlstring(b, (char *)&d, size);
+      break;
+    }
+#endif
+    case 'c': case 's': {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      if (size == 0) size = l;
+      luaL_argcheck(L, l >= (size_t)size, arg + 1, "string too short");
+      luaL_addlstring(b, s, size);
+      if (opt == 's') {
+        luaL_addchar(b, '\0');  /* add zero at the end */
+        size++;
+      }
+      break;
+    }
+  }
+  return size;
+}
+
+
+static int c_pack (lua_State *L, Compiled *c) {
+  luaL_Buffer b;
+  int arg = 2;
+  size_t totalsize = 0;
+  int i;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  for (i = 0; i < c->nfields; i++) {
+    Field *f = &c->fields[i];
+    int toalign = padding(totalsize, f->align);
+    totalsize += toalign;
+    while (toalign-- > 0) luaL_addchar(&b, '\0');
+    totalsize += packfield(L, &b, f->opt, f->size, f->endian, arg);
+    if (f->opt != 'x') arg++;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
 static int b_pack (lua_State *L) {
   luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
+  const char *fmt;
   Header h;
   int arg = 2;
   size_t totalsize = 0;
+  if (lua_isuserdata(L, 1))
+    return c_pack(L, (Compiled *)luaL_checkudata(L, 1, COMPILED_MT));
+  fmt = luaL_checkstring(L, 1);
   defaultoptions(&h);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
   luaL_buffinit(L, &b);
@@ -224,44 +342,12 @@ static int b_pack (lua_State *L) {
     int toalign = gettoalign(totalsize, &h, opt, size);
     totalsize += toalign;
     while (toalign-- > 0) luaL_addchar(&b, '\0');
-    switch (opt) {
-      case 'b': case 'B': case 'h': case 'H':
-      case 'l': case 'L': case 'T': case 'i': case 'I': {  /* integer types */
-        putinteger(L, &b, arg++, h.endian, size);
-        break;
-      }
-      case 'x': {
-        luaL_addchar(&b, '\0');
-        break;
-      }
-#ifndef LUA_NUMBER_INTEGRAL
-      case 'f': {
-        float f = (float)luaL_checknumber(L, arg++);
-        correctbytes((char *)&f, size, h.endian);
-        luaL_addlstring(&b, (char *)&f, size);
-        break;
-      }
-      case 'd': {
-        double d = luaL_checknumber(L, arg++);
-        correctbytes((char *)&d, size, h.endian);
-        luaL_addlstring(&b, (char *)&d, size);
-        break;
-      }
-#endif
-      case 'c': case 's': {
-        size_t l;
-        const char *s = luaL_checklstring(L, arg++, &l);
-        if (size == 0) size = l;
-        luaL_argcheck(L, l >= (size_t)size, arg, "string too short");
-        luaL_addlstring(&b, s, size);
-        if (opt == 's') {
-          luaL_addchar(&b, '\0');  /* add zero at the end */
-          size++;
-        }
-        break;
-      }
-      default: controloptions(L, opt, &fmt, &h);
+    if (isfield(opt)) {
+      size = packfield(L, &b, opt, size, h.endian, arg);
+      if (opt != 'x') arg++;
     }
+    else
+      controloptions(L, opt, &fmt, &h);
     totalsize += size;
   }
   luaL_pushresult(&b);
@@ -296,79 +382,174 @@ static lua_Number getinteger (const char *buff, int endian,
 }
 
 
-static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+/*
+** push the value of one field at 'pos' (nothing for 'x'), returns its
+** size in the data. 'c0' takes its size from the value on top of the stack
+*/
+static size_t unpackfield (lua_State *L, const char *data, size_t ld,
+                           size_t pos, int opt, size_t size, int endian) {
+  switch (opt) {
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'T': case 'i':  case 'I': {  /* integer types */
+      int issigned = islower(opt);
+      lua_Number res = getinteger(data+pos, endian, issigned, size);
+      lua_pushnumber(L, res);
+      break;
+    }
+    case 'x': {
+      break;
+    }
+#ifndef LUA_NUMBER_INTEGRAL
+    case 'f': {
+      float f;
+      memcpy(&f, data+pos, size);
+      correctbytes((char *)&f, sizeof(f), endian);
+      lua_pushnumber(L, f);
+      break;
+    }
+    case 'd': {
+      double d;
+      memcpy(&d, data+pos, size);
+      correctbytes((char *)&d, sizeof(d), endian);
+      lua_pushnumber(L, d);
+      break;
+    }
+#endif
+    case 'c': {
+      if (size == 0) {
+        if (!lua_isnumber(L, -1))
+          luaL_error(L, "format `c0' needs a previous size");
+        size = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
+      }
+      lua_pushlstring(L, data+pos, size);
+      break;
+    }
+    case 's': {
+      const char *e = (const char *)memchr(data+pos, '\0', ld - pos);
+      if (e == NULL)
+        luaL_error(L, "unfinished string in data");
+      size = (e - (data+pos)) + 1;
+      lua_pushlstring(L, data+pos, size - 1);
+      break;
+    }
+  }
+  return size;
+}
+
+
+/*
+** with a table at index 4 the values go into it instead of the stack;
+** 'n' counts them
+*/
+static void storefield (lua_State *L, int opt, int *n) {
+  if (opt != 'x')
+    lua_rawseti(L, 4, ++(*n));
+}
+
+
+static void getprevious (lua_State *L, int *n) {
+  lua_rawgeti(L, 4, *n);  /* 'c0' consumes the previous value */
+  lua_pushnil(L);
+  lua_rawseti(L, 4, (*n)--);
+}
+
+
+static int unpackresult (lua_State *L, int intable, size_t pos) {
+  if (intable) {
+    lua_settop(L, 4);
+    lua_pushinteger(L, pos + 1);
+    return 2;
+  }
+  lua_pushinteger(L, pos + 1);
+  return lua_gettop(L) - 2;
+}
+
+
+static int c_unpack (lua_State *L, Compiled *c) {
   size_t ld;
   const char *data = luaL_checklstring(L, 2, &ld);
   size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  int intable = !lua_isnoneornil(L, 4);
+  int checked, i, n = 0;
+  if (intable) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 4);
+  }
+  else {
+    lua_settop(L, 2);
+    luaL_checkstack(L, c->nfields + 1, "too many results");
+  }
+  /* a fixed layout at an aligned start is checked once for all fields */
+  checked = c->fixed && (pos & (c->maxalign - 1)) == 0;
+  if (checked)
+    luaL_argcheck(L, pos <= ld && c->size <= ld - pos, 2, "data string too short");
+  for (i = 0; i < c->nfields; i++) {
+    Field *f = &c->fields[i];
+    pos += padding(pos, f->align);
+    if (!checked)
+      luaL_argcheck(L, pos+f->size <= ld, 2, "data string too short");
+    if (intable && f->opt == 'c' && f->size == 0)
+      getprevious(L, &n);
+    pos += unpackfield(L, data, ld, pos, f->opt, f->size, f->endian);
+    if (intable)
+      storefield(L, f->opt, &n);
+  }
+  return unpackresult(L, intable, pos);
+}
+
+
+static int b_unpack (lua_State *L) {
+  Header h;
+  const char *fmt;
+  size_t ld;
+  const char *data;
+  size_t pos;
+  int intable, n = 0;
+  if (lua_isuserdata(L, 1))
+    return c_unpack(L, (Compiled *)luaL_checkudata(L, 1, COMPILED_MT));
+  fmt = luaL_checkstring(L, 1);
+  data = luaL_checklstring(L, 2, &ld);
+  pos = luaL_optinteger(L, 3, 1) - 1;
+  intable = !lua_isnoneornil(L, 4);
+  if (intable)
+    luaL_checktype(L, 4, LUA_TTABLE);
   defaultoptions(&h);
-  lua_settop(L, 2);
+  lua_settop(L, intable ? 4 : 2);
   while (*fmt) {
     int opt = *fmt++;
     size_t size = optsize(L, opt, &fmt);
     pos += gettoalign(pos, &h, opt, size);
     luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
     luaL_checkstack(L, 2, "too many results");
-    switch (opt) {
-      case 'b': case 'B': case 'h': case 'H':
-      case 'l': case 'L': case 'T': case 'i':  case 'I': {  /* integer types */
-        int issigned = islower(opt);
-        lua_Number res = getinteger(data+pos, h.endian, issigned, size);
-        lua_pushnumber(L, res);
-        break;
-      }
-      case 'x': {
-        break;
-      }
-#ifndef LUA_NUMBER_INTEGRAL
-      case 'f': {
-        float f;
-        memcpy(&f, data+pos, size);
-        correctbytes((char *)&f, sizeof(f), h.endian);
-        lua_pushnumber(L, f);
-        break;
-      }
-      case 'd': {
-        double d;
-        memcpy(&d, data+pos, size);
-        correctbytes((char *)&d, sizeof(d), h.endian);
-        lua_pushnumber(L, d);
-        break;
-      }
-#endif
-      case 'c': {
-        if (size == 0) {
-          if (!lua_isnumber(L, -1))
-            luaL_error(L, "format `c0' needs a previous size");
-          size = lua_tonumber(L, -1);
-          lua_pop(L, 1);
-          luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
-        }
-        lua_pushlstring(L, data+pos, size);
-        break;
-      }
-      case 's': {
-        const char *e = (const char *)memchr(data+pos, '\0', ld - pos);
-        if (e == NULL)
-          luaL_error(L, "unfinished string in data");
-        size = (e - (data+pos)) + 1;
-        lua_pushlstring(L, data+pos, size - 1);
-        break;
-      }
-      default: controloptions(L, opt, &fmt, &h);
+    if (isfield(opt)) {
+      if (intable && opt == 'c' && size == 0)
+        getprevious(L, &n);
+      size = unpackfield(L, data, ld, pos, opt, size, h.endian);
+      if (intable)
+        storefield(L, opt, &n);
     }
+    else
+      controloptions(L, opt, &fmt, &h);
     pos += size;
   }
-  lua_pushinteger(L, pos + 1);
-  return lua_gettop(L) - 2;
+  return unpackresult(L, intable, pos);
 }
 
 
 static int b_size (lua_State *L) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+  const char *fmt;
   size_t pos = 0;
+  if (lua_isuserdata(L, 1)) {
+    Compiled *c = (Compiled *)luaL_checkudata(L, 1, COMPILED_MT);
+    if (!c->fixed)
+      luaL_argerror(L, 1, "format has no fixed size");
+    lua_pushinteger(L, c->size);
+    return 1;
+  }
+  fmt = luaL_checkstring(L, 1);
   defaultoptions(&h);
   while (*fmt) {
     int opt = *fmt++;
@@ -386,19 +567,73 @@ static int b_size (lua_State *L) {
   return 1;
 }
 
+static int b_compile (lua_State *L) {
+  Header h;
+  size_t len;
+  const char *fmt = luaL_checklstring(L, 1, &len);
+  size_t pos = 0;
+  /* every field takes at least one character of the format */
+  Compiled *c = (Compiled *)lua_newuserdata(L, sizeof(Compiled) +
+                                               len * sizeof(Field));
+  c->nfields = 0;
+  c->fixed = 1;
+  c->maxalign = 1;
+  defaultoptions(&h);
+  while (*fmt) {
+    int opt = *fmt++;
+    size_t size = optsize(L, opt, &fmt);
+    if (isfield(opt)) {
+      Field *f = &c->fields[c->nfields++];
+      f->opt = opt;
+      f->endian = h.endian;
+      f->size = size;
+      f->align = getalign(&h, opt, size);
+      if (!isp2(f->align))
+        c->fixed = 0;  /* offsets depend on the start position */
+      else if (f->align > c->maxalign)
+        c->maxalign = f->align;
+      if (opt == 's' || (opt == 'c' && size == 0))
+        c->fixed = 0;
+      pos += padding(pos, f->align) + size;
+    }
+    else
+      controloptions(L, opt, &fmt, &h);
+  }
+  c->size = pos;
+  luaL_getmetatable(L, COMPILED_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
 /* }====================================================== */
 
 
 
+static const LUA_REG_TYPE compiled_map[] = {
+  {LSTRKEY("pack"), LFUNCVAL(b_pack)},
+  {LSTRKEY("unpack"), LFUNCVAL(b_unpack)},
+  {LSTRKEY("size"), LFUNCVAL(b_size)},
+  {LSTRKEY("__index"), LROVAL(compiled_map)},
+  {LNILKEY, LNILVAL}
+};
+
+
 static const LUA_REG_TYPE thislib[] = {
   {LSTRKEY("pack"), LFUNCVAL(b_pack)},
   {LSTRKEY("unpack"), LFUNCVAL(b_unpack)},
   {LSTRKEY("size"), LFUNCVAL(b_size)},
+  {LSTRKEY("compile"), LFUNCVAL(b_compile)},
   {LNILKEY, LNILVAL}
 };
 
 
-NODEMCU_MODULE(STRUCT, "struct", thislib, NULL);
+int luaopen_struct (lua_State *L) {
+  luaL_rometatable(L, COMPILED_MT, (void *)compiled_map);
+  return 0;
+}
+
+
+NODEMCU_MODULE(STRUCT, "struct", thislib, luaopen_struct);
 
 /******************************************************************************
 * Copyright (C) 2010-2012 Lua.org, PUC-Rio.  All rights reserved.
@@ -6,6 +6,9 @@
 // ws:on("receive", function(_, data, opcode) print(data) end)
 // ws:on("close", function(_, reasonCode) print('ws closed', reasonCode) end)
 // ws:connect('ws://echo.websocket.org')
+//
+// srv = websocket.createServer(8080)
+// srv:on("receive", function(client, data, opcode) client:send(data, opcode) end)
 
 #include "lmem.h"
 #include "lualib.h"
@@ -18,8 +21,11 @@
 #include "c_stdlib.h"
 
 #include "websocketclient.h"
+#include "websocketserver.h"
 
 #define METATABLE_WSCLIENT "websocket.client"
+#define METATABLE_WSSERVER "websocket.server"
+#define METATABLE_WSSERVERCLIENT "websocket.serverclient"
 
 typedef struct ws_data {
   int self_ref;
@@ -28,6 +34,12 @@ typedef struct ws_data {
   int onClose;
 } ws_data;
 
+// Lua side of a server connection
+typedef struct ws_peer {
+  ws_serverClient *client; // NULL once closed
+  int self_ref;
+} ws_peer;
+
 static void websocketclient_onConnectionCallback(ws_info *ws) {
   NODE_DBG("websocketclient_onConnectionCallback\n");
 
@@ -46,7 +58,7 @@ static void websocketclient_onConnectionCallback(ws_info *ws) {
   }
 }
 
-static void websocketclient_onReceiveCallback(ws_info *ws, int len, char *message, int opCode) {
+static void websocketclient_onReceiveCallback(ws_info *ws, int len, char *message, int opCode, bool fin) {
   NODE_DBG("websocketclient_onReceiveCallback\n");
 
   lua_State *L = lua_getstate();
@@ -62,7 +74,8 @@ static void websocketclient_onReceiveCallback(ws_info *ws, int len, char *messag
     lua_rawgeti(L, LUA_REGISTRYINDEX, data->self_ref);  // pass itself, #1 callback argument
     lua_pushlstring(L, message, len); // #2 callback argument
     lua_pushnumber(L, opCode); // #3 callback argument
-    lua_call(L, 3, 0);
+    lua_pushboolean(L, fin); // #4 callback argument, false for all but the last piece in stream mode
+    lua_call(L, 4, 0);
   }
 }
 
@@ -104,6 +117,8 @@ static int websocket_createClient(lua_State *L) {
   ws_info *ws = (ws_info *) lua_newuserdata(L, sizeof(ws_info));
   ws->connectionState = 0;
   ws->extraHeaders = NULL;
+  ws->maxMessage = 0;
+  ws->streaming = false;
   ws->onConnection = &websocketclient_onConnectionCallback;
   ws->onReceive = &websocketclient_onReceiveCallback;
   ws->onFailure = &websocketclient_onCloseCallback;
@@ -116,13 +131,8 @@ static int websocket_createClient(lua_State *L) {
   return 1;
 }
 
-static int websocketclient_on(lua_State *L) {
-  NODE_DBG("websocketclient_on\n");
-
-  ws_info *ws = (ws_info *) luaL_checkudata(L, 1, METATABLE_WSCLIENT);  
-
-  ws_data *data = (ws_data *) ws->reservedData;
-
+// shared by client and server, both keep their callbacks in ws_data
+static int websocket_on(lua_State *L, ws_data *data) {
   int handle = luaL_checkoption(L, 2, NULL, (const char * const[]){ "connection", "receive", "close", NULL });
   if (lua_type(L, 3) != LUA_TNIL && lua_type(L, 3) != LUA_TFUNCTION && lua_type(L, 3) != LUA_TLIGHTFUNCTION) {
     return luaL_typerror(L, 3, "function or nil");
@@ -167,6 +177,14 @@ static int websocketclient_on(lua_State *L) {
   return 0;
 }
 
+static int websocketclient_on(lua_State *L) {
+  NODE_DBG("websocketclient_on\n");
+
+  ws_info *ws = (ws_info *) luaL_checkudata(L, 1, METATABLE_WSCLIENT);  
+
+  return websocket_on(L, (ws_data *) ws->reservedData);
+}
+
 static int websocketclient_connect(lua_State *L) {
   NODE_DBG("websocketclient_connect is called.\n");
 
@@ -236,6 +254,18 @@ static int websocketclient_config(lua_State *L) {
   }
   lua_pop(L, 1); // pop headers
 
+  lua_getfield(L, 2, "maxmessage");
+  if (!lua_isnil(L, -1)) {
+    ws->maxMessage = luaL_checkinteger(L, -1);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "stream");
+  if (!lua_isnil(L, -1)) {
+    ws->streaming = lua_toboolean(L, -1);
+  }
+  lua_pop(L, 1);
+
   return 0;
 }
 
@@ -251,15 +281,18 @@ static int websocketclient_send(lua_State *L) {
     return luaL_error(L, "Websocket isn't connected.\n");
   }
 
-  int msgLength;
+  size_t msgLength;
   const char *msg = luaL_checklstring(L, 2, &msgLength);
+  if (msgLength > 0xffff - WS_FRAME_HEADER_MAX) {
+    return luaL_error(L, "Message too long.\n"); // must fit a single espconn send
+  }
 
   int opCode = 1; // default: text message
   if (lua_gettop(L) == 3) {
     opCode = luaL_checkint(L, 3);
   }
 
-  ws_send(ws, opCode, msg, (unsigned short) msgLength);
+  ws_send(ws, opCode, msg, (unsigned int) msgLength);
   return 0;
 }
 
@@ -307,9 +340,242 @@ static int websocketclient_gc(lua_State *L) {
   return 0;
 }
 
+static void websocketserver_release(lua_State *L, ws_server *server) {
+  ws_data *data = (ws_data *) server->reservedData;
+
+  // the server is kept alive while listening or while connections are open
+  if (server->listener == NULL && server->clients == NULL && data->self_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, data->self_ref);
+    data->self_ref = LUA_NOREF;
+  }
+}
+
+static void websocketserver_onConnectionCallback(ws_serverClient *client, const char *path) {
+  NODE_DBG("websocketserver_onConnectionCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_data *data = (ws_data *) client->server->reservedData;
+
+  ws_peer *peer = (ws_peer *) lua_newuserdata(L, sizeof(ws_peer));
+  peer->client = client;
+  luaL_getmetatable(L, METATABLE_WSSERVERCLIENT);
+  lua_setmetatable(L, -2);
+  peer->self_ref = luaL_ref(L, LUA_REGISTRYINDEX); // kept until the connection closes
+  client->reservedData = peer;
+
+  if (data->onConnection != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onConnection); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, peer->self_ref);  // pass the client, #1 callback argument
+    lua_pushstring(L, path); // #2 callback argument
+    lua_call(L, 2, 0);
+  }
+}
+
+static void websocketserver_onReceiveCallback(ws_serverClient *client, int len, char *message, int opCode, bool fin) {
+  NODE_DBG("websocketserver_onReceiveCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_data *data = (ws_data *) client->server->reservedData;
+  ws_peer *peer = (ws_peer *) client->reservedData;
+
+  if (data->onReceive != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onReceive); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, peer->self_ref);  // pass the client, #1 callback argument
+    lua_pushlstring(L, message, len); // #2 callback argument
+    lua_pushnumber(L, opCode); // #3 callback argument
+    lua_pushboolean(L, fin); // #4 callback argument
+    lua_call(L, 4, 0);
+  }
+}
+
+static void websocketserver_onCloseCallback(ws_serverClient *client, int status) {
+  NODE_DBG("websocketserver_onCloseCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_server *server = client->server;
+  ws_data *data = (ws_data *) server->reservedData;
+  ws_peer *peer = (ws_peer *) client->reservedData;
+
+  if (data->onClose != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onClose); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, peer->self_ref);  // pass the client, #1 callback argument
+    lua_pushnumber(L, status); // pass the close status, #2 callback argument
+    lua_call(L, 2, 0);
+  }
+
+  // the client object outlives the connection, but can't be used anymore
+  peer->client = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, peer->self_ref);
+  peer->self_ref = LUA_NOREF;
+
+  websocketserver_release(L, server);
+}
+
+static int websocket_createServer(lua_State *L) {
+  NODE_DBG("websocket_createServer\n");
+
+  int port = luaL_checkinteger(L, 1);
+
+  ws_data *data = (ws_data *) luaM_malloc(L, sizeof(ws_data));
+  data->onConnection = LUA_NOREF;
+  data->onReceive = LUA_NOREF;
+  data->onClose = LUA_NOREF;
+  data->self_ref = LUA_NOREF;
+
+  ws_server *server = (ws_server *) lua_newuserdata(L, sizeof(ws_server));
+  c_memset(server, 0, sizeof(ws_server));
+  server->maxBacklog = WS_SERVER_DEFAULT_BACKLOG;
+  server->timeout = WS_SERVER_DEFAULT_TIMEOUT;
+  server->onConnection = &websocketserver_onConnectionCallback;
+  server->onReceive = &websocketserver_onReceiveCallback;
+  server->onClose = &websocketserver_onCloseCallback;
+  server->reservedData = data;
+
+  // set its metatable
+  luaL_getmetatable(L, METATABLE_WSSERVER);
+  lua_setmetatable(L, -2);
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "maxbacklog");
+    server->maxBacklog = luaL_optinteger(L, -1, WS_SERVER_DEFAULT_BACKLOG);
+    lua_getfield(L, 2, "maxmessage");
+    server->maxMessage = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 2, "timeout");
+    server->timeout = luaL_optinteger(L, -1, WS_SERVER_DEFAULT_TIMEOUT);
+    lua_getfield(L, 2, "stream");
+    server->streaming = lua_toboolean(L, -1);
+    lua_pop(L, 4);
+  }
+
+  if (ws_serverStart(server, port) != 0) {
+    return luaL_error(L, "Failed to listen on port %d.\n", port);
+  }
+
+  lua_pushvalue(L, -1);  // copy userdata to the top of stack to allow ref
+  data->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  return 1;
+}
+
+static int websocketserver_on(lua_State *L) {
+  NODE_DBG("websocketserver_on\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+
+  return websocket_on(L, (ws_data *) server->reservedData);
+}
+
+static int websocketserver_broadcast(lua_State *L) {
+  NODE_DBG("websocketserver_broadcast is called.\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+
+  size_t msgLength;
+  const char *msg = luaL_checklstring(L, 2, &msgLength);
+  int opCode = luaL_optint(L, 3, WS_OPCODE_TEXT);
+  if (msgLength > 0xffff - WS_FRAME_HEADER_MAX) {
+    return luaL_error(L, "Message too long.\n");
+  }
+
+  int count = ws_serverBroadcast(server, opCode, msg, (unsigned int) msgLength);
+  if (count < 0) {
+    return luaL_error(L, "Out of memory.\n");
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int websocketserver_close(lua_State *L) {
+  NODE_DBG("websocketserver_close.\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  ws_serverStop(server);
+  websocketserver_release(L, server);
+
+  return 0;
+}
+
+static int websocketserver_gc(lua_State *L) {
+  NODE_DBG("websocketserver_gc\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  ws_data *data = (ws_data *) server->reservedData;
+
+  // only collected once it stopped listening and all connections are gone
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onConnection);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onReceive);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onClose);
+  luaM_free(L, data);
+
+  return 0;
+}
+
+static ws_serverClient *websocketserverclient_check(lua_State *L) {
+  ws_peer *peer = (ws_peer *) luaL_checkudata(L, 1, METATABLE_WSSERVERCLIENT);
+  return peer->client;
+}
+
+static int websocketserverclient_send(lua_State *L) {
+  NODE_DBG("websocketserverclient_send is called.\n");
+
+  ws_serverClient *client = websocketserverclient_check(L);
+
+  size_t msgLength;
+  const char *msg = luaL_checklstring(L, 2, &msgLength);
+  int opCode = luaL_optint(L, 3, WS_OPCODE_TEXT);
+  if (client == NULL || client->connectionState != 3) {
+    return luaL_error(L, "Websocket isn't connected.\n");
+  }
+  if (msgLength > 0xffff - WS_FRAME_HEADER_MAX) {
+    return luaL_error(L, "Message too long.\n");
+  }
+
+  int result = ws_serverSend(client, opCode, msg, (unsigned int) msgLength);
+  if (result == -2) {
+    return luaL_error(L, "Out of memory.\n");
+  }
+  lua_pushboolean(L, result == 0); // false when dropped because the backlog is full
+  return 1;
+}
+
+static int websocketserverclient_close(lua_State *L) {
+  NODE_DBG("websocketserverclient_close.\n");
+
+  ws_serverClient *client = websocketserverclient_check(L);
+  int status = luaL_optint(L, 2, WS_CLOSE_NORMAL);
+  if (client != NULL) {
+    ws_serverClose(client, status);
+  }
+
+  return 0;
+}
+
+static int websocketserverclient_backlog(lua_State *L) {
+  ws_serverClient *client = websocketserverclient_check(L);
+
+  lua_pushinteger(L, client != NULL ? client->backlog : 0);
+  return 1;
+}
+
+static int websocketserverclient_getpeer(lua_State *L) {
+  ws_serverClient *client = websocketserverclient_check(L);
+
+  if (client == NULL) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 2;
+  }
+  char temp[20];
+  c_sprintf(temp, IPSTR, IP2STR(&(client->conn->proto.tcp->remote_ip)));
+  lua_pushstring(L, temp);
+  lua_pushinteger(L, client->conn->proto.tcp->remote_port);
+  return 2;
+}
+
 static const LUA_REG_TYPE websocket_map[] =
 {
   { LSTRKEY("createClient"), LFUNCVAL(websocket_createClient) },
+  { LSTRKEY("createServer"), LFUNCVAL(websocket_createServer) },
   { LNILKEY, LNILVAL }
 };
 
@@ -325,8 +591,30 @@ static const LUA_REG_TYPE websocketclient_map[] =
   { LNILKEY, LNILVAL }
 };
 
+static const LUA_REG_TYPE websocketserver_map[] =
+{
+  { LSTRKEY("on"), LFUNCVAL(websocketserver_on) },
+  { LSTRKEY("broadcast"), LFUNCVAL(websocketserver_broadcast) },
+  { LSTRKEY("close"), LFUNCVAL(websocketserver_close) },
+  { LSTRKEY("__gc" ), LFUNCVAL(websocketserver_gc) },
+  { LSTRKEY("__index"), LROVAL(websocketserver_map) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE websocketserverclient_map[] =
+{
+  { LSTRKEY("send"), LFUNCVAL(websocketserverclient_send) },
+  { LSTRKEY("close"), LFUNCVAL(websocketserverclient_close) },
+  { LSTRKEY("backlog"), LFUNCVAL(websocketserverclient_backlog) },
+  { LSTRKEY("getpeer"), LFUNCVAL(websocketserverclient_getpeer) },
+  { LSTRKEY("__index"), LROVAL(websocketserverclient_map) },
+  { LNILKEY, LNILVAL }
+};
+
 int loadWebsocketModule(lua_State *L) {
   luaL_rometatable(L, METATABLE_WSCLIENT, (void *) websocketclient_map);
+  luaL_rometatable(L, METATABLE_WSSERVER, (void *) websocketserver_map);
+  luaL_rometatable(L, METATABLE_WSSERVERCLIENT, (void *) websocketserverclient_map);
 
   return 0;
 }
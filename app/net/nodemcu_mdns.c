@@ -100,6 +100,7 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 
 /* DNS protocol flags */
 #define DNS_FLAG1_RESPONSE        0x84
+#define DNS_FLAG1_QR              0x80
 #define DNS_FLAG1_OPCODE_STATUS   0x10
 #define DNS_FLAG1_OPCODE_INVERSE  0x08
 #define DNS_FLAG1_OPCODE_STANDARD 0x00
@@ -197,6 +198,55 @@ PACK_STRUCT_END
 
 #define SIZEOF_MDNS_SERVICE 6
 
+/* Records of the registered service, encoded once by mdns_build_records */
+#define MDNS_RR_SERVICES     0    /* _services._dns-sd._udp.local PTR service type */
+#define MDNS_RR_PTR          1    /* service type PTR instance */
+#define MDNS_RR_TXT          2
+#define MDNS_RR_SRV          3
+#define MDNS_RR_A            4
+#define MDNS_RR_NSEC_HOST    5    /* the host has only an A record */
+#define MDNS_RR_NSEC_INST    6    /* the instance has only TXT and SRV records */
+#define MDNS_RR_COUNT        7
+
+#define MDNS_RR_BIT(rr)      (1 << (rr))
+
+/* A record isn't multicast again within this time, RFC 6762 section 6 */
+#define MDNS_RATE_LIMIT_US   1000000
+
+/* Browsing */
+#define MDNS_BROWSE_MAX      16   /* instances remembered, so they are reported once */
+#define MDNS_BROWSE_QUERIES  4    /* queries sent, 1, 2, 4 seconds apart */
+#define MDNS_BROWSE_RRS      16   /* records looked at per response */
+
+struct mdns_record {
+	const char *name;       /* owner name */
+	const char *target;     /* PTR target name */
+	u16_t type;
+	u16_t offset;           /* encoded record in mdns_records */
+	u16_t len;
+	u16_t name_len;         /* the fixed fields follow the encoded name */
+	u8_t unique;            /* sets the cache flush bit when multicast */
+	u32_t ttl;
+	u32_t last_multicast;   /* system_get_time() */
+};
+
+struct mdns_instance {
+	char *label;
+	u32_t ttl;
+	u32_t seen;             /* system_get_time() of the last announcement */
+	struct mdns_instance *next;
+};
+
+struct mdns_browse {
+	char *service;          /* _service._tcp.local */
+	nodemcu_mdns_browse_cb callback;
+	void *arg;
+	struct mdns_instance *instances;
+	u8_t count;
+	u8_t queries;
+	os_timer_t timer;
+};
+
 static os_timer_t mdns_timer;
 /* forward declarations */
 static void mdns_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
@@ -207,7 +257,6 @@ static void mdns_recv(void *s, struct udp_pcb *pcb, struct pbuf *p,
  *----------------------------------------------------------------------------*/
 
 /* MDNS variables */
-//static char puck_datasheet[PUCK_DATASHEET_SIZE];
 static struct udp_pcb *mdns_pcb = NULL;
 static struct nodemcu_mdns_info * ms_info = NULL;
 static struct ip_addr multicast_addr;
@@ -215,6 +264,18 @@ static uint8 register_flag = 0;
 static uint8 mdns_flag = 0;
 static u8_t *mdns_payload;
 
+static struct mdns_record mdns_rr[MDNS_RR_COUNT];
+static u8_t *mdns_records = NULL;
+static char *host_fqdn = NULL;          /* host.local */
+static char *instance_fqdn = NULL;      /* description._service._tcp.local */
+
+static struct mdns_browse *browse = NULL;
+
+static char ICACHE_FLASH_ATTR
+mdns_lower(char c) {
+	return (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
+}
+
 /**
  * Compare the "dotted" name "query" with the encoded name "response"
  * to make sure an answer from the DNS server matches the current mdns_table
@@ -223,71 +284,144 @@ static u8_t *mdns_payload;
  *
  * @param query hostname (not encoded) from the mdns_table
  * @param response encoded hostname in the DNS response
+ * @param pktbase start of the DNS message, compression pointers are relative to it
+ * @param pktend end of the DNS message (or of the record data holding the name)
  * @return 0: names equal; 1: names differ
  */
 static u8_t ICACHE_FLASH_ATTR
-mdns_compare_name(unsigned char *query, unsigned char *response, unsigned char *pktbase) {
+mdns_compare_name(unsigned char *query, unsigned char *response, unsigned char *pktbase, unsigned char *pktend) {
+	unsigned char *start = query;
 	unsigned char n;
+	int hops = 0;
 
-	do {
-		n = *response++;
+	for (;;) {
+		if (response >= pktend) {
+			return 1;
+		}
+		if ((n = *response++) == 0) {
+			break;
+		}
 		/** @see RFC 1035 - 4.1.4. Message compression */
 		if ((n & 0xc0) == 0xc0) {
-		  	n = ((n << 8) + *response) & 0x3fff;
-			if (n < response - pktbase) {
-			  response = pktbase + n;
-			} else {
-			  return 1;
+			if (response >= pktend) {
+				return 1;
+			}
+			u16_t offset = ((n << 8) + *response) & 0x3fff;
+			/* pointers lead backwards, the hop limit stops loops anyway */
+			if (offset >= response - 1 - pktbase || ++hops > 16) {
+				return 1;
+			}
+			response = pktbase + offset;
+			continue;
+		}
+		if (n > 63 || n > pktend - response) {
+			return 1;
+		}
+		if (query != start && *query++ != '.') {
+			return 1;
+		}
+		/* Not compressed name */
+		while (n > 0) {
+			if (*query == 0 || mdns_lower(*query) != mdns_lower(*response)) {
+				return 1;
 			}
-		} else {
-			/* Not compressed name */
-			while (n > 0) {
-				char q = *query;
-				if (q >= 'A' && q <= 'Z') {
-				  q = q + 'a' - 'A';
-				}
-				char r = *response;
-				if (r >= 'A' && r <= 'Z') {
-				  r = r + 'a' - 'A';
-				}
-				if (q != r) {
-					return 1;
-				}
-				++response;
-				++query;
-				--n;
-			};
+			++response;
 			++query;
+			--n;
 		}
-	} while (*response != 0);
+	}
 
-	return 0;
+	return *query != 0;
 }
 
-static int 
-mdns_namelen(u8_t *p, unsigned int maxlen) {
+/* Length of the encoded name at p as stored there, -1 if it runs past end */
+static int
+mdns_namelen(u8_t *p, u8_t *end) {
   u8_t *orig = p;
 
-  while (*p && *p <= 63) {
-    if (p - orig > maxlen) {
-      return -1;
-    }
+  while (p < end && *p && *p <= 63) {
     p += *p + 1;
   }
 
-  if (*p >= 0xc0) {
+  if (p >= end) {
+    return -1;
+  }
+  if ((*p & 0xc0) == 0xc0) {
     p += 2;	// advance over the two byte pointer
-  } else {
+  } else if (*p == 0) {
     p++;	// advance over the final 0
+  } else {
+    return -1;	// extended label types are not used
   }
 
-  if (p - orig > maxlen) {
+  if (p > end) {
     return -1;
   }
 
   return p - orig;
 }
 
+/* Follow the pointers of an encoded name to its first label, copy that and
+ * return where the rest of the name starts (NULL if the name is bad) */
+static u8_t *
+mdns_first_label(u8_t *p, u8_t *pktbase, u8_t *pktend, char *label) {
+  int hops = 0;
+
+  if (p >= pktend) {
+    return NULL;
+  }
+  while ((*p & 0xc0) == 0xc0) {
+    if (p + 1 >= pktend) {
+      return NULL;
+    }
+    u16_t offset = ((p[0] << 8) + p[1]) & 0x3fff;
+    if (pktbase + offset >= p || ++hops > 16) {
+      return NULL;
+    }
+    p = pktbase + offset;
+  }
+  if (*p == 0 || *p > 63 || p + 1 + *p >= pktend) {
+    return NULL;
+  }
+  memcpy(label, p + 1, *p);
+  label[*p] = 0;
+
+  return p + 1 + *p;
+}
+
+/* Decode an encoded name into dotted form, returns 0 on success */
+static int
+mdns_read_name(u8_t *p, u8_t *pktbase, u8_t *pktend, char *name, int len) {
+  char *out = name;
+  int hops = 0;
+
+  while (p < pktend && *p) {
+    if ((*p & 0xc0) == 0xc0) {
+      if (p + 1 >= pktend) {
+	return 1;
+      }
+      u16_t offset = ((p[0] << 8) + p[1]) & 0x3fff;
+      if (pktbase + offset >= p || ++hops > 16) {
+	return 1;
+      }
+      p = pktbase + offset;
+      continue;
+    }
+    if (*p > 63 || p + 1 + *p >= pktend || out + *p + 2 > name + len) {
+      return 1;
+    }
+    if (out != name) {
+      *out++ = '.';
+    }
+    memcpy(out, p + 1, *p);
+    out += *p;
+    p += 1 + *p;
+  }
+  *out = 0;
+
+  return p >= pktend;
+}
+
 /* Copy an unencoded name into an encoded name */
 static unsigned char *copy_and_encode_name(unsigned char *ptr, const char *name) {
   while (*name) {
@@ -317,12 +451,14 @@ static err_t send_packet(struct pbuf *p, struct ip_addr *dst_addr, u16_t dst_por
   if (addr_ptr) {
     if (wifi_get_opmode() == 0x02) {
       if (!ap_netif) {
-	return;
+	pbuf_free(p);
+	return ERR_IF;
       }
       memcpy(addr_ptr, &ap_netif->ip_addr, sizeof(ap_netif->ip_addr));
     } else {
       if (!sta_netif) {
-	return;
+	pbuf_free(p);
+	return ERR_IF;
       }
       memcpy(addr_ptr, &sta_netif->ip_addr, sizeof(sta_netif->ip_addr));
     }
@@ -350,506 +486,566 @@ static err_t send_packet(struct pbuf *p, struct ip_addr *dst_addr, u16_t dst_por
 
   return err;
 }
+
 /**
- * Send a mDNS packet for the service type
+ * Start encoding record rr into the record buffer.
  *
- * @param id transaction ID in the DNS query packet
- * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
+ * @return where the record data goes
  */
-static err_t ICACHE_FLASH_ATTR
-mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
-	err_t err;
-	struct mdns_hdr *hdr;
-	struct mdns_answer ans;
-	struct mdns_a_rr a_rr;
-	struct mdns_service serv;
-	struct pbuf *p ,*p_sta;
-	char *query, *nptr;
-	const char *pHostname;
-	struct netif * sta_netif = NULL;
-	struct netif * ap_netif = NULL;
-	int max_ttl = dst_addr ? 10 : 7200;
-	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
-	u8_t n;
-	u16_t length = 0;
-	/* if here, we have either a new query or a retry on a previous query to process */
-	p = pbuf_alloc(PBUF_TRANSPORT,
-			SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
-	if (p != NULL) {
-		LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
-		/* fill dns header */
-		hdr = (struct mdns_hdr*) p->payload;
-		os_memset(hdr, 0, SIZEOF_DNS_HDR);
-		hdr->id = htons(id);
-		hdr->flags1 = DNS_FLAG1_RESPONSE;
-
-		pHostname = DNS_SD_SERVICE;
-		hdr->numanswers = htons(1);
-		query = (char*) hdr + SIZEOF_DNS_HDR;
-		--pHostname;
-		/* convert hostname into suitable query format. */
-		do {
-			++pHostname;
-			nptr = query;
-			++query;
-			for (n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname) {
-				*query = *pHostname;
-				++query;
-				++n;
-			}
-			*nptr = n;
-		} while (*pHostname != 0);
-		*query++ = '\0';
-		/* fill dns query */
+static u8_t * ICACHE_FLASH_ATTR
+mdns_begin_rr(u8_t *ptr, int rr, const char *name, u16_t type, u32_t ttl, u8_t unique) {
+  struct mdns_record *rec = &mdns_rr[rr];
+  struct mdns_answer ans;
 
+  rec->name = name;
+  rec->target = NULL;
+  rec->type = type;
+  rec->ttl = ttl;
+  rec->unique = unique;
+  rec->offset = ptr - mdns_payload;
+  ptr = copy_and_encode_name(ptr, name);
+  rec->name_len = ptr - mdns_payload - rec->offset;
 
-		ans.type = htons(DNS_RRTYPE_PTR);
-		ans.class = htons(DNS_RRCLASS_IN);
-		ans.ttl = htonl(min(max_ttl, 3600));
-		ans.len = htons(os_strlen(service_name_with_suffix) + 1 +1 );
-		length = 0;
+  ans.type = htons(type);
+  ans.class = htons(DNS_RRCLASS_IN);
+  ans.ttl = htonl(ttl);
+  ans.len = 0;
+  MEMCPY(ptr, &ans, SIZEOF_DNS_ANSWER);
 
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
+  return ptr + SIZEOF_DNS_ANSWER;
+}
 
-		/* resize the query */
-		query = query + SIZEOF_DNS_ANSWER;
-		pHostname = service_name_with_suffix;
-		--pHostname;
+/* Finish record rr, its data ends at ptr */
+static void ICACHE_FLASH_ATTR
+mdns_end_rr(u8_t *ptr, int rr) {
+  struct mdns_record *rec = &mdns_rr[rr];
+  u8_t *rdata = mdns_payload + rec->offset + rec->name_len + SIZEOF_DNS_ANSWER;
+  u16_t rdlen = ptr - rdata;
+
+  rdata[-2] = rdlen >> 8;
+  rdata[-1] = rdlen & 0xff;
+  rec->len = ptr - mdns_payload - rec->offset;
+  rec->last_multicast = system_get_time() - MDNS_RATE_LIMIT_US;
+}
 
-		/* convert hostname into suitable query format. */
-		do {
-			++pHostname;
-			nptr = query;
-			++query;
-			for (n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname) {
-				*query = *pHostname;
-				++query;
-				++n;
-			}
-			*nptr = n;
-		} while (*pHostname != 0);
-		*query++ = '\0';
+/* NSEC record data listing the types name has, RFC 6762 section 6.1 */
+static u8_t * ICACHE_FLASH_ATTR
+mdns_put_nsec(u8_t *ptr, const char *name, u16_t type1, u16_t type2) {
+  u8_t len = (type1 > type2 ? type1 : type2) / 8 + 1;
+
+  ptr = copy_and_encode_name(ptr, name);
+  *ptr++ = 0;		// window block 0
+  *ptr++ = len;
+  os_memset(ptr, 0, len);
+  ptr[type1 >> 3] |= 0x80 >> (type1 & 7);
+  if (type2) {
+    ptr[type2 >> 3] |= 0x80 >> (type2 & 7);
+  }
 
-		/* resize pbuf to the exact dns query */
-		pbuf_realloc(p, (query + length) - ((char*) (p->payload)));
+  return ptr + len;
+}
 
-		err = send_packet(p, dst_addr, dst_port, 0);
+/**
+ * Encode all records of the service once, answers are then put together by
+ * copying them. Uses mdns_payload as scratch space.
+ *
+ * @return FALSE if the records don't fit in a message or out of memory
+ */
+static bool ICACHE_FLASH_ATTR
+mdns_build_records(struct nodemcu_mdns_info *info) {
+  const char *attributes[12];
+  int attr_count = 0;
+  int i;
+  u16_t txt_len = 0;
+  u8_t *ptr;
 
-	} else {
-		err = ERR_MEM;
-	}
+  for (i = 0; i < 10 && info->txt_data[i] != NULL; i++) {
+    txt_len += min(os_strlen(info->txt_data[i]), 255) + 1;
+    attributes[attr_count++] = info->txt_data[i];
+  }
+  static const char *defaults[] = { "platform=nodemcu", NULL };
+  for (i = 0; defaults[i] != NULL; i++) {
+    // See if this is a duplicate
+    int j;
+    int len = strchr(defaults[i], '=') + 1 - defaults[i];
+    for (j = 0; j < attr_count; j++) {
+      if (strncmp(attributes[j], defaults[i], len) == 0) {
+	break;
+      }
+    }
+    if (j == attr_count) {
+      txt_len += os_strlen(defaults[i]) + 1;
+      attributes[attr_count++] = defaults[i];
+    }
+  }
 
-	return err;
+  host_fqdn = (char *) os_malloc(os_strlen(info->host_name) + sizeof(MDNS_LOCAL) + 1);
+  instance_fqdn = (char *) os_malloc(os_strlen(info->host_desc) + os_strlen(service_name_with_suffix) + 2);
+  if (!host_fqdn || !instance_fqdn) {
+    return FALSE;
+  }
+  os_sprintf(host_fqdn, "%s.%s", info->host_name, MDNS_LOCAL);
+  os_sprintf(instance_fqdn, "%s.%s", info->host_desc, service_name_with_suffix);
+
+  // Encoded names are 2 bytes longer than dotted ones
+  int sd_len = os_strlen(DNS_SD_SERVICE) + 2;
+  int service_len = os_strlen(service_name_with_suffix) + 2;
+  int instance_len = os_strlen(instance_fqdn) + 2;
+  int host_len = os_strlen(host_fqdn) + 2;
+  int size = MDNS_RR_COUNT * SIZEOF_DNS_ANSWER +
+      sd_len + service_len +			// services PTR
+      service_len + instance_len +		// PTR
+      instance_len + txt_len +			// TXT
+      instance_len + SIZEOF_MDNS_SERVICE + host_len +	// SRV
+      host_len + SIZEOF_MDNS_A_RR +		// A
+      host_len * 2 + 3 +			// NSEC (A)
+      instance_len * 2 + 7;			// NSEC (TXT, SRV)
+
+  if (SIZEOF_DNS_HDR + size > DNS_MSG_SIZE) {
+    MDNS_DBG("Too much data to send\n");
+    return FALSE;
+  }
+
+  ptr = mdns_begin_rr(mdns_payload, MDNS_RR_SERVICES, DNS_SD_SERVICE, DNS_RRTYPE_PTR, 3600, 0);
+  ptr = copy_and_encode_name(ptr, service_name_with_suffix);
+  mdns_end_rr(ptr, MDNS_RR_SERVICES);
+  mdns_rr[MDNS_RR_SERVICES].target = service_name_with_suffix;
+
+  ptr = mdns_begin_rr(ptr, MDNS_RR_PTR, service_name_with_suffix, DNS_RRTYPE_PTR, 300, 0);
+  ptr = copy_and_encode_name(ptr, instance_fqdn);
+  mdns_end_rr(ptr, MDNS_RR_PTR);
+  mdns_rr[MDNS_RR_PTR].target = instance_fqdn;
+
+  ptr = mdns_begin_rr(ptr, MDNS_RR_TXT, instance_fqdn, DNS_RRTYPE_TXT, 300, 1);
+  for (i = 0; i < attr_count; i++) {
+    u8_t len = min(os_strlen(attributes[i]), 255);
+    *ptr++ = len;
+    memcpy(ptr, attributes[i], len);
+    ptr += len;
+  }
+  mdns_end_rr(ptr, MDNS_RR_TXT);
+
+  ptr = mdns_begin_rr(ptr, MDNS_RR_SRV, instance_fqdn, DNS_RRTYPE_SRV, 300, 1);
+  struct mdns_service serv;
+  serv.prior = htons(0);
+  serv.weight = htons(0);
+  serv.port = htons(info->service_port);
+  MEMCPY(ptr, &serv, SIZEOF_MDNS_SERVICE);
+  ptr = copy_and_encode_name(ptr + SIZEOF_MDNS_SERVICE, host_fqdn);
+  mdns_end_rr(ptr, MDNS_RR_SRV);
+
+  // The address is filled in when sent, it depends on the interface
+  ptr = mdns_begin_rr(ptr, MDNS_RR_A, host_fqdn, DNS_RRTYPE_A, 300, 1);
+  os_memset(ptr, 0, SIZEOF_MDNS_A_RR);
+  mdns_end_rr(ptr + SIZEOF_MDNS_A_RR, MDNS_RR_A);
+  ptr += SIZEOF_MDNS_A_RR;
+
+  ptr = mdns_begin_rr(ptr, MDNS_RR_NSEC_HOST, host_fqdn, DNS_RRTYPE_NSEC, 300, 1);
+  ptr = mdns_put_nsec(ptr, host_fqdn, DNS_RRTYPE_A, 0);
+  mdns_end_rr(ptr, MDNS_RR_NSEC_HOST);
+
+  ptr = mdns_begin_rr(ptr, MDNS_RR_NSEC_INST, instance_fqdn, DNS_RRTYPE_NSEC, 300, 1);
+  ptr = mdns_put_nsec(ptr, instance_fqdn, DNS_RRTYPE_TXT, DNS_RRTYPE_SRV);
+  mdns_end_rr(ptr, MDNS_RR_NSEC_INST);
+
+  mdns_records = (u8_t *) os_malloc(ptr - mdns_payload);
+  if (!mdns_records) {
+    return FALSE;
+  }
+  memcpy(mdns_records, mdns_payload, ptr - mdns_payload);
+
+  return TRUE;
 }
 
 /**
- * Send a mDNS service answer packet.
+ * Send a response made of precomputed records.
  *
- * @param name service name to query
- * @param id transaction ID in the DNS query packet
- * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
+ * @param id transaction ID, only used for unicast responses
+ * @param answers MDNS_RR_BIT set of the answer records
+ * @param additional MDNS_RR_BIT set of the additional records
+ * @param dst_addr where to send to, NULL to multicast
  */
-static err_t ICACHE_FLASH_ATTR
-mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
-	err_t err;
-	struct mdns_hdr *hdr;
-	struct mdns_answer ans;
-	struct mdns_service serv;
-	struct mdns_a_rr a_rr;
-	struct pbuf *p ,*p_sta;
-	char *query, *nptr;
-	char *query_end;
-	const char *pHostname;
-	const char *name = info->host_name;
-	int max_ttl = dst_addr ? 10 : 7200;
-	u8_t n;
-	u8_t i = 0;
-	u16_t length = 0;
-	u8_t addr1 = 12, addr2 = 12;
-	struct netif * sta_netif = NULL;
-	struct netif * ap_netif = NULL;
-	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
-	u16_t dns_class = dst_addr ? DNS_RRCLASS_IN : DNS_RRCLASS_FLUSH_IN;
-	/* if here, we have either a new query or a retry on a previous query to process */
-	p = pbuf_alloc(PBUF_TRANSPORT,
-			SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
-	if (p != NULL) {
-		LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
-		/* fill dns header */
-		hdr = (struct mdns_hdr*) p->payload;
-		os_memset(hdr, 0, SIZEOF_DNS_HDR);
-		hdr->id = htons(id);
-		hdr->flags1 = DNS_FLAG1_RESPONSE;
-		hdr->numanswers = htons(4);
-		hdr->numextrarr = htons(1);
-		query = (char*) hdr + SIZEOF_DNS_HDR;
-		query_end = (char *) p->payload + p->tot_len;
-		c_strlcpy(tmpBuf, service_name_with_suffix, sizeof(tmpBuf));
-
-		pHostname = tmpBuf;
-		--pHostname;
-
-		/* convert hostname into suitable query format. */
-		do {
-			++pHostname;
-			nptr = query;
-			++query;
-			++addr1;
-			++addr2;
-			for (n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname) {
-				*query = *pHostname;
-				++query;
-				++addr1;
-				++addr2;
-				++n;
-			}
-			*nptr = n;
-		} while (*pHostname != 0);
-		*query++ = '\0';
-		length = sizeof(MDNS_LOCAL);
-		addr1 -= length;
-		length = os_strlen(service_name_with_suffix) + 1;
-		addr2 -= length;
-
-		ans.type = htons(DNS_RRTYPE_PTR);
-		ans.class = htons(DNS_RRCLASS_IN);
-		ans.ttl = htonl(min(max_ttl, 300));
-		length = os_strlen(ms_info->host_desc) + MDNS_LENGTH_ADD + 1;
-		ans.len = htons(length);
-		length = 0;
-
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-		/* resize the query */
-		query = query + SIZEOF_DNS_ANSWER;
-
-		int name_offset = query - (const char *) hdr;
-
-		pHostname = ms_info->host_desc;
-		--pHostname;
-		/* convert hostname into suitable query format. */
-		do {
-			++pHostname;
-			nptr = query;
-			++query;
-			for (n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname) {
-				*query = *pHostname;
-				++query;
-				++n;
-			}
-			*nptr = n;
-		} while (*pHostname != 0);
-		*query++ = DNS_OFFSET_FLAG;
-		*query++ = DNS_DEFAULT_OFFSET;
-
-		*query++ = 0xc0 + (name_offset >> 8);
-		*query++ = name_offset & 0xff;
-
-		/* fill the answer */
-		ans.type = htons(DNS_RRTYPE_TXT);
-		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
-//		length = os_strlen(TXT_DATA) + MDNS_LENGTH_ADD + 1;
-		const char *attributes[12];
-		int attr_count = 0;
-		for(i = 0; i < 10 && (info->txt_data[i] != NULL); i++) {
-		  length += os_strlen(info->txt_data[i]);
-		  length++;
-		  attributes[attr_count++] = info->txt_data[i];
-		}
-		//MDNS_DBG("Found %d user attributes\n", i);
-		static const char *defaults[] = { "platform=nodemcu", NULL };
-		for(i = 0; defaults[i] != NULL; i++) {
-		  // See if this is a duplicate
-		  int j;
-		  int len = strchr(defaults[i], '=') + 1 - defaults[i];
-		  for (j = 0; j < attr_count; j++) {
-		    if (strncmp(attributes[j], defaults[i], len) == 0) {
-		      break;
-		    }
-		  }
-		  if (j == attr_count) {
-		    length += os_strlen(defaults[i]);
-		    length++;
-		    attributes[attr_count++] = defaults[i];
-		  }
-		}
-		//MDNS_DBG("Found %d total attributes\n", attr_count);
-
-		ans.len = htons(length);
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-		query = query + SIZEOF_DNS_ANSWER;
-		// Check enough space in the packet
-	        const char *end_of_packet = query + length + 2 + SIZEOF_DNS_ANSWER + SIZEOF_MDNS_SERVICE +
-		    os_strlen(ms_info->host_name) + 7 + 1 + 2 + SIZEOF_DNS_ANSWER + SIZEOF_MDNS_A_RR +
-		    2 + SIZEOF_DNS_ANSWER + 5;
-
-	        if (query_end <= end_of_packet) {
-		  MDNS_DBG("Too much data to send\n");
-		  pbuf_free(p);
-		  return ERR_MEM;
-		}
-		//MDNS_DBG("Query=%x, query_end=%x, end_ofpacket=%x, length=%x\n", query, query_end, end_of_packet, length);
-
-		i = 0;
-		while(attributes[i] != NULL && i < attr_count) {
-			pHostname = attributes[i];
-			--pHostname;
-			/* convert hostname into suitable query format. */
-			do {
-				++pHostname;
-				nptr = query;
-				++query;
-				for (n = 0;  *pHostname != 0; ++pHostname) {
-					*query = *pHostname;
-					++query;
-					++n;
-				}
-				*nptr = n;
-			} while (*pHostname != 0);
-			i++;
-		}
-//		*query++ = '\0';
-		// Increment by length
-		*query++ = 0xc0 + (name_offset >> 8);
-		*query++ = name_offset & 0xff;
-
-		// Increment by 2
-
-		ans.type = htons(DNS_RRTYPE_SRV);
-		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
-		c_strlcpy(tmpBuf,ms_info->host_name, sizeof(tmpBuf));
-		c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
-		c_strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
-		length = os_strlen(tmpBuf) + MDNS_LENGTH_ADD;
-		ans.len = htons(SIZEOF_MDNS_SERVICE + length);
-		length = 0;
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-
-		/* resize the query */
-		query = query + SIZEOF_DNS_ANSWER;
-
-		serv.prior = htons(0);
-		serv.weight = htons(0);
-		serv.port = htons(ms_info->service_port);
-		MEMCPY( query, &serv, SIZEOF_MDNS_SERVICE);
-		/* resize the query */
-		query = query + SIZEOF_MDNS_SERVICE;
-
-		int hostname_offset = query - (const char *) hdr;
-
-		pHostname = tmpBuf;
-		--pHostname;
-		do {
-			++pHostname;
-			nptr = query;
-			++query;
-			for (n = 0; *pHostname != '.' && *pHostname != 0; ++pHostname) {
-				*query = *pHostname;
-				++query;
-				++n;
-			}
-			*nptr = n;
-		} while (*pHostname != 0);
-		*query++ = '\0';
-
-		// increment by strlen(service_name) + 1 + 7 + sizeof_dns_answer + sizeof_mdns_service
-		
-		*query++ = 0xc0 + (hostname_offset >> 8);
-		*query++ = hostname_offset & 0xff;
-
-		ans.type = htons(DNS_RRTYPE_A);
-		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
-		ans.len = htons(DNS_IP_ADDR_LEN);
-
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-
-		/* resize the query */
-		query = query + SIZEOF_DNS_ANSWER;
-		
-		// increment by strlen(service_name) + 1 + 7 + sizeof_dns_answer 
-		
-
-		/* fill the payload of the mDNS message */
-		/* set the local IP address */
-		a_rr.src = 0;
-		MEMCPY( query, &a_rr, SIZEOF_MDNS_A_RR);
-		u8_t *addr_ptr = query + ((char *) &a_rr.src - (char *) &a_rr);
-		/* resize the query */
-		query = query + SIZEOF_MDNS_A_RR;
-
-		// Append the NSEC record that says we only have an A record
-		*query++ = 0xc0 + (hostname_offset >> 8);
-		*query++ = hostname_offset & 0xff;
-
-		ans.type = htons(DNS_RRTYPE_NSEC);
-		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
-		ans.len = htons(5);
-
-		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-		query = query + SIZEOF_DNS_ANSWER;
-		*query++ = 0xc0 + (hostname_offset >> 8);
-		*query++ = hostname_offset & 0xff;
-		*query++ = 0;
-		*query++ = 1;
-		*query++ = 0x40;
-
-
-		//MDNS_DBG("Final ptr=%x\n", query);
-
-		// increment by sizeof_mdns_a_rr
-
-		/* set the name of the authority field.
-		 * The same name as the Query using the offset address*/
-
-		/* resize pbuf to the exact dns query */
-		pbuf_realloc(p, (query) - ((char*) (p->payload)));
-
-		err = send_packet(p, dst_addr, dst_port, addr_ptr);
-
-		if (!dst_addr) {
-		  // this is being sent multicast...
-		  // so reset the timer
-		  os_timer_disarm(&mdns_timer);
-		  os_timer_arm(&mdns_timer, 1000 * 280, 1);
-		}
-	} else {
-		MDNS_DBG("ERR_MEM \n");
-		err = ERR_MEM;
-	}
-
-	return err;
-}
+static void ICACHE_FLASH_ATTR
+mdns_send_records(u16_t id, u32_t answers, u32_t additional, struct ip_addr *dst_addr, u16_t dst_port) {
+  u32_t now = system_get_time();
+  u32_t rrs;
+  u16_t len = SIZEOF_DNS_HDR;
+  u8_t *addr_ptr = NULL;
+  int rr;
+
+  additional &= ~answers;
+  if (!dst_addr) {
+    /* leave out what was just multicast, RFC 6762 section 6 */
+    bool had_answers = answers != 0;
+    for (rr = 0; rr < MDNS_RR_COUNT; rr++) {
+      if (now - mdns_rr[rr].last_multicast < MDNS_RATE_LIMIT_US) {
+	answers &= ~MDNS_RR_BIT(rr);
+	additional &= ~MDNS_RR_BIT(rr);
+      }
+    }
+    if (had_answers && !answers) {
+      return;
+    }
+  }
+  rrs = answers | additional;
+  if (!rrs) {
+    return;
+  }
 
-static char *append_nsec_record(char *query, u32_t actual_rr, int max_ttl) {
-  struct mdns_answer ans;
+  for (rr = 0; rr < MDNS_RR_COUNT; rr++) {
+    if (rrs & MDNS_RR_BIT(rr)) {
+      len += mdns_rr[rr].len;
+    }
+  }
 
-  ans.type = htons(DNS_RRTYPE_NSEC);
-  ans.class = htons(DNS_RRCLASS_IN);
-  ans.ttl = htonl(min(max_ttl, 300));
-  ans.len = htons(9);
-
-  MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-  char *rr_len = query + ((char *) &ans.len - (char *) &ans) + 1;
-  query = query + SIZEOF_DNS_ANSWER;
-  *query++ = 0xc0;
-  *query++ = sizeof(struct mdns_hdr);
-  *query++ = 0;
-  char *bm_len = query;
-  *query++ = 5;
-  char *abase = query;
-  *query++ = 0;
-  *query++ = 0;
-  *query++ = 0;
-  *query++ = 0;
-  *query++ = 0;
-
-  while (actual_rr > 0) {
-    int v = actual_rr & 255;
-
-    if (v < 5 * 8) {
-      abase[v >> 3] |= 0x80 >> (v & 7);
-
-      actual_rr = actual_rr >> 8;
+  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if (p == NULL) {
+    MDNS_DBG("ERR_MEM \n");
+    return;
+  }
+  LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
+  /* fill dns header */
+  struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
+  os_memset(hdr, 0, SIZEOF_DNS_HDR);
+  hdr->id = dst_addr ? htons(id) : 0;
+  hdr->flags1 = DNS_FLAG1_RESPONSE;
+  u8_t *ptr = (u8_t *) (hdr + 1);
+
+  int section;
+  for (section = 0; section < 2; section++) {
+    u32_t set = section ? additional : answers;
+    u16_t count = 0;
+    for (rr = 0; rr < MDNS_RR_COUNT; rr++) {
+      struct mdns_record *rec = &mdns_rr[rr];
+      if (!(set & MDNS_RR_BIT(rr))) {
+	continue;
+      }
+      memcpy(ptr, mdns_records + rec->offset, rec->len);
+      u8_t *fixed = ptr + rec->name_len;
+      if (dst_addr) {
+	/* unicast answers are not meant to be cached for long */
+	u32_t ttl = htonl(min(rec->ttl, 10));
+	MEMCPY(fixed + 4, &ttl, sizeof(ttl));
+      } else {
+	if (rec->unique) {
+	  fixed[2] = DNS_RRCLASS_FLUSH_IN >> 8;
+	}
+	rec->last_multicast = now;
+      }
+      if (rr == MDNS_RR_A) {
+	addr_ptr = fixed + SIZEOF_DNS_ANSWER;
+      }
+      ptr += rec->len;
+      count++;
+    }
+    if (section) {
+      hdr->numextrarr = htons(count);
+    } else {
+      hdr->numanswers = htons(count);
     }
   }
 
-  while (query[-1] == 0) {
-    query--;
-    (*bm_len)--;
-    (*rr_len)--;
+  send_packet(p, dst_addr, dst_port, addr_ptr);
+
+  if (!dst_addr && (rrs & MDNS_RR_BIT(MDNS_RR_SRV))) {
+    // this is being sent multicast...
+    // so reset the timer
+    os_timer_disarm(&mdns_timer);
+    os_timer_arm(&mdns_timer, 1000 * 280, 1);
   }
+}
 
-  return query;
+/**
+ * Check a known answer of a query against our records, RFC 6762 section 7.1
+ *
+ * @return MDNS_RR_BIT of the record the querier already has, 0 if none
+ */
+static u32_t ICACHE_FLASH_ATTR
+mdns_known_answer(struct mdns_hdr *hdr, u8_t *name, u8_t *end, struct mdns_answer *ans, u8_t *rdata) {
+  u8_t *rdend = rdata + ntohs(ans->len);
+  int rr;
+
+  for (rr = 0; rr < MDNS_RR_COUNT; rr++) {
+    struct mdns_record *rec = &mdns_rr[rr];
+    if (ntohs(ans->type) != rec->type || ntohl(ans->ttl) < rec->ttl / 2) {
+      continue;
+    }
+    if (mdns_compare_name((unsigned char *) rec->name, name, (unsigned char *) hdr, end) != 0) {
+      continue;
+    }
+    if (rec->target && mdns_compare_name((unsigned char *) rec->target, rdata, (unsigned char *) hdr, rdend) != 0) {
+      continue;
+    }
+    return MDNS_RR_BIT(rr);
+  }
+
+  return 0;
 }
 
 /**
- * This sends an empty response -- this is used when we doin't have an RR to send
- * but the name exists
+ * Answer all questions of a query in one multicast and one unicast response.
  */
+static void ICACHE_FLASH_ATTR
+mdns_answer_query(struct mdns_hdr *hdr, u8_t *qend, struct ip_addr *addr, u16_t port) {
+  u32_t mc_answers = 0, mc_additional = 0;
+  u32_t uc_answers = 0, uc_additional = 0;
+  u32_t known = 0;
+  u16_t nquestions = ntohs(hdr->numquestions);
+  u16_t nanswers = ntohs(hdr->numanswers);
+  u8_t *ptr = (u8_t *) (hdr + 1);
+  u16_t qno;
+  int namelen;
+
+  /* the known answers follow the questions */
+  for (qno = 0; qno < nquestions; qno++) {
+    namelen = mdns_namelen(ptr, qend);
+    if (namelen < 0 || SIZEOF_DNS_QUERY > qend - ptr - namelen) {
+      return;
+    }
+    ptr += namelen + SIZEOF_DNS_QUERY;
+  }
+  for (qno = 0; qno < nanswers; qno++) {
+    struct mdns_answer ans;
+    namelen = mdns_namelen(ptr, qend);
+    if (namelen < 0 || SIZEOF_DNS_ANSWER > qend - ptr - namelen) {
+      break;
+    }
+    MEMCPY(&ans, ptr + namelen, SIZEOF_DNS_ANSWER);
+    if (ntohs(ans.len) > qend - ptr - namelen - SIZEOF_DNS_ANSWER) {
+      break;	// the record data runs past the packet
+    }
+    known |= mdns_known_answer(hdr, ptr, qend, &ans, ptr + namelen + SIZEOF_DNS_ANSWER);
+    ptr += namelen + SIZEOF_DNS_ANSWER + ntohs(ans.len);
+  }
 
-static void 
-mdns_send_no_rr(struct mdns_hdr *req, const char *name, u32_t actual_rr, struct ip_addr *dst_addr, u16_t dst_port) {
-  int max_ttl = dst_addr ? 10 : 7200;
-  struct pbuf *p;
-  p = pbuf_alloc(PBUF_TRANSPORT,
-		  SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
-  if (p != NULL) {
-    LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
-    /* fill dns header */
-    struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
-    os_memset(hdr, 0, SIZEOF_DNS_HDR);
-    hdr->id = req->id;
-    hdr->flags1 = DNS_FLAG1_RESPONSE;
-    hdr->numextrarr = htons(1);
-    char *query = (char*) hdr + SIZEOF_DNS_HDR;
-    char *query_end = (char *) p->payload + p->tot_len;
-    // Now copy over the dns name 
-    int len = strlen(name);
+  ptr = (u8_t *) (hdr + 1);
+  for (qno = 0; qno < nquestions; qno++) {
+    struct mdns_query qry;
+    u32_t answers = 0, additional = 0;
+
+    namelen = mdns_namelen(ptr, qend);   // checked above
+    MEMCPY(&qry, ptr + namelen, SIZEOF_DNS_QUERY);
 
-    if (query_end - query >= len + SIZEOF_DNS_QUERY + 15) {
-      query = copy_and_encode_name((char *) (hdr + 1), name);
+    u16_t qry_type = ntohs(qry.type);
+    bool any = qry_type == DNS_RRTYPE_ANY;
 
-      query = append_nsec_record(query, actual_rr, max_ttl);
+    if (mdns_compare_name((unsigned char *) DNS_SD_SERVICE, ptr, (unsigned char *) hdr, qend) == 0) {
+      if (qry_type == DNS_RRTYPE_PTR || any) {
+	answers = MDNS_RR_BIT(MDNS_RR_SERVICES);
+      }
+    } else if (mdns_compare_name((unsigned char *) service_name_with_suffix, ptr, (unsigned char *) hdr, qend) == 0) {
+      if (qry_type == DNS_RRTYPE_PTR || any) {
+	answers = MDNS_RR_BIT(MDNS_RR_PTR);
+	additional = MDNS_RR_BIT(MDNS_RR_TXT) | MDNS_RR_BIT(MDNS_RR_SRV) | MDNS_RR_BIT(MDNS_RR_A) |
+	    MDNS_RR_BIT(MDNS_RR_NSEC_HOST) | MDNS_RR_BIT(MDNS_RR_NSEC_INST);
+      }
+    } else if (mdns_compare_name((unsigned char *) host_fqdn, ptr, (unsigned char *) hdr, qend) == 0) {
+      if (qry_type == DNS_RRTYPE_A || any) {
+	answers = MDNS_RR_BIT(MDNS_RR_A);
+      }
+      additional = MDNS_RR_BIT(MDNS_RR_NSEC_HOST);
+    } else if (mdns_compare_name((unsigned char *) instance_fqdn, ptr, (unsigned char *) hdr, qend) == 0) {
+      if (qry_type == DNS_RRTYPE_TXT || any) {
+	answers |= MDNS_RR_BIT(MDNS_RR_TXT);
+      }
+      if (qry_type == DNS_RRTYPE_SRV || any) {
+	answers |= MDNS_RR_BIT(MDNS_RR_SRV);
+	additional = MDNS_RR_BIT(MDNS_RR_A) | MDNS_RR_BIT(MDNS_RR_NSEC_HOST);
+      }
+      additional |= MDNS_RR_BIT(MDNS_RR_NSEC_INST);
+    }
+
+    ptr += namelen + SIZEOF_DNS_QUERY;
+
+    /* don't tell the querier what it already knows */
+    if (answers && !(answers & ~known)) {
+      continue;
+    }
+    answers &= ~known;
+    additional &= ~known;
+
+    if (port == DNS_MDNS_PORT && (ntohs(qry.class) & 0x8000) == 0) {
+      mc_answers |= answers;
+      mc_additional |= additional;
+    } else {
+      uc_answers |= answers;
+      uc_additional |= additional;
+    }
+  }
+
+  mdns_send_records(0, mc_answers, mc_additional, NULL, 0);
+  mdns_send_records(ntohs(hdr->id), uc_answers, uc_additional, addr, port);
+}
 
-      // Set the length code correctly
-      pbuf_realloc(p, query - ((char*) (p->payload)));
+static struct mdns_instance *
+mdns_find_instance(const char *label, struct mdns_instance ***pprev) {
+  struct mdns_instance **pp;
 
-      send_packet(p, dst_addr, dst_port, NULL);
+  for (pp = &browse->instances; *pp; pp = &(*pp)->next) {
+    const char *a = (*pp)->label;
+    const char *b = label;
+    while (*a && mdns_lower(*a) == mdns_lower(*b)) {
+      a++;
+      b++;
+    }
+    if (*a == *b) {
+      break;
     }
   }
+  if (pprev) {
+    *pprev = pp;
+  }
+
+  return *pp;
 }
 
 /**
- * This sends a single A record and the NSEC record as additional
+ * Look for instances of the browsed service in a response. Responders send
+ * the SRV, TXT and A records along with the PTR record, those are reported
+ * when present.
  */
+static void ICACHE_FLASH_ATTR
+mdns_browse_response(struct mdns_hdr *hdr, u8_t *end) {
+  struct mdns_browse *b = browse;
+  u8_t *names[MDNS_BROWSE_RRS];
+  struct mdns_answer rrs[MDNS_BROWSE_RRS];
+  int count = 0;
+  int i, j;
+  u16_t n;
+  int namelen;
+  u8_t *ptr = (u8_t *) (hdr + 1);
+  u8_t *pktbase = (u8_t *) hdr;
+
+  for (n = ntohs(hdr->numquestions); n > 0; n--) {
+    namelen = mdns_namelen(ptr, end);
+    if (namelen < 0 || SIZEOF_DNS_QUERY > end - ptr - namelen) {
+      return;
+    }
+    ptr += namelen + SIZEOF_DNS_QUERY;
+  }
+  n = ntohs(hdr->numanswers) + ntohs(hdr->numauthrr) + ntohs(hdr->numextrarr);
+  while (n-- > 0 && count < MDNS_BROWSE_RRS) {
+    namelen = mdns_namelen(ptr, end);
+    if (namelen < 0 || SIZEOF_DNS_ANSWER > end - ptr - namelen) {
+      break;
+    }
+    names[count] = ptr;
+    MEMCPY(&rrs[count], ptr + namelen, SIZEOF_DNS_ANSWER);
+    if (ntohs(rrs[count].len) > end - ptr - namelen - SIZEOF_DNS_ANSWER) {
+      break;	// the record data runs past the packet
+    }
+    ptr += namelen + SIZEOF_DNS_ANSWER + ntohs(rrs[count].len);
+    count++;
+  }
 
-static void 
-mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr, u16_t dst_port) {
-  int max_ttl = dst_addr ? 10 : 7200;
-  struct pbuf *p;
-  p = pbuf_alloc(PBUF_TRANSPORT,
-		  SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
-  if (p != NULL) {
-    LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
-    /* fill dns header */
-    struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
-    os_memset(hdr, 0, SIZEOF_DNS_HDR);
-    hdr->id = req->id;
-    hdr->flags1 = DNS_FLAG1_RESPONSE;
-    hdr->numanswers = htons(1);
-    hdr->numextrarr = htons(1);
-    char *query = (char*) hdr + SIZEOF_DNS_HDR;
-    char *query_end = (char *) p->payload + p->tot_len;
-    // Now copy over the dns name 
-    int len = strlen(name) + 1;
-
-    if (query_end - query >= len + SIZEOF_DNS_QUERY + 4 + 2 + 4 + 15) {
-      query = copy_and_encode_name((char *) (hdr + 1), name);
+  for (i = 0; i < count; i++) {
+    char label[64];
+    char host[MDNS_NAME_LENGTH];
+    char txt[256];
+    struct nodemcu_mdns_result result;
+    struct mdns_instance *inst, **pprev;
+    u8_t *rdata = names[i] + mdns_namelen(names[i], end) + SIZEOF_DNS_ANSWER;
+
+    if (ntohs(rrs[i].type) != DNS_RRTYPE_PTR ||
+	mdns_compare_name((unsigned char *) b->service, names[i], pktbase, end) != 0) {
+      continue;
+    }
+    u8_t *rest = mdns_first_label(rdata, pktbase, end, label);
+    if (!rest || mdns_compare_name((unsigned char *) b->service, rest, pktbase, end) != 0) {
+      continue;
+    }
 
-      struct mdns_answer ans;
+    inst = mdns_find_instance(label, &pprev);
+    if (rrs[i].ttl == 0) {
+      /* goodbye, the instance is gone */
+      if (inst) {
+	*pprev = inst->next;
+	os_free(inst->label);
+	os_free(inst);
+	b->count--;
+      }
+      continue;
+    }
+    if (inst) {
+      inst->ttl = ntohl(rrs[i].ttl);
+      inst->seen = system_get_time();
+      continue;
+    }
 
-      ans.type = htons(DNS_RRTYPE_A);
-      ans.class = htons(DNS_RRCLASS_IN);
-      ans.ttl = htonl(min(max_ttl, 300));
-      ans.len = htons(4);
+    os_memset(&result, 0, sizeof(result));
+    result.instance = label;
 
-      MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
-      query = query + SIZEOF_DNS_ANSWER;
-      char *addr_ptr = query;
-      query += 4;
+    for (j = 0; j < count; j++) {
+      u16_t type = ntohs(rrs[j].type);
+      char other[64];
+      u8_t *other_rest;
 
-      // Now add the NSEC record
-      *query++ = 0xc0;
-      *query++ = sizeof(*hdr);
-      query = append_nsec_record(query, DNS_RRTYPE_A, max_ttl);
+      if (type != DNS_RRTYPE_SRV && type != DNS_RRTYPE_TXT) {
+	continue;
+      }
+      other_rest = mdns_first_label(names[j], pktbase, end, other);
+      if (!other_rest || c_strcmp(other, label) != 0 ||
+	  mdns_compare_name((unsigned char *) b->service, other_rest, pktbase, end) != 0) {
+	continue;
+      }
+      u8_t *data = names[j] + mdns_namelen(names[j], end) + SIZEOF_DNS_ANSWER;
+      u16_t len = ntohs(rrs[j].len);
 
-      // Set the length code correctly
-      pbuf_realloc(p, query - ((char*) (p->payload)));
+      if (type == DNS_RRTYPE_SRV && len > SIZEOF_MDNS_SERVICE) {
+	result.port = (data[4] << 8) + data[5];
+	if (mdns_read_name(data + SIZEOF_MDNS_SERVICE, pktbase, end, host, sizeof(host)) == 0) {
+	  result.host_name = host;
+	}
+      } else if (type == DNS_RRTYPE_TXT) {
+	/* split the strings up in place, each gets a terminating 0 */
+	char *out = txt;
+	int slot = 0;
+	u8_t *p = data;
+	while (p < data + len && slot < sizeof(result.txt_data) / sizeof(result.txt_data[0])) {
+	  u8_t slen = *p++;
+	  if (slen == 0 || p + slen > data + len || out + slen + 1 > txt + sizeof(txt)) {
+	    break;
+	  }
+	  memcpy(out, p, slen);
+	  out[slen] = 0;
+	  result.txt_data[slot++] = out;
+	  out += slen + 1;
+	  p += slen;
+	}
+      }
+    }
 
-      send_packet(p, dst_addr, dst_port, addr_ptr);
+    if (result.host_name) {
+      for (j = 0; j < count; j++) {
+	if (ntohs(rrs[j].type) == DNS_RRTYPE_A && ntohs(rrs[j].len) == SIZEOF_MDNS_A_RR &&
+	    mdns_compare_name((unsigned char *) result.host_name, names[j], pktbase, end) == 0) {
+	  u8_t *data = names[j] + mdns_namelen(names[j], end) + SIZEOF_DNS_ANSWER;
+	  memcpy(&result.ip, data, sizeof(result.ip));
+	  break;
+	}
+      }
+    }
+
+    if (b->count < MDNS_BROWSE_MAX) {
+      inst = (struct mdns_instance *) os_zalloc(sizeof(struct mdns_instance));
+      if (inst) {
+	inst->label = c_strdup(label);
+	if (!inst->label) {
+	  os_free(inst);
+	} else {
+	  inst->ttl = ntohl(rrs[i].ttl);
+	  inst->seen = system_get_time();
+	  inst->next = b->instances;
+	  b->instances = inst;
+	  b->count++;
+	}
+      }
+    }
+
+    b->callback(&result, b->arg);
+    if (browse != b) {
+      /* the callback stopped browsing */
+      return;
     }
   }
 }
@@ -862,12 +1058,9 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
 static void ICACHE_FLASH_ATTR
 mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		u16_t port) {
-	u16_t i;
 	struct mdns_hdr *hdr;
-	u8_t nquestions;
 	LWIP_UNUSED_ARG(arg);
 	LWIP_UNUSED_ARG(pcb);
-	struct nodemcu_mdns_info *info = (struct nodemcu_mdns_info *)arg;
 	/* is the dns message too big ? */
 	if (p->tot_len > DNS_MSG_SIZE) {
 		LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: pbuf too big\n"));
@@ -883,86 +1076,14 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 	}
 	/* copy dns payload inside static buffer for processing */
 	if (pbuf_copy_partial(p, mdns_payload, p->tot_len, 0) == p->tot_len) {
-		/* The ID in the DNS header should be our entry into the name table. */
 		hdr = (struct mdns_hdr*) mdns_payload;
 
-		i = htons(hdr->id);
-
-		nquestions = htons(hdr->numquestions);
-		//nanswers   = htons(hdr->numanswers);
-		/* if we have a question send an answer if necessary */
-		u8_t qno;
-		u8_t *qptr = (u8_t *) (hdr + 1);
-		u8_t *qend = mdns_payload + p->tot_len;
-		for (qno = 0; qno < nquestions && qptr < qend; qno++) {
-		  char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
-		  struct mdns_query qry;
-
-		  int namelen = mdns_namelen(qptr, qend - qptr);
-
-		  memcpy(&qry, namelen + qptr, sizeof(qry));
-
-		  u16_t qry_type = ntohs(qry.type);
-
-		  if (port == 5353 && (ntohs(qry.class) & 0x8000) == 0) {
-		    addr = NULL;
-		  }
-
-		  u32_t actual_rr = 0;
-
-		  const char *no_rr_name = NULL;
-
-		  /* MDNS_DS_DOES_NAME_CHECK */
-		  /* Check if the name in the "question" part match with the name of the MDNS DS service. */
-		  if (mdns_compare_name((unsigned char *) DNS_SD_SERVICE,
-				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service_type(i, addr, port);
-		    } else {
-		      no_rr_name = DNS_SD_SERVICE;
-		      actual_rr = DNS_RRTYPE_PTR;
-		    }
-		  } else if (mdns_compare_name((unsigned char *) service_name_with_suffix,
-				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service(info, i, addr, port);
-		    } else {
-		      no_rr_name = service_name_with_suffix;
-		      actual_rr = DNS_RRTYPE_PTR;
-		    }
-		  } else {
-		    c_strlcpy(tmpBuf,ms_info->host_name, sizeof(tmpBuf));
-		    c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
-		    c_strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
-		    no_rr_name = tmpBuf;
-
-		    if (mdns_compare_name((unsigned char *) tmpBuf,
-				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		      if (qry_type == DNS_RRTYPE_A || qry_type == DNS_RRTYPE_ANY) {
-			mdns_send_a_rr(hdr, tmpBuf, addr, port);
-		      } else {
-			actual_rr = DNS_RRTYPE_A;
-		      }
-		    } else {
-		      c_strlcpy(tmpBuf,ms_info->host_desc, sizeof(tmpBuf));
-		      c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
-		      c_strlcat(tmpBuf, service_name_with_suffix, sizeof(tmpBuf));
-		      if (mdns_compare_name((unsigned char *) tmpBuf,
-				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-			if (qry_type == DNS_RRTYPE_TXT || qry_type == DNS_RRTYPE_SRV || qry_type == DNS_RRTYPE_ANY) {
-			  mdns_send_service(info, i, addr, port);
-			} else {
-			  actual_rr = (DNS_RRTYPE_TXT << 8) + DNS_RRTYPE_SRV;
+		if (hdr->flags1 & DNS_FLAG1_QR) {
+			if (browse) {
+				mdns_browse_response(hdr, mdns_payload + p->tot_len);
 			}
-		      }
-		    }
-		  }
-
-		  if (actual_rr) {
-		    mdns_send_no_rr(hdr, no_rr_name, actual_rr, addr, port);
-		  }
-
-		  qptr += namelen + sizeof(qry);		// Now points to next question
+		} else if (ms_info && mdns_records) {
+			mdns_answer_query(hdr, mdns_payload + p->tot_len, addr, port);
 		}
 	}
 memerr1:
@@ -971,19 +1092,75 @@ memerr1:
 	return;
 }
 
-static void
-mdns_free_info(struct nodemcu_mdns_info *info) {
-  os_free((void *) info);
+/**
+ * Set up the UDP pcb shared by the responder and browsing, if not done yet.
+ */
+static bool ICACHE_FLASH_ATTR
+mdns_open(void) {
+  if (mdns_pcb) {
+    return TRUE;
+  }
+
+  /* initialize default DNS server address */
+  multicast_addr.addr = DNS_MULTICAST_ADDRESS;
+
+  mdns_payload = (u8_t *) os_malloc(DNS_MSG_SIZE);
+  if (!mdns_payload) {
+    MDNS_DBG("Alloc fail\n");
+    return FALSE;
+  }
+
+  /* initialize mDNS */
+  mdns_pcb = udp_new();
+
+  if (!mdns_pcb) {
+    goto fail;
+  }
+  /* join to the multicast address 224.0.0.251 */
+  if(wifi_get_opmode() & 0x01) {
+    struct netif *sta_netif = (struct netif *)eagle_lwip_getif(0x00);
+    if (sta_netif && sta_netif->ip_addr.addr && igmp_joingroup(&sta_netif->ip_addr, &multicast_addr) != ERR_OK) {
+      MDNS_DBG("sta udp_join_multigrup failed!\n");
+      goto fail;
+    };
+  }
+  if(wifi_get_opmode() & 0x02) {
+    struct netif *ap_netif = (struct netif *)eagle_lwip_getif(0x01);
+    if (ap_netif && ap_netif->ip_addr.addr && igmp_joingroup(&ap_netif->ip_addr, &multicast_addr) != ERR_OK) {
+      MDNS_DBG("ap udp_join_multigrup failed!\n");
+      goto fail;
+    };
+  }
+  /* join to any IP address at the port 5353 */
+  if (udp_bind(mdns_pcb, IP_ADDR_ANY, DNS_MDNS_PORT) != ERR_OK) {
+	  MDNS_DBG("udp_bind failed!\n");
+	  goto fail;
+  };
+
+  /*loopback function for the multicast(224.0.0.251) messages received at port 5353*/
+  udp_recv(mdns_pcb, mdns_recv, NULL);
+  mdns_flag = 1;
+
+  return TRUE;
+
+fail:
+  if (mdns_pcb) {
+    udp_remove(mdns_pcb);
+  }
+  os_free(mdns_payload);
+  mdns_payload = NULL;
+  mdns_pcb = NULL;
+  return FALSE;
 }
 
 /**
- * close the UDP pcb .
+ * close the UDP pcb, once neither the responder nor browsing use it.
  */
-void ICACHE_FLASH_ATTR
-nodemcu_mdns_close(void)
-{
-  os_timer_disarm(&mdns_timer);
-
+static void ICACHE_FLASH_ATTR
+mdns_release(void) {
+  if (ms_info || browse) {
+    return;
+  }
   if (mdns_pcb != NULL) {
     udp_remove(mdns_pcb);
   }
@@ -992,8 +1169,39 @@ nodemcu_mdns_close(void)
   }
   mdns_payload = NULL;
   mdns_pcb = NULL;
+  mdns_flag = 0;
+}
+
+static void
+mdns_free_info(struct nodemcu_mdns_info *info) {
+  os_free((void *) info);
+}
+
+/**
+ * Stop the responder.
+ */
+void ICACHE_FLASH_ATTR
+nodemcu_mdns_close(void)
+{
+  os_timer_disarm(&mdns_timer);
+
   mdns_free_info(ms_info);
   ms_info = NULL;
+  if (mdns_records) {
+    os_free(mdns_records);
+  }
+  mdns_records = NULL;
+  if (host_fqdn) {
+    os_free(host_fqdn);
+  }
+  host_fqdn = NULL;
+  if (instance_fqdn) {
+    os_free(instance_fqdn);
+  }
+  instance_fqdn = NULL;
+  register_flag = 0;
+
+  mdns_release();
 }
 
 static void ICACHE_FLASH_ATTR
@@ -1015,11 +1223,14 @@ mdns_reg_handler_restart(void) {
 
 static void ICACHE_FLASH_ATTR
 mdns_reg(struct nodemcu_mdns_info *info) {
-  mdns_send_service(info,0,0,0);
+  u32_t announce = MDNS_RR_BIT(MDNS_RR_PTR) | MDNS_RR_BIT(MDNS_RR_TXT) |
+      MDNS_RR_BIT(MDNS_RR_SRV) | MDNS_RR_BIT(MDNS_RR_A);
+
   if (reg_counter++ > 10) {
-    mdns_send_service_type(0,0,0);
+    announce |= MDNS_RR_BIT(MDNS_RR_SERVICES);
     reg_counter = 0;
   }
+  mdns_send_records(0, announce, MDNS_RR_BIT(MDNS_RR_NSEC_HOST) | MDNS_RR_BIT(MDNS_RR_NSEC_INST), NULL, 0);
 }
 
 static struct nodemcu_mdns_info *
@@ -1064,9 +1275,6 @@ mdns_dup_info(const struct nodemcu_mdns_info *info) {
  */
 bool ICACHE_FLASH_ATTR
 nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
-  /* initialize default DNS server address */
-  multicast_addr.addr = DNS_MULTICAST_ADDRESS;
-  struct ip_info ipconfig;
   mdns_free_info(ms_info);
   ms_info = mdns_dup_info(info);		// Save the passed block. We need all the data forever
 
@@ -1074,17 +1282,12 @@ nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
     return FALSE;
   }
 
-  if (mdns_payload) {
-    os_free(mdns_payload);
-  }
-  mdns_payload = (u8_t *) os_malloc(DNS_MSG_SIZE);
-  if (!mdns_payload) {
-    MDNS_DBG("Alloc fail\n");
+  LWIP_DEBUGF(DNS_DEBUG, ("dns_init: initializing\n"));
+
+  if (!mdns_open()) {
     return FALSE;
   }
 
-  LWIP_DEBUGF(DNS_DEBUG, ("dns_init: initializing\n"));
-
   mdns_set_servicename(ms_info->service_name);
 
   // get the host name as instrumentName_serialNumber for MDNS
@@ -1092,37 +1295,11 @@ nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
   MDNS_DBG("host_name = %s\n", ms_info->host_name);
   MDNS_DBG("server_name = %s\n", service_name_with_suffix);
 
-  /* initialize mDNS */
-  mdns_pcb = udp_new();
-
-  if (!mdns_pcb) {
+  if (!mdns_build_records(ms_info)) {
     return FALSE;
   }
-  /* join to the multicast address 224.0.0.251 */
-  if(wifi_get_opmode() & 0x01) {
-    struct netif *sta_netif = (struct netif *)eagle_lwip_getif(0x00);
-    if (sta_netif && sta_netif->ip_addr.addr && igmp_joingroup(&sta_netif->ip_addr, &multicast_addr) != ERR_OK) {
-      MDNS_DBG("sta udp_join_multigrup failed!\n");
-      return FALSE;
-    };
-  }
-  if(wifi_get_opmode() & 0x02) {
-    struct netif *ap_netif = (struct netif *)eagle_lwip_getif(0x01);
-    if (ap_netif && ap_netif->ip_addr.addr && igmp_joingroup(&ap_netif->ip_addr, &multicast_addr) != ERR_OK) {
-      MDNS_DBG("ap udp_join_multigrup failed!\n");
-      return FALSE;
-    };
-  }
   register_flag = 1;
-  /* join to any IP address at the port 5353 */
-  if (udp_bind(mdns_pcb, IP_ADDR_ANY, DNS_MDNS_PORT) != ERR_OK) {
-	  MDNS_DBG("udp_bind failed!\n");
-	  return FALSE;
-  };
 
-  /*loopback function for the multicast(224.0.0.251) messages received at port 5353*/
-  udp_recv(mdns_pcb, mdns_recv, ms_info);
-  mdns_flag = 1;
   /*
    * Register the name of the instrument
    */
@@ -1138,4 +1315,133 @@ nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
   return TRUE;
 }
 
+/**
+ * Send a PTR query for the browsed service, listing the instances already
+ * known so their responders stay quiet (RFC 6762 section 7.1).
+ */
+static void ICACHE_FLASH_ATTR
+mdns_browse_query(void *arg) {
+  struct mdns_browse *b = (struct mdns_browse *) arg;
+  struct mdns_instance *inst;
+  u32_t now = system_get_time();
+  u16_t nanswers = 0;
+
+  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, DNS_MSG_SIZE, PBUF_RAM);
+  if (p != NULL) {
+    LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
+    struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
+    u8_t *ptr = (u8_t *) (hdr + 1);
+    u8_t *end = (u8_t *) p->payload + DNS_MSG_SIZE;
+    struct mdns_query qry;
+
+    os_memset(hdr, 0, SIZEOF_DNS_HDR);
+    hdr->numquestions = htons(1);
+    ptr = copy_and_encode_name(ptr, b->service);
+    qry.type = htons(DNS_RRTYPE_PTR);
+    qry.class = htons(DNS_RRCLASS_IN);
+    MEMCPY(ptr, &qry, SIZEOF_DNS_QUERY);
+    ptr += SIZEOF_DNS_QUERY;
+
+    for (inst = b->instances; inst; inst = inst->next) {
+      u32_t age = (now - inst->seen) / 1000000;
+      u16_t len = os_strlen(inst->label);
+      struct mdns_answer ans;
+
+      if (age >= inst->ttl / 2) {
+	continue;
+      }
+      if (ptr + 2 + SIZEOF_DNS_ANSWER + 1 + len + 2 > end) {
+	break;
+      }
+      *ptr++ = DNS_OFFSET_FLAG;
+      *ptr++ = DNS_DEFAULT_OFFSET;
+      ans.type = htons(DNS_RRTYPE_PTR);
+      ans.class = htons(DNS_RRCLASS_IN);
+      ans.ttl = htonl(inst->ttl - age);
+      ans.len = htons(1 + len + 2);
+      MEMCPY(ptr, &ans, SIZEOF_DNS_ANSWER);
+      ptr += SIZEOF_DNS_ANSWER;
+      *ptr++ = len;
+      memcpy(ptr, inst->label, len);
+      ptr += len;
+      *ptr++ = DNS_OFFSET_FLAG;
+      *ptr++ = DNS_DEFAULT_OFFSET;
+      nanswers++;
+    }
+    hdr->numanswers = htons(nanswers);
+
+    pbuf_realloc(p, ptr - (u8_t *) p->payload);
+    send_packet(p, NULL, 0, NULL);
+  }
+
+  if (++b->queries < MDNS_BROWSE_QUERIES) {
+    os_timer_arm(&b->timer, 1000 << (b->queries - 1), 0);
+  }
+}
+
+/**
+ * Stop browsing, forgetting the instances found.
+ */
+void ICACHE_FLASH_ATTR
+nodemcu_mdns_browse_stop(void) {
+  struct mdns_browse *b = browse;
+
+  if (!b) {
+    return;
+  }
+  browse = NULL;
+  os_timer_disarm(&b->timer);
+  while (b->instances) {
+    struct mdns_instance *inst = b->instances;
+    b->instances = inst->next;
+    os_free(inst->label);
+    os_free(inst);
+  }
+  os_free(b->service);
+  os_free(b);
+
+  mdns_release();
+}
+
+/**
+ * Look for instances of a service. callback is called once for every
+ * instance found, until browsing is stopped.
+ *
+ * returns TRUE if it worked, FALSE if it failed.
+ */
+bool ICACHE_FLASH_ATTR
+nodemcu_mdns_browse(const char *service, nodemcu_mdns_browse_cb callback, void *arg) {
+  char tmpBuf[128];
+
+  nodemcu_mdns_browse_stop();
+
+  if (os_strlen(service) > sizeof(tmpBuf) - sizeof("_._tcp.local")) {
+    return FALSE;
+  }
+  os_sprintf(tmpBuf, "_%s._tcp.local", service);
+
+  struct mdns_browse *b = (struct mdns_browse *) os_zalloc(sizeof(struct mdns_browse));
+  if (!b) {
+    return FALSE;
+  }
+  b->service = c_strdup(tmpBuf);
+  if (!b->service) {
+    os_free(b);
+    return FALSE;
+  }
+  b->callback = callback;
+  b->arg = arg;
+  browse = b;
+
+  if (!mdns_open()) {
+    nodemcu_mdns_browse_stop();
+    return FALSE;
+  }
+
+  os_timer_setfn(&b->timer, mdns_browse_query, b);
+  mdns_browse_query(b);
+
+  return TRUE;
+}
+
 #endif /* LWIP_MDNS */
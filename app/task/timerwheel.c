@@ -0,0 +1,97 @@
+/**
+  A hashed timer wheel shared by modules needing many one-shot timeouts, such
+  as protocol retransmissions.
+ */
+#include "task/timerwheel.h"
+#include "c_string.h"
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+static void timerwheel_link (timerwheel_timer_t **head, timerwheel_timer_t *timer) {
+  timer->next = *head;
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void timerwheel_unlink (timerwheel_timer_t *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static void timerwheel_tick (void *arg) {
+  timerwheel_t *wheel = (timerwheel_t *)arg;
+  uint32 tick_us = wheel->resolution * 1000;
+  uint32 ticks, steps, slot;
+
+  /* the OS timer may run late, catch up with the time that really passed */
+  ticks = (system_get_time() - wheel->last_us) / tick_us;
+  if (ticks == 0)
+    return;
+  wheel->last_us += ticks * tick_us;
+
+  slot = wheel->now + 1;
+  wheel->now += ticks;
+  steps = ticks < TIMERWHEEL_SLOTS ? ticks : TIMERWHEEL_SLOTS;
+
+  while (steps--) {
+    timerwheel_timer_t **head = &wheel->slots[slot++ & SLOT_MASK];
+    timerwheel_timer_t *timer;
+
+    /* detach the slot first, callbacks may add timers to it */
+    wheel->expiring = *head;
+    if (wheel->expiring)
+      wheel->expiring->pprev = &wheel->expiring;
+    *head = NULL;
+
+    while ((timer = wheel->expiring) != NULL) {
+      timerwheel_unlink(timer);
+      if ((int32)(timer->expires - wheel->now) > 0) {
+        timerwheel_link(head, timer);   // due in a later round
+      } else {
+        wheel->pending--;
+        timer->callback(timer, timer->arg);
+      }
+    }
+  }
+
+  if (wheel->pending == 0)
+    os_timer_disarm(&wheel->timer);
+}
+
+void timerwheel_init (timerwheel_t *wheel, uint32 resolution_ms) {
+  c_memset(wheel, 0, sizeof(timerwheel_t));
+  wheel->resolution = resolution_ms ? resolution_ms : 1;
+  os_timer_setfn(&wheel->timer, timerwheel_tick, wheel);
+}
+
+void timerwheel_add (timerwheel_t *wheel, timerwheel_timer_t *timer, uint32 delay_ms, timerwheel_callback_t callback, void *arg) {
+  uint32 ticks = (delay_ms + wheel->resolution - 1) / wheel->resolution;
+
+  timerwheel_cancel(timer);
+
+  if (wheel->pending == 0) {
+    /* idle wheels don't tick, restart the clock */
+    wheel->last_us = system_get_time();
+    os_timer_arm(&wheel->timer, wheel->resolution, 1);
+  }
+
+  timer->wheel = wheel;
+  timer->callback = callback;
+  timer->arg = arg;
+  timer->expires = wheel->now + (ticks ? ticks : 1);
+  timerwheel_link(&wheel->slots[timer->expires & SLOT_MASK], timer);
+  wheel->pending++;
+}
+
+void timerwheel_cancel (timerwheel_timer_t *timer) {
+  if (!timerwheel_pending(timer))
+    return;
+  timerwheel_unlink(timer);
+  /* the wheel keeps ticking until its next tick finds it empty */
+  timer->wheel->pending--;
+}
@@ -29,6 +29,10 @@
 #include "rtc/rtctime.h"
 #endif
 
+#ifdef LUA_USE_MODULES_LWIPSTATS
+#include "../modules/lwipstats.h"
+#endif
+
 static task_handle_t input_sig;
 static uint8 input_sig_flag = 0;
 
@@ -150,6 +154,10 @@ void nodemcu_init(void)
     }
     // test_spiffs();
 #endif
+
+#if defined(BUILD_SPIFFS) && defined(LUA_USE_MODULES_LWIPSTATS)
+    lwipstats_boot_profile();
+#endif
     // endpoint_setup();
 
     if (!task_post_low(task_get_id(start_lua),'s'))
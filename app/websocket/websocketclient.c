@@ -35,10 +35,7 @@
 #include "c_stdio.h"
 
 #include "websocketclient.h"
-
-// Depends on 'crypto' module for sha1
-#include "../crypto/digests.h"
-#include "../crypto/mech.h"
+#include "../crypto/mask.h"
 
 #define PROTOCOL_SECURE "wss://"
 #define PROTOCOL_INSECURE "ws://"
@@ -51,8 +48,6 @@
                          "Host: %s:%d\r\n"
 
 #define WS_INIT_REQUEST_LENGTH 30
-#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define WS_GUID_LENGTH 36
 
 #define WS_HTTP_SWITCH_PROTOCOL_HEADER "HTTP/1.1 101"
 #define WS_HTTP_SEC_WEBSOCKET_ACCEPT "Sec-WebSocket-Accept:"
@@ -62,13 +57,6 @@
 #define WS_FORCE_CLOSE_TIMEOUT_MS 5 * 1000
 #define WS_UNHEALTHY_THRESHOLD 2
 
-#define WS_OPCODE_CONTINUATION 0x0
-#define WS_OPCODE_TEXT 0x1
-#define WS_OPCODE_BINARY 0x2
-#define WS_OPCODE_CLOSE 0x8
-#define WS_OPCODE_PING 0x9
-#define WS_OPCODE_PONG 0xA
-
 header_t DEFAULT_HEADERS[] = {
   {"User-Agent", "ESP8266"},
   {"Sec-WebSocket-Protocol", "chat"},
@@ -76,37 +64,6 @@ header_t DEFAULT_HEADERS[] = {
 };
 header_t *EMPTY_HEADERS = DEFAULT_HEADERS + sizeof(DEFAULT_HEADERS) / sizeof(header_t) - 1;
 
-static char *cryptoSha1(char *data, unsigned int len) {
-  SHA1_CTX ctx;
-  SHA1Init(&ctx);
-  SHA1Update(&ctx, data, len);
-  
-  uint8_t *digest = (uint8_t *) c_zalloc(20);
-  SHA1Final(digest, &ctx);
-  return (char *) digest; // Requires free
-}
-
-static const char *bytes64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-static char *base64Encode(char *data, unsigned int len) {
-  int blen = (len + 2) / 3 * 4;
-
-  char *out = (char *) c_zalloc(blen + 1);
-  out[blen] = '\0';
-  int j = 0, i;
-  for (i = 0; i < len; i += 3) {
-    int a = data[i];
-    int b = (i + 1 < len) ? data[i + 1] : 0;
-    int c = (i + 2 < len) ? data[i + 2] : 0;
-    out[j++] = bytes64[a >> 2];
-    out[j++] = bytes64[((a & 3) << 4) | (b >> 4)];
-    out[j++] = (i + 1 < len) ? bytes64[((b & 15) << 2) | (c >> 6)] : 61;
-    out[j++] = (i + 2 < len) ? bytes64[(c & 63)] : 61;
-  }
-
-  return out; // Requires free
-}
-
 static void generateSecKeys(char **key, char **expectedKey) {
   char rndData[16];
   int i;
@@ -114,17 +71,8 @@ static void generateSecKeys(char **key, char **expectedKey) {
     rndData[i] = (char) os_random();
   }
 
-  *key = base64Encode(rndData, 16);
-
-  // expectedKey = b64(sha1(keyB64 + GUID))
-  char keyWithGuid[24 + WS_GUID_LENGTH];
-  memcpy(keyWithGuid, *key, 24);
-  memcpy(keyWithGuid + 24, WS_GUID, WS_GUID_LENGTH);
-
-  char *keyEncrypted = cryptoSha1(keyWithGuid, 24 + WS_GUID_LENGTH);
-  *expectedKey = base64Encode(keyEncrypted, 20);
-
-  os_free(keyEncrypted);
+  *key = ws_base64Encode(rndData, 16);
+  *expectedKey = ws_acceptKey(*key, 24);
 }
 
 static char *_strcpy(char *dst, char *src) {
@@ -183,7 +131,7 @@ static void ws_closeSentCallback(void *arg) {
     espconn_disconnect(conn);
 }
 
-static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, unsigned short len) {
+static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, unsigned int len) {
   NODE_DBG("ws_sendFrame %d %d\n", opCode, len);
   ws_info *ws = (ws_info *) conn->reverse;
   
@@ -195,7 +143,7 @@ static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, uns
     return;
   }
 
-  char *b = c_zalloc(10 + len); // 10 bytes = worst case scenario for framming
+  char *b = c_zalloc(WS_FRAME_HEADER_MAX + len);
   if (b == NULL) {
     NODE_DBG("Out of memory when receiving message, disconnecting...\n");
 
@@ -207,54 +155,17 @@ static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, uns
     return;
   }
 
-  b[0] = 1 << 7; // has fin
-  b[0] += opCode;
-  b[1] = 1 << 7; // has mask
-  int bufOffset;
-  if (len < 126) {
-    b[1] += len;
-    bufOffset = 2;
-  } else if (len < 0x10000) {
-    b[1] += 126;
-    b[2] = len >> 8;
-    b[3] = len;
-    bufOffset = 4;
-  } else {
-    b[1] += 127;
-    b[2] = len >> 24;
-    b[3] = len >> 16;
-    b[4] = len >> 8;
-    b[5] = len;
-    bufOffset = 6;
-  }
-
   // Random mask:
-  b[bufOffset] = (char) os_random();
-  b[bufOffset + 1] = (char) os_random();
-  b[bufOffset + 2] = (char) os_random();
-  b[bufOffset + 3] = (char) os_random();
-  bufOffset += 4;
-
-  // Copy data to buffer
-  memcpy(b + bufOffset, data, len);
-
-  // Apply mask to encode payload
+  uint8_t mask[4];
   int i;
-  for (i = 0; i < len; i++) {
-    b[bufOffset + i] ^= b[bufOffset - 4 + i % 4]; 
+  for (i = 0; i < 4; i++) {
+    mask[i] = (uint8_t) os_random();
   }
-  bufOffset += len;
+  int bufOffset = ws_frameHeader((uint8_t *) b, opCode, true, len, mask);
 
-  NODE_DBG("b[0] = %d \n", b[0]);
-  NODE_DBG("b[1] = %d \n", b[1]);
-  NODE_DBG("b[2] = %d \n", b[2]);
-  NODE_DBG("b[3] = %d \n", b[3]);
-  NODE_DBG("b[4] = %d \n", b[4]);
-  NODE_DBG("b[5] = %d \n", b[5]);
-  NODE_DBG("b[6] = %d \n", b[6]);
-  NODE_DBG("b[7] = %d \n", b[7]);
-  NODE_DBG("b[8] = %d \n", b[8]);
-  NODE_DBG("b[9] = %d \n", b[9]);
+  // Copy data to buffer and apply mask to encode payload, in one pass
+  crypto_xor_mask((uint8_t *) b + bufOffset, (const uint8_t *) data, len, mask, 0);
+  bufOffset += len;
 
   NODE_DBG("sending message\n");
   if (ws->isSecure)
@@ -285,247 +196,56 @@ static void ws_sendPingTimeout(void *arg) {
   ws->unhealthyPoints += 1;
 }
 
+static int ws_receiveFrame(void *arg, int opCode, char *data, unsigned int len, bool fin) {
+  NODE_DBG("ws_receiveFrame %d %d %d\n", opCode, len, fin);
+  struct espconn *conn = (struct espconn *) arg;
+  ws_info *ws = (ws_info *) conn->reverse;
+
+  if (opCode == WS_OPCODE_CLOSE) {
+    NODE_DBG("Closing message received\n"); // reason must not be shown to client as per spec
+
+    espconn_regist_sentcb(conn, ws_closeSentCallback);
+    ws_sendFrame(conn, WS_OPCODE_CLOSE, data, len);
+    ws->connectionState = 4;
+    return 1; // nothing after a close frame is of interest
+  } else if (opCode == WS_OPCODE_PING) {
+    ws_sendFrame(conn, WS_OPCODE_PONG, data, len);
+  } else if (opCode == WS_OPCODE_PONG) {
+    // ping alarm was already reset...
+  } else {
+    if (ws->onReceive) ws->onReceive(ws, len, data, opCode, fin);
+  }
+  return 0;
+}
+
 static void ws_receiveCallback(void *arg, char *buf, unsigned short len) {
   NODE_DBG("ws_receiveCallback %d \n", len);
   struct espconn *conn = (struct espconn *) arg;
   ws_info *ws = (ws_info *) conn->reverse;
 
+  if (ws->connectionState == 4) {
+    return;
+  }
+
   ws->unhealthyPoints = 0; // received data, connection is healthy
   os_timer_disarm(&ws->timeoutTimer); // reset ping check
   os_timer_arm(&ws->timeoutTimer, WS_PING_INTERVAL_MS, true);
 
+  // frames may be split across or combined within segments, the parser keeps track
+  int result = ws_parserFeed(&ws->parser, buf, len);
+  if (result > 1) {
+    NODE_DBG("Failed to receive frame (%d), disconnecting...\n", result);
 
-  char *b = buf;
-  if (ws->frameBuffer != NULL) { // Append previous frameBuffer with new content
-    NODE_DBG("Appending new frameBuffer to old one \n");
-
-    ws->frameBuffer = c_realloc(ws->frameBuffer, ws->frameBufferLen + len);
-    if (ws->frameBuffer == NULL) {
-      NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
-
+    if (result == WS_CLOSE_TOO_BIG)
+      ws->knownFailureCode = -20;
+    else if (result == WS_CLOSE_INTERNAL_ERROR)
       ws->knownFailureCode = -8;
-      if (ws->isSecure)
-        espconn_secure_disconnect(conn);
-      else
-        espconn_disconnect(conn);
-      return;
-    }
-    memcpy(ws->frameBuffer + ws->frameBufferLen, b, len);
-
-    ws->frameBufferLen += len;
-
-    len = ws->frameBufferLen;
-    b = ws->frameBuffer;
-    NODE_DBG("New frameBufferLen: %d\n", len);
-  }
-
-  while (b != NULL) { // several frames can be present, b pointer will be moved to the next frame
-    NODE_DBG("b[0] = %d \n", b[0]);
-    NODE_DBG("b[1] = %d \n", b[1]);
-    NODE_DBG("b[2] = %d \n", b[2]);
-    NODE_DBG("b[3] = %d \n", b[3]);
-    NODE_DBG("b[4] = %d \n", b[4]);
-    NODE_DBG("b[5] = %d \n", b[5]);
-    NODE_DBG("b[6] = %d \n", b[6]);
-    NODE_DBG("b[7] = %d \n", b[7]);
-
-    int isFin = b[0] & 0x80 ? 1 : 0;
-    int opCode = b[0] & 0x0f;
-    int hasMask = b[1] & 0x80 ? 1 : 0;
-    uint64_t payloadLength = b[1] & 0x7f;
-    int bufOffset = 2;
-    if (payloadLength == 126) {
-      payloadLength = (b[2] << 8) + b[3];
-      bufOffset = 4;
-    } else if (payloadLength == 127) { // this will clearly not hold in heap, abort??
-      payloadLength = (b[2] << 24) + (b[3] << 16) + (b[4] << 8) + b[5];
-      bufOffset = 6;
-    }
-
-    if (hasMask) {
-      int maskOffset = bufOffset;
-      bufOffset += 4;
-
-      int i;
-      for (i = 0; i < payloadLength; i++) {
-        b[bufOffset + i] ^= b[maskOffset + i % 4]; // apply mask to decode payload
-      }
-    }
-
-    if (payloadLength > len - bufOffset) {
-      NODE_DBG("INCOMPLETE Frame \n");
-      if (ws->frameBuffer == NULL) {
-        NODE_DBG("Allocing new frameBuffer \n");
-        ws->frameBuffer = c_zalloc(len);
-        if (ws->frameBuffer == NULL) {
-          NODE_DBG("Failed to allocate framebuffer, disconnecting... \n");
-
-          ws->knownFailureCode = -9;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->frameBuffer, b, len);
-        ws->frameBufferLen = len;
-      }
-      break; // since the buffer were already concat'ed, wait for the next receive
-    }
-
-    if (!isFin) {
-      NODE_DBG("PARTIAL frame! Should concat payload and later restore opcode\n");
-      if(ws->payloadBuffer == NULL) {
-        NODE_DBG("Allocing new payloadBuffer \n");
-        ws->payloadBuffer = c_zalloc(payloadLength);
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Failed to allocate payloadBuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -10;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->payloadBuffer, b + bufOffset, payloadLength);
-        ws->frameBufferLen = payloadLength;
-        ws->payloadOriginalOpCode = opCode;
-      } else {
-        NODE_DBG("Appending new payloadBuffer to old one \n");
-        ws->payloadBuffer = c_realloc(ws->payloadBuffer, ws->payloadBufferLen + payloadLength);
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -11;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->payloadBuffer + ws->payloadBufferLen, b + bufOffset, payloadLength);
-
-        ws->payloadBufferLen += payloadLength;
-      }
-    } else {
-      char *payload;
-      if (opCode == WS_OPCODE_CONTINUATION) {
-        NODE_DBG("restoring original opcode\n");
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Got FIN continuation frame but didn't receive any beforehand, disconnecting...\n");
-
-          ws->knownFailureCode = -15;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        // concat buffer with payload
-        payload = c_zalloc(ws->payloadBufferLen + payloadLength);
-
-        if (payload == NULL) {
-          NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -12;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(payload, ws->payloadBuffer, ws->payloadBufferLen);
-        memcpy(payload + ws->payloadBufferLen, b + bufOffset, payloadLength);
-
-        os_free(ws->payloadBuffer); // free previous buffer
-        ws->payloadBuffer = NULL;
-
-        payloadLength += ws->payloadBufferLen;
-        ws->payloadBufferLen = 0;
-
-        opCode = ws->payloadOriginalOpCode;
-        ws->payloadOriginalOpCode = 0;
-      } else {
-        int extensionDataOffset = 0;
-
-        if (opCode == WS_OPCODE_CLOSE && payloadLength > 0) {
-          unsigned int reasonCode = b[bufOffset] << 8 + b[bufOffset + 1];
-          NODE_DBG("Closing due to: %d\n", reasonCode); // Must not be shown to client as per spec
-          extensionDataOffset += 2;
-        }
-
-        payload = c_zalloc(payloadLength - extensionDataOffset + 1);
-        if (payload == NULL) {
-          NODE_DBG("Failed to allocate payload, disconnecting...\n");
-
-          ws->knownFailureCode = -13;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-
-        memcpy(payload, b + bufOffset + extensionDataOffset, payloadLength - extensionDataOffset);
-        payload[payloadLength - extensionDataOffset] = '\0';
-      }
-
-      NODE_DBG("isFin %d \n", isFin);
-      NODE_DBG("opCode %d \n", opCode);
-      NODE_DBG("hasMask %d \n", hasMask);
-      NODE_DBG("payloadLength %d \n", payloadLength);
-      NODE_DBG("len %d \n", len);
-      NODE_DBG("bufOffset %d \n", bufOffset);
-
-      if (opCode == WS_OPCODE_CLOSE) {
-        NODE_DBG("Closing message: %s\n", payload); // Must not be shown to client as per spec
-
-        espconn_regist_sentcb(conn, ws_closeSentCallback);
-        ws_sendFrame(conn, WS_OPCODE_CLOSE, (const char *) (b + bufOffset), (unsigned short) payloadLength);
-        ws->connectionState = 4;
-      } else if (opCode == WS_OPCODE_PING) {
-        ws_sendFrame(conn, WS_OPCODE_PONG, (const char *) (b + bufOffset), (unsigned short) payloadLength);
-      } else if (opCode == WS_OPCODE_PONG) {
-        // ping alarm was already reset...
-      } else {
-        if (ws->onReceive) ws->onReceive(ws, payloadLength, payload, opCode);
-      }
-      os_free(payload);
-    }
-
-    bufOffset += payloadLength;
-    NODE_DBG("bufOffset %d \n", bufOffset);
-    if (bufOffset == len) { // (bufOffset > len) won't happen here because it's being checked earlier
-      b = NULL;
-      if (ws->frameBuffer != NULL) { // the last frame inside buffer was processed
-        os_free(ws->frameBuffer);
-        ws->frameBuffer = NULL;
-        ws->frameBufferLen = 0;
-      }
-    } else {
-      len -= bufOffset;
-      b += bufOffset; // move b to next frame
-      if (ws->frameBuffer != NULL) {
-        NODE_DBG("Reallocing frameBuffer to remove consumed frame\n");
-
-        ws->frameBuffer = c_realloc(ws->frameBuffer, ws->frameBufferLen + len);
-        if (ws->frameBuffer == NULL) {
-          NODE_DBG("Failed to allocate new frame buffer, disconnecting...\n");
-
-          ws->knownFailureCode = -14;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->frameBuffer + ws->frameBufferLen, b, len);
-
-        ws->frameBufferLen += len;
-        b = ws->frameBuffer;
-      }
-    }
+    else
+      ws->knownFailureCode = -15;
+    if (ws->isSecure)
+      espconn_secure_disconnect(conn);
+    else
+      espconn_disconnect(conn);
   }
 }
 
@@ -636,13 +356,7 @@ static void disconnect_callback(void *arg) {
     os_free(ws->expectedSecKey);
   }
 
-  if (ws->frameBuffer != NULL) {
-    os_free(ws->frameBuffer);
-  }
-
-  if (ws->payloadBuffer != NULL) {
-    os_free(ws->payloadBuffer);
-  }
+  ws_parserFree(&ws->parser);
 
   if (conn->proto.tcp != NULL) {
     os_free(conn->proto.tcp);
@@ -801,11 +515,6 @@ void ws_connect(ws_info *ws, const char *url) {
   ws->path = c_strdup(path);
   ws->expectedSecKey = NULL;
   ws->knownFailureCode = 0;
-  ws->frameBuffer = NULL;
-  ws->frameBufferLen = 0;
-  ws->payloadBuffer = NULL;
-  ws->payloadBufferLen = 0;
-  ws->payloadOriginalOpCode = 0;
   ws->unhealthyPoints = 0;
 
   // Prepare espconn
@@ -819,6 +528,8 @@ void ws_connect(ws_info *ws, const char *url) {
   conn->reverse = ws;
   ws->conn = conn;
 
+  ws_parserInit(&ws->parser, ws->maxMessage, ws->streaming ? WS_PARSER_STREAM : 0, ws_receiveFrame, conn);
+
   // Attempt to resolve hostname address
   ip_addr_t  addr;
   err_t result = espconn_gethostbyname(conn, hostname, &addr, dns_callback);
@@ -832,7 +543,7 @@ void ws_connect(ws_info *ws, const char *url) {
   return;
 }
 
-void ws_send(ws_info *ws, int opCode, const char *message, unsigned short length) {
+void ws_send(ws_info *ws, int opCode, const char *message, unsigned int length) {
   NODE_DBG("ws_send\n");
   ws_sendFrame(ws->conn, opCode, message, length);
 }
@@ -32,6 +32,8 @@
 #include "limits.h"
 #include "stdlib.h"
 
+#include "websocketframe.h"
+
 #if defined(USES_SDK_BEFORE_V140)
 #define espconn_send espconn_sent
 #define espconn_secure_send espconn_secure_sent
@@ -40,7 +42,7 @@
 struct ws_info;
 
 typedef void (*ws_onConnectionCallback)(struct ws_info *wsInfo);
-typedef void (*ws_onReceiveCallback)(struct ws_info *wsInfo, int len, char *message, int opCode);
+typedef void (*ws_onReceiveCallback)(struct ws_info *wsInfo, int len, char *message, int opCode, bool fin);
 typedef void (*ws_onFailureCallback)(struct ws_info *wsInfo, int errorCode);
 
 typedef struct {
@@ -62,12 +64,9 @@ typedef struct ws_info {
   void *reservedData;
   int knownFailureCode;
 
-  char *frameBuffer;
-  int frameBufferLen;
-
-  char *payloadBuffer;
-  int payloadBufferLen;
-  int payloadOriginalOpCode;
+  ws_parser parser;
+  unsigned int maxMessage; // largest message to reassemble, 0 for no limit
+  bool streaming; // deliver messages in pieces as they arrive
 
   os_timer_t  timeoutTimer;
   int unhealthyPoints;
@@ -85,7 +84,7 @@ void ws_connect(ws_info *wsInfo, const char *url);
 /*
  * Sends a message with a given opcode.
  */
-void ws_send(ws_info *wsInfo, int opCode, const char *message, unsigned short length);
+void ws_send(ws_info *wsInfo, int opCode, const char *message, unsigned int length);
 
 /*
  * Disconnects existing conection and frees memory.
@@ -0,0 +1,301 @@
+/* Websocket frame encoding and decoding (RFC 6455)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "osapi.h"
+#include "mem.h"
+
+#include "c_types.h"
+#include "c_string.h"
+#include "c_stdlib.h"
+#include "c_stdio.h"
+#include "c_limits.h"
+
+#include "websocketframe.h"
+
+// Depends on 'crypto' module for sha1 and base64
+#include "../crypto/digests.h"
+#include "../crypto/mech.h"
+#include "../crypto/codec.h"
+#include "../crypto/mask.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_GUID_LENGTH 36
+
+char *ws_base64Encode(const char *data, unsigned int len) {
+  int blen = codec_encoded_len(CODEC_BASE64, len);
+
+  char *out = (char *) c_zalloc(blen + 1);
+  if (out == NULL) {
+    return NULL;
+  }
+  out[codec_encode(CODEC_BASE64, (const uint8_t *) data, len, out)] = '\0';
+
+  return out; // Requires free
+}
+
+char *ws_acceptKey(const char *key, unsigned int len) {
+  // b64(sha1(key + GUID))
+  SHA1_CTX ctx;
+  uint8_t digest[20];
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, (const uint8_t *) key, len);
+  SHA1Update(&ctx, (const uint8_t *) WS_GUID, WS_GUID_LENGTH);
+  SHA1Final(digest, &ctx);
+
+  return ws_base64Encode((const char *) digest, 20); // Requires free
+}
+
+void ws_parserInit(ws_parser *p, unsigned int maxMessage, int flags, ws_frameCallback onFrame, void *arg) {
+  memset(p, 0, sizeof(ws_parser));
+  p->maxMessage = maxMessage;
+  p->flags = flags;
+  p->onFrame = onFrame;
+  p->arg = arg;
+}
+
+void ws_parserFree(ws_parser *p) {
+  if (p->message != NULL) {
+    os_free(p->message);
+    p->message = NULL;
+  }
+  p->messageLen = 0;
+  p->messageOpCode = 0;
+  p->headerLen = 0;
+  p->inPayload = false;
+}
+
+// Header is complete: decode and validate it
+static int ws_parserStartFrame(ws_parser *p) {
+  uint8_t *h = p->header;
+  int offset = 2;
+
+  p->fin = (h[0] & 0x80) != 0;
+  p->opCode = h[0] & 0x0f;
+  p->masked = (h[1] & 0x80) != 0;
+  p->frameLen = h[1] & 0x7f;
+  if (p->frameLen == 126) {
+    p->frameLen = ((uint64_t) h[2] << 8) | h[3];
+    offset = 4;
+  } else if (p->frameLen == 127) {
+    p->frameLen = 0;
+    for (; offset < 10; offset++) {
+      p->frameLen = (p->frameLen << 8) | h[offset];
+    }
+  }
+  if (p->masked) {
+    memcpy(p->mask, h + offset, 4);
+  }
+  p->remaining = p->frameLen;
+  p->controlLen = 0;
+
+  if (h[0] & 0x70) {
+    NODE_DBG("reserved bits set without extension\n");
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+  if ((p->flags & WS_PARSER_MASKED) && !p->masked) {
+    NODE_DBG("unmasked frame\n");
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (p->opCode & 0x08) {
+    if (!p->fin || p->frameLen > WS_CONTROL_MAX ||
+        (p->opCode != WS_OPCODE_CLOSE && p->opCode != WS_OPCODE_PING && p->opCode != WS_OPCODE_PONG)) {
+      NODE_DBG("invalid control frame\n");
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    return 0;
+  }
+
+  if (p->opCode == WS_OPCODE_CONTINUATION) {
+    if (p->messageOpCode == 0) {
+      NODE_DBG("continuation without message\n");
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+  } else if (p->opCode == WS_OPCODE_TEXT || p->opCode == WS_OPCODE_BINARY) {
+    if (p->messageOpCode != 0) {
+      NODE_DBG("new message before previous one finished\n");
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    p->messageOpCode = p->opCode;
+  } else {
+    NODE_DBG("unknown opcode %d\n", p->opCode);
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (!(p->flags & WS_PARSER_STREAM)) {
+    uint64_t total = p->messageLen + p->frameLen;
+    if (total > UINT_MAX - 1 || (p->maxMessage && total > p->maxMessage)) {
+      NODE_DBG("message too big\n");
+      return WS_CLOSE_TOO_BIG;
+    }
+  }
+  return 0;
+}
+
+// Payload bytes of the current frame, already unmasked
+static int ws_parserPayload(ws_parser *p, char *data, unsigned int len) {
+  if (p->opCode & 0x08) {
+    memcpy(p->control + p->controlLen, data, len);
+    p->controlLen += len;
+    return 0;
+  }
+
+  if (p->flags & WS_PARSER_STREAM) {
+    return p->onFrame(p->arg, p->messageOpCode, data, len, p->fin && len == p->remaining);
+  }
+
+  if (p->message == NULL && p->fin && len == p->remaining) {
+    // whole message in one piece of one segment, no need to copy it
+    return p->onFrame(p->arg, p->messageOpCode, data, len, true);
+  }
+
+  if (p->message == NULL || p->remaining == p->frameLen) {
+    // size the buffer for the rest of this frame once, not for every segment
+    char *message = (char *) os_realloc(p->message, p->messageLen + p->remaining);
+    if (message == NULL) {
+      NODE_DBG("failed to allocate message buffer\n");
+      return WS_CLOSE_INTERNAL_ERROR;
+    }
+    p->message = message;
+  }
+  memcpy(p->message + p->messageLen, data, len);
+  p->messageLen += len;
+  return 0;
+}
+
+// All payload bytes of the current frame are in
+static int ws_parserEndFrame(ws_parser *p) {
+  int result = 0;
+
+  if (p->opCode & 0x08) {
+    return p->onFrame(p->arg, p->opCode, p->control, p->controlLen, true);
+  }
+
+  if (!p->fin) {
+    return 0;
+  }
+
+  if (p->message != NULL) {
+    result = p->onFrame(p->arg, p->messageOpCode, p->message, p->messageLen, true);
+    os_free(p->message);
+    p->message = NULL;
+  } else if (p->frameLen == 0) {
+    // empty message, or the final fragment was empty
+    result = p->onFrame(p->arg, p->messageOpCode, p->control, 0, true);
+  }
+  p->messageLen = 0;
+  p->messageOpCode = 0;
+  return result;
+}
+
+int ws_parserFeed(ws_parser *p, char *data, unsigned int len) {
+  int result;
+
+  while (true) {
+    if (!p->inPayload) {
+      if (len == 0) {
+        return 0;
+      }
+
+      // the header may itself be split across segments
+      unsigned int need = p->headerLen < 2 ? 2 : p->headerNeed;
+      unsigned int n = need - p->headerLen;
+      if (n > len) {
+        n = len;
+      }
+      memcpy(p->header + p->headerLen, data, n);
+      p->headerLen += n;
+      data += n;
+      len -= n;
+      if (p->headerLen == 2) {
+        uint8_t lengthCode = p->header[1] & 0x7f;
+        p->headerNeed = 2 + (lengthCode == 126 ? 2 : lengthCode == 127 ? 8 : 0) + (p->header[1] & 0x80 ? 4 : 0);
+      }
+      if (p->headerLen < 2 || p->headerLen < p->headerNeed) {
+        continue;
+      }
+
+      p->headerLen = 0;
+      p->inPayload = true;
+      result = ws_parserStartFrame(p);
+      if (result) {
+        return result;
+      }
+    }
+
+    unsigned int n = p->remaining < len ? (unsigned int) p->remaining : len;
+    if (n > 0) {
+      if (p->masked) {
+        ws_frameMask(data, n, p->mask, (unsigned int) (p->frameLen - p->remaining));
+      }
+      result = ws_parserPayload(p, data, n);
+      p->remaining -= n;
+      data += n;
+      len -= n;
+      if (result) {
+        return result;
+      }
+    }
+    if (p->remaining > 0) {
+      return 0;
+    }
+
+    p->inPayload = false;
+    result = ws_parserEndFrame(p);
+    if (result) {
+      return result;
+    }
+  }
+}
+
+int ws_frameHeader(uint8_t *buf, int opCode, bool fin, uint64_t len, const uint8_t *mask) {
+  int offset = 2;
+
+  buf[0] = (fin ? 0x80 : 0) | opCode;
+  buf[1] = mask ? 0x80 : 0;
+  if (len < 126) {
+    buf[1] |= len;
+  } else if (len < 0x10000) {
+    buf[1] |= 126;
+    buf[2] = len >> 8;
+    buf[3] = len;
+    offset = 4;
+  } else {
+    buf[1] |= 127;
+    int i;
+    for (i = 9; i >= 2; i--) {
+      buf[i] = len;
+      len >>= 8;
+    }
+    offset = 10;
+  }
+
+  if (mask) {
+    memcpy(buf + offset, mask, 4);
+    offset += 4;
+  }
+  return offset;
+}
+
+void ws_frameMask(char *data, unsigned int len, const uint8_t *mask, unsigned int offset) {
+  crypto_xor_mask((uint8_t *) data, (const uint8_t *) data, len, mask, offset);
+}
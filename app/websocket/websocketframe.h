@@ -0,0 +1,124 @@
+/* Websocket frame encoding and decoding (RFC 6455)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _WEBSOCKETFRAME_H_
+#define _WEBSOCKETFRAME_H_
+
+#include "c_types.h"
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_TOO_BIG 1009
+#define WS_CLOSE_INTERNAL_ERROR 1011
+
+#define WS_FRAME_HEADER_MAX 14 // 2 + 8 bytes length + 4 bytes mask
+#define WS_CONTROL_MAX 125
+
+// ws_parserInit flags
+#define WS_PARSER_STREAM 0x01 // deliver data as it arrives instead of whole messages
+#define WS_PARSER_MASKED 0x02 // frames must be masked (server side)
+
+/*
+ * Called for every complete control frame and for message data. In stream
+ * mode message data is delivered in pieces as it arrives, with fin set on the
+ * last piece; otherwise whole messages are delivered. opCode is always the
+ * opcode of the message, never WS_OPCODE_CONTINUATION. Returning nonzero
+ * stops parsing, ws_parserFeed then returns that value.
+ */
+typedef int (*ws_frameCallback)(void *arg, int opCode, char *data, unsigned int len, bool fin);
+
+typedef struct ws_parser {
+  uint8_t header[WS_FRAME_HEADER_MAX];
+  uint8_t headerLen;  // header bytes received so far
+  uint8_t headerNeed; // header size, known once the first two bytes are in
+  bool inPayload;
+
+  // frame being received
+  bool fin;
+  uint8_t opCode;
+  bool masked;
+  uint8_t mask[4];
+  uint64_t frameLen;
+  uint64_t remaining;
+
+  // data message being received
+  uint8_t messageOpCode; // 0 while no message is in progress
+  char *message;
+  unsigned int messageLen;
+  unsigned int maxMessage; // 0 means only limited by memory
+
+  char control[WS_CONTROL_MAX];
+  uint8_t controlLen;
+
+  int flags;
+  ws_frameCallback onFrame;
+  void *arg;
+} ws_parser;
+
+/*
+ * Prepares a parser, nothing is allocated until a message needs buffering.
+ */
+void ws_parserInit(ws_parser *p, unsigned int maxMessage, int flags, ws_frameCallback onFrame, void *arg);
+
+/*
+ * Feeds received data, which may hold any part of any number of frames.
+ * The data is unmasked in place. Returns 0 when all data was consumed, a
+ * WS_CLOSE_* status when the peer broke the protocol or memory ran out, or
+ * the value the callback stopped parsing with.
+ */
+int ws_parserFeed(ws_parser *p, char *data, unsigned int len);
+
+/*
+ * Frees a partially received message.
+ */
+void ws_parserFree(ws_parser *p);
+
+/*
+ * Writes a frame header to buf, which must hold WS_FRAME_HEADER_MAX bytes.
+ * mask may be NULL for unmasked (server) frames. Returns the header length.
+ */
+int ws_frameHeader(uint8_t *buf, int opCode, bool fin, uint64_t len, const uint8_t *mask);
+
+/*
+ * Applies the mask to data, offset is the position of data in the payload.
+ */
+void ws_frameMask(char *data, unsigned int len, const uint8_t *mask, unsigned int offset);
+
+/*
+ * Base64 encodes data into a new string, which requires free.
+ */
+char *ws_base64Encode(const char *data, unsigned int len);
+
+/*
+ * Computes the Sec-WebSocket-Accept value for a Sec-WebSocket-Key into a new
+ * string, which requires free.
+ */
+char *ws_acceptKey(const char *key, unsigned int len);
+
+#endif // _WEBSOCKETFRAME_H_
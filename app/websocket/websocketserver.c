@@ -0,0 +1,444 @@
+/* Websocket server implementation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mem.h"
+
+#include "c_types.h"
+#include "c_string.h"
+#include "c_stdlib.h"
+#include "c_stdio.h"
+
+#include "websocketserver.h"
+
+#define WS_HTTP_SWITCH_PROTOCOL_RESPONSE "HTTP/1.1 101 Switching Protocols\r\n"\
+                                         "Upgrade: websocket\r\n"\
+                                         "Connection: Upgrade\r\n"\
+                                         "Sec-WebSocket-Accept: %s\r\n"
+#define WS_HTTP_BAD_REQUEST_RESPONSE "HTTP/1.1 400 Bad Request\r\n"\
+                                     "Connection: close\r\n\r\n"
+
+static ws_buffer *ws_bufferNew(const char *data, unsigned int len, int opCode, bool frame) {
+  uint8_t header[WS_FRAME_HEADER_MAX];
+  int headerLen = frame ? ws_frameHeader(header, opCode, true, len, NULL) : 0;
+
+  if (headerLen + len > 0xffff) { // must fit a single espconn send
+    return NULL;
+  }
+  ws_buffer *buffer = (ws_buffer *) os_malloc(sizeof(ws_buffer) + headerLen + len);
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer->refs = 0;
+  buffer->len = headerLen + len;
+  memcpy(buffer->data, header, headerLen);
+  memcpy(buffer->data + headerLen, data, len);
+  return buffer;
+}
+
+static void ws_bufferRelease(ws_buffer *buffer) {
+  if (--buffer->refs == 0) {
+    os_free(buffer);
+  }
+}
+
+static void ws_serverSendNext(ws_serverClient *client) {
+  if (client->queue == NULL) {
+    if (client->connectionState == 4 || client->connectionState == 1) {
+      // close frame or handshake rejection went out
+      espconn_disconnect(client->conn);
+    }
+    return;
+  }
+
+  // espconn keeps pointing into the buffer until the sent callback, the queue holds it until then
+  client->sending = true;
+  if (espconn_send(client->conn, (uint8_t *) client->queue->buffer->data, client->queue->buffer->len) != ESPCONN_OK) {
+    NODE_DBG("ws server send failed, disconnecting...\n");
+    client->sending = false;
+    espconn_disconnect(client->conn);
+  }
+}
+
+// Control frames and handshake responses are forced, they don't count against the backlog limit
+static bool ws_serverEnqueue(ws_serverClient *client, ws_buffer *buffer, bool force) {
+  if (!force && client->backlog > 0 && client->backlog + buffer->len > client->server->maxBacklog) {
+    NODE_DBG("ws server client backlog full\n");
+    return false;
+  }
+  ws_queued *queued = (ws_queued *) os_malloc(sizeof(ws_queued));
+  if (queued == NULL) {
+    return false;
+  }
+  queued->buffer = buffer;
+  queued->next = NULL;
+  buffer->refs++;
+  if (client->queueTail) {
+    client->queueTail->next = queued;
+  } else {
+    client->queue = queued;
+  }
+  client->queueTail = queued;
+  client->backlog += buffer->len;
+
+  if (!client->sending) {
+    ws_serverSendNext(client);
+  }
+  return true;
+}
+
+static void ws_serverSentCallback(void *arg) {
+  struct espconn *conn = (struct espconn *) arg;
+  ws_serverClient *client = (ws_serverClient *) conn->reverse;
+  if (client == NULL || client->queue == NULL) {
+    return;
+  }
+
+  ws_queued *queued = client->queue;
+  client->queue = queued->next;
+  if (client->queue == NULL) {
+    client->queueTail = NULL;
+  }
+  client->backlog -= queued->buffer->len;
+  ws_bufferRelease(queued->buffer);
+  os_free(queued);
+
+  client->sending = false;
+  ws_serverSendNext(client);
+}
+
+int ws_serverSend(ws_serverClient *client, int opCode, const char *message, unsigned int length) {
+  if (client->connectionState != 3) {
+    return -1;
+  }
+  ws_buffer *buffer = ws_bufferNew(message, length, opCode, true);
+  if (buffer == NULL) {
+    return -2;
+  }
+  if (!ws_serverEnqueue(client, buffer, opCode & 0x08)) {
+    os_free(buffer);
+    return -1;
+  }
+  return 0;
+}
+
+int ws_serverBroadcast(ws_server *server, int opCode, const char *message, unsigned int length) {
+  ws_buffer *buffer = ws_bufferNew(message, length, opCode, true);
+  if (buffer == NULL) {
+    return -2;
+  }
+
+  // protect the buffer while queuing, a failing send may free it otherwise
+  buffer->refs = 1;
+  int count = 0;
+  ws_serverClient *client;
+  for (client = server->clients; client != NULL; client = client->next) {
+    if (client->connectionState == 3 && ws_serverEnqueue(client, buffer, false)) {
+      count++;
+    }
+  }
+  ws_bufferRelease(buffer);
+  return count;
+}
+
+void ws_serverClose(ws_serverClient *client, int status) {
+  if (client->connectionState == 4) {
+    return;
+  }
+  if (client->connectionState != 3) {
+    espconn_disconnect(client->conn);
+    return;
+  }
+
+  client->connectionState = 4;
+  if (client->closeStatus == 0) {
+    client->closeStatus = status;
+  }
+  char payload[2] = { status >> 8, status };
+  ws_buffer *buffer = ws_bufferNew(payload, 2, WS_OPCODE_CLOSE, true);
+  if (buffer == NULL || !ws_serverEnqueue(client, buffer, true)) {
+    if (buffer) {
+      os_free(buffer);
+    }
+    espconn_disconnect(client->conn);
+  }
+}
+
+static int ws_serverFrame(void *arg, int opCode, char *data, unsigned int len, bool fin) {
+  ws_serverClient *client = (ws_serverClient *) arg;
+
+  if (opCode == WS_OPCODE_CLOSE) {
+    int status = len >= 2 ? ((uint8_t) data[0] << 8) | (uint8_t) data[1] : WS_CLOSE_NORMAL;
+    client->closeStatus = status;
+    ws_serverClose(client, status);
+  } else if (opCode == WS_OPCODE_PING) {
+    ws_serverSend(client, WS_OPCODE_PONG, data, len);
+  } else if (opCode == WS_OPCODE_PONG) {
+    // nothing to do
+  } else if (client->server->onReceive) {
+    client->server->onReceive(client, len, data, opCode, fin);
+  }
+
+  return client->connectionState == 3 ? 0 : 1; // stop once closing
+}
+
+// Finds a header in a request, the name must be lower case
+static const char *ws_serverHeader(const char *request, const char *name, unsigned int *len) {
+  unsigned int nameLen = strlen(name);
+  const char *line = strstr(request, "\r\n");
+
+  while (line != NULL && line[2] != '\r') {
+    line += 2;
+    if (c_strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+      const char *value = line + nameLen + 1;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      const char *end = strstr(value, "\r\n");
+      *len = end - value;
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+static void ws_serverHandshake(ws_serverClient *client, char *data, unsigned short len) {
+  ws_server *server = client->server;
+
+  if (client->requestLen + len > WS_SERVER_REQUEST_MAX) {
+    NODE_DBG("ws server handshake too large\n");
+    espconn_disconnect(client->conn);
+    return;
+  }
+  char *request = (char *) os_realloc(client->request, client->requestLen + len + 1);
+  if (request == NULL) {
+    espconn_disconnect(client->conn);
+    return;
+  }
+  memcpy(request + client->requestLen, data, len);
+  client->request = request;
+  client->requestLen += len;
+  request[client->requestLen] = '\0';
+
+  char *end = strstr(request, "\r\n\r\n");
+  if (end == NULL) {
+    return; // wait for the rest of the request
+  }
+  unsigned int requestLen = end + 4 - request;
+
+  unsigned int keyLen = 0, upgradeLen = 0, protocolLen = 0;
+  const char *key = ws_serverHeader(request, "sec-websocket-key", &keyLen);
+  const char *upgrade = ws_serverHeader(request, "upgrade", &upgradeLen);
+  const char *protocol = ws_serverHeader(request, "sec-websocket-protocol", &protocolLen);
+  char *path = request + 4;
+  char *pathEnd = strchr(path, ' ');
+
+  if (strncmp(request, "GET ", 4) != 0 || pathEnd == NULL || key == NULL ||
+      upgrade == NULL || upgradeLen != 9 || c_strncasecmp(upgrade, "websocket", 9) != 0) {
+    NODE_DBG("ws server bad handshake\n");
+    ws_buffer *buffer = ws_bufferNew(WS_HTTP_BAD_REQUEST_RESPONSE, strlen(WS_HTTP_BAD_REQUEST_RESPONSE), 0, false);
+    if (buffer == NULL || !ws_serverEnqueue(client, buffer, true)) {
+      if (buffer) {
+        os_free(buffer);
+      }
+      espconn_disconnect(client->conn);
+    }
+    return; // the connection is closed once the response went out
+  }
+
+  // answer with the first subprotocol offered, clients fail the connection otherwise
+  if (protocol) {
+    unsigned int i;
+    for (i = 0; i < protocolLen && protocol[i] != ',' && protocol[i] != ' '; i++);
+    protocolLen = i;
+  }
+
+  char *accept = ws_acceptKey(key, keyLen);
+  char response[sizeof(WS_HTTP_SWITCH_PROTOCOL_RESPONSE) + 32 + protocolLen + 32];
+  int responseLen = 0;
+  if (accept != NULL) {
+    responseLen = os_sprintf(response, WS_HTTP_SWITCH_PROTOCOL_RESPONSE, accept);
+    os_free(accept);
+    if (protocolLen > 0) {
+      responseLen += os_sprintf(response + responseLen, "Sec-WebSocket-Protocol: ");
+      memcpy(response + responseLen, protocol, protocolLen);
+      responseLen += protocolLen;
+      responseLen += os_sprintf(response + responseLen, "\r\n");
+    }
+    responseLen += os_sprintf(response + responseLen, "\r\n");
+  }
+  ws_buffer *buffer = accept ? ws_bufferNew(response, responseLen, 0, false) : NULL;
+  if (buffer == NULL || !ws_serverEnqueue(client, buffer, true)) {
+    if (buffer) {
+      os_free(buffer);
+    }
+    espconn_disconnect(client->conn);
+    return;
+  }
+
+  NODE_DBG("ws server connection upgraded\n");
+  client->connectionState = 3;
+  ws_parserInit(&client->parser, server->maxMessage, WS_PARSER_MASKED | (server->streaming ? WS_PARSER_STREAM : 0),
+                ws_serverFrame, client);
+
+  *pathEnd = '\0';
+  if (server->onConnection) {
+    server->onConnection(client, path);
+  }
+
+  // frames sent right behind the handshake
+  if (client->connectionState == 3 && client->requestLen > requestLen) {
+    int result = ws_parserFeed(&client->parser, request + requestLen, client->requestLen - requestLen);
+    if (result > 1) {
+      ws_serverClose(client, result);
+    }
+  }
+  os_free(client->request);
+  client->request = NULL;
+  client->requestLen = 0;
+}
+
+static void ws_serverReceiveCallback(void *arg, char *buf, unsigned short len) {
+  struct espconn *conn = (struct espconn *) arg;
+  ws_serverClient *client = (ws_serverClient *) conn->reverse;
+  if (client == NULL) {
+    return;
+  }
+
+  if (client->connectionState == 1) {
+    if (client->queue == NULL) { // not yet rejected
+      ws_serverHandshake(client, buf, len);
+    }
+  } else if (client->connectionState == 3) {
+    int result = ws_parserFeed(&client->parser, buf, len);
+    if (result > 1) {
+      NODE_DBG("ws server failed to receive frame (%d)\n", result);
+      ws_serverClose(client, result);
+    }
+  }
+}
+
+static void ws_serverDisconnectCallback(void *arg) {
+  struct espconn *conn = (struct espconn *) arg;
+  ws_serverClient *client = (ws_serverClient *) conn->reverse;
+  if (client == NULL) {
+    return;
+  }
+  conn->reverse = NULL;
+  ws_server *server = client->server;
+
+  while (client->queue != NULL) {
+    ws_queued *queued = client->queue;
+    client->queue = queued->next;
+    ws_bufferRelease(queued->buffer);
+    os_free(queued);
+  }
+  ws_parserFree(&client->parser);
+  if (client->request != NULL) {
+    os_free(client->request);
+  }
+
+  ws_serverClient **p;
+  for (p = &server->clients; *p != NULL; p = &(*p)->next) {
+    if (*p == client) {
+      *p = client->next;
+      break;
+    }
+  }
+
+  // only connections that completed the handshake were reported
+  if (client->connectionState != 1 && server->onClose) {
+    server->onClose(client, client->closeStatus);
+  }
+  os_free(client);
+}
+
+static void ws_serverErrorCallback(void *arg, sint8 errType) {
+  NODE_DBG("ws server error %d\n", errType);
+  ws_serverDisconnectCallback(arg);
+}
+
+static void ws_serverConnectCallback(void *arg) {
+  struct espconn *conn = (struct espconn *) arg;
+  ws_server *server = (ws_server *) conn->reverse; // inherited from the listener
+
+  ws_serverClient *client = (ws_serverClient *) os_zalloc(sizeof(ws_serverClient));
+  if (client == NULL) {
+    conn->reverse = NULL;
+    espconn_disconnect(conn);
+    return;
+  }
+  client->conn = conn;
+  client->server = server;
+  client->connectionState = 1;
+  client->next = server->clients;
+  server->clients = client;
+  conn->reverse = client;
+
+  espconn_regist_recvcb(conn, ws_serverReceiveCallback);
+  espconn_regist_sentcb(conn, ws_serverSentCallback);
+  espconn_regist_disconcb(conn, ws_serverDisconnectCallback);
+  espconn_regist_reconcb(conn, ws_serverErrorCallback);
+}
+
+int ws_serverStart(ws_server *server, int port) {
+  struct espconn *listener = (struct espconn *) os_zalloc(sizeof(struct espconn));
+  if (listener == NULL) {
+    return -1;
+  }
+  listener->proto.tcp = (esp_tcp *) os_zalloc(sizeof(esp_tcp));
+  if (listener->proto.tcp == NULL) {
+    os_free(listener);
+    return -1;
+  }
+  listener->type = ESPCONN_TCP;
+  listener->state = ESPCONN_NONE;
+  listener->proto.tcp->local_port = port;
+  listener->reverse = server;
+
+  espconn_regist_connectcb(listener, ws_serverConnectCallback);
+  if (espconn_accept(listener) != ESPCONN_OK) {
+    os_free(listener->proto.tcp);
+    os_free(listener);
+    return -1;
+  }
+  espconn_regist_time(listener, server->timeout, 0);
+  server->listener = listener;
+  return 0;
+}
+
+void ws_serverStop(ws_server *server) {
+  ws_serverClient *client;
+  for (client = server->clients; client != NULL; client = client->next) {
+    ws_serverClose(client, 1001); // going away
+  }
+
+  if (server->listener != NULL) {
+    espconn_delete(server->listener);
+    os_free(server->listener->proto.tcp);
+    os_free(server->listener);
+    server->listener = NULL;
+  }
+}
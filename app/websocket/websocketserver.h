@@ -0,0 +1,120 @@
+/* Websocket server implementation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _WEBSOCKETSERVER_H_
+#define _WEBSOCKETSERVER_H_
+
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mem.h"
+
+#include "websocketframe.h"
+
+#define WS_SERVER_REQUEST_MAX 1024 // largest accepted handshake request
+#define WS_SERVER_DEFAULT_BACKLOG 4096
+#define WS_SERVER_DEFAULT_TIMEOUT 300 // seconds
+
+struct ws_server;
+struct ws_serverClient;
+
+typedef void (*ws_serverOnConnectionCallback)(struct ws_serverClient *client, const char *path);
+typedef void (*ws_serverOnReceiveCallback)(struct ws_serverClient *client, int len, char *message, int opCode, bool fin);
+typedef void (*ws_serverOnCloseCallback)(struct ws_serverClient *client, int status);
+
+/*
+ * An encoded frame, shared by all connections it is queued on.
+ */
+typedef struct ws_buffer {
+  unsigned int refs;
+  unsigned int len;
+  char data[];
+} ws_buffer;
+
+typedef struct ws_queued {
+  ws_buffer *buffer;
+  struct ws_queued *next;
+} ws_queued;
+
+typedef struct ws_serverClient {
+  struct espconn *conn;
+  struct ws_server *server;
+  int connectionState; // 1 handshake, 3 open, 4 closing (as ws_info)
+  int closeStatus; // close status received or sent, 0 if the connection just dropped
+
+  char *request; // handshake request received so far
+  unsigned int requestLen;
+
+  ws_parser parser;
+
+  ws_queued *queue; // frames waiting to be sent, the head one is being sent
+  ws_queued *queueTail;
+  unsigned int backlog; // bytes queued
+  bool sending;
+
+  void *reservedData;
+  struct ws_serverClient *next;
+} ws_serverClient;
+
+typedef struct ws_server {
+  struct espconn *listener;
+  ws_serverClient *clients;
+
+  unsigned int maxBacklog; // bytes queued per client before messages are dropped
+  unsigned int maxMessage;
+  bool streaming;
+  int timeout;
+
+  void *reservedData;
+  ws_serverOnConnectionCallback onConnection;
+  ws_serverOnReceiveCallback onReceive;
+  ws_serverOnCloseCallback onClose;
+} ws_server;
+
+/*
+ * Starts listening, returns 0 on success.
+ */
+int ws_serverStart(ws_server *server, int port);
+
+/*
+ * Stops listening and closes all connections.
+ */
+void ws_serverStop(ws_server *server);
+
+/*
+ * Queues a message to one client. Returns 0, or -1 if the client's backlog
+ * is full or it isn't open, -2 when out of memory.
+ */
+int ws_serverSend(ws_serverClient *client, int opCode, const char *message, unsigned int length);
+
+/*
+ * Queues a message to all open clients, encoding the frame only once.
+ * Returns the number of clients it was queued to.
+ */
+int ws_serverBroadcast(ws_server *server, int opCode, const char *message, unsigned int length);
+
+/*
+ * Sends a close frame and disconnects once it went out.
+ */
+void ws_serverClose(ws_serverClient *client, int status);
+
+#endif // _WEBSOCKETSERVER_H_
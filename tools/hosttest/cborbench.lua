@@ -0,0 +1,380 @@
+-- Host test and benchmark for the cbor module (app/modules/cbor.c), next to
+-- cjson on the same values.
+--
+--   luahost cborbench.lua      RFC 7049 examples, round trips, the options
+--                              shared with cjson, streaming, damaged input
+--   luahost -b cborbench.lua   size and speed against cjson on telemetry
+--                              payloads
+
+local failures = 0
+
+local function check(cond, what)
+  if not cond then
+    failures = failures + 1
+    print("FAIL: " .. what)
+  end
+end
+
+local function hex(s)
+  return (s:gsub(".", function(c) return string.format("%02x", c:byte()) end))
+end
+
+local function unhex(h)
+  return (h:gsub("%x%x", function(x) return string.char(tonumber(x, 16)) end))
+end
+
+-- deep comparison, NaN equal to itself
+local function same(a, b)
+  if type(a) ~= type(b) then
+    return false
+  end
+  if type(a) == "number" then
+    return a == b or (a ~= a and b ~= b)
+  end
+  if type(a) ~= "table" then
+    return a == b
+  end
+  for k, v in pairs(a) do
+    if not same(v, b[k]) then
+      return false
+    end
+  end
+  for k in pairs(b) do
+    if a[k] == nil then
+      return false
+    end
+  end
+  return true
+end
+
+local function show(v)
+  if type(v) == "table" then
+    local ok, s = pcall(cjson.encode, v)
+    return ok and s or tostring(v)
+  end
+  return tostring(v)
+end
+
+---------------------------------------------------------------------------
+-- RFC 7049 appendix A. Non-integral numbers that a float keeps exactly go
+-- out as floats, not half floats, so 1.5 differs from the RFC's f93e00.
+
+local encodings = {
+  {0, "00"}, {1, "01"}, {10, "0a"}, {23, "17"}, {24, "1818"}, {25, "1819"},
+  {100, "1864"}, {1000, "1903e8"}, {1000000, "1a000f4240"},
+  {1000000000000, "1b000000e8d4a51000"}, {-1, "20"}, {-10, "29"},
+  {-100, "3863"}, {-1000, "3903e7"}, {1.1, "fb3ff199999999999a"},
+  {1.5, "fa3fc00000"}, {100000.0, "1a000186a0"},
+  {3.4028234663852886e+38, "fa7f7fffff"}, {1.0e+300, "fb7e37e43c8800759c"},
+  {-4.1, "fbc010666666666666"}, {false, "f4"}, {true, "f5"}, {cbor.null, "f6"},
+  {"", "60"}, {"a", "6161"}, {"IETF", "6449455446"}, {"\"\\", "62225c"},
+  {"\195\188", "62c3bc"}, {{1, 2, 3}, "83010203"},
+  {{1, {2, 3}, {4, 5}}, "8301820203820405"}, {{a = 1}, "a1616101"}, {{}, "a0"},
+}
+
+local decodings = {
+  {"f90000", 0}, {"f98000", -0}, {"f93c00", 1}, {"f93e00", 1.5}, {"f97bff", 65504},
+  {"f90001", 5.960464477539063e-8}, {"f90400", 6.103515625e-05}, {"f9c400", -4},
+  {"f97c00", math.huge}, {"f9fc00", -math.huge}, {"f97e00", 0 / 0},
+  {"fa47c35000", 100000}, {"fb7ff0000000000000", math.huge}, {"f7", cbor.null},
+  {"80", {}}, {"9fff", {}}, {"9f018202039f0405ffff", {1, {2, 3}, {4, 5}}},
+  {"bf61610161629f0203ffff", {a = 1, b = {2, 3}}}, {"a201020304", {[1] = 2, [3] = 4}},
+  {"5f42010243030405ff", "\1\2\3\4\5"}, {"7f657374726561646d696e67ff", "streaming"},
+  {"c074323031332d30332d32315432303a30343a30305a", "2013-03-21T20:04:00Z"},
+  {"c11a514b67b0", 1363896240}, {"d74401020304", "\1\2\3\4"},
+  {"c0c0c0c001", 1}, {"a163" .. hex("nan") .. "01", {nan = 1}},
+}
+
+local malformed = {
+  "", "ff", "1c", "18", "1900", "9f", "81", "a1", "a101", "0000", "a1f97e0001",
+  "5f01ff", "5f6161ff", "f820", "1f", "3f", "df", "c0", "7f", "62c3",
+}
+
+local function test_rfc()
+  for _, e in ipairs(encodings) do
+    local ok, s = pcall(cbor.encode, e[1])
+    check(ok and hex(s) == e[2], "encode " .. show(e[1]) .. ": " .. (ok and hex(s) or s) .. ", expected " .. e[2])
+    check(same(cbor.decode(unhex(e[2])), e[1]), "decode " .. e[2])
+  end
+  for _, d in ipairs(decodings) do
+    local ok, v = pcall(cbor.decode, unhex(d[1]))
+    check(ok and same(v, d[2]), "decode " .. d[1] .. ": " .. show(v))
+  end
+  -- -0 keeps its sign
+  check(1 / cbor.decode(unhex("f98000")) < 0, "decode f98000 sign")
+  for _, h in ipairs(malformed) do
+    check(not pcall(cbor.decode, unhex(h)), "malformed " .. h .. " decoded")
+  end
+end
+
+---------------------------------------------------------------------------
+-- Random values
+
+math.randomseed(1)
+
+local function random_string(binary)
+  local n = math.random(0, 4) == 0 and math.random(24, 300) or math.random(0, 23)
+  local t = {}
+  for i = 1, n do
+    t[i] = string.char(binary and math.random(0, 255) or math.random(32, 126))
+  end
+  return table.concat(t)
+end
+
+local function random_number(json)
+  local kind = math.random(1, json and 5 or 8)
+  if kind == 1 then
+    return math.random(0, 30)
+  elseif kind == 2 then
+    return math.random(-70000, 70000)
+  elseif kind == 3 then
+    return math.random(0, 2 ^ 30) * 8192 - 2 ^ 40
+  elseif kind == 4 then
+    return math.random(-50000, 50000) / 4
+  elseif kind == 5 then
+    return math.random(-50000, 50000) / 10
+  elseif kind == 6 then
+    return (math.random() - 0.5) * 10 ^ math.random(-300, 300)
+  elseif kind == 7 then
+    return ({math.huge, -math.huge, 0 / 0, 2 ^ 64, -2 ^ 63, 2 ^ 53 + 2})[math.random(1, 6)]
+  end
+  return math.random() * 2 ^ 20
+end
+
+-- json limits values to what cjson gives back unchanged
+local function random_value(depth, json)
+  local kind = math.random(1, depth > 0 and 7 or 4)
+  if kind == 1 then
+    return random_number(json)
+  elseif kind == 2 then
+    return random_string(not json)
+  elseif kind == 3 then
+    return ({true, false, cbor.null})[math.random(1, 3)]
+  elseif kind == 4 then
+    return random_number(json)
+  elseif kind == 5 or kind == 6 then
+    local t = {}
+    for i = 1, math.random(1, 8) do
+      t[i] = random_value(depth - 1, json)
+    end
+    return t
+  end
+  local t = {}
+  for i = 1, math.random(0, 8) do
+    local key = random_string(false)
+    if not json and math.random(1, 4) == 1 then
+      -- integral keys would make it a (possibly sparse) array
+      key = math.random(-1000, 1000) + 0.25
+    end
+    t[key] = random_value(depth - 1, json)
+  end
+  return t
+end
+
+local function test_roundtrip(rounds)
+  for i = 1, rounds do
+    local v = random_value(4, false)
+    local s = cbor.encode(v)
+    local ok, back = pcall(cbor.decode, s)
+    check(ok and same(back, v), "round trip " .. hex(s):sub(1, 80))
+
+    -- whatever cjson gives back, cbor must give back too
+    v = random_value(4, true)
+    local j = cjson.decode(cjson.encode(v))
+    check(same(cbor.decode(cbor.encode(v)), j), "cbor and cjson differ on " .. show(v):sub(1, 80))
+    if failures > 10 then
+      return
+    end
+  end
+end
+
+---------------------------------------------------------------------------
+-- The options cbor shares with cjson. The firmware's cjson has its setters
+-- compiled out, so it is compared at its defaults, which cbor also starts at.
+
+local function nested(depth)
+  local v = 1
+  for i = 1, depth do
+    v = {v}
+  end
+  return v
+end
+
+local function test_options()
+  local limit = cbor.encode_max_depth()
+  cbor.encode_max_depth(5)
+  check(pcall(cbor.encode, nested(5)), "depth 5 within encode_max_depth(5)")
+  check(not pcall(cbor.encode, nested(6)), "depth 6 past encode_max_depth(5)")
+  cbor.encode_max_depth(limit)
+  check(pcall(cbor.encode, nested(limit)), "depth " .. limit .. " within the default")
+
+  -- a table holding itself is cut off by the depth limit
+  local loop = {}
+  loop[1] = loop
+  check(not pcall(cbor.encode, loop), "encoding a loop")
+
+  limit = cbor.decode_max_depth()
+  cbor.decode_max_depth(5)
+  check(pcall(cbor.decode, unhex("818181818101")), "depth 5 within decode_max_depth(5)")
+  check(not pcall(cbor.decode, unhex("81818181818101")), "depth 6 past decode_max_depth(5)")
+  cbor.decode_max_depth(limit)
+  check(not pcall(cbor.decode, string.rep("\129", 100000) .. "\1"), "deep nesting decoded")
+  check(pcall(cbor.decode, string.rep("\192", 100000) .. "\1"), "long run of tags")
+
+  local sparse = {
+    {[20] = 1}, {[11] = 1}, {[10] = 1}, {1, 2, [7] = 3}, {1, nil, 3}, {[1000] = 1, [999] = 2},
+    {[1.5] = 1}, {[-1] = 1}, {[0] = 1},
+  }
+  local convert, ratio, safe = cbor.encode_sparse_array()
+  check(not convert and ratio == 2 and safe == 10, "sparse array defaults differ from cjson's")
+  for _, t in ipairs(sparse) do
+    local ok_cbor, s = pcall(cbor.encode, t)
+    local ok_json, j = pcall(cjson.encode, t)
+    check(ok_cbor == ok_json, "sparse array " .. (ok_json and j or hex(s)))
+  end
+  cbor.encode_sparse_array(true)
+  check(hex(cbor.encode({[20] = 1})) == "a11401", "sparse array converted to a map")
+  cbor.encode_sparse_array(false, 0)
+  check(pcall(cbor.encode, {[1000] = 1}), "sparse array check off")
+  cbor.encode_sparse_array(false, 2, 10)
+
+  -- a kept buffer gives the same results, also after a failed encode
+  local values = {}
+  for i = 1, 50 do
+    values[i] = random_value(3, false)
+  end
+  local plain = {}
+  for i, v in ipairs(values) do
+    plain[i] = cbor.encode(v)
+  end
+  cbor.encode_keep_buffer(true)
+  for i, v in ipairs(values) do
+    check(cbor.encode(v) == plain[i], "encode_keep_buffer result " .. i)
+    check(not pcall(cbor.encode, {v, print}), "function encoded")
+  end
+  cbor.encode_keep_buffer(false)
+  check(not cbor.encode_keep_buffer(), "encode_keep_buffer off")
+end
+
+---------------------------------------------------------------------------
+-- Streaming into a function or an object with write() must give the same
+-- bytes, in pieces no bigger than asked for
+
+local function test_streaming()
+  for i = 1, 200 do
+    local v = random_value(4, false)
+    local whole = cbor.encode(v)
+    local size = ({16, 17, 31, 64, 256, 1000})[i % 6 + 1]
+    local pieces, fits = {}, true
+    cbor.encode(v, function(s)
+      pieces[#pieces + 1] = s
+      fits = fits and #s <= size and #s > 0
+    end, size)
+    check(table.concat(pieces) == whole and fits, "streamed at " .. size .. ": " .. hex(whole):sub(1, 80))
+
+    local sink = {parts = {}}
+    function sink:write(s)
+      self.parts[#self.parts + 1] = s
+    end
+    cbor.encode(v, sink, size)
+    check(table.concat(sink.parts) == whole, "streamed to an object at " .. size)
+  end
+
+  local ok, err = pcall(cbor.encode, {string.rep("x", 100)}, function() error("sink full") end, 16)
+  check(not ok and tostring(err):find("sink full"), "sink error passed on: " .. tostring(err))
+  check(not pcall(cbor.encode, 1, {}, 16), "object without write()")
+  check(not pcall(cbor.encode, 1, print, 15), "chunk size below 16")
+end
+
+---------------------------------------------------------------------------
+-- No strict prefix of an encoding is a value, and damaged encodings may
+-- fail but never crash or read past the string
+
+local function test_damaged(rounds)
+  for i = 1, rounds do
+    local s = cbor.encode(random_value(4, false))
+    for n = 0, #s - 1, math.max(1, math.floor(#s / 40)) do
+      check(not pcall(cbor.decode, s:sub(1, n)), "prefix of " .. n .. " bytes decoded")
+    end
+    for j = 1, 20 do
+      local at = math.random(1, #s)
+      local b = ({0x00, 0x18, 0x1b, 0x1f, 0x5f, 0x7f, 0x9f, 0xbf, 0xc0, 0xf9, 0xfb, 0xff,
+                  math.random(0, 255)})[math.random(1, 13)]
+      local damaged = s:sub(1, at - 1) .. string.char(b) .. s:sub(at + (math.random(0, 1)))
+      pcall(cbor.decode, damaged)
+    end
+    if failures > 10 then
+      return
+    end
+  end
+end
+
+---------------------------------------------------------------------------
+-- Benchmark: telemetry payloads as our MQTT nodes publish them
+
+local function reading(t)
+  return {id = "node-7f3a21", t = t, temp = 21.5, hum = 48.25, press = 1013.2, vbat = 3.28, rssi = -67}
+end
+
+local function batch()
+  local t = {}
+  for i = 1, 30 do
+    t[i] = {t = 1700000000 + i * 60, v = 20 + (i % 7) / 4}
+  end
+  return {id = "node-7f3a21", unit = "C", samples = t}
+end
+
+local payloads = {
+  {"reading", reading(1700000000)},
+  {"batch of 30", batch()},
+  {"status", {uptime = 86400, heap = 31888, fw = "3.0.0-master", reset = "watchdog",
+              wifi = {ssid = "plant-3", ch = 6, bssid = "a4:2b:b0:11:22:33", rssi = -71},
+              gpio = {0, 1, 1, 0, 0, 1, 0, 1}, ota = false, debug = true}},
+  {"counters", {1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377, 610, 987, 1597}},
+}
+
+-- microseconds per call, run for a fifth of a second
+local function time(f, v)
+  local n, start = 0, clock()
+  local elapsed
+  repeat
+    for i = 1, 100 do
+      f(v)
+    end
+    n = n + 100
+    elapsed = clock() - start
+  until elapsed > 0.2
+  return elapsed / n * 1e6
+end
+
+local function bench()
+  print(string.format("%-12s %6s %6s %9s %9s %9s %9s", "", "json", "cbor", "json enc", "cbor enc",
+                      "json dec", "cbor dec"))
+  print(string.format("%-12s %6s %6s %9s %9s %9s %9s", "", "bytes", "bytes", "us", "us", "us", "us"))
+  for _, p in ipairs(payloads) do
+    local j, c = cjson.encode(p[2]), cbor.encode(p[2])
+    print(string.format("%-12s %6d %6d %9.2f %9.2f %9.2f %9.2f", p[1], #j, #c,
+                        time(cjson.encode, p[2]), time(cbor.encode, p[2]),
+                        time(cjson.decode, j), time(cbor.decode, c)))
+  end
+  cbor.encode_keep_buffer(true)
+  print(string.format("%-12s %23s %9.2f", "reading", "with encode_keep_buffer", time(cbor.encode, payloads[1][2])))
+  cbor.encode_keep_buffer(false)
+end
+
+---------------------------------------------------------------------------
+
+if BENCH then
+  bench()
+  return
+end
+
+test_rfc()
+test_roundtrip(2000)
+test_options()
+test_streaming()
+test_damaged(1000)
+if failures > 0 then
+  error(failures .. " checks failed")
+end
+print("cborbench: RFC examples, round trips, options, streaming and damaged input ok")
@@ -0,0 +1,234 @@
+/*
+ * Host comparison and benchmark for the number formatting and parsing in
+ * app/modules/cjson.c. The functions are cut out of cjson.c by the Makefile
+ * into cjson_numbers.inc, so the code tested is the code the firmware runs.
+ *
+ *   cjsonbench [-n count] [-s seed]   json_format_number must write what
+ *                                     "%.14g" writes, and json_fast_number
+ *                                     must read what strtod() reads
+ *   cjsonbench -b                     both against the libc path over
+ *                                     sensor style payloads
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "c_types.h"
+#include "c_stdio.h"
+#include "c_string.h"
+
+/* as luaconf.h has them */
+#define LUA_NUMBER double
+#define LUA_NUMBER_FMT "%.14g"
+
+#include "cjson_numbers.inc"
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static unsigned int rnd_below(unsigned int n) {
+  return (unsigned int) (rnd() >> 32) % n;
+}
+
+/* The kinds of number a telemetry payload holds */
+enum { KIND_COUNTER, KIND_FIXED1, KIND_FIXED2, KIND_TIMESTAMP, KIND_SMALL, KIND_ANY, KIND_COUNT };
+
+static const char *kind_names[KIND_COUNT] = {
+  "counters", "0.1 fixed", "0.01 fixed", "timestamps", "small/large", "any double"
+};
+
+static double random_number(int kind) {
+  union { double d; uint64_t u; } bits;
+
+  switch (kind) {
+  case KIND_COUNTER:
+    return rnd_below(100000);
+  case KIND_FIXED1:
+    return ((double) rnd_below(20000) - 5000) / 10;
+  case KIND_FIXED2:
+    return ((double) rnd_below(200000) - 50000) / 100;
+  case KIND_TIMESTAMP:
+    return 1600000000 + rnd_below(200000000) + (rnd_below(2) ? rnd_below(1000) / 1000.0 : 0);
+  case KIND_SMALL:
+    return rnd_below(100000) / 1000.0 * pow(10, (int) rnd_below(40) - 20);
+  default:
+    do {
+      bits.u = rnd();
+    } while (isnan(bits.d) || isinf(bits.d));
+    return bits.d;
+  }
+}
+
+static int check_number(double v, long *bad) {
+  char mine[FPCONV_G_FMT_BUFSIZE], ref[64], text[64];
+  const char *end;
+  char *refend;
+  double parsed, want;
+  int len, i;
+
+  len = json_format_number(mine, v);
+  mine[len] = '\0';
+  snprintf(ref, sizeof(ref), "%.14g", v);
+  if (strcmp(mine, ref) != 0) {
+    if ((*bad)++ < 10) {
+      fprintf(stderr, "format %.17g: %s, expected %s\n", v, mine, ref);
+    }
+    return 0;
+  }
+
+  /* read back the shortest exact form and a few fixed point forms */
+  for (i = -1; i < 6; i++) {
+    if (i < 0) {
+      snprintf(text, sizeof(text), "%.17g", v);
+    } else {
+      snprintf(text, sizeof(text), "%.*f", i, v);
+    }
+    want = strtod(text, &refend);
+    if (json_fast_number(text, &parsed, &end) && (parsed != want || end != refend)) {
+      if ((*bad)++ < 10) {
+        fprintf(stderr, "parse %s: %.17g, expected %.17g\n", text, parsed, want);
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int check(long count) {
+  static const double edges[] = {
+    0, 1, 0.5, 0.1, 123.456, 1e13, 1e14, 99999999999999, 99999999999999.5, 1e-4, 1e-5,
+    0.00012345, 1e300, 1e-300, 5e-324, 1.7976931348623157e308, 123456789012345678.0,
+    3.14159265358979, 2.5e-7, 1e21, 1e22, 1e23, 0.30000000000000004
+  };
+  static const char *texts[] = {
+    "0", "-0", "12", "1.5e3", "1E-2", "-12.25", "1e400", "0.1", "123456789012345678901",
+    "7e22", "9007199254740993", "1e+05", "-"
+  };
+  long bad = 0, i;
+  unsigned int j;
+
+  for (j = 0; j < sizeof(edges) / sizeof(edges[0]); j++) {
+    check_number(edges[j], &bad);
+    check_number(-edges[j], &bad);
+  }
+  for (j = 0; j < sizeof(texts) / sizeof(texts[0]); j++) {
+    const char *end;
+    char *refend;
+    double parsed, want = strtod(texts[j], &refend);
+    if (json_fast_number(texts[j], &parsed, &end) && (parsed != want || end != refend)) {
+      fprintf(stderr, "parse %s: %.17g, expected %.17g\n", texts[j], parsed, want);
+      bad++;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    check_number(random_number(i % KIND_COUNT), &bad);
+  }
+
+  if (bad) {
+    fprintf(stderr, "%ld of %ld numbers wrong\n", bad, count);
+    return 0;
+  }
+  printf("cjsonbench: %ld numbers format and parse as libc does\n", count);
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_COUNT 200000
+
+/* Nanoseconds per number for the firmware's functions and for the libc
+ * calls cjson used before them, per kind of number */
+static void bench(void) {
+  static double values[BENCH_COUNT];
+  static char texts[BENCH_COUNT][32];
+  char buf[FPCONV_G_FMT_BUFSIZE + 8];
+  volatile double sink = 0;
+  volatile int len = 0;
+  int kind, i;
+
+  printf("%-12s %10s %10s %10s %10s   (ns per number)\n", "", "format", "%.14g", "parse",
+         "strtod");
+  for (kind = 0; kind < KIND_COUNT; kind++) {
+    double start, t[4];
+    const char *end;
+    char *libend;
+    double v;
+
+    for (i = 0; i < BENCH_COUNT; i++) {
+      values[i] = random_number(kind);
+      snprintf(texts[i], sizeof(texts[i]), "%.14g", values[i]);
+    }
+
+    start = now();
+    for (i = 0; i < BENCH_COUNT; i++) {
+      len += json_format_number(buf, values[i]);
+    }
+    t[0] = now() - start;
+
+    start = now();
+    for (i = 0; i < BENCH_COUNT; i++) {
+      len += snprintf(buf, sizeof(buf), "%.14g", values[i]);
+    }
+    t[1] = now() - start;
+
+    start = now();
+    for (i = 0; i < BENCH_COUNT; i++) {
+      if (!json_fast_number(texts[i], &v, &end)) {
+        v = strtod(texts[i], &libend);
+      }
+      sink += v;
+    }
+    t[2] = now() - start;
+
+    start = now();
+    for (i = 0; i < BENCH_COUNT; i++) {
+      sink += strtod(texts[i], &libend);
+    }
+    t[3] = now() - start;
+
+    printf("%-12s", kind_names[kind]);
+    for (i = 0; i < 4; i++) {
+      printf(" %10.1f", t[i] * 1e9 / BENCH_COUNT);
+    }
+    printf("\n");
+  }
+  (void) sink;
+  (void) len;
+}
+
+int main(int argc, char **argv) {
+  long count = 1000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench();
+      return 0;
+    case 'n':
+      count = strtol(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n count] [-s seed] | -b\n", argv[0]);
+      return 2;
+    }
+  }
+  return check(count) ? 0 : 1;
+}
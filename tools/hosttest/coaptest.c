@@ -0,0 +1,716 @@
+/*
+ * Host test for the CoAP parser, builder and resource dispatch in
+ * app/coap/coap.c and coap_server.c. Requests are encoded and replies decoded
+ * here independently of the firmware code.
+ *
+ *   coaptest [-n rounds] [-s seed]   recorded and scripted requests, then
+ *                                    every one damaged at random and
+ *                                    answered into buffers of random size
+ *   coaptest packet...               answers captured requests, each file
+ *                                    holding one UDP payload, and prints
+ *                                    the replies
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coap.h"
+#include "coap_server.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/* ------------------------------------------------------------------------
+ * Stand-ins for the SDK and for endpoints.c
+ */
+
+static int resets;
+
+unsigned long os_random(void) {
+  return 0x5a17;
+}
+
+void coap_observe_reset(const coap_packet_t *pkt, const coap_peer_t *peer) {
+  resets++;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static unsigned int rnd_below(unsigned int n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (unsigned int) (rng_state >> 32) % n;
+}
+
+/* ------------------------------------------------------------------------
+ * Resources: variables under /v1/v/<name>, an echo function under /v1/f/echo
+ * and /v1/id, registered as endpoints.c registers its own
+ */
+
+#define BIG_SIZE 3000
+#define VARIABLES 200
+
+typedef struct {
+  coap_luser_entry entry;     /* first, the handlers get a pointer to it */
+  const uint8_t *data;
+  size_t len;
+} test_variable;
+
+static uint8_t big[BIG_SIZE];
+static char variable_names[VARIABLES][8];
+static test_variable variables[VARIABLES + 2];
+
+static int handle_get_variable(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer,
+                               coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt,
+                               uint8_t id_hi, uint8_t id_lo) {
+  const test_variable *v = (const test_variable *) entry;
+
+  return coap_make_block_response(scratch, outpkt, inpkt, v->data, v->len, id_hi, id_lo, &inpkt->tok,
+                                  COAP_RSPCODE_CONTENT, entry->content_type);
+}
+
+static int handle_post_function(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer,
+                                coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt,
+                                uint8_t id_hi, uint8_t id_lo) {
+  return coap_make_response(scratch, outpkt, inpkt->payload.p, inpkt->payload.len, id_hi, id_lo, &inpkt->tok,
+                            COAP_RSPCODE_CHANGED, COAP_CONTENTTYPE_TEXT_PLAIN);
+}
+
+static int handle_get_id(const coap_endpoint_t *ep, coap_luser_entry *entry, const coap_peer_t *peer,
+                         coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt,
+                         uint8_t id_hi, uint8_t id_lo) {
+  return coap_make_response(scratch, outpkt, (const uint8_t *) "42", 2, id_hi, id_lo, &inpkt->tok,
+                            COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
+}
+
+static const coap_endpoint_path_t path_variable = {2, {"v1", "v"}};
+static const coap_endpoint_path_t path_function = {2, {"v1", "f"}};
+static const coap_endpoint_path_t path_id = {2, {"v1", "id"}};
+
+static const coap_endpoint_t endpoints[] = {
+  {COAP_METHOD_GET, handle_get_variable, &path_variable, "ct=0", NULL},
+  {COAP_METHOD_POST, handle_post_function, &path_function, NULL, NULL},
+  {COAP_METHOD_GET, handle_get_id, &path_id, "ct=0", NULL},
+};
+
+static coap_luser_entry echo_function = {"echo", NULL, COAP_CONTENTTYPE_TEXT_PLAIN};
+
+static void setup_resources(void) {
+  int i;
+
+  for (i = 0; i < BIG_SIZE; i++) {
+    big[i] = 'a' + i % 26;
+  }
+  for (i = 0; i < VARIABLES + 2; i++) {
+    test_variable *v = &variables[i];
+    if (i == VARIABLES) {
+      v->entry.name = "temp";
+      v->data = (const uint8_t *) "21.5";
+      v->len = 4;
+    } else if (i == VARIABLES + 1) {
+      v->entry.name = "big";
+      v->data = big;
+      v->len = BIG_SIZE;
+      v->entry.content_type = COAP_CONTENTTYPE_APPLICATION_OCTET_STREAM;
+    } else {
+      snprintf(variable_names[i], sizeof(variable_names[i]), "e%d", i);
+      v->entry.name = variable_names[i];
+      v->data = (const uint8_t *) variable_names[i];
+      v->len = strlen(variable_names[i]);
+    }
+    CHECK(coap_resource_add(&endpoints[0], &v->entry));
+  }
+  CHECK(coap_resource_add(&endpoints[1], &echo_function));
+  CHECK(coap_resource_add(&endpoints[2], NULL));
+}
+
+/* ------------------------------------------------------------------------
+ * Request encoder and reply decoder, written from RFC 7252 section 3
+ */
+
+#define PACKET_MAX 2048
+
+typedef struct {
+  uint8_t buf[PACKET_MAX];
+  size_t len;
+  int last_option;
+} packet_t;
+
+static void put_nibble_ext(packet_t *p, uint32_t value, uint8_t *nibble, uint8_t *ext, size_t *ext_len) {
+  if (value < 13) {
+    *nibble = value;
+  } else if (value < 269) {
+    *nibble = 13;
+    ext[(*ext_len)++] = value - 13;
+  } else {
+    *nibble = 14;
+    ext[(*ext_len)++] = (value - 269) >> 8;
+    ext[(*ext_len)++] = (value - 269) & 0xff;
+  }
+}
+
+static void pkt_start(packet_t *p, int type, int code, uint16_t mid, const char *token) {
+  size_t tkl = token ? strlen(token) : 0;
+
+  p->buf[0] = 0x40 | type << 4 | tkl;
+  p->buf[1] = code;
+  p->buf[2] = mid >> 8;
+  p->buf[3] = mid & 0xff;
+  if (tkl) {
+    memcpy(p->buf + 4, token, tkl);
+  }
+  p->len = 4 + tkl;
+  p->last_option = 0;
+}
+
+static void pkt_opt(packet_t *p, int num, const void *value, size_t len) {
+  uint8_t ext[4], delta, length;
+  size_t ext_len = 0;
+
+  put_nibble_ext(p, num - p->last_option, &delta, ext, &ext_len);
+  put_nibble_ext(p, len, &length, ext, &ext_len);
+  p->buf[p->len++] = delta << 4 | length;
+  memcpy(p->buf + p->len, ext, ext_len);
+  p->len += ext_len;
+  memcpy(p->buf + p->len, value, len);
+  p->len += len;
+  p->last_option = num;
+}
+
+static void pkt_uint(packet_t *p, int num, uint32_t value) {
+  uint8_t bytes[4];
+  size_t n = 0;
+  int shift;
+
+  for (shift = 24; shift >= 0; shift -= 8) {
+    if (n || (value >> shift) & 0xff) {
+      bytes[n++] = (value >> shift) & 0xff;
+    }
+  }
+  pkt_opt(p, num, bytes, n);
+}
+
+static void pkt_path(packet_t *p, const char *path) {
+  while (*path) {
+    size_t len = strcspn(path, "/");
+    pkt_opt(p, COAP_OPTION_URI_PATH, path, len);
+    path += len + (path[len] == '/');
+  }
+}
+
+static void pkt_payload(packet_t *p, const void *data, size_t len) {
+  p->buf[p->len++] = 0xff;
+  memcpy(p->buf + p->len, data, len);
+  p->len += len;
+}
+
+#define REPLY_OPTIONS 32
+
+typedef struct {
+  int type, code, tkl;
+  uint16_t mid;
+  uint8_t token[8];
+  int numopts;
+  struct {
+    int num;
+    const uint8_t *value;
+    size_t len;
+  } opts[REPLY_OPTIONS];
+  const uint8_t *payload;
+  size_t payload_len;
+} reply_t;
+
+static int get_ext(int *value, const uint8_t **p, const uint8_t *end) {
+  if (*value == 13) {
+    if (*p >= end) {
+      return 0;
+    }
+    *value = 13 + *(*p)++;
+  } else if (*value == 14) {
+    if (end - *p < 2) {
+      return 0;
+    }
+    *value = 269 + ((*p)[0] << 8 | (*p)[1]);
+    *p += 2;
+  } else if (*value == 15) {
+    return 0;
+  }
+  return 1;
+}
+
+static int decode(reply_t *r, const uint8_t *buf, size_t len) {
+  const uint8_t *p = buf + 4, *end = buf + len;
+  int num = 0;
+
+  memset(r, 0, sizeof(*r));
+  if (len < 4 || buf[0] >> 6 != 1) {
+    return 0;
+  }
+  r->type = (buf[0] >> 4) & 3;
+  r->tkl = buf[0] & 0x0f;
+  r->code = buf[1];
+  r->mid = buf[2] << 8 | buf[3];
+  if (r->tkl > 8 || end - p < r->tkl) {
+    return 0;
+  }
+  memcpy(r->token, p, r->tkl);
+  p += r->tkl;
+
+  while (p < end) {
+    int delta, length;
+
+    if (*p == 0xff) {
+      /* a payload marker must be followed by a payload */
+      if (p + 1 == end) {
+        return 0;
+      }
+      r->payload = p + 1;
+      r->payload_len = end - p - 1;
+      return 1;
+    }
+    delta = *p >> 4;
+    length = *p++ & 0x0f;
+    if (!get_ext(&delta, &p, end) || !get_ext(&length, &p, end) || end - p < length ||
+        r->numopts == REPLY_OPTIONS) {
+      return 0;
+    }
+    num += delta;
+    r->opts[r->numopts].num = num;
+    r->opts[r->numopts].value = p;
+    r->opts[r->numopts].len = length;
+    r->numopts++;
+    p += length;
+  }
+  return 1;
+}
+
+static int reply_uint(const reply_t *r, int num, uint32_t *value) {
+  int i;
+  size_t j;
+
+  for (i = 0; i < r->numopts; i++) {
+    if (r->opts[i].num == num) {
+      *value = 0;
+      for (j = 0; j < r->opts[i].len; j++) {
+        *value = *value << 8 | r->opts[i].value[j];
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void dump_reply(const reply_t *r) {
+  int i;
+  size_t j;
+
+  printf("  type %d code %d.%02d mid 0x%04x token ", r->type, r->code >> 5, r->code & 0x1f, r->mid);
+  for (i = 0; i < r->tkl; i++) {
+    printf("%02x", r->token[i]);
+  }
+  printf("\n");
+  for (i = 0; i < r->numopts; i++) {
+    printf("  option %d:", r->opts[i].num);
+    for (j = 0; j < r->opts[i].len; j++) {
+      printf(" %02x", r->opts[i].value[j]);
+    }
+    printf("\n");
+  }
+  if (r->payload) {
+    /* the start of it, as text */
+    printf("  payload %zu bytes: %.*s\n", r->payload_len, r->payload_len < 64 ? (int) r->payload_len : 64,
+           (const char *) r->payload);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Exchanges with coap_server_respond(). Every request sent is kept for the
+ * damaged pass.
+ */
+
+#define SCRIPT_MAX 1024
+
+static packet_t script[SCRIPT_MAX];
+static int script_len;
+static uint8_t response[MAX_MESSAGE_SIZE];
+
+static size_t respond(const uint8_t *req, size_t reqlen, uint8_t *rsp, size_t rsplen) {
+  /* exact sized copies, so ASan sees reads and writes past either end */
+  uint8_t *in = malloc(reqlen ? reqlen : 1), *out = malloc(rsplen ? rsplen : 1);
+  coap_peer_t peer = {{192, 168, 4, 2}, 5683, NULL};
+  size_t n;
+
+  memcpy(in, req, reqlen);
+  n = coap_server_respond((char *) in, reqlen, (char *) out, rsplen, &peer);
+  CHECK(n <= rsplen);
+  if (n <= rsplen) {
+    memcpy(rsp, out, n);
+  }
+  free(in);
+  free(out);
+  return n;
+}
+
+static void record(const uint8_t *req, size_t len) {
+  if (script_len < SCRIPT_MAX) {
+    memcpy(script[script_len].buf, req, len);
+    script[script_len++].len = len;
+  }
+}
+
+static int exchange(const packet_t *req, reply_t *r) {
+  size_t n;
+
+  record(req->buf, req->len);
+  n = respond(req->buf, req->len, response, sizeof(response));
+  if (n == 0) {
+    return 0;
+  }
+  CHECK(decode(r, response, n));
+  return 1;
+}
+
+/* the reply must acknowledge the request, with its message id and token */
+static int acknowledges(const reply_t *r, uint16_t mid, const char *token) {
+  size_t tkl = token ? strlen(token) : 0;
+
+  return r->type == COAP_TYPE_ACK && r->mid == mid && r->tkl == (int) tkl && memcmp(r->token, token, tkl) == 0;
+}
+
+static void get(reply_t *r, const char *path, uint16_t mid, int block2) {
+  packet_t req;
+
+  pkt_start(&req, COAP_TYPE_CON, COAP_METHOD_GET, mid, "tk");
+  pkt_path(&req, path);
+  if (block2 >= 0) {
+    pkt_uint(&req, COAP_OPTION_BLOCK2, block2);
+  }
+  CHECK(exchange(&req, r));
+  CHECK(acknowledges(r, mid, "tk"));
+}
+
+/* ------------------------------------------------------------------------
+ * Tests
+ */
+
+/* Requests as libcoap's coap-client and Copper send them */
+static void test_recorded(void) {
+  static const uint8_t well_known[] = {
+    0x41, 0x01, 0x7d, 0x34, 0x71, 0xbb, 0x2e, 0x77, 0x65, 0x6c, 0x6c, 0x2d, 0x6b, 0x6e, 0x6f, 0x77,
+    0x6e, 0x04, 0x63, 0x6f, 0x72, 0x65
+  };
+  static const uint8_t get_temp[] = {
+    0x44, 0x01, 0x8a, 0x02, 0x3b, 0x91, 0x0e, 0x60, 0x3b, 0x31, 0x39, 0x32, 0x2e, 0x31, 0x36,
+    0x38, 0x2e, 0x34, 0x2e, 0x31, 0x82, 0x76, 0x31, 0x01, 0x76, 0x04, 0x74, 0x65, 0x6d, 0x70, 0xc1,
+    0x02
+  };
+  coap_packet_t pkt;
+  reply_t r;
+  size_t n;
+
+  CHECK(coap_parse(&pkt, well_known, sizeof(well_known)) == 0);
+  CHECK(pkt.hdr.ver == 1 && pkt.hdr.t == COAP_TYPE_CON && pkt.hdr.code == COAP_METHOD_GET);
+  CHECK(pkt.hdr.id[0] == 0x7d && pkt.hdr.id[1] == 0x34);
+  CHECK(pkt.tok.len == 1 && pkt.tok.p[0] == 0x71);
+  CHECK(pkt.numopts == 2 && pkt.opts[0].num == COAP_OPTION_URI_PATH && pkt.opts[1].num == COAP_OPTION_URI_PATH);
+  CHECK(pkt.opts[0].buf.len == 11 && memcmp(pkt.opts[0].buf.p, ".well-known", 11) == 0);
+  CHECK(pkt.payload.len == 0);
+
+  /* nothing registers /.well-known/core here */
+  record(well_known, sizeof(well_known));
+  n = respond(well_known, sizeof(well_known), response, sizeof(response));
+  CHECK(n > 0 && decode(&r, response, n));
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND && r.mid == 0x7d34 && r.tkl == 1 && r.token[0] == 0x71);
+  CHECK(r.payload == NULL);
+
+  /* Uri-Host, Uri-Path v1/v/temp, Block2 0/0/64 */
+  CHECK(coap_parse(&pkt, get_temp, sizeof(get_temp)) == 0);
+  CHECK(pkt.numopts == 5 && pkt.opts[0].num == COAP_OPTION_URI_HOST && pkt.opts[4].num == COAP_OPTION_BLOCK2);
+  record(get_temp, sizeof(get_temp));
+  n = respond(get_temp, sizeof(get_temp), response, sizeof(response));
+  CHECK(n > 0 && decode(&r, response, n));
+  CHECK(r.code == COAP_RSPCODE_CONTENT && r.mid == 0x8a02 && r.tkl == 4);
+  CHECK(r.payload_len == 4 && memcmp(r.payload, "21.5", 4) == 0);
+}
+
+/* Parsing a packet and building it again must give the packet back, and
+ * building it into anything smaller must fail without writing past the end */
+static void check_roundtrip(const packet_t *p) {
+  coap_packet_t pkt;
+  uint8_t *out;
+  size_t size, len;
+
+  CHECK(coap_parse(&pkt, p->buf, p->len) == 0);
+  for (size = 0; size <= p->len; size++) {
+    out = malloc(size ? size : 1);
+    len = size;
+    if (size < p->len) {
+      CHECK(coap_build(out, &len, &pkt) != 0);
+    } else {
+      CHECK(coap_build(out, &len, &pkt) == 0);
+      CHECK(len == p->len && memcmp(out, p->buf, len) == 0);
+    }
+    free(out);
+  }
+}
+
+static void test_roundtrip(void) {
+  static const size_t lengths[] = {0, 1, 12, 13, 14, 268, 269, 270, 300, 1000};
+  static char value[1001];
+  packet_t p;
+  unsigned int i;
+
+  memset(value, 'x', sizeof(value));
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    pkt_start(&p, COAP_TYPE_CON, COAP_METHOD_GET, 0x1000 + i, "token123");
+    pkt_opt(&p, COAP_OPTION_IF_MATCH, value, lengths[i] < 8 ? lengths[i] : 8);
+    pkt_path(&p, "a/bb/ccc");
+    pkt_opt(&p, COAP_OPTION_PROXY_URI, value, lengths[i]);
+    pkt_uint(&p, COAP_OPTION_SIZE1, 70000);
+    if (i & 1) {
+      pkt_payload(&p, value, lengths[i] + 1);
+    }
+    check_roundtrip(&p);
+  }
+
+  /* option deltas needing one extension byte, and options that repeat */
+  pkt_start(&p, COAP_TYPE_NONCON, COAP_METHOD_POST, 7, NULL);
+  pkt_opt(&p, 13, "", 0);
+  pkt_opt(&p, 13, "", 0);
+  pkt_opt(&p, 255, "z", 1);
+  check_roundtrip(&p);
+}
+
+static void test_dispatch(void) {
+  packet_t req;
+  reply_t r;
+  uint32_t value;
+  int i;
+
+  get(&r, "v1/v/temp", 1, -1);
+  CHECK(r.code == COAP_RSPCODE_CONTENT);
+  CHECK(reply_uint(&r, COAP_OPTION_CONTENT_FORMAT, &value) && value == COAP_CONTENTTYPE_TEXT_PLAIN);
+  CHECK(!reply_uint(&r, COAP_OPTION_BLOCK2, &value));
+  CHECK(r.payload_len == 4 && memcmp(r.payload, "21.5", 4) == 0);
+
+  /* enough resources to share hash buckets */
+  for (i = 0; i < VARIABLES; i++) {
+    char path[16];
+    snprintf(path, sizeof(path), "v1/v/e%d", i);
+    get(&r, path, 100 + i, -1);
+    CHECK(r.code == COAP_RSPCODE_CONTENT);
+    CHECK(r.payload_len == strlen(variable_names[i]) && memcmp(r.payload, variable_names[i], r.payload_len) == 0);
+  }
+
+  get(&r, "v1/id", 2, -1);
+  CHECK(r.code == COAP_RSPCODE_CONTENT && r.payload_len == 2 && memcmp(r.payload, "42", 2) == 0);
+
+  /* paths that name nothing, or more or less than a resource */
+  get(&r, "v1/v/nothing", 3, -1);
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND && r.payload == NULL);
+  get(&r, "v1/v", 4, -1);
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND);
+  get(&r, "v1/v/temp/x", 5, -1);
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND);
+  get(&r, "v1/vtemp", 6, -1);
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND);
+  get(&r, "", 7, -1);
+  CHECK(r.code == COAP_RSPCODE_NOT_FOUND);
+
+  pkt_start(&req, COAP_TYPE_CON, COAP_METHOD_PUT, 8, "p");
+  pkt_path(&req, "v1/v/temp");
+  CHECK(exchange(&req, &r) && acknowledges(&r, 8, "p"));
+  CHECK(r.code == COAP_RSPCODE_METHOD_NOT_ALLOWED);
+
+  pkt_start(&req, COAP_TYPE_CON, COAP_METHOD_POST, 9, "pq");
+  pkt_path(&req, "v1/f/echo");
+  pkt_payload(&req, "hello", 5);
+  CHECK(exchange(&req, &r) && acknowledges(&r, 9, "pq"));
+  CHECK(r.code == COAP_RSPCODE_CHANGED && r.payload_len == 5 && memcmp(r.payload, "hello", 5) == 0);
+
+  /* empty ACKs are not answered, a reset ends an observation */
+  pkt_start(&req, COAP_TYPE_ACK, 0, 10, NULL);
+  CHECK(!exchange(&req, &r));
+  pkt_start(&req, COAP_TYPE_RESET, 0, 11, NULL);
+  CHECK(!exchange(&req, &r) && resets == 1);
+
+  /* malformed requests are dropped */
+  pkt_start(&req, COAP_TYPE_CON, COAP_METHOD_GET, 12, NULL);
+  req.buf[0] = 0x49;     /* token length 9 */
+  CHECK(!exchange(&req, &r));
+  pkt_start(&req, COAP_TYPE_CON, COAP_METHOD_GET, 13, NULL);
+  req.buf[req.len++] = 0xf0;
+  CHECK(!exchange(&req, &r));
+}
+
+/* RFC 7959 section 2.4: the big variable fetched block by block at every
+ * block size must come back whole */
+static void test_block2(void) {
+  static uint8_t fetched[BIG_SIZE];
+  uint32_t value, size2 = 0;
+  reply_t r;
+  int szx;
+
+  for (szx = 0; szx <= COAP_BLOCK_SZX_MAX; szx++) {
+    uint32_t num = 0, block = COAP_BLOCK_SIZE(szx);
+    size_t got = 0;
+    int more;
+
+    do {
+      get(&r, "v1/v/big", 200 + num, num << 4 | szx);
+      CHECK(r.code == COAP_RSPCODE_CONTENT);
+      CHECK(reply_uint(&r, COAP_OPTION_CONTENT_FORMAT, &value) && value == COAP_CONTENTTYPE_APPLICATION_OCTET_STREAM);
+      CHECK(reply_uint(&r, COAP_OPTION_BLOCK2, &value) && value >> 4 == num && (value & 7) == (uint32_t) szx);
+      more = (value >> 3) & 1;
+      CHECK(reply_uint(&r, COAP_OPTION_SIZE2, &size2) == (num == 0));
+      CHECK(num > 0 || size2 == BIG_SIZE);
+      CHECK(more ? r.payload_len == block : r.payload_len == BIG_SIZE - got);
+      if (failures || got + r.payload_len > BIG_SIZE) {
+        return;
+      }
+      memcpy(fetched + got, r.payload, r.payload_len);
+      got += r.payload_len;
+      num++;
+    } while (more);
+    CHECK(got == BIG_SIZE && memcmp(fetched, big, BIG_SIZE) == 0);
+
+    /* just past the end */
+    get(&r, "v1/v/big", 300, num << 4 | szx);
+    CHECK(r.code == COAP_RSPCODE_BAD_OPTION && r.payload == NULL);
+  }
+
+  /* without a Block2 option, or with the reserved size, the first 1024 bytes */
+  get(&r, "v1/v/big", 301, -1);
+  CHECK(reply_uint(&r, COAP_OPTION_BLOCK2, &value) && value == (1 << 3 | COAP_BLOCK_SZX_MAX));
+  CHECK(r.payload_len == 1024 && memcmp(r.payload, big, 1024) == 0);
+  get(&r, "v1/v/big", 302, 7);
+  CHECK(reply_uint(&r, COAP_OPTION_BLOCK2, &value) && value == (1 << 3 | COAP_BLOCK_SZX_MAX));
+
+  /* small content asked for in blocks still answers with a Block2 option */
+  get(&r, "v1/v/temp", 303, 0);
+  CHECK(reply_uint(&r, COAP_OPTION_BLOCK2, &value) && value == 0);
+  CHECK(r.payload_len == 4);
+  get(&r, "v1/v/temp", 304, 1 << 4);
+  CHECK(r.code == COAP_RSPCODE_BAD_OPTION);
+}
+
+/* Every request of the script damaged and answered into a buffer of random
+ * size, down to nothing. Whatever comes back must fit and decode. */
+static void test_damaged(unsigned int rounds) {
+  static const uint8_t nasty[] = {0x00, 0xff, 0x0d, 0x0e, 0x0f, 0xd0, 0xe0, 0xf0, 0xdd, 0xee, 0x48};
+  uint8_t buf[PACKET_MAX];
+  unsigned int round;
+  reply_t r;
+
+  for (round = 0; round < rounds && !failures; round++) {
+    const packet_t *p = &script[rnd_below(script_len)];
+    size_t len = p->len, rsplen, n;
+    int i;
+
+    memcpy(buf, p->buf, len);
+    for (i = 1 + rnd_below(4); i > 0; i--) {
+      size_t at = len ? rnd_below(len) : 0;
+      switch (rnd_below(5)) {
+      case 0:
+        len = at;
+        break;
+      case 1:
+        if (len < sizeof(buf)) {
+          memmove(buf + at + 1, buf + at, len - at);
+          buf[at] = nasty[rnd_below(sizeof(nasty))];
+          len++;
+        }
+        break;
+      case 2:
+        if (len) {
+          buf[at] = nasty[rnd_below(sizeof(nasty))];
+        }
+        break;
+      default:
+        if (len) {
+          buf[at] ^= 1 << rnd_below(8);
+        }
+        break;
+      }
+    }
+
+    rsplen = rnd_below(4) ? sizeof(response) : rnd_below(64);
+    n = respond(buf, len, response, rsplen);
+    if (n > 0) {
+      CHECK(decode(&r, response, n));
+    }
+  }
+}
+
+static int replay(int argc, char **argv) {
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    uint8_t buf[PACKET_MAX];
+    FILE *f = fopen(argv[i], "rb");
+    size_t len, n;
+    reply_t r;
+
+    if (!f) {
+      perror(argv[i]);
+      return 1;
+    }
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    printf("%s: %zu bytes\n", argv[i], len);
+    n = respond(buf, len, response, sizeof(response));
+    if (n == 0) {
+      printf("  no reply\n");
+    } else if (decode(&r, response, n)) {
+      dump_reply(&r);
+    } else {
+      printf("  undecodable reply of %zu bytes\n", n);
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned int rounds = 200000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      rounds = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n rounds] [-s seed] [packet...]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  setup_resources();
+  if (optind < argc) {
+    return replay(argc - optind, argv + optind);
+  }
+
+  test_recorded();
+  test_roundtrip();
+  test_dispatch();
+  test_block2();
+  test_damaged(rounds);
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("coaptest: %d scripted requests and %u damaged ones ok\n", script_len, rounds);
+  return 0;
+}
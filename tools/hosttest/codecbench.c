@@ -0,0 +1,493 @@
+/*
+ * Host check and benchmark for the base64, base64url and hex codecs in
+ * app/crypto/codec.c, against the plain byte at a time code below, which
+ * works the way crypto.toBase64 and crypto.toHex did before.
+ *
+ *   codecbench [-n count] [-s seed]   round trips against the reference,
+ *                                     streamed in pieces split at every
+ *                                     point, and invalid input
+ *   codecbench -b                     MB/s of the codecs and the reference
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "codec.h"
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static unsigned int rnd_below(unsigned int n) {
+  return (unsigned int) (rnd() >> 32) % n;
+}
+
+static const char *alphabet_names[3] = { "base64", "base64url", "hex" };
+
+static const char *const ref_chars[3] = {
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_",
+  "0123456789abcdef"
+};
+
+/* RFC 4648, one byte at a time, returns the number of characters */
+static size_t ref_encode(int alphabet, const uint8_t *in, size_t len, char *out) {
+  const char *chars = ref_chars[alphabet];
+  size_t i, n = 0;
+
+  if (alphabet == CODEC_HEX) {
+    for (i = 0; i < len; i++) {
+      out[n++] = chars[in[i] >> 4];
+      out[n++] = chars[in[i] & 15];
+    }
+    return n;
+  }
+  for (i = 0; i < len; i += 3) {
+    uint32_t g = in[i] << 16;
+    if (i + 1 < len) {
+      g |= in[i + 1] << 8;
+    }
+    if (i + 2 < len) {
+      g |= in[i + 2];
+    }
+    out[n++] = chars[g >> 18];
+    out[n++] = chars[(g >> 12) & 63];
+    if (i + 1 < len) {
+      out[n++] = chars[(g >> 6) & 63];
+    } else if (alphabet == CODEC_BASE64) {
+      out[n++] = '=';
+    }
+    if (i + 2 < len) {
+      out[n++] = chars[g & 63];
+    } else if (alphabet == CODEC_BASE64) {
+      out[n++] = '=';
+    }
+  }
+  return n;
+}
+
+/* The inverse for well formed input, looking each character up with
+ * strchr() */
+static size_t ref_decode(int alphabet, const char *in, size_t len, uint8_t *out) {
+  const char *chars = ref_chars[alphabet];
+  uint32_t acc = 0;
+  size_t i, n = 0;
+  int bits = 0, width = alphabet == CODEC_HEX ? 4 : 6;
+
+  for (i = 0; i < len && in[i] != '='; i++) {
+    acc = (acc << width) | (strchr(chars, in[i]) - chars);
+    bits += width;
+    if (bits >= 8) {
+      bits -= 8;
+      out[n++] = acc >> bits;
+    }
+  }
+  return n;
+}
+
+static long failures;
+
+static void fail(const char *what, int alphabet, size_t len) {
+  if (failures++ < 10) {
+    fprintf(stderr, "%s: %s of %zu bytes\n", alphabet_names[alphabet], what, len);
+  }
+}
+
+/* Each call gets a buffer of exactly the size the header promises is
+ * enough, so ASan catches any write past it */
+static size_t stream_encode(int alphabet, const uint8_t *in, const size_t *cuts, int ncuts, char *out) {
+  codec_ctx_t ctx;
+  size_t pos = 0, n = 0;
+  char *buf;
+  int i;
+
+  codec_init(&ctx, alphabet);
+  for (i = 0; i < ncuts; i++) {
+    size_t len = cuts[i] - pos, got;
+    buf = malloc(codec_encoded_len(alphabet, len) + 1);
+    got = codec_encode_update(&ctx, in + pos, len, buf);
+    if (got > codec_encoded_len(alphabet, len)) {
+      fail("encode_update wrote more than codec_encoded_len", alphabet, len);
+    }
+    memcpy(out + n, buf, got);
+    free(buf);
+    n += got;
+    pos = cuts[i];
+  }
+  buf = malloc(4);
+  i = codec_encode_final(&ctx, buf);
+  memcpy(out + n, buf, i);
+  free(buf);
+  return n + i;
+}
+
+static int stream_decode(int alphabet, const char *in, const size_t *cuts, int ncuts, uint8_t *out) {
+  codec_ctx_t ctx;
+  size_t pos = 0;
+  uint8_t *buf;
+  int i, n = 0, got;
+
+  codec_init(&ctx, alphabet);
+  for (i = 0; i < ncuts; i++) {
+    size_t len = cuts[i] - pos;
+    buf = malloc(codec_decoded_len(alphabet, len) + 1);
+    got = codec_decode_update(&ctx, in + pos, len, buf);
+    if (got < 0) {
+      free(buf);
+      return -1;
+    }
+    if ((size_t) got > codec_decoded_len(alphabet, len)) {
+      fail("decode_update wrote more than codec_decoded_len", alphabet, len);
+    }
+    memcpy(out + n, buf, got);
+    free(buf);
+    n += got;
+    pos = cuts[i];
+  }
+  buf = malloc(2);
+  got = codec_decode_final(&ctx, buf);
+  if (got >= 0) {
+    memcpy(out + n, buf, got);
+  }
+  free(buf);
+  return got < 0 ? -1 : n + got;
+}
+
+/* Encodes data and decodes text in the pieces cuts gives, the last cut
+ * being the whole length, and compares with the reference */
+static void check_encode_pieces(int alphabet, const uint8_t *data, size_t len, const char *text,
+                                size_t tlen, const size_t *cuts, int ncuts) {
+  char out[2 * 1024 + 8];
+  size_t n = stream_encode(alphabet, data, cuts, ncuts, out);
+
+  if (n != tlen || memcmp(out, text, tlen) != 0) {
+    fail("streamed encoding differs", alphabet, len);
+  }
+}
+
+static void check_decode_pieces(int alphabet, const uint8_t *data, size_t len, const char *text,
+                                const size_t *cuts, int ncuts) {
+  uint8_t back[1024 + 8];
+  int n = stream_decode(alphabet, text, cuts, ncuts, back);
+
+  if (n < 0 || (size_t) n != len || memcmp(back, data, len) != 0) {
+    fail("streamed decoding differs", alphabet, len);
+  }
+}
+
+/* Up to seven random cuts before the end */
+static int random_cuts(size_t len, size_t *cuts) {
+  size_t at = 0;
+  int ncuts = 0;
+
+  while (ncuts < 7) {
+    at += rnd_below(len / 4 + 2);
+    if (at >= len) {
+      break;
+    }
+    cuts[ncuts++] = at;
+  }
+  cuts[ncuts++] = len;
+  return ncuts;
+}
+
+static void check_message(int alphabet, const uint8_t *data, size_t len, int every_split) {
+  char text[2 * 1024 + 8], *exact;
+  uint8_t back[1024 + 8], *exact_back;
+  size_t tlen, n, i, j, cuts[8];
+  int got;
+
+  tlen = ref_encode(alphabet, data, len, text);
+  if (tlen > codec_encoded_len(alphabet, len)) {
+    fail("codec_encoded_len too small", alphabet, len);
+    return;
+  }
+  exact = malloc(codec_encoded_len(alphabet, len) + 1);
+  n = codec_encode(alphabet, data, len, exact);
+  if (n != tlen || memcmp(exact, text, tlen) != 0) {
+    fail("encoding differs", alphabet, len);
+  }
+  free(exact);
+
+  exact_back = malloc(codec_decoded_len(alphabet, tlen) + 1);
+  got = codec_decode(alphabet, text, tlen, exact_back);
+  if (got < 0 || (size_t) got != len || memcmp(exact_back, data, len) != 0) {
+    fail("decoding differs", alphabet, len);
+  }
+  free(exact_back);
+
+  if (alphabet != CODEC_HEX) {
+    /* base64 decoding takes either alphabet, padded or not */
+    size_t unpadded = tlen;
+    while (unpadded && text[unpadded - 1] == '=') {
+      unpadded--;
+    }
+    got = codec_decode(CODEC_BASE64, text, unpadded, back);
+    if (got < 0 || (size_t) got != len || memcmp(back, data, len) != 0) {
+      fail("decoding without padding differs", alphabet, len);
+    }
+  } else {
+    /* and hex decoding upper case digits */
+    char upper[2 * 1024 + 8];
+    for (i = 0; i < tlen; i++) {
+      upper[i] = text[i] >= 'a' ? text[i] - 'a' + 'A' : text[i];
+    }
+    got = codec_decode(CODEC_HEX, upper, tlen, back);
+    if (got < 0 || (size_t) got != len || memcmp(back, data, len) != 0) {
+      fail("decoding upper case differs", alphabet, len);
+    }
+  }
+
+  if (ref_decode(alphabet, text, tlen, back) != len || memcmp(back, data, len) != 0) {
+    fail("reference round trip", alphabet, len);
+  }
+
+  if (every_split) {
+    /* two pieces split at every point, and three at every pair of points */
+    for (i = 0; i <= len; i++) {
+      size_t two[2] = { i, len };
+      check_encode_pieces(alphabet, data, len, text, tlen, two, 2);
+      for (j = i; j <= len; j++) {
+        size_t three[3] = { i, j, len };
+        check_encode_pieces(alphabet, data, len, text, tlen, three, 3);
+      }
+    }
+    for (i = 0; i <= tlen; i++) {
+      size_t two[2] = { i, tlen };
+      check_decode_pieces(alphabet, data, len, text, two, 2);
+      for (j = i; j <= tlen; j++) {
+        size_t three[3] = { i, j, tlen };
+        check_decode_pieces(alphabet, data, len, text, three, 3);
+      }
+    }
+  } else {
+    check_encode_pieces(alphabet, data, len, text, tlen, cuts, random_cuts(len, cuts));
+    check_decode_pieces(alphabet, data, len, text, cuts, random_cuts(tlen, cuts));
+  }
+}
+
+/* Text that must not decode, whole or streamed in two pieces split at
+ * any point */
+static const struct {
+  int alphabet;
+  const char *text;
+} invalid[] = {
+  { CODEC_BASE64, "A" },          /* a group of one character */
+  { CODEC_BASE64, "QUJDR" },
+  { CODEC_BASE64, "A===" },       /* padding after one character */
+  { CODEC_BASE64, "QQ=" },        /* too little padding */
+  { CODEC_BASE64, "QUI==" },      /* too much */
+  { CODEC_BASE64, "QUJD=" },
+  { CODEC_BASE64, "QQ==QUJD" },   /* data after the padding */
+  { CODEC_BASE64, "QQ=Q" },
+  { CODEC_BASE64, "=QUJ" },
+  { CODEC_BASE64, "QUJ*" },       /* not in either alphabet */
+  { CODEC_BASE64, "QUJD QUJD" },
+  { CODEC_BASE64, "QUJD\n" },
+  { CODEC_BASE64, "QU\xc3\xa4" },
+  { CODEC_BASE64, "QUJDQUJD.UJD" },
+  { CODEC_BASE64URL, "QQ=Q" },
+  { CODEC_BASE64URL, "A" },
+  { CODEC_BASE64URL, "QUJ%" },
+  { CODEC_HEX, "a" },             /* odd number of digits */
+  { CODEC_HEX, "abc" },
+  { CODEC_HEX, "0g" },
+  { CODEC_HEX, "x0" },
+  { CODEC_HEX, "00 11" },
+  { CODEC_HEX, "0x12" },
+  { CODEC_HEX, "12\xff" },
+  { CODEC_HEX, "abcdef0123456789=" },
+};
+
+/* Text that must decode to the given bytes */
+static const struct {
+  int alphabet;
+  const char *text;
+  const char *bytes;
+} valid[] = {
+  { CODEC_BASE64, "", "" },
+  { CODEC_BASE64, "Zg==", "f" },          /* RFC 4648 section 10 */
+  { CODEC_BASE64, "Zm8=", "fo" },
+  { CODEC_BASE64, "Zm9v", "foo" },
+  { CODEC_BASE64, "Zm9vYg==", "foob" },
+  { CODEC_BASE64, "Zm9vYmE=", "fooba" },
+  { CODEC_BASE64, "Zm9vYmFy", "foobar" },
+  { CODEC_BASE64, "Zm9vYg", "foob" },     /* padding left out */
+  { CODEC_BASE64, "Pz8_", "???" },        /* base64url characters */
+  { CODEC_BASE64, "Pz8/", "???" },
+  { CODEC_BASE64URL, "Pz8_", "???" },
+  { CODEC_BASE64URL, "Zm8=", "fo" },
+  { CODEC_HEX, "666f6F", "foo" },
+  { CODEC_HEX, "", "" },
+};
+
+static void check_fixed(void) {
+  uint8_t out[64];
+  unsigned int i;
+  size_t split, len;
+  int n;
+
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    len = strlen(invalid[i].text);
+    if (codec_decode(invalid[i].alphabet, invalid[i].text, len, out) >= 0) {
+      fprintf(stderr, "%s: \"%s\" decoded\n", alphabet_names[invalid[i].alphabet], invalid[i].text);
+      failures++;
+    }
+    for (split = 0; split <= len; split++) {
+      size_t cuts[2] = { split, len };
+      if (stream_decode(invalid[i].alphabet, invalid[i].text, cuts, 2, out) >= 0) {
+        fprintf(stderr, "%s: \"%s\" split at %zu decoded\n", alphabet_names[invalid[i].alphabet],
+                invalid[i].text, split);
+        failures++;
+      }
+    }
+  }
+
+  for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+    len = strlen(valid[i].text);
+    for (split = 0; split <= len; split++) {
+      size_t cuts[2] = { split, len };
+      n = stream_decode(valid[i].alphabet, valid[i].text, cuts, 2, out);
+      if (n != (int) strlen(valid[i].bytes) || memcmp(out, valid[i].bytes, n) != 0) {
+        fprintf(stderr, "%s: \"%s\" split at %zu decoded wrongly\n",
+                alphabet_names[valid[i].alphabet], valid[i].text, split);
+        failures++;
+      }
+    }
+  }
+
+  for (i = 0; i < 256; i++) {
+    const char *digits = "0123456789abcdefABCDEF";
+    const char *at = i ? strchr(digits, i) : NULL;
+    int want = at ? (at - digits < 16 ? at - digits : at - digits - 6) : -1;
+    if (codec_hex_value(i) != want) {
+      fprintf(stderr, "codec_hex_value(%u) is %d\n", i, codec_hex_value(i));
+      failures++;
+    }
+  }
+}
+
+static int check(long count) {
+  uint8_t data[1024];
+  size_t len, i;
+  long round;
+  int alphabet;
+
+  check_fixed();
+
+  /* every byte value, then short messages split at every point */
+  for (i = 0; i < 256; i++) {
+    data[i] = i;
+  }
+  for (alphabet = 0; alphabet < 3; alphabet++) {
+    check_message(alphabet, data, 256, 0);
+  }
+  for (len = 0; len <= 24; len++) {
+    for (i = 0; i < len; i++) {
+      data[i] = rnd();
+    }
+    for (alphabet = 0; alphabet < 3; alphabet++) {
+      check_message(alphabet, data, len, 1);
+    }
+  }
+
+  /* longer random messages in random pieces */
+  for (round = 0; round < count; round++) {
+    len = rnd_below(sizeof(data) + 1);
+    for (i = 0; i < len; i++) {
+      data[i] = rnd();
+    }
+    check_message(rnd_below(3), data, len, 0);
+  }
+
+  if (failures) {
+    fprintf(stderr, "%ld checks failed\n", failures);
+    return 0;
+  }
+  printf("codecbench: %ld round trips, every split point and invalid input ok\n", count);
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_SIZE 65536
+
+static uint8_t bench_data[BENCH_SIZE];
+static char bench_text[2 * BENCH_SIZE + 4];
+static uint8_t bench_back[BENCH_SIZE + 4];
+
+/* MB/s of the raw data, the best of five runs of 0.05 s */
+static double bench_one(int alphabet, int decode, int reference) {
+  size_t tlen = ref_encode(alphabet, bench_data, BENCH_SIZE, bench_text);
+  double best = 0;
+  int run;
+
+  for (run = 0; run < 5; run++) {
+    double start = now(), elapsed;
+    long n = 0;
+    do {
+      if (!decode) {
+        (reference ? ref_encode : codec_encode)(alphabet, bench_data, BENCH_SIZE, bench_text);
+      } else if (reference) {
+        ref_decode(alphabet, bench_text, tlen, bench_back);
+      } else {
+        codec_decode(alphabet, bench_text, tlen, bench_back);
+      }
+      n++;
+      elapsed = now() - start;
+    } while (elapsed < 0.05);
+    if (n * (double) BENCH_SIZE / elapsed / 1e6 > best) {
+      best = n * (double) BENCH_SIZE / elapsed / 1e6;
+    }
+  }
+  return best;
+}
+
+static void bench(void) {
+  int alphabet, i;
+
+  for (i = 0; i < BENCH_SIZE; i++) {
+    bench_data[i] = rnd();
+  }
+  printf("%-10s %10s %10s %10s %10s   (MB/s)\n", "", "encode", "reference", "decode", "reference");
+  for (alphabet = 0; alphabet < 3; alphabet++) {
+    printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", alphabet_names[alphabet],
+           bench_one(alphabet, 0, 0), bench_one(alphabet, 0, 1),
+           bench_one(alphabet, 1, 0), bench_one(alphabet, 1, 1));
+  }
+}
+
+int main(int argc, char **argv) {
+  long count = 20000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench();
+      return 0;
+    case 'n':
+      count = strtol(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n count] [-s seed] | -b\n", argv[0]);
+      return 2;
+    }
+  }
+  return check(count) ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ * The firmware's Lua VM with the cjson, cbor and struct modules, built for
+ * the host to run test and benchmark scripts against them.
+ *
+ *   luahost [-b] script.lua...   runs each script; -b sets the global BENCH
+ *                                so scripts print timings as well
+ *
+ * Scripts also get clock(), monotonic seconds as a number.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "flash_api.h"
+
+/* ------------------------------------------------------------------------
+ * What the linker script and the platform layer provide on the device
+ */
+
+/* The firmware collects these from the .lua_libs and .lua_rotable sections */
+extern const luaL_Reg lua_lib_CJSON, lua_lib_STRUCT;
+extern const luaR_table CJSON_module_selected, CBOR_module_selected, STRUCT_module_selected;
+extern const luaR_entry strlib[], tab_funcs[], math_map[];
+
+luaR_table lua_rotable[8];
+
+uint8_t byte_of_aligned_array(const uint8_t *aligned_array, uint32_t index) {
+  return aligned_array[index];
+}
+
+/* Scripts are loaded from the host file system, never through the VFS */
+int vfs_open(const char *name, const char *mode) {
+  return 0;
+}
+
+int vfs_getc(int fd) {
+  return -1;
+}
+
+int vfs_ungetc(int c, int fd) {
+  return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int host_clock(lua_State *L) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, ts.tv_sec + ts.tv_nsec / 1e9);
+  return 1;
+}
+
+static void open_lib(lua_State *L, const char *name, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  lua_pushstring(L, name);
+  lua_call(L, 1, 0);
+}
+
+static lua_State *new_state(int bench) {
+  const luaR_table rotables[] = {
+    {LUA_STRLIBNAME, strlib},
+    {LUA_TABLIBNAME, tab_funcs},
+    {LUA_MATHLIBNAME, math_map},
+    CJSON_module_selected,
+    CBOR_module_selected,
+    STRUCT_module_selected,
+    {NULL, NULL}
+  };
+  lua_State *L;
+
+  memcpy(lua_rotable, rotables, sizeof(rotables));
+  L = luaL_newstate();
+  open_lib(L, "", luaopen_base);
+  open_lib(L, LUA_STRLIBNAME, luaopen_string);
+  open_lib(L, LUA_TABLIBNAME, luaopen_table);
+  open_lib(L, lua_lib_CJSON.name, lua_lib_CJSON.func);
+  open_lib(L, lua_lib_STRUCT.name, lua_lib_STRUCT.func);
+  lua_register(L, "clock", host_clock);
+  lua_pushboolean(L, bench);
+  lua_setglobal(L, "BENCH");
+  return L;
+}
+
+static int run(const char *script, int bench) {
+  lua_State *L = new_state(bench);
+  FILE *f = fopen(script, "rb");
+  static char text[1 << 20];
+  size_t len;
+  int rc;
+
+  if (!f) {
+    perror(script);
+    return 1;
+  }
+  len = fread(text, 1, sizeof(text), f);
+  fclose(f);
+
+  rc = luaL_loadbuffer(L, text, len, script) || lua_pcall(L, 0, 0, 0);
+  if (rc) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  }
+  lua_close(L);
+  return rc != 0;
+}
+
+int main(int argc, char **argv) {
+  int bench = 0, failed = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b] script.lua...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "usage: %s [-b] script.lua...\n", argv[0]);
+    return 2;
+  }
+  for (; optind < argc; optind++) {
+    failed |= run(argv[optind], bench);
+  }
+  return failed;
+}
@@ -0,0 +1,817 @@
+/*
+ * Host packet test for the mDNS responder and browser in
+ * app/net/nodemcu_mdns.c, built against the lwIP and SDK stand-ins below.
+ *
+ *   mdnstest [-n rounds] [-s seed]   scripted queries and responses, each
+ *                                    reply checked record by record, then
+ *                                    the same packets damaged at random
+ *   mdnstest packet...               replay captured packets (raw UDP
+ *                                    payloads) to a responder for
+ *                                    "My Node._http._tcp.local" that also
+ *                                    browses for _printer._tcp, and print
+ *                                    what it sends back
+ *
+ * The received packet is copied into a DNS_MSG_SIZE buffer, so reads past
+ * its end would stay inside that buffer. Under AddressSanitizer the rest of
+ * the buffer is poisoned while the packet is parsed, which catches them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sanitizer/asan_interface.h>
+
+#include "lwip/udp.h"
+#include "lwip/mdns.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "nodemcu_mdns.h"
+
+#define MDNS_PORT 5353
+#define DNS_FLAG1_QR       0x80
+#define DNS_FLAG1_RESPONSE 0x84
+#define MAX_SENT  8
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/* ------------------------------------------------------------------------
+ * lwIP and SDK stand-ins
+ */
+
+typedef struct {
+  u8_t data[DNS_MSG_SIZE * 2];
+  int len;
+  struct ip_addr to;
+  u16_t port;
+} sent_packet;
+
+static sent_packet sent[MAX_SENT];
+static int nsent;
+static int verbose;
+
+static u32_t now_us = 1000000000;
+static struct netif sta_netif = { { 0 }, 1 };
+static udp_recv_fn recv_fn;
+static void *recv_arg;
+static int pcb_open;
+static os_timer_t *timers[8];
+
+static u8_t *poisoned;
+static int poisoned_len;
+
+const struct ip_addr ip_addr_any;
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type) {
+  struct pbuf *p = calloc(1, sizeof(struct pbuf));
+
+  p->payload = malloc(length);
+  p->tot_len = p->len = length;
+  return p;
+}
+
+void pbuf_realloc(struct pbuf *p, u16_t size) {
+  if (size < p->tot_len) {
+    p->tot_len = p->len = size;
+  }
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+  if (poisoned && p->payload == NULL) {
+    /* the received packet is done with */
+    ASAN_UNPOISON_MEMORY_REGION(poisoned, poisoned_len);
+    poisoned = NULL;
+  }
+  free(p->payload);
+  free(p);
+  return 1;
+}
+
+u16_t pbuf_copy_partial(struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+  memcpy(dataptr, (u8_t *) p->payload + offset, len);
+  poisoned = (u8_t *) dataptr + len;
+  poisoned_len = DNS_MSG_SIZE - len;
+  ASAN_POISON_MEMORY_REGION(poisoned, poisoned_len);
+  /* marks this as the received packet for pbuf_free */
+  free(p->payload);
+  p->payload = NULL;
+  return len;
+}
+
+struct udp_pcb *udp_new(void) {
+  pcb_open++;
+  return (struct udp_pcb *) &pcb_open;
+}
+
+void udp_remove(struct udp_pcb *pcb) {
+  pcb_open--;
+  recv_fn = NULL;
+}
+
+err_t udp_bind(struct udp_pcb *pcb, struct ip_addr *ipaddr, u16_t port) {
+  return port == MDNS_PORT ? ERR_OK : ERR_IF;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *arg) {
+  recv_fn = recv;
+  recv_arg = arg;
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *dst_ip, u16_t dst_port) {
+  if (nsent < MAX_SENT) {
+    sent_packet *s = &sent[nsent++];
+    memcpy(s->data, p->payload, p->tot_len);
+    s->len = p->tot_len;
+    s->to = *dst_ip;
+    s->port = dst_port;
+  }
+  return ERR_OK;
+}
+
+void netif_set_default(struct netif *netif) {
+}
+
+err_t igmp_joingroup(struct ip_addr *ifaddr, struct ip_addr *groupaddr) {
+  return ERR_OK;
+}
+
+uint8 wifi_get_opmode(void) {
+  return 1;
+}
+
+uint8 wifi_get_broadcast_if(void) {
+  return 1;
+}
+
+void *eagle_lwip_getif(uint8 index) {
+  return index == 0 ? &sta_netif : NULL;
+}
+
+uint32 system_get_time(void) {
+  return now_us;
+}
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *func, void *arg) {
+  unsigned int i;
+
+  t->func = func;
+  t->arg = arg;
+  for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
+    if (timers[i] == t || timers[i] == NULL) {
+      timers[i] = t;
+      break;
+    }
+  }
+}
+
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat) {
+  t->armed = 1;
+}
+
+void os_timer_disarm(os_timer_t *t) {
+  t->armed = 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Building packets
+ */
+
+typedef struct {
+  u8_t buf[DNS_MSG_SIZE];
+  int len;
+  int counts[4];    /* questions, answers, authority, additional */
+} packet;
+
+static void pkt_start(packet *p, u16_t id, u8_t flags1) {
+  memset(p, 0, sizeof(*p));
+  p->buf[0] = id >> 8;
+  p->buf[1] = id & 0xff;
+  p->buf[2] = flags1;
+  p->len = 12;
+}
+
+static void pkt_finish(packet *p) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    p->buf[4 + 2 * i] = p->counts[i] >> 8;
+    p->buf[5 + 2 * i] = p->counts[i] & 0xff;
+  }
+}
+
+static void put_u16(u8_t *buf, int *len, u16_t v) {
+  buf[(*len)++] = v >> 8;
+  buf[(*len)++] = v & 0xff;
+}
+
+/* Encodes a dotted name, "name@offset" ends it with a pointer to offset */
+static void put_name(u8_t *buf, int *len, const char *name) {
+  const char *at = strchr(name, '@');
+  const char *end = at ? at : name + strlen(name);
+
+  while (name < end) {
+    const char *dot = memchr(name, '.', end - name);
+    int n = (dot ? dot : end) - name;
+    buf[(*len)++] = n;
+    memcpy(buf + *len, name, n);
+    *len += n;
+    name += n + (dot != NULL);
+  }
+  if (at) {
+    put_u16(buf, len, 0xc000 | atoi(at + 1));
+  } else {
+    buf[(*len)++] = 0;
+  }
+}
+
+static void put_question(packet *p, const char *name, u16_t type, u16_t class) {
+  put_name(p->buf, &p->len, name);
+  put_u16(p->buf, &p->len, type);
+  put_u16(p->buf, &p->len, class);
+  p->counts[0]++;
+}
+
+static void put_rr(packet *p, int section, const char *name, u16_t type, u32_t ttl,
+                   const u8_t *rdata, int rdlen) {
+  put_name(p->buf, &p->len, name);
+  put_u16(p->buf, &p->len, type);
+  put_u16(p->buf, &p->len, DNS_RRCLASS_IN);
+  put_u16(p->buf, &p->len, ttl >> 16);
+  put_u16(p->buf, &p->len, ttl & 0xffff);
+  put_u16(p->buf, &p->len, rdlen);
+  memcpy(p->buf + p->len, rdata, rdlen);
+  p->len += rdlen;
+  p->counts[section]++;
+}
+
+static void put_ptr(packet *p, int section, const char *name, u32_t ttl, const char *target) {
+  u8_t rdata[256];
+  int len = 0;
+
+  put_name(rdata, &len, target);
+  put_rr(p, section, name, DNS_RRTYPE_PTR, ttl, rdata, len);
+}
+
+/* ------------------------------------------------------------------------
+ * Reading the packets sent, independently of the code under test
+ */
+
+typedef struct {
+  char name[256];
+  u16_t type;
+  u16_t class;
+  u32_t ttl;
+  u16_t rdlen;
+  const u8_t *rdata;
+  int section;
+} record;
+
+typedef struct {
+  u16_t id;
+  u8_t flags1;
+  int counts[4];
+  record rr[16];
+  int nrr;
+} message;
+
+static int read_name(const u8_t *pkt, int len, int *pos, char *out) {
+  int p = *pos, jumped = 0, hops = 0;
+
+  *out = 0;
+  while (p < len && pkt[p]) {
+    if ((pkt[p] & 0xc0) == 0xc0) {
+      if (p + 1 >= len || ++hops > 16) {
+        return 0;
+      }
+      if (!jumped) {
+        *pos = p + 2;
+      }
+      jumped = 1;
+      p = ((pkt[p] & 0x3f) << 8) | pkt[p + 1];
+      continue;
+    }
+    if (p + 1 + pkt[p] > len) {
+      return 0;
+    }
+    if (*out) {
+      strcat(out, ".");
+    }
+    strncat(out, (const char *) pkt + p + 1, pkt[p]);
+    p += 1 + pkt[p];
+  }
+  if (p >= len) {
+    return 0;
+  }
+  if (!jumped) {
+    *pos = p + 1;
+  }
+  return 1;
+}
+
+static int parse(const sent_packet *s, message *m) {
+  const u8_t *b = s->data;
+  int pos = 12, section, i;
+
+  memset(m, 0, sizeof(*m));
+  if (s->len < 12) {
+    return 0;
+  }
+  m->id = (b[0] << 8) | b[1];
+  m->flags1 = b[2];
+  for (i = 0; i < 4; i++) {
+    m->counts[i] = (b[4 + 2 * i] << 8) | b[5 + 2 * i];
+  }
+  for (i = 0; i < m->counts[0]; i++) {
+    char name[256];
+    if (!read_name(b, s->len, &pos, name) || pos + 4 > s->len) {
+      return 0;
+    }
+    pos += 4;
+  }
+  for (section = 1; section < 4; section++) {
+    for (i = 0; i < m->counts[section]; i++) {
+      record *r = &m->rr[m->nrr++];
+      if (m->nrr > 16 || !read_name(b, s->len, &pos, r->name) || pos + 10 > s->len) {
+        return 0;
+      }
+      r->type = (b[pos] << 8) | b[pos + 1];
+      r->class = (b[pos + 2] << 8) | b[pos + 3];
+      r->ttl = ((u32_t) b[pos + 4] << 24) | (b[pos + 5] << 16) | (b[pos + 6] << 8) | b[pos + 7];
+      r->rdlen = (b[pos + 8] << 8) | b[pos + 9];
+      r->rdata = b + pos + 10;
+      r->section = section;
+      pos += 10 + r->rdlen;
+      if (pos > s->len) {
+        return 0;
+      }
+    }
+  }
+  return pos == s->len;
+}
+
+static const record *find(const message *m, int section, const char *name, u16_t type) {
+  int i;
+
+  for (i = 0; i < m->nrr; i++) {
+    if (m->rr[i].section == section && m->rr[i].type == type && strcasecmp(m->rr[i].name, name) == 0) {
+      return &m->rr[i];
+    }
+  }
+  return NULL;
+}
+
+/* The name in the rdata of r, at offset into it */
+static const char *rdata_name(const sent_packet *s, const record *r, int offset) {
+  static char name[256];
+  int pos = r->rdata - s->data + offset;
+
+  if (!read_name(s->data, s->len, &pos, name)) {
+    return "";
+  }
+  return name;
+}
+
+static void dump(const sent_packet *s) {
+  static const char *sections[] = { "", "answer", "authority", "additional" };
+  struct in_addr to;
+  message m;
+  int i;
+
+  memcpy(&to, &s->to, sizeof(to));
+  printf("  to %s:%u, %d bytes\n", inet_ntoa(to), s->port, s->len);
+  if (!parse(s, &m)) {
+    printf("    malformed\n");
+    return;
+  }
+  for (i = 0; i < m.nrr; i++) {
+    const record *r = &m.rr[i];
+    printf("    %-10s %s type %u ttl %u\n", sections[r->section], r->name, r->type, r->ttl);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Driving the code under test
+ */
+
+static packet corpus[64];
+static int ncorpus;
+
+static void deliver_raw(const u8_t *data, int len, const char *from, u16_t port) {
+  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  struct ip_addr addr;
+
+  memcpy(p->payload, data, len);
+  addr.addr = inet_addr(from);
+  nsent = 0;
+  if (recv_fn) {
+    recv_fn(recv_arg, NULL, p, &addr, port);
+  } else {
+    pbuf_free(p);
+  }
+}
+
+/* Delivers a packet and keeps it for the damaged packet pass */
+static void deliver(packet *p, const char *from, u16_t port) {
+  pkt_finish(p);
+  if (ncorpus < (int) (sizeof(corpus) / sizeof(corpus[0]))) {
+    corpus[ncorpus++] = *p;
+  }
+  deliver_raw(p->buf, p->len, from, port);
+}
+
+static void advance(u32_t ms) {
+  now_us += ms * 1000;
+}
+
+static struct nodemcu_mdns_info info = {
+  .host_name = "node",
+  .host_desc = "My Node",
+  .service_name = "http",
+  .service_port = 80,
+  .txt_data = { "path=/", NULL },
+};
+
+static int found;
+static struct {
+  char instance[64];
+  char host[128];
+  u16_t port;
+  struct ip_addr ip;
+  char txt[2][64];
+} result;
+static int stop_in_callback;
+
+static void on_found(const struct nodemcu_mdns_result *r, void *arg) {
+  int i;
+
+  found++;
+  memset(&result, 0, sizeof(result));
+  snprintf(result.instance, sizeof(result.instance), "%s", r->instance);
+  snprintf(result.host, sizeof(result.host), "%s", r->host_name ? r->host_name : "");
+  result.port = r->port;
+  result.ip = r->ip;
+  for (i = 0; i < 10 && r->txt_data[i]; i++) {
+    if (i < 2) {
+      snprintf(result.txt[i], sizeof(result.txt[i]), "%s", r->txt_data[i]);
+    }
+    CHECK(strlen(r->txt_data[i]) < 256);
+  }
+  if (verbose) {
+    printf("  found %s at %s:%u\n", r->instance, r->host_name ? r->host_name : "?", r->port);
+  }
+  if (stop_in_callback) {
+    nodemcu_mdns_browse_stop();
+  }
+}
+
+static void fire_timers(void) {
+  unsigned int i;
+
+  nsent = 0;
+  for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
+    if (timers[i] && timers[i]->armed && timers[i]->func) {
+      timers[i]->func(timers[i]->arg);
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * The scripted tests
+ */
+
+#define SERVICE  "_http._tcp.local"
+#define INSTANCE "My Node._http._tcp.local"
+#define HOST     "node.local"
+
+static void test_announce(void) {
+  message m;
+
+  sta_netif.ip_addr.addr = inet_addr("10.0.0.7");
+  nsent = 0;
+  CHECK(nodemcu_mdns_init(&info));
+  CHECK(nsent == 1);
+  CHECK(parse(&sent[0], &m));
+  CHECK(sent[0].to.addr == inet_addr("224.0.0.251") && sent[0].port == MDNS_PORT);
+  CHECK(m.flags1 == DNS_FLAG1_RESPONSE && m.id == 0);
+  CHECK(m.counts[1] == 5 && m.counts[3] == 2);
+
+  const record *r = find(&m, 1, "_services._dns-sd._udp.local", DNS_RRTYPE_PTR);
+  CHECK(r && strcmp(rdata_name(&sent[0], r, 0), SERVICE) == 0);
+  r = find(&m, 1, SERVICE, DNS_RRTYPE_PTR);
+  CHECK(r && strcmp(rdata_name(&sent[0], r, 0), INSTANCE) == 0 && r->ttl == 300);
+  r = find(&m, 1, INSTANCE, DNS_RRTYPE_SRV);
+  CHECK(r && r->rdata[4] == 0 && r->rdata[5] == 80 && strcmp(rdata_name(&sent[0], r, 6), HOST) == 0);
+  CHECK(r && r->class == DNS_RRCLASS_FLUSH_IN);
+  r = find(&m, 1, INSTANCE, DNS_RRTYPE_TXT);
+  CHECK(r && r->rdlen == 24 && memcmp(r->rdata, "\006path=/\020platform=nodemcu", 24) == 0);
+  r = find(&m, 1, HOST, DNS_RRTYPE_A);
+  CHECK(r && r->rdlen == 4 && memcmp(r->rdata, &sta_netif.ip_addr, 4) == 0);
+  CHECK(find(&m, 3, HOST, 47) && find(&m, 3, INSTANCE, 47));
+}
+
+static void test_queries(void) {
+  packet q;
+  message m;
+  const record *r;
+
+  /* everything was just announced, RFC 6762 section 6 rate limits it */
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+
+  advance(2000);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1 && parse(&sent[0], &m));
+  CHECK(sent[0].to.addr == inet_addr("224.0.0.251"));
+  CHECK(m.counts[1] == 1 && find(&m, 1, SERVICE, DNS_RRTYPE_PTR));
+  CHECK(m.counts[3] == 5 && find(&m, 3, INSTANCE, DNS_RRTYPE_SRV) && find(&m, 3, HOST, DNS_RRTYPE_A));
+
+  /* asked again right away */
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+
+  /* known answers with more than half their TTL left are not repeated */
+  advance(2000);
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_ptr(&q, 1, "@12", 300, INSTANCE);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_ptr(&q, 1, "@12", 100, INSTANCE);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1);
+
+  advance(2000);
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_ptr(&q, 1, "@12", 300, "Other Node@12");
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1);
+
+  /* legacy unicast query, RFC 6762 section 6.7 */
+  pkt_start(&q, 0x1234, 0);
+  put_question(&q, HOST, DNS_RRTYPE_A, DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", 40000);
+  CHECK(nsent == 1 && parse(&sent[0], &m));
+  CHECK(sent[0].to.addr == inet_addr("10.0.0.9") && sent[0].port == 40000);
+  CHECK(m.id == 0x1234);
+  r = find(&m, 1, HOST, DNS_RRTYPE_A);
+  CHECK(r && r->ttl == 10 && memcmp(r->rdata, &sta_netif.ip_addr, 4) == 0);
+
+  /* QU bit asks for a unicast reply */
+  pkt_start(&q, 0, 0);
+  put_question(&q, "NODE.Local", DNS_RRTYPE_A, 0x8000 | DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1 && sent[0].to.addr == inet_addr("10.0.0.9") && sent[0].port == MDNS_PORT);
+
+  /* compressed question names, and ANY */
+  advance(2000);
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_question(&q, "My Node@12", DNS_RRTYPE_ANY, DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1 && parse(&sent[0], &m));
+  CHECK(find(&m, 1, SERVICE, DNS_RRTYPE_PTR) && find(&m, 1, INSTANCE, DNS_RRTYPE_SRV) &&
+        find(&m, 1, INSTANCE, DNS_RRTYPE_TXT));
+  CHECK(!find(&m, 3, INSTANCE, DNS_RRTYPE_SRV));
+
+  /* not ours */
+  advance(2000);
+  pkt_start(&q, 0, 0);
+  put_question(&q, "_ipp._tcp.local", DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_question(&q, "other.local", DNS_RRTYPE_A, DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+
+  /* a known answer whose data runs past the packet is ignored, the
+   * question is still answered */
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_ptr(&q, 1, "@12", 300, INSTANCE);
+  q.buf[q.len - (int) strlen(INSTANCE) - 4] = 0xff;
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 1);
+
+  /* a question cut short is dropped whole */
+  pkt_start(&q, 0, 0);
+  put_question(&q, SERVICE, DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  put_question(&q, HOST, DNS_RRTYPE_A, DNS_RRCLASS_IN);
+  q.len -= 3;
+  advance(2000);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+
+  /* a pointer loop */
+  pkt_start(&q, 0, 0);
+  put_question(&q, "a@12", DNS_RRTYPE_A, DNS_RRCLASS_IN);
+  deliver(&q, "10.0.0.9", MDNS_PORT);
+  CHECK(nsent == 0);
+}
+
+/* A printer's reply to a browse query */
+static void printer_response(packet *r, u32_t ttl) {
+  u8_t rdata[128];
+  int len = 0;
+
+  pkt_start(r, 0, DNS_FLAG1_RESPONSE);
+  put_ptr(r, 1, "_printer._tcp.local", ttl, "Office@12");
+  /* the instance name is the PTR data, after the 21 byte owner name and
+   * the 10 fixed bytes */
+  put_u16(rdata, &len, 0);
+  put_u16(rdata, &len, 0);
+  put_u16(rdata, &len, 631);
+  put_name(rdata, &len, "office-pr.local");
+  put_rr(r, 3, "@43", DNS_RRTYPE_SRV, 120, rdata, len);
+  put_rr(r, 3, "@43", DNS_RRTYPE_TXT, 120, (const u8_t *) "\006rp=ipp\007color=T", 15);
+  struct in_addr ip = { inet_addr("10.0.0.20") };
+  put_rr(r, 3, "office-pr.local", DNS_RRTYPE_A, 120, (const u8_t *) &ip, 4);
+}
+
+static void test_browse(void) {
+  packet r;
+  message m;
+
+  nsent = 0;
+  CHECK(nodemcu_mdns_browse("printer", on_found, NULL));
+  CHECK(nsent == 1 && parse(&sent[0], &m));
+  CHECK(m.counts[0] == 1 && m.counts[1] == 0 && sent[0].port == MDNS_PORT);
+
+  found = 0;
+  printer_response(&r, 120);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 1);
+  CHECK(strcmp(result.instance, "Office") == 0 && strcmp(result.host, "office-pr.local") == 0);
+  CHECK(result.port == 631 && result.ip.addr == inet_addr("10.0.0.20"));
+  CHECK(strcmp(result.txt[0], "rp=ipp") == 0 && strcmp(result.txt[1], "color=T") == 0);
+  CHECK(nsent == 0);
+
+  /* reported once */
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 1);
+
+  /* the next query lists it as a known answer */
+  fire_timers();
+  const sent_packet *query = NULL;
+  int i;
+  for (i = 0; i < nsent; i++) {
+    if (parse(&sent[i], &m) && m.counts[0] == 1) {
+      query = &sent[i];
+    }
+  }
+  CHECK(query && parse(query, &m) && m.counts[1] == 1);
+  const record *k = query ? find(&m, 1, "_printer._tcp.local", DNS_RRTYPE_PTR) : NULL;
+  CHECK(k && strcmp(rdata_name(query, k, 0), "Office._printer._tcp.local") == 0);
+
+  /* goodbye, then it is new again */
+  printer_response(&r, 0);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 1);
+  printer_response(&r, 120);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 2);
+
+  /* other services are not reported, nor are queries */
+  pkt_start(&r, 0, DNS_FLAG1_RESPONSE);
+  put_ptr(&r, 1, "_ipp._tcp.local", 120, "Office@12");
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  pkt_start(&r, 0, 0);
+  put_question(&r, "_printer._tcp.local", DNS_RRTYPE_PTR, DNS_RRCLASS_IN);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 2);
+
+  /* stopping from the callback */
+  printer_response(&r, 0);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  stop_in_callback = 1;
+  printer_response(&r, 120);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  stop_in_callback = 0;
+  CHECK(found == 3);
+  deliver(&r, "10.0.0.20", MDNS_PORT);
+  CHECK(found == 3);
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static unsigned int rnd_below(unsigned int n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (unsigned int) (rng_state >> 32) % n;
+}
+
+/* The packets above, damaged, to the responder and browser together */
+static void test_damaged(unsigned int rounds) {
+  unsigned int round;
+
+  nodemcu_mdns_browse("printer", on_found, NULL);
+  for (round = 0; round < rounds; round++) {
+    packet p = corpus[rnd_below(ncorpus)];
+    int i;
+
+    for (i = rnd_below(6); i >= 0; i--) {
+      switch (rnd_below(5)) {
+      case 0:
+        p.buf[rnd_below(p.len)] ^= 1 << rnd_below(8);
+        break;
+      case 1:
+        p.buf[rnd_below(p.len)] = rnd_below(256);
+        break;
+      case 2:
+        /* section counts */
+        p.buf[4 + rnd_below(8)] = rnd_below(2) ? 0xff : rnd_below(4);
+        break;
+      case 3:
+        p.buf[rnd_below(p.len)] = 0xc0 | rnd_below(2);
+        break;
+      default:
+        p.len = 12 + rnd_below(p.len - 11);
+        break;
+      }
+    }
+    if (rnd_below(4) == 0) {
+      p.buf[2] ^= DNS_FLAG1_QR;
+    }
+    advance(rnd_below(3000));
+    deliver_raw(p.buf, p.len, "10.0.0.9", rnd_below(2) ? MDNS_PORT : 40000);
+    for (i = 0; i < nsent; i++) {
+      message m;
+      CHECK(parse(&sent[i], &m));
+    }
+  }
+}
+
+static void replay(int argc, char **argv) {
+  int i, j;
+
+  verbose = 1;
+  sta_netif.ip_addr.addr = inet_addr("10.0.0.7");
+  nodemcu_mdns_init(&info);
+  nodemcu_mdns_browse("printer", on_found, NULL);
+  for (i = 0; i < argc; i++) {
+    u8_t buf[DNS_MSG_SIZE * 2];
+    FILE *f = fopen(argv[i], "rb");
+    if (!f) {
+      perror(argv[i]);
+      continue;
+    }
+    int len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    printf("%s: %d bytes\n", argv[i], len);
+    advance(2000);
+    deliver_raw(buf, len, "10.0.0.9", MDNS_PORT);
+    for (j = 0; j < nsent; j++) {
+      dump(&sent[j]);
+    }
+  }
+  nodemcu_mdns_browse_stop();
+  nodemcu_mdns_close();
+}
+
+int main(int argc, char **argv) {
+  unsigned int rounds = 200000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      rounds = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n rounds] [-s seed] | packet...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind < argc) {
+    replay(argc - optind, argv + optind);
+    return 0;
+  }
+
+  test_announce();
+  test_queries();
+  test_browse();
+  test_damaged(rounds);
+  nodemcu_mdns_browse_stop();
+  nodemcu_mdns_close();
+  CHECK(pcb_open == 0);
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("mdnstest: scripted packets and %u damaged ones ok\n", rounds);
+  return 0;
+}
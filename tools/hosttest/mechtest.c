@@ -0,0 +1,296 @@
+/*
+ * Host test for the AES modes in app/crypto/mech.c, on a plain AES-128
+ * (shim/aes.c) standing in for the SDK's.
+ *
+ *   mechtest    known answers for ECB, CBC, CTR and GCM, fed whole and in
+ *               three pieces split at every pair of points, both ways
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mech.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/* ------------------------------------------------------------------------
+ * Known answers. A missing tag means the mode has none.
+ */
+
+typedef struct {
+  const char *what;
+  const char *mode;
+  const char *key, *iv, *aad, *plain, *cipher, *tag;
+} vector_t;
+
+#define SP800_38A_KEY "2b7e151628aed2a6abf7158809cf4f3c"
+#define SP800_38A_PLAIN \
+  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51" \
+  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710"
+
+#define GCM_KEY "feffe9928665731c6d6a8f9467308308"
+#define GCM_PLAIN60 \
+  "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72" \
+  "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39"
+#define GCM_AAD "feedfacedeadbeeffeedfacedeadbeefabaddad2"
+
+static const vector_t vectors[] = {
+  { "SP 800-38A F.1.1", "AES-ECB", SP800_38A_KEY, "", "", SP800_38A_PLAIN,
+    "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+    "43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4", NULL },
+  { "SP 800-38A F.2.1", "AES-CBC", SP800_38A_KEY, "000102030405060708090a0b0c0d0e0f", "",
+    SP800_38A_PLAIN,
+    "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+    "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7", NULL },
+  { "SP 800-38A F.5.1", "AES-CTR", SP800_38A_KEY, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", "",
+    SP800_38A_PLAIN,
+    "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+    "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee", NULL },
+
+  /* RFC 3686 section 6, the counter block being nonce, IV and 1 */
+  { "RFC 3686 #1", "AES-CTR", "ae6852f8121067cc4bf7a5765577f39e",
+    "00000030000000000000000000000001", "", "53696e676c6520626c6f636b206d7367",
+    "e4095d4fb7a7b3792d6175a3261311b8", NULL },
+  { "RFC 3686 #2", "AES-CTR", "7e24067817fae0d743d6ce1f32539163",
+    "006cb6dbc0543b59da48d90b00000001", "",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+    "5104a106168a72d9790d41ee8edad388eb2e1efc46da57c8fce630df9141be28", NULL },
+  { "RFC 3686 #3", "AES-CTR", "7691be035e5020a8ac6e618529f9a0dc",
+    "00e0017b27777f3f4a1786f000000001", "",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f20212223",
+    "c1cf48a89f2ffdd9cf4652e9efdb72d74540a42bde6d7836d59a5ceaaef3105325b2072f", NULL },
+  /* the counter carrying out of its low 32 bits, from OpenSSL's AES-128-CTR,
+     which counts over all 128 bits as mech.c does */
+  { "CTR carry", "AES-CTR", SP800_38A_KEY, "000000000000000000000000fffffffe", "",
+    "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52ef",
+    "19349c288a689b7097ef8ead5f31d79f9decc4298cdb4779c055b775cfb1eb635759b7d88cf209fea276cf653f4a4341",
+    NULL },
+
+  /* The GCM specification's test cases 1 to 6 (AES-128) */
+  { "GCM test case 1", "AES-GCM", "00000000000000000000000000000000", "000000000000000000000000", "",
+    "", "", "58e2fccefa7e3061367f1d57a4e7455a" },
+  { "GCM test case 2", "AES-GCM", "00000000000000000000000000000000", "000000000000000000000000", "",
+    "00000000000000000000000000000000", "0388dace60b6a392f328c2b971b2fe78",
+    "ab6e47d42cec13bdf53a67b21257bddf" },
+  { "GCM test case 3", "AES-GCM", GCM_KEY, "cafebabefacedbaddecaf888", "", GCM_PLAIN60 "1aafd255",
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+    "4d5c2af327cd64a62cf35abd2ba6fab4" },
+  { "GCM test case 4", "AES-GCM", GCM_KEY, "cafebabefacedbaddecaf888", GCM_AAD, GCM_PLAIN60,
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+    "5bc94fbc3221a5db94fae95ae7121a47" },
+  { "GCM test case 5 (64 bit IV)", "AES-GCM", GCM_KEY, "cafebabefacedbad", GCM_AAD, GCM_PLAIN60,
+    "61353b4c2806934a777ff51fa22a4755699b2a714fcdc6f83766e5f97b6c7423"
+    "73806900e49f24b22b097544d4896b424989b5e1ebac0f07c23f4598",
+    "3612d2e79e3b0785561be14aaca2fccb" },
+  { "GCM test case 6 (480 bit IV)", "AES-GCM", GCM_KEY,
+    "9313225df88406e555909c5aff5269aa6a7a9538534f7da1e4c303d2a318a728"
+    "c3c0c95156809539fcf0e2429a6b525416aedbf5a0de6a57a637b39b",
+    GCM_AAD, GCM_PLAIN60,
+    "8ce24998625615b603a033aca13fb894be9112a5c3a211a8ba262a3cca7e2ca7"
+    "01e4a9a4fba43c90ccdcb281d48c7c6fd62875d2aca417034c34aee5",
+    "619cc5aefffe0bfa462af43c1699d050" },
+  /* NIST CAVS gcmEncryptExtIV128, the first case with only additional data */
+  { "CAVS AAD only", "AES-GCM", "77be63708971c4e240d1cb79e8d77feb", "e0e00f19fed7ba0136a797f3",
+    "7a43ec1d9c0a5a78a0b16533a6213cab", "", "", "209fcc8d3675ed938e9c7166709dd946" },
+};
+
+typedef struct {
+  uint8_t bytes[128];
+  size_t len;
+} buf_t;
+
+static void unhex(const char *hex, buf_t *b) {
+  size_t i;
+
+  b->len = strlen(hex) / 2;
+  for (i = 0; i < b->len; i++) {
+    sscanf(hex + 2 * i, "%2hhx", &b->bytes[i]);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Running a vector through crypto_cipher_*
+ */
+
+/* Runs a vector's data in through a cipher in three updates split at a and
+ * b, and its additional data in two split at aad_at. Every call gets an
+ * output buffer of exactly the size mech.h asks for, so ASan catches any
+ * write past it. Returns the output length, the output in out and the tag
+ * in tag. */
+static size_t run(const vector_t *v, int op, const buf_t *in, size_t a, size_t b, size_t aad_at,
+                  uint8_t *out, uint8_t *tag) {
+  buf_t key, iv, aad;
+  crypto_cipher_t c;
+  size_t cuts[3] = { a, b, in->len }, pos = 0, n = 0, got;
+  char *chunk;
+  int i;
+
+  unhex(v->key, &key);
+  unhex(v->iv, &iv);
+  unhex(v->aad, &aad);
+  if (!crypto_cipher_init(&c, v->mode, op, (const char *) key.bytes, key.len,
+                          (const char *) iv.bytes, iv.len)) {
+    fprintf(stderr, "%s: init failed\n", v->what);
+    failures++;
+    return 0;
+  }
+  if (v->tag) {
+    CHECK(crypto_cipher_aad(&c, (const char *) aad.bytes, aad_at));
+    CHECK(crypto_cipher_aad(&c, (const char *) aad.bytes + aad_at, aad.len - aad_at));
+  }
+  for (i = 0; i < 3; i++) {
+    size_t len = cuts[i] - pos;
+    chunk = malloc(len + AES_BLOCKSIZE - 1);
+    got = crypto_cipher_update(&c, (const char *) in->bytes + pos, len, chunk);
+    CHECK(got <= len + AES_BLOCKSIZE - 1);
+    memcpy(out + n, chunk, got);
+    free(chunk);
+    n += got;
+    pos = cuts[i];
+  }
+  if (v->tag && in->len) {
+    CHECK(!crypto_cipher_aad(&c, "late", 4));
+  }
+  chunk = malloc(AES_BLOCKSIZE);
+  got = crypto_cipher_finalize(&c, chunk, tag);
+  memcpy(out + n, chunk, got);
+  free(chunk);
+  crypto_cipher_deinit(&c);
+  return n + got;
+}
+
+static int check_run(const vector_t *v, int op, size_t a, size_t b, size_t aad_at) {
+  buf_t in, want, tag;
+  uint8_t out[sizeof(in.bytes) + AES_BLOCKSIZE], got_tag[CRYPTO_GCM_TAG_SIZE];
+  size_t n;
+
+  unhex(op == OP_ENCRYPT ? v->plain : v->cipher, &in);
+  unhex(op == OP_ENCRYPT ? v->cipher : v->plain, &want);
+  n = run(v, op, &in, a, b, aad_at, out, got_tag);
+  if (n != want.len || memcmp(out, want.bytes, n) != 0) {
+    fprintf(stderr, "%s: %s split at %zu, %zu differs\n", v->what,
+            op == OP_ENCRYPT ? "encrypting" : "decrypting", a, b);
+    return 0;
+  }
+  if (v->tag) {
+    unhex(v->tag, &tag);
+    if (memcmp(got_tag, tag.bytes, tag.len) != 0) {
+      fprintf(stderr, "%s: %s tag, data split at %zu, %zu and additional data at %zu, differs\n",
+              v->what, op == OP_ENCRYPT ? "encryption" : "decryption", a, b, aad_at);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Every vector both ways, whole and split at every pair of points. The
+ * additional data is split at every point too, one split per run. */
+static int test_vectors(void) {
+  unsigned int i;
+  size_t a, b, len;
+  int op, runs = 0;
+
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    const vector_t *v = &vectors[i];
+    size_t aad_len = strlen(v->aad) / 2, aad_at = 0;
+    len = strlen(v->plain) / 2;
+    for (op = OP_ENCRYPT; op <= OP_DECRYPT; op++) {
+      for (a = 0; a <= len; a++) {
+        for (b = a; b <= len; b++) {
+          if (!check_run(v, op, a, b, aad_at)) {
+            failures++;
+            a = len;
+            break;
+          }
+          aad_at = aad_at < aad_len ? aad_at + 1 : 0;
+          runs++;
+        }
+      }
+    }
+  }
+  return runs;
+}
+
+/* crypto_mech_t, as crypto.encrypt and crypto.decrypt use it */
+static void test_mechs(void) {
+  unsigned int i;
+
+  CHECK(crypto_encryption_mech("aes-cbc") != NULL);
+  CHECK(crypto_encryption_mech("AES-GCM") == NULL);
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    const vector_t *v = &vectors[i];
+    const crypto_mech_t *mech = crypto_encryption_mech(v->mode);
+    buf_t key, iv, plain, cipher;
+    char out[sizeof(plain.bytes)];
+    crypto_op_t op;
+
+    if (!mech) {
+      continue;
+    }
+    unhex(v->key, &key);
+    unhex(v->iv, &iv);
+    unhex(v->plain, &plain);
+    unhex(v->cipher, &cipher);
+    memset(&op, 0, sizeof(op));
+    op.key = (const char *) key.bytes;
+    op.keylen = key.len;
+    op.iv = (const char *) iv.bytes;
+    op.ivlen = iv.len;
+    op.data = (const char *) plain.bytes;
+    op.datalen = plain.len;
+    op.out = out;
+    op.outlen = sizeof(out);
+    op.op = OP_ENCRYPT;
+    CHECK(mech->run(&op));
+    CHECK(memcmp(out, cipher.bytes, cipher.len) == 0);
+    op.data = (const char *) cipher.bytes;
+    op.op = OP_DECRYPT;
+    CHECK(mech->run(&op));
+    CHECK(memcmp(out, plain.bytes, plain.len) == 0);
+  }
+}
+
+/* What crypto_cipher_init and crypto_cipher_aad turn down */
+static void test_rejected(void) {
+  static const char key[16], iv[16];
+  crypto_cipher_t c;
+
+  CHECK(!crypto_cipher_init(&c, "AES-XTS", OP_ENCRYPT, key, 16, iv, 16));
+  CHECK(!crypto_cipher_init(&c, "AES-CBC", OP_ENCRYPT, key, 24, iv, 16));
+  CHECK(!crypto_cipher_init(&c, "AES-GCM", OP_ENCRYPT, key, 16, iv, 0));
+  CHECK(!crypto_cipher_init(&c, "AES-CTR", OP_ENCRYPT, key, 16, iv, 0));
+  CHECK(!crypto_cipher_init(&c, "AES-CTR", OP_ENCRYPT, key, 16, iv, 12));
+
+  CHECK(crypto_cipher_init(&c, "aes-cbc", OP_ENCRYPT, key, 16, NULL, 0));
+  CHECK(!crypto_cipher_aad(&c, "x", 1));
+  crypto_cipher_deinit(&c);
+  CHECK(crypto_cipher_init(&c, "AES-GCM", OP_DECRYPT, key, 16, iv, 1));
+  crypto_cipher_deinit(&c);
+}
+
+int main(int argc, char **argv) {
+  int runs;
+
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return 2;
+  }
+  runs = test_vectors();
+  test_mechs();
+  test_rejected();
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("mechtest: %zu known answers in %d runs ok\n", sizeof(vectors) / sizeof(vectors[0]), runs);
+  return 0;
+}
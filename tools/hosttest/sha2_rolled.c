@@ -0,0 +1,20 @@
+/*
+ * app/crypto/sha2.c once more, with the rolled transform loops the firmware
+ * no longer uses and its functions renamed, for sha2bench to compare.
+ */
+#define SHA2_ROLLED_TRANSFORM
+
+#define SHA256_Init      rolled_SHA256_Init
+#define SHA256_Update    rolled_SHA256_Update
+#define SHA256_Final     rolled_SHA256_Final
+#define SHA256_Transform rolled_SHA256_Transform
+#define SHA384_Init      rolled_SHA384_Init
+#define SHA384_Update    rolled_SHA384_Update
+#define SHA384_Final     rolled_SHA384_Final
+#define SHA512_Init      rolled_SHA512_Init
+#define SHA512_Update    rolled_SHA512_Update
+#define SHA512_Final     rolled_SHA512_Final
+#define SHA512_Last      rolled_SHA512_Last
+#define SHA512_Transform rolled_SHA512_Transform
+
+#include "sha2.c"
@@ -0,0 +1,290 @@
+/*
+ * Host check and benchmark for the SHA-2 hashes in app/crypto/sha2.c, with
+ * the unrolled transforms the firmware uses and the rolled ones it used
+ * before (sha2_rolled.c).
+ *
+ *   sha2bench [-n count] [-s seed]   FIPS 180 examples for SHA-256, SHA-384
+ *                                    and SHA-512, fed from every alignment
+ *                                    and in random pieces, then random
+ *                                    messages through both transforms
+ *   sha2bench -b                     MB/s of each transform, from aligned
+ *                                    and unaligned buffers
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha2.h"
+
+void rolled_SHA256_Init(SHA256_CTX *);
+void rolled_SHA256_Update(SHA256_CTX *, const uint8_t *msg, size_t len);
+void rolled_SHA256_Final(uint8_t[SHA256_DIGEST_LENGTH], SHA256_CTX *);
+void rolled_SHA384_Init(SHA384_CTX *);
+void rolled_SHA384_Update(SHA384_CTX *, const uint8_t *msg, size_t len);
+void rolled_SHA384_Final(uint8_t[SHA384_DIGEST_LENGTH], SHA384_CTX *);
+void rolled_SHA512_Init(SHA512_CTX *);
+void rolled_SHA512_Update(SHA512_CTX *, const uint8_t *msg, size_t len);
+void rolled_SHA512_Final(uint8_t[SHA512_DIGEST_LENGTH], SHA512_CTX *);
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rnd(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static unsigned int rnd_below(unsigned int n) {
+  return (unsigned int) (rnd() >> 32) % n;
+}
+
+enum { ALG_SHA256, ALG_SHA384, ALG_SHA512, ALG_COUNT };
+
+static const char *alg_names[ALG_COUNT] = { "SHA-256", "SHA-384", "SHA-512" };
+static const size_t digest_len[ALG_COUNT] = {
+  SHA256_DIGEST_LENGTH, SHA384_DIGEST_LENGTH, SHA512_DIGEST_LENGTH
+};
+
+typedef union {
+  SHA256_CTX sha256;
+  SHA512_CTX sha512;
+} hash_ctx;
+
+static void hash_init(hash_ctx *ctx, int alg, int rolled) {
+  switch (alg) {
+  case ALG_SHA256:
+    (rolled ? rolled_SHA256_Init : SHA256_Init)(&ctx->sha256);
+    break;
+  case ALG_SHA384:
+    (rolled ? rolled_SHA384_Init : SHA384_Init)(&ctx->sha512);
+    break;
+  default:
+    (rolled ? rolled_SHA512_Init : SHA512_Init)(&ctx->sha512);
+  }
+}
+
+static void hash_update(hash_ctx *ctx, int alg, int rolled, const uint8_t *data, size_t len) {
+  switch (alg) {
+  case ALG_SHA256:
+    (rolled ? rolled_SHA256_Update : SHA256_Update)(&ctx->sha256, data, len);
+    break;
+  case ALG_SHA384:
+    (rolled ? rolled_SHA384_Update : SHA384_Update)(&ctx->sha512, data, len);
+    break;
+  default:
+    (rolled ? rolled_SHA512_Update : SHA512_Update)(&ctx->sha512, data, len);
+  }
+}
+
+static void hash_final(hash_ctx *ctx, int alg, int rolled, uint8_t *digest) {
+  switch (alg) {
+  case ALG_SHA256:
+    (rolled ? rolled_SHA256_Final : SHA256_Final)(digest, &ctx->sha256);
+    break;
+  case ALG_SHA384:
+    (rolled ? rolled_SHA384_Final : SHA384_Final)(digest, &ctx->sha512);
+    break;
+  default:
+    (rolled ? rolled_SHA512_Final : SHA512_Final)(digest, &ctx->sha512);
+  }
+}
+
+/* Hashes len bytes copied to offset bytes past an aligned address, given
+ * in pieces of random size when pieces is set */
+static void hash(int alg, int rolled, const uint8_t *msg, size_t len, int offset, int pieces,
+                 uint8_t *digest) {
+  static uint64_t space[1000000 / 8 + 2];
+  uint8_t *data = (uint8_t *) space + offset;
+  hash_ctx ctx;
+  size_t pos = 0;
+
+  memcpy(data, msg, len);
+  hash_init(&ctx, alg, rolled);
+  while (pos < len) {
+    size_t n = len - pos;
+    if (pieces) {
+      static const size_t sizes[] = { 1, 3, 55, 56, 63, 64, 65, 111, 112, 127, 128, 129, 1000 };
+      size_t size = sizes[rnd_below(sizeof(sizes) / sizeof(sizes[0]))];
+      if (n > size) {
+        n = size;
+      }
+    }
+    hash_update(&ctx, alg, rolled, data + pos, n);
+    pos += n;
+  }
+  hash_final(&ctx, alg, rolled, digest);
+}
+
+static void to_hex(const uint8_t *digest, size_t len, char *hex) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+}
+
+/* The FIPS 180 examples, the empty message, and each algorithm's two block
+ * example through the others as well */
+static const char msg56[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+static const char msg112[] =
+  "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrs"
+  "mnopqrstnopqrstu";
+
+static const struct {
+  int alg;
+  const char *msg;          /* NULL for a million 'a' */
+  const char *digest;
+} vectors[] = {
+  { ALG_SHA256, "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+  { ALG_SHA256, "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { ALG_SHA256, msg56, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+  { ALG_SHA256, msg112, "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+  { ALG_SHA256, NULL, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+  { ALG_SHA384, "", "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da"
+                    "274edebfe76f65fbd51ad2f14898b95b" },
+  { ALG_SHA384, "abc", "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed"
+                       "8086072ba1e7cc2358baeca134c825a7" },
+  { ALG_SHA384, msg56, "3391fdddfc8dc7393707a65b1b4709397cf8b1d162af05abfe8f450de5f36bc6"
+                       "b0455a8520bc4e6f5fe95b1fe3c8452b" },
+  { ALG_SHA384, msg112, "09330c33f71147e83d192fc782cd1b4753111b173b3b05d22fa08086e3b0f712"
+                        "fcc7c71a557e2db966c3e9fa91746039" },
+  { ALG_SHA384, NULL, "9d0e1809716474cb086e834e310a4a1ced149e9c00f248527972cec5704c2a5b"
+                      "07b8b3dc38ecc4ebae97ddd87f3d8985" },
+  { ALG_SHA512, "", "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+                    "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+  { ALG_SHA512, "abc", "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+                       "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+  { ALG_SHA512, msg56, "204a8fc6dda82f0a0ced7beb8e08a41657c16ef468b228a8279be331a703c335"
+                       "96fd15c13b1b07f9aa1d3bea57789ca031ad85c7a71dd70354ec631238ca3445" },
+  { ALG_SHA512, msg112, "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+                        "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+  { ALG_SHA512, NULL, "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+                      "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+};
+
+static int check_vectors(void) {
+  static uint8_t million[1000000];
+  uint8_t digest[SHA512_DIGEST_LENGTH];
+  char hex[2 * SHA512_DIGEST_LENGTH + 1];
+  int bad = 0, rolled, offset, pieces;
+  unsigned int i;
+
+  memset(million, 'a', sizeof(million));
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    const uint8_t *msg = vectors[i].msg ? (const uint8_t *) vectors[i].msg : million;
+    size_t len = vectors[i].msg ? strlen(vectors[i].msg) : sizeof(million);
+    int alg = vectors[i].alg;
+
+    for (rolled = 0; rolled < 2; rolled++) {
+      for (offset = 0; offset < 8; offset++) {
+        for (pieces = 0; pieces < 2; pieces++) {
+          hash(alg, rolled, msg, len, offset, pieces, digest);
+          to_hex(digest, digest_len[alg], hex);
+          if (strcmp(hex, vectors[i].digest) != 0) {
+            fprintf(stderr, "%s %s of %zu bytes at offset %d%s: %s, expected %s\n",
+                    rolled ? "rolled" : "unrolled", alg_names[alg], len, offset,
+                    pieces ? " in pieces" : "", hex, vectors[i].digest);
+            bad++;
+          }
+        }
+      }
+    }
+  }
+  return bad;
+}
+
+/* Random messages, at random offsets and in random pieces, must hash the
+ * same through both transforms */
+static int check_random(long count) {
+  static uint8_t msg[2000];
+  uint8_t digest[SHA512_DIGEST_LENGTH], rolled[SHA512_DIGEST_LENGTH];
+  int bad = 0;
+  long i;
+
+  for (i = 0; i < count; i++) {
+    size_t len = rnd_below(sizeof(msg)), j;
+    int alg = rnd_below(ALG_COUNT);
+
+    for (j = 0; j < len; j++) {
+      msg[j] = rnd();
+    }
+    hash(alg, 0, msg, len, rnd_below(8), 1, digest);
+    hash(alg, 1, msg, len, rnd_below(8), 1, rolled);
+    if (memcmp(digest, rolled, digest_len[alg]) != 0 && bad++ < 10) {
+      fprintf(stderr, "%s of %zu random bytes differs between the transforms\n", alg_names[alg], len);
+    }
+  }
+  return bad;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_SIZE 65536
+
+/* MB/s hashing a 64 KiB buffer again and again for a fifth of a second */
+static double bench_one(int alg, int rolled, int offset) {
+  static uint64_t space[BENCH_SIZE / 8 + 1];
+  uint8_t *data = (uint8_t *) space + offset;
+  uint8_t digest[SHA512_DIGEST_LENGTH];
+  double start = now(), elapsed;
+  long bytes = 0;
+  hash_ctx ctx;
+
+  memset(space, 0x5a, sizeof(space));
+  hash_init(&ctx, alg, rolled);
+  do {
+    hash_update(&ctx, alg, rolled, data, BENCH_SIZE);
+    bytes += BENCH_SIZE;
+    elapsed = now() - start;
+  } while (elapsed < 0.2);
+  hash_final(&ctx, alg, rolled, digest);
+  return bytes / elapsed / 1e6;
+}
+
+static void bench(void) {
+  int alg;
+
+  printf("%-8s %10s %10s %10s %10s   (MB/s)\n", "", "unrolled", "rolled", "unrolled", "rolled");
+  printf("%-8s %10s %10s %10s %10s\n", "", "aligned", "aligned", "offset 1", "offset 1");
+  for (alg = 0; alg < ALG_COUNT; alg++) {
+    printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", alg_names[alg],
+           bench_one(alg, 0, 0), bench_one(alg, 1, 0), bench_one(alg, 0, 1), bench_one(alg, 1, 1));
+  }
+}
+
+int main(int argc, char **argv) {
+  long count = 20000;
+  int opt, bad;
+
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench();
+      return 0;
+    case 'n':
+      count = strtol(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n count] [-s seed] | -b\n", argv[0]);
+      return 2;
+    }
+  }
+  bad = check_vectors();
+  bad += check_random(count);
+  if (bad) {
+    return 1;
+  }
+  printf("sha2bench: FIPS 180 examples at every alignment and %ld random messages ok\n", count);
+  return 0;
+}
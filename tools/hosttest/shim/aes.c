@@ -0,0 +1,171 @@
+/* Plain AES-128 (FIPS 197) in place of the SDK's aes_encrypt/aes_decrypt */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdk-aes.h"
+
+#define ROL8(v, n) ((uint8_t)(((v) << (n)) | ((v) >> (8 - (n)))))
+
+typedef struct {
+	uint8_t round_keys[11][16];
+} aes_ctx;
+
+static uint8_t sbox[256], inv_sbox[256];
+
+/* x * 2 in GF(2^8) */
+static uint8_t xtime(uint8_t x)
+{
+	return (uint8_t)(x << 1) ^ (x & 0x80 ? 0x1b : 0);
+}
+
+static uint8_t mul(uint8_t x, uint8_t y)
+{
+	uint8_t r = 0;
+
+	while (y) {
+		if (y & 1)
+			r ^= x;
+		x = xtime(x);
+		y >>= 1;
+	}
+	return r;
+}
+
+/* The S-box from the inverses in GF(2^8): p runs through the powers of 3
+ * and q through those of its inverse */
+static void make_sbox(void)
+{
+	uint8_t p = 1, q = 1;
+
+	do {
+		p ^= xtime(p);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		sbox[p] = q ^ ROL8(q, 1) ^ ROL8(q, 2) ^ ROL8(q, 3) ^ ROL8(q, 4) ^ 0x63;
+	} while (p != 1);
+	sbox[0] = 0x63;
+	for (p = 0; ; p++) {
+		inv_sbox[sbox[p]] = p;
+		if (p == 255)
+			break;
+	}
+}
+
+static void *aes_init(const char *key, size_t len)
+{
+	aes_ctx *ctx;
+	uint8_t rcon = 1;
+	int i, j;
+
+	if (len != 16)
+		return NULL;
+	if (!sbox[0])
+		make_sbox();
+	ctx = malloc(sizeof(*ctx));
+	memcpy(ctx->round_keys[0], key, 16);
+	for (i = 1; i <= 10; i++) {
+		const uint8_t *prev = ctx->round_keys[i - 1];
+		uint8_t *rk = ctx->round_keys[i];
+		rk[0] = prev[0] ^ sbox[prev[13]] ^ rcon;
+		rk[1] = prev[1] ^ sbox[prev[14]];
+		rk[2] = prev[2] ^ sbox[prev[15]];
+		rk[3] = prev[3] ^ sbox[prev[12]];
+		for (j = 4; j < 16; j++)
+			rk[j] = prev[j] ^ rk[j - 4];
+		rcon = xtime(rcon);
+	}
+	return ctx;
+}
+
+static void add_round_key(uint8_t *s, const uint8_t *rk)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		s[i] ^= rk[i];
+}
+
+/* The state is column by column, as the bytes come in */
+static void sub_shift(uint8_t *s, const uint8_t *box, int dir)
+{
+	uint8_t t[16];
+	int c, r;
+
+	for (c = 0; c < 4; c++)
+		for (r = 0; r < 4; r++)
+			t[4 * c + r] = box[s[4 * ((c + dir * r + 4) % 4) + r]];
+	memcpy(s, t, 16);
+}
+
+static void mix_columns(uint8_t *s, const uint8_t m[4])
+{
+	uint8_t t[4];
+	int c, r;
+
+	for (c = 0; c < 4; c++) {
+		uint8_t *col = s + 4 * c;
+		for (r = 0; r < 4; r++)
+			t[r] = mul(col[r], m[0]) ^ mul(col[(r + 1) % 4], m[1]) ^
+			       mul(col[(r + 2) % 4], m[2]) ^ mul(col[(r + 3) % 4], m[3]);
+		memcpy(col, t, 4);
+	}
+}
+
+void *aes_encrypt_init(const char *key, size_t len)
+{
+	return aes_init(key, len);
+}
+
+void aes_encrypt(void *ctx, const char *plain, char *crypt)
+{
+	static const uint8_t m[4] = { 2, 3, 1, 1 };
+	aes_ctx *aes = ctx;
+	uint8_t s[16];
+	int i;
+
+	memcpy(s, plain, 16);
+	add_round_key(s, aes->round_keys[0]);
+	for (i = 1; i <= 10; i++) {
+		sub_shift(s, sbox, 1);
+		if (i < 10)
+			mix_columns(s, m);
+		add_round_key(s, aes->round_keys[i]);
+	}
+	memcpy(crypt, s, 16);
+}
+
+void aes_encrypt_deinit(void *ctx)
+{
+	free(ctx);
+}
+
+void *aes_decrypt_init(const char *key, size_t len)
+{
+	return aes_init(key, len);
+}
+
+void aes_decrypt(void *ctx, const char *crypt, char *plain)
+{
+	static const uint8_t m[4] = { 14, 11, 13, 9 };
+	aes_ctx *aes = ctx;
+	uint8_t s[16];
+	int i;
+
+	memcpy(s, crypt, 16);
+	add_round_key(s, aes->round_keys[10]);
+	for (i = 9; i >= 0; i--) {
+		sub_shift(s, inv_sbox, -1);
+		add_round_key(s, aes->round_keys[i]);
+		if (i > 0)
+			mix_columns(s, m);
+	}
+	memcpy(plain, s, 16);
+}
+
+void aes_decrypt_deinit(void *ctx)
+{
+	free(ctx);
+}
@@ -0,0 +1 @@
+#include <ctype.h>
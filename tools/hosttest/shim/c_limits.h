@@ -0,0 +1 @@
+#include <limits.h>
@@ -0,0 +1 @@
+#include "c_types.h"
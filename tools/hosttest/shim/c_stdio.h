@@ -0,0 +1,10 @@
+#include <stdio.h>
+#include "osapi.h"
+#define c_sprintf sprintf
+#define c_printf printf
+#define c_fprintf fprintf
+#define c_puts(s) fputs((s), stdout)
+#define c_fputs fputs
+#define c_stdout stdout
+#define c_stderr stderr
+#define dbg_printf printf
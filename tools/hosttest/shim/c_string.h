@@ -0,0 +1,20 @@
+#include <string.h>
+#include <strings.h>
+#define c_memcpy memcpy
+#define c_memset memset
+#define c_memcmp memcmp
+#define c_strlen strlen
+#define c_strcmp strcmp
+#define c_strncmp strncmp
+#define c_strncasecmp strncasecmp
+#define c_strcoll strcoll
+#define c_strdup strdup
+#define c_strcpy strcpy
+#define c_strncpy strncpy
+#define c_strcat strcat
+#define c_strncat strncat
+#define c_strchr strchr
+#define c_strrchr strrchr
+#define c_strstr strstr
+#define c_strpbrk strpbrk
+#define c_strcspn strcspn
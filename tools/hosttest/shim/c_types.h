@@ -0,0 +1,31 @@
+/* Host stand-ins for the SDK headers the firmware sources include */
+#ifndef _HOSTTEST_C_TYPES_H_
+#define _HOSTTEST_C_TYPES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef int8_t   sint8_t;
+typedef int16_t  sint16_t;
+typedef int32_t  sint32_t;
+typedef int64_t  sint64_t;
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t   sint8;
+typedef int16_t  sint16;
+typedef int32_t  sint32;
+typedef int32_t  int32;
+
+#ifndef TRUE
+#define TRUE  true
+#define FALSE false
+#endif
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define ICACHE_STORE_ATTR
+#define ICACHE_RODATA_ATTR
+
+#endif
@@ -0,0 +1,3 @@
+/* The Lua core and cjson read tables in flash a word at a time */
+#include "c_types.h"
+uint8_t byte_of_aligned_array(const uint8_t *aligned_array, uint32_t index);
@@ -0,0 +1,5 @@
+/* The coap headers only name Lua types, they don't need Lua itself */
+#ifndef _HOSTTEST_LAUXLIB_H_
+#define _HOSTTEST_LAUXLIB_H_
+typedef struct lua_State lua_State;
+#endif
@@ -0,0 +1 @@
+#include "lauxlib.h"
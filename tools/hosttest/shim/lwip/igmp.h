@@ -0,0 +1,2 @@
+#include "lwip/udp.h"
+err_t igmp_joingroup(struct ip_addr *ifaddr, struct ip_addr *groupaddr);
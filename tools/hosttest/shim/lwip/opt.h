@@ -0,0 +1,34 @@
+/* Only what nodemcu_mdns.c takes from lwIP, mdnstest.c implements it */
+#ifndef _HOSTTEST_LWIP_OPT_H_
+#define _HOSTTEST_LWIP_OPT_H_
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+#include "c_types.h"
+
+typedef uint8_t  u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t   s8_t;
+typedef s8_t     err_t;
+
+#define ERR_OK  0
+#define ERR_MEM -1
+#define ERR_IF  -12
+
+#define LWIP_MDNS    1
+#define DNS_MSG_SIZE 512
+
+#define DNS_DEBUG              0
+#define LWIP_DEBUGF(debug, message)
+#define LWIP_ASSERT(message, assertion) assert(assertion)
+#define LWIP_UNUSED_ARG(x)     (void)(x)
+#define MEMCPY(dst, src, len)  memcpy(dst, src, len)
+
+#define PACK_STRUCT_BEGIN
+#define PACK_STRUCT_END
+#define PACK_STRUCT_FIELD(x)   x
+#define PACK_STRUCT_STRUCT     __attribute__((packed))
+
+#endif
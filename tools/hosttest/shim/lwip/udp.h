@@ -0,0 +1,47 @@
+#ifndef _HOSTTEST_LWIP_UDP_H_
+#define _HOSTTEST_LWIP_UDP_H_
+
+#include "lwip/opt.h"
+
+struct ip_addr {
+	u32_t addr;
+};
+
+struct pbuf {
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len;
+	u16_t len;
+};
+
+typedef enum { PBUF_TRANSPORT } pbuf_layer;
+typedef enum { PBUF_RAM } pbuf_type;
+
+struct netif {
+	struct ip_addr ip_addr;
+	u8_t up;
+};
+
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+		struct ip_addr *addr, u16_t port);
+
+extern const struct ip_addr ip_addr_any;
+#define IP_ADDR_ANY ((struct ip_addr *)&ip_addr_any)
+#define ipaddr_addr(cp) inet_addr(cp)
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+void pbuf_realloc(struct pbuf *p, u16_t size);
+u8_t pbuf_free(struct pbuf *p);
+u16_t pbuf_copy_partial(struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+struct udp_pcb *udp_new(void);
+void udp_remove(struct udp_pcb *pcb);
+err_t udp_bind(struct udp_pcb *pcb, struct ip_addr *ipaddr, u16_t port);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *dst_ip, u16_t dst_port);
+
+#define netif_is_up(netif) ((netif)->up)
+void netif_set_default(struct netif *netif);
+
+#endif
@@ -0,0 +1,5 @@
+#include <stdlib.h>
+#define os_malloc malloc
+#define os_zalloc(n) calloc(1, (n))
+#define os_realloc realloc
+#define os_free(p) free((void *)(p))
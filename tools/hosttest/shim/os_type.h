@@ -0,0 +1,12 @@
+#ifndef _HOSTTEST_OS_TYPE_H_
+#define _HOSTTEST_OS_TYPE_H_
+
+typedef void os_timer_func_t(void *arg);
+
+typedef struct {
+	os_timer_func_t *func;
+	void *arg;
+	int armed;
+} os_timer_t;
+
+#endif
@@ -0,0 +1,17 @@
+#include "c_types.h"
+#include "user_config.h"
+#include "os_type.h"
+#include "rom.h"
+#include "mem.h"
+#include <stdio.h>
+#include <string.h>
+#define os_memcpy memcpy
+#define os_memset memset
+#define os_strlen strlen
+#define os_sprintf sprintf
+
+unsigned long os_random(void);
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *func, void *arg);
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat);
+void os_timer_disarm(os_timer_t *t);
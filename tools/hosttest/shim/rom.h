@@ -0,0 +1,19 @@
+/* SHA1 is in the ESP8266 ROM, sha1.c stands in for it on the host */
+#ifndef _HOSTTEST_ROM_H_
+#define _HOSTTEST_ROM_H_
+
+#include "c_types.h"
+
+#define SHA1_DIGEST_LENGTH 20
+
+typedef struct {
+	uint32_t state[5];
+	uint32_t count[2];
+	uint8_t buffer[64];
+} SHA1_CTX;
+
+void SHA1Init(SHA1_CTX *);
+void SHA1Final(uint8_t[SHA1_DIGEST_LENGTH], SHA1_CTX *);
+void SHA1Update(SHA1_CTX *, const uint8_t *, unsigned int);
+
+#endif
@@ -0,0 +1,83 @@
+/* Plain SHA1 (FIPS 180-1) in place of the ROM routines */
+#include <string.h>
+#include "rom.h"
+
+#define ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void SHA1Transform(uint32_t state[5], const uint8_t block[64])
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+		       (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+void SHA1Init(SHA1_CTX *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->count[0] = ctx->count[1] = 0;
+}
+
+void SHA1Update(SHA1_CTX *ctx, const uint8_t *data, unsigned int len)
+{
+	unsigned int used = (ctx->count[0] >> 3) & 63;
+
+	if ((ctx->count[0] += len << 3) < (len << 3))
+		ctx->count[1]++;
+	ctx->count[1] += len >> 29;
+
+	while (len) {
+		unsigned int n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buffer + used, data, n);
+		used += n;
+		data += n;
+		len -= n;
+		if (used == 64) {
+			SHA1Transform(ctx->state, ctx->buffer);
+			used = 0;
+		}
+	}
+}
+
+void SHA1Final(uint8_t digest[SHA1_DIGEST_LENGTH], SHA1_CTX *ctx)
+{
+	uint8_t bits[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		bits[i] = ctx->count[i < 4 ? 1 : 0] >> ((3 - (i & 3)) * 8);
+	SHA1Update(ctx, (const uint8_t *)"\x80", 1);
+	while (((ctx->count[0] >> 3) & 63) != 56)
+		SHA1Update(ctx, (const uint8_t *)"", 1);
+	SHA1Update(ctx, bits, 8);
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+		digest[i] = ctx->state[i >> 2] >> ((3 - (i & 3)) * 8);
+}
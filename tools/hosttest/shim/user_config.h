@@ -0,0 +1,10 @@
+#ifndef _HOSTTEST_USER_CONFIG_H_
+#define _HOSTTEST_USER_CONFIG_H_
+#include "c_types.h"
+#ifdef NODE_DEBUG
+#define NODE_DBG printf
+#else
+#define NODE_DBG(...) ((void) 0)
+#endif
+#define NODE_ERR(...) ((void) 0)
+#endif
@@ -0,0 +1,5 @@
+#include "c_types.h"
+uint8 wifi_get_opmode(void);
+uint8 wifi_get_broadcast_if(void);
+void *eagle_lwip_getif(uint8 index);
+uint32 system_get_time(void);
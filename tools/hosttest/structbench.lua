@@ -0,0 +1,318 @@
+-- Host test and benchmark for struct.compile and unpacking at an offset or
+-- into a table (app/modules/struct.c).
+--
+--   luahost structbench.lua      compiled formats against format strings on
+--                                random layouts, offsets and truncated data
+--   luahost -b structbench.lua   Modbus and BLE bridge frames parsed the old
+--                                way and the new ways
+
+local failures = 0
+
+local function check(cond, what)
+  if not cond then
+    failures = failures + 1
+    print("FAIL: " .. what)
+  end
+end
+
+local function hex(s)
+  return (s:gsub(".", function(c) return string.format("%02x", c:byte()) end))
+end
+
+local function same(a, b)
+  if #a ~= #b then
+    return false
+  end
+  for i = 1, #a do
+    if a[i] ~= b[i] and (a[i] == a[i] or b[i] == b[i]) then
+      return false
+    end
+  end
+  return true
+end
+
+---------------------------------------------------------------------------
+-- Random layouts with values that survive a pack and unpack
+
+math.randomseed(1)
+
+local function random_bytes(n, nozero)
+  local t = {}
+  for i = 1, n do
+    t[i] = string.char(math.random(nozero and 1 or 0, 255))
+  end
+  return table.concat(t)
+end
+
+local function int_field(fmt, values, size, signed)
+  local bits = math.min(size * 8, 32)
+  local v = math.random(0, 2 ^ (bits - 2) - 1) * 4 + math.random(0, 3)
+  if signed and v >= 2 ^ (bits - 1) then
+    v = v - 2 ^ bits
+  end
+  values[#values + 1] = v
+  return fmt
+end
+
+-- returns the format, the values it packs and the values it unpacks to,
+-- which lack the lengths that 'c0' consumes
+local function random_layout()
+  local parts, values, expect, skip = {}, {}, {}, {}
+  local prefix = ({"", "<", ">", "!", "!1", "!2", "!4", "!8", "<!4", ">!2"})[math.random(1, 10)]
+  parts[1] = prefix
+  for i = 1, math.random(1, 10) do
+    local kind = math.random(1, 15)
+    local part
+    if kind == 1 then
+      part = int_field("b", values, 1, true)
+    elseif kind == 2 then
+      part = int_field("B", values, 1, false)
+    elseif kind == 3 then
+      part = int_field("h", values, 2, true)
+    elseif kind == 4 then
+      part = int_field("H", values, 2, false)
+    elseif kind == 5 then
+      part = int_field("l", values, 4, true)
+    elseif kind == 6 then
+      part = int_field("L", values, 4, false)
+    elseif kind == 7 then
+      local n = math.random(1, 4)
+      part = int_field("i" .. n, values, n, true)
+    elseif kind == 8 then
+      local n = math.random(1, 4)
+      part = int_field("I" .. n, values, n, false)
+    elseif kind == 9 then
+      part = "f"
+      values[#values + 1] = math.random(-100000, 100000) / 8
+    elseif kind == 10 then
+      part = "d"
+      values[#values + 1] = (math.random() - 0.5) * 10 ^ math.random(-300, 300)
+    elseif kind == 11 then
+      part = "x"
+    elseif kind == 12 then
+      local n = math.random(1, 12)
+      part = "c" .. n
+      values[#values + 1] = random_bytes(n)
+    elseif kind == 13 then
+      -- a length byte then that many bytes
+      local s = random_bytes(math.random(0, 12))
+      part = "Bc0"
+      values[#values + 1] = #s
+      values[#values + 1] = s
+      skip[#values - 1] = true
+    elseif kind == 14 then
+      part = "s"
+      values[#values + 1] = random_bytes(math.random(0, 12), true)
+    else
+      part = ({" ", "<", ">"})[math.random(1, 3)]
+    end
+    parts[#parts + 1] = part
+  end
+  for n = 1, #values do
+    if not skip[n] then
+      expect[#expect + 1] = values[n]
+    end
+  end
+  return table.concat(parts), values, expect
+end
+
+-- unpack results, without the next position, and that position
+local function results(...)
+  local n = select("#", ...)
+  local t = {...}
+  local nextpos = t[n]
+  t[n] = nil
+  return t, nextpos
+end
+
+local function test_layouts(rounds)
+  for round = 1, rounds do
+    local fmt, values, expect = random_layout()
+    local compiled = struct.compile(fmt)
+    local data = struct.pack(fmt, unpack(values))
+    check(struct.pack(compiled, unpack(values)) == data, "pack '" .. fmt .. "'")
+    check(compiled:pack(unpack(values)) == data, "method pack '" .. fmt .. "'")
+
+    local ok_size, size = pcall(struct.size, fmt)
+    if ok_size then
+      local ok, csize = pcall(compiled.size, compiled)
+      check(#data == size and (not ok or csize == size), "size '" .. fmt .. "'")
+    else
+      check(not pcall(struct.size, compiled), "size of '" .. fmt .. "' has no fixed size")
+    end
+
+    local got, nextpos = results(struct.unpack(fmt, data))
+    check(same(got, expect) and nextpos == #data + 1, "unpack '" .. fmt .. "' " .. hex(data))
+    got, nextpos = results(struct.unpack(compiled, data))
+    check(same(got, expect) and nextpos == #data + 1, "compiled unpack '" .. fmt .. "' " .. hex(data))
+
+    -- offsets that keep the alignment give the same values; any other
+    -- offset must still agree with the format string
+    local lead = math.random(0, 3) * 8 + (math.random(1, 2) == 1 and 0 or math.random(1, 7))
+    local framed = random_bytes(lead) .. data .. random_bytes(math.random(0, 4))
+    local via_string = {pcall(struct.unpack, fmt, framed, lead + 1)}
+    local via_compiled = {pcall(struct.unpack, compiled, framed, lead + 1)}
+    check(same(via_string, via_compiled), "unpack '" .. fmt .. "' at " .. lead + 1)
+    if lead % 8 == 0 then
+      got, nextpos = results(struct.unpack(compiled, framed, lead + 1))
+      check(same(got, expect) and nextpos == lead + #data + 1, "unpack '" .. fmt .. "' at " .. lead + 1)
+    end
+
+    -- into a table reused from an earlier frame of the same layout
+    local into = {}
+    for i = 1, #expect do
+      into[i] = "stale"
+    end
+    local t, tpos = struct.unpack(compiled, data, 1, into)
+    check(t == into and same(into, expect) and tpos == #data + 1, "unpack '" .. fmt .. "' into a table")
+    t, tpos = struct.unpack(fmt, data, 1, {})
+    check(same(t, expect) and tpos == #data + 1, "unpack '" .. fmt .. "' string into a table")
+
+    -- every truncation fails the same way for both
+    for n = 0, #data - 1 do
+      local ok_string = pcall(struct.unpack, fmt, data:sub(1, n))
+      local ok_compiled = pcall(struct.unpack, compiled, data:sub(1, n))
+      local ok_table = pcall(struct.unpack, compiled, data:sub(1, n), 1, {})
+      check(ok_string == ok_compiled and ok_compiled == ok_table, "truncated '" .. fmt .. "' at " .. n)
+    end
+    if failures > 10 then
+      return
+    end
+  end
+end
+
+local function test_errors()
+  check(not pcall(struct.compile, "!3i"), "alignment 3")
+  check(not pcall(struct.compile, "i40"), "integral size 40")
+  check(not pcall(struct.compile, "q"), "invalid option")
+  check(not pcall(struct.size, struct.compile("Bs")), "size of 's'")
+  check(not pcall(struct.size, struct.compile("Bc0")), "size of 'c0'")
+  check(not pcall(struct.unpack, struct.compile("c0"), "\3abc"), "'c0' first")
+  check(not pcall(struct.unpack, struct.compile("s"), "abc"), "unfinished string")
+  check(not pcall(struct.unpack, struct.compile("H"), "\1\2", 2), "offset past the data")
+  check(not pcall(struct.unpack, struct.compile("H"), "\1\2", 1e9), "offset far past the data")
+  check(not pcall(struct.unpack, struct.compile("B"), "", 0), "offset 0 into empty data")
+  check(not pcall(struct.unpack, struct.compile("B"), "\1", 1, "table"), "a string for the table")
+  check(not pcall(struct.pack, struct.compile("c3"), "ab"), "string too short")
+  check(not pcall(struct.pack, newproxy and newproxy() or io, 1), "something else as the format")
+  check(struct.size(struct.compile("")) == 0, "empty format")
+  check(select("#", struct.unpack(struct.compile(""), "xyz", 2)) == 1, "empty format unpack")
+  check(struct.size(struct.compile("!4 B i")) == 8, "alignment in size")
+  check(struct.size(struct.compile("!8 B d B")) == 17, "trailing field not padded")
+end
+
+---------------------------------------------------------------------------
+-- Benchmark: frames as the Modbus and BLE bridges receive them, many to a
+-- buffer
+
+-- Modbus RTU reply to "read holding registers" for ten registers: address,
+-- function, byte count, ten big endian registers, little endian CRC
+local modbus = ">BBBHHHHHHHHHH<H"
+
+-- BLE sensor advertisement as the bridge forwards it: type, flags,
+-- sequence, temperature and humidity in hundredths, battery mV, timestamp
+local ble = "<BBHhhHI"
+
+local function frames(fmt, count)
+  local t = {}
+  for i = 1, count do
+    local values = {}
+    for n = 1, select("#", struct.unpack(fmt, string.rep("\0", struct.size(fmt)))) - 1 do
+      values[n] = math.random(0, 127)
+    end
+    t[i] = struct.pack(fmt, unpack(values))
+  end
+  return table.concat(t)
+end
+
+-- Each parser unpacks every frame of a buffer and returns the last one's
+-- values; the benchmark calls them on a buffer of 64 frames
+
+-- the old way, cutting each frame out first
+local function parse_sub(fmt, buf, size)
+  for pos = 1, #buf, size do
+    struct.unpack(fmt, buf:sub(pos, pos + size - 1))
+  end
+  return {struct.unpack(fmt, buf:sub(#buf - size + 1))}
+end
+
+-- unpacking in place, taking the next position from the results
+local function parse_pos(fmt, buf)
+  local pos, last = 1, 1
+  while pos < #buf do
+    last = pos
+    pos = select(-1, struct.unpack(fmt, buf, pos))
+  end
+  return {struct.unpack(fmt, buf, last)}
+end
+
+local function parse_table(fmt, buf)
+  local pos, t = 1, {}
+  while pos < #buf do
+    t, pos = struct.unpack(fmt, buf, pos, t)
+  end
+  return t
+end
+
+-- nanoseconds per frame, the best of five runs
+local function time(parse, fmt, buf, size)
+  local best = math.huge
+  for run = 1, 5 do
+    local n, start = 0, clock()
+    local elapsed
+    repeat
+      parse(fmt, buf, size)
+      n = n + 1
+      elapsed = clock() - start
+    until elapsed > 0.05
+    best = math.min(best, elapsed / n / (#buf / size) * 1e9)
+  end
+  return best
+end
+
+-- the same values all four ways
+local function test_frames()
+  for _, fmt in ipairs({modbus, ble}) do
+    local size = struct.size(fmt)
+    local buf = frames(fmt, 10)
+    local compiled = struct.compile(fmt)
+    local expect = parse_sub(fmt, buf, size)
+    table.remove(expect)
+    local got = parse_pos(fmt, buf)
+    table.remove(got)
+    check(same(got, expect), "frames '" .. fmt .. "' at a position")
+    got = parse_pos(compiled, buf)
+    table.remove(got)
+    check(same(got, expect), "frames '" .. fmt .. "' compiled")
+    check(same(parse_table(compiled, buf), expect), "frames '" .. fmt .. "' into a table")
+  end
+end
+
+local function bench()
+  print(string.format("%-8s %12s %12s %12s %12s", "ns/frame", "string.sub", "position", "compiled",
+                      "into table"))
+  for _, f in ipairs({{"modbus", modbus}, {"ble", ble}}) do
+    local fmt = f[2]
+    local size = struct.size(fmt)
+    local buf = frames(fmt, 64)
+    local compiled = struct.compile(fmt)
+    print(string.format("%-8s %12.0f %12.0f %12.0f %12.0f", f[1],
+                        time(parse_sub, fmt, buf, size), time(parse_pos, fmt, buf, size),
+                        time(parse_pos, compiled, buf, size), time(parse_table, compiled, buf, size)))
+  end
+end
+
+---------------------------------------------------------------------------
+
+if BENCH then
+  bench()
+  return
+end
+
+test_layouts(3000)
+test_errors()
+test_frames()
+if failures > 0 then
+  error(failures .. " checks failed")
+end
+print("structbench: compiled formats, offsets, tables and frames ok")
@@ -0,0 +1,406 @@
+/*
+ * Host test and benchmark for the timer wheel in app/task/timerwheel.c and
+ * the coap send queue built on it in app/coap/node.c.
+ *
+ *   wheeltest [-n steps] [-s seed]   random timers added, re-added and
+ *                                    cancelled, also from callbacks, on a
+ *                                    clock that runs late and wraps; none
+ *                                    may fire early, late or twice
+ *   wheeltest -b                     500 concurrent confirmable requests
+ *                                    sent and acknowledged, against the
+ *                                    delta list the send queue used before
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "node.h"
+
+#define RESOLUTION   10     /* ms, as COAP_TIMER_RESOLUTION */
+#define TIMERS       600
+#define REQUESTS     500
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+/* ------------------------------------------------------------------------
+ * SDK stand-ins: a clock the test moves, OS timers it fires by hand
+ */
+
+static uint32 now_us = 0xffffffff - 5000000;   /* wraps 5 s in */
+static unsigned long timer_arms;
+
+uint32 system_get_time(void) {
+  return now_us;
+}
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *func, void *arg) {
+  t->func = func;
+  t->arg = arg;
+}
+
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat) {
+  t->armed = 1;
+  timer_arms++;
+}
+
+void os_timer_disarm(os_timer_t *t) {
+  t->armed = 0;
+}
+
+/* the send queue frees the PDU of a node, the nodes here have none */
+void coap_delete_pdu(coap_pdu_t *pdu) {
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static unsigned int rnd_below(unsigned int n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (unsigned int) (rng_state >> 32) % n;
+}
+
+/* ------------------------------------------------------------------------
+ * The wheel against a model of what should be pending
+ */
+
+typedef struct {
+  timerwheel_timer_t timer;
+  uint32 added_us;
+  uint32 delay_ms;
+  int pending;
+  int fired;
+} test_timer;
+
+static timerwheel_t wheel;
+static test_timer timers[TIMERS];
+static int model_pending;
+
+static void on_expire(timerwheel_timer_t *timer, void *arg);
+
+static void add(test_timer *t, uint32 delay_ms) {
+  if (t->pending) {
+    model_pending--;
+  }
+  t->added_us = now_us;
+  t->delay_ms = delay_ms;
+  t->pending = 1;
+  model_pending++;
+  timerwheel_add(&wheel, &t->timer, delay_ms, on_expire, t);
+}
+
+static void cancel(test_timer *t) {
+  if (t->pending) {
+    model_pending--;
+  }
+  t->pending = 0;
+  timerwheel_cancel(&t->timer);
+}
+
+static uint32 random_delay(void) {
+  /* mostly within one turn of the wheel, some several turns out */
+  return rnd_below(4) ? rnd_below(TIMERWHEEL_SLOTS * RESOLUTION) : rnd_below(10000);
+}
+
+static void on_expire(timerwheel_timer_t *timer, void *arg) {
+  test_timer *t = arg;
+  uint32 elapsed = now_us - t->added_us;
+
+  CHECK(&t->timer == timer);
+  CHECK(t->pending);
+  /* ticks are whole, a timer added late in one may fire up to a tick early */
+  CHECK(elapsed + RESOLUTION * 1000 > t->delay_ms * 1000);
+  CHECK(!timerwheel_pending(timer));
+  t->pending = 0;
+  t->fired++;
+  model_pending--;
+
+  /* callbacks may re-add themselves and add or cancel any other timer */
+  switch (rnd_below(8)) {
+  case 0:
+    add(t, random_delay());
+    break;
+  case 1:
+    cancel(&timers[rnd_below(TIMERS)]);
+    break;
+  case 2:
+    add(&timers[rnd_below(TIMERS)], random_delay());
+    break;
+  }
+}
+
+static void check_wheel(unsigned int steps) {
+  unsigned int step;
+  int i;
+
+  timerwheel_init(&wheel, RESOLUTION);
+  for (step = 0; step < steps; step++) {
+    for (i = rnd_below(4); i > 0; i--) {
+      test_timer *t = &timers[rnd_below(TIMERS)];
+      if (rnd_below(4)) {
+        add(t, random_delay());
+      } else {
+        cancel(t);
+      }
+    }
+
+    /* the OS timer fires a tick apart, now and then much later */
+    switch (rnd_below(50)) {
+    case 0:
+      now_us += RESOLUTION * 1000 * (1 + rnd_below(200));
+      break;
+    case 1:
+      now_us += rnd_below(RESOLUTION * 1000);
+      break;
+    default:
+      now_us += RESOLUTION * 1000 + rnd_below(2000);
+      break;
+    }
+    if (wheel.timer.armed) {
+      wheel.timer.func(wheel.timer.arg);
+    }
+
+    /* nothing overdue by a whole tick may still be pending */
+    for (i = 0; i < TIMERS; i++) {
+      test_timer *t = &timers[i];
+      CHECK(t->pending == timerwheel_pending(&t->timer));
+      if (t->pending) {
+        CHECK(now_us - t->added_us < (t->delay_ms + 2 * RESOLUTION) * 1000);
+      }
+    }
+    CHECK(wheel.pending == (uint32) model_pending);
+    CHECK(wheel.timer.armed || model_pending == 0);
+    if (failures > 20) {
+      return;
+    }
+  }
+}
+
+/* The send queue: nodes are found by transaction id and their timers stop
+ * when they are removed */
+static void check_sendqueue(void) {
+  coap_sendqueue_t queue;
+  coap_queue_t *nodes[REQUESTS];
+  int i;
+
+  memset(&queue, 0, sizeof(queue));
+  timerwheel_init(&wheel, RESOLUTION);
+  for (i = 0; i < REQUESTS; i++) {
+    nodes[i] = coap_new_node();
+    nodes[i]->id = i * 7919;
+    CHECK(coap_insert_node(&queue, nodes[i]));
+    timerwheel_add(&wheel, &nodes[i]->timer, 2000, NULL, nodes[i]);
+  }
+  CHECK(queue.count == REQUESTS && wheel.pending == REQUESTS);
+  for (i = 0; i < REQUESTS; i += 2) {
+    CHECK(coap_find_node(&queue, i * 7919) == nodes[i]);
+    CHECK(coap_remove_node(&queue, i * 7919));
+    CHECK(coap_find_node(&queue, i * 7919) == NULL);
+  }
+  CHECK(!coap_remove_node(&queue, 1));
+  CHECK(queue.count == REQUESTS / 2 && wheel.pending == REQUESTS / 2);
+  coap_delete_all(&queue);
+  CHECK(queue.count == 0 && wheel.pending == 0);
+}
+
+/* ------------------------------------------------------------------------
+ * The delta list node.c used before, for comparison: ordered by expiry,
+ * each node holding the time after the one before it, and one OS timer
+ * re-armed for the head on every change
+ */
+
+typedef struct old_node {
+  struct old_node *next;
+  uint32 t;
+  coap_tid_t id;
+} old_node;
+
+static os_timer_t old_timer;
+static uint32 old_basetime;
+
+static void old_insert(old_node **queue, old_node *node) {
+  old_node *p, *q;
+
+  if (!*queue) {
+    *queue = node;
+    return;
+  }
+  q = *queue;
+  if (node->t < q->t) {
+    node->next = q;
+    *queue = node;
+    q->t -= node->t;
+    return;
+  }
+  do {
+    node->t -= q->t;
+    p = q;
+    q = q->next;
+  } while (q && q->t <= node->t);
+  if (q) {
+    q->t -= node->t;
+  }
+  node->next = q;
+  p->next = node;
+}
+
+static old_node *old_remove(old_node **queue, coap_tid_t id) {
+  old_node *p = NULL, *q = *queue;
+
+  while (q && q->id != id) {
+    p = q;
+    q = q->next;
+  }
+  if (!q) {
+    return NULL;
+  }
+  if (p) {
+    p->next = q->next;
+  } else {
+    *queue = q->next;
+  }
+  if (q->next) {
+    q->next->t += q->t;
+  }
+  q->next = NULL;
+  return q;
+}
+
+/* coap_timer_update() and coap_timer_start() */
+static void old_update_and_start(old_node **queue) {
+  uint32 now = system_get_time() / 1000;
+
+  if (*queue) {
+    uint32 diff = now - old_basetime;
+    (*queue)->t = (*queue)->t >= diff ? (*queue)->t - diff : 0;
+  }
+  old_basetime = now;
+  if (*queue) {
+    os_timer_disarm(&old_timer);
+    os_timer_setfn(&old_timer, NULL, queue);
+    os_timer_arm(&old_timer, (*queue)->t, 0);
+  }
+}
+
+static double seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sends REQUESTS confirmable requests a millisecond apart with randomised
+ * timeouts as RFC 7252 section 4.8 has them, then takes the ACKs in random
+ * order */
+static void bench(void) {
+  static coap_queue_t *nodes[REQUESTS];
+  static old_node old_nodes[REQUESTS];
+  static uint32 timeout[REQUESTS];
+  static int ack_order[REQUESTS];
+  coap_sendqueue_t queue;
+  old_node *old_queue = NULL;
+  double t_new = 0, t_old = 0;
+  unsigned long arms_new = 0, arms_old = 0;
+  int reps = 200, rep, i;
+
+  for (rep = 0; rep < reps; rep++) {
+    uint32 start_us = now_us;
+    unsigned long arms;
+    double start;
+
+    for (i = 0; i < REQUESTS; i++) {
+      timeout[i] = 2000 + rnd_below(1000);
+      ack_order[i] = i;
+    }
+    for (i = REQUESTS - 1; i > 0; i--) {
+      int j = rnd_below(i + 1), k = ack_order[i];
+      ack_order[i] = ack_order[j];
+      ack_order[j] = k;
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    timerwheel_init(&wheel, RESOLUTION);
+    arms = timer_arms;
+    start = seconds();
+    for (i = 0; i < REQUESTS; i++) {
+      nodes[i] = coap_new_node();
+      nodes[i]->id = (coap_tid_t) (i * 40503u & 0xffff);
+      nodes[i]->timeout = timeout[i];
+      coap_insert_node(&queue, nodes[i]);
+      timerwheel_add(&wheel, &nodes[i]->timer, nodes[i]->timeout, NULL, nodes[i]);
+      now_us += 1000;
+    }
+    for (i = 0; i < REQUESTS; i++) {
+      coap_remove_node(&queue, (coap_tid_t) (ack_order[i] * 40503u & 0xffff));
+      now_us += 1000;
+    }
+    t_new += seconds() - start;
+    arms_new += timer_arms - arms;
+
+    now_us = start_us;
+    memset(old_nodes, 0, sizeof(old_nodes));
+    arms = timer_arms;
+    start = seconds();
+    for (i = 0; i < REQUESTS; i++) {
+      old_nodes[i].id = (coap_tid_t) (i * 40503u & 0xffff);
+      old_nodes[i].t = timeout[i];
+      old_update_and_start(&old_queue);
+      old_insert(&old_queue, &old_nodes[i]);
+      old_update_and_start(&old_queue);
+      now_us += 1000;
+    }
+    for (i = 0; i < REQUESTS; i++) {
+      old_remove(&old_queue, (coap_tid_t) (ack_order[i] * 40503u & 0xffff));
+      old_update_and_start(&old_queue);
+      now_us += 1000;
+    }
+    t_old += seconds() - start;
+    arms_old += timer_arms - arms;
+  }
+
+  printf("%d requests sent and acknowledged, per request:\n", REQUESTS);
+  printf("  %-20s %8.1f ns %6.3f OS timer arms\n", "timer wheel", t_new * 1e9 / reps / REQUESTS,
+         (double) arms_new / reps / REQUESTS);
+  printf("  %-20s %8.1f ns %6.3f OS timer arms\n", "delta list (before)", t_old * 1e9 / reps / REQUESTS,
+         (double) arms_old / reps / REQUESTS);
+}
+
+int main(int argc, char **argv) {
+  unsigned int steps = 200000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench();
+      return 0;
+    case 'n':
+      steps = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n steps] [-s seed] | -b\n", argv[0]);
+      return 2;
+    }
+  }
+
+  check_sendqueue();
+  check_wheel(steps);
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("wheeltest: send queue and %u wheel steps ok\n", steps);
+  return 0;
+}
@@ -0,0 +1,488 @@
+/*
+ * Host fuzz and throughput harness for the websocket frame parser in
+ * app/websocket/websocketframe.c.
+ *
+ *   wsfuzz [-n rounds] [-s seed]   random valid frame streams, fed in random
+ *                                  pieces and checked against what was sent,
+ *                                  then mutated streams for the sanitizers
+ *   wsfuzz -b                      parser throughput on 1460 byte segments
+ *
+ * Built with -DWSFUZZ_LIBFUZZER it is a libFuzzer target instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "websocketframe.h"
+
+#define MAX_EVENTS 256
+
+typedef struct {
+  int opCode;
+  char *data;
+  unsigned int len;
+} event;
+
+typedef struct {
+  event ev[MAX_EVENTS];
+  int count;
+  // stream mode: the message being put together from its pieces
+  char *partial;
+  unsigned int partialLen;
+  int partialOp;
+  int flags;
+  unsigned int maxMessage;
+  int failed;
+} collector;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint32_t rnd(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t) (rng_state >> 16);
+}
+
+static unsigned int rnd_below(unsigned int n) {
+  return n ? rnd() % n : 0;
+}
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n ? n : 1);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+  return p;
+}
+
+static void push_event(collector *c, int opCode, const char *data, unsigned int len) {
+  if (c->count == MAX_EVENTS) {
+    c->failed = 1;
+    return;
+  }
+  event *e = &c->ev[c->count++];
+  e->opCode = opCode;
+  e->len = len;
+  e->data = xrealloc(NULL, len);
+  memcpy(e->data, data, len);
+}
+
+static void clear_events(collector *c) {
+  int i;
+
+  for (i = 0; i < c->count; i++) {
+    free(c->ev[i].data);
+  }
+  free(c->partial);
+  memset(c->ev, 0, sizeof(c->ev));
+  c->count = 0;
+  c->partial = NULL;
+  c->partialLen = 0;
+  c->partialOp = 0;
+  c->failed = 0;
+}
+
+static int on_frame(void *arg, int opCode, char *data, unsigned int len, bool fin) {
+  collector *c = arg;
+
+  if (opCode & 0x08) {
+    if (!fin || len > WS_CONTROL_MAX) {
+      fprintf(stderr, "bad control frame delivered: op %d len %u fin %d\n", opCode, len, fin);
+      c->failed = 1;
+    }
+    push_event(c, opCode, data, len);
+    return 0;
+  }
+  if (opCode != WS_OPCODE_TEXT && opCode != WS_OPCODE_BINARY) {
+    fprintf(stderr, "bad message opcode %d delivered\n", opCode);
+    c->failed = 1;
+    return 0;
+  }
+
+  if (!(c->flags & WS_PARSER_STREAM)) {
+    if (!fin || (c->maxMessage && len > c->maxMessage)) {
+      fprintf(stderr, "bad message delivered: len %u fin %d\n", len, fin);
+      c->failed = 1;
+    }
+    push_event(c, opCode, data, len);
+    return 0;
+  }
+
+  if (c->partialOp && c->partialOp != opCode) {
+    fprintf(stderr, "opcode changed within a message\n");
+    c->failed = 1;
+  }
+  c->partialOp = opCode;
+  c->partial = xrealloc(c->partial, c->partialLen + len);
+  memcpy(c->partial + c->partialLen, data, len);
+  c->partialLen += len;
+  if (fin) {
+    push_event(c, opCode, c->partial, c->partialLen);
+    c->partialLen = 0;
+    c->partialOp = 0;
+  }
+  return 0;
+}
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t size;
+} wire;
+
+static void wire_put(wire *w, const void *data, size_t len) {
+  if (w->len + len > w->size) {
+    w->size = (w->len + len) * 2;
+    w->buf = xrealloc(w->buf, w->size);
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+// One frame, sometimes with a longer length encoding than needed, which
+// the protocol allows
+static void put_frame(wire *w, int opCode, bool fin, const char *payload, unsigned int len, bool masked) {
+  uint8_t header[WS_FRAME_HEADER_MAX];
+  uint8_t mask[4];
+  int hlen, i;
+
+  for (i = 0; i < 4; i++) {
+    mask[i] = rnd();
+  }
+  if (!(opCode & 0x08) && len < 126 && rnd_below(8) == 0) {
+    header[0] = (fin ? 0x80 : 0) | opCode;
+    header[1] = (masked ? 0x80 : 0) | 127;
+    for (i = 0; i < 8; i++) {
+      header[2 + i] = i < 6 ? 0 : (uint8_t) (len >> ((7 - i) * 8));
+    }
+    hlen = 10;
+    if (masked) {
+      memcpy(header + hlen, mask, 4);
+      hlen += 4;
+    }
+  } else {
+    hlen = ws_frameHeader(header, opCode, fin, len, masked ? mask : NULL);
+  }
+  wire_put(w, header, hlen);
+
+  size_t at = w->len;
+  wire_put(w, payload, len);
+  if (masked) {
+    ws_frameMask(w->buf + at, len, mask, 0);
+  }
+}
+
+// Lengths around every length encoding boundary, otherwise mostly small
+static unsigned int random_length(void) {
+  static const unsigned int edges[] = { 0, 1, 125, 126, 127, 65535, 65536, 65537 };
+
+  switch (rnd_below(8)) {
+  case 0:
+    return edges[rnd_below(sizeof(edges) / sizeof(edges[0]))];
+  case 1:
+    return rnd_below(70000);
+  default:
+    return rnd_below(2000);
+  }
+}
+
+// Random messages, fragmented, with control frames between the fragments;
+// the expected events are recorded in want
+static void build_stream(wire *w, collector *want, bool masked) {
+  int messages = 1 + rnd_below(6);
+  int m, f;
+  char control[WS_CONTROL_MAX];
+
+  while (messages--) {
+    int opCode = rnd_below(2) ? WS_OPCODE_TEXT : WS_OPCODE_BINARY;
+    unsigned int len = random_length();
+    char *payload = xrealloc(NULL, len);
+    for (m = 0; m < (int) len; m++) {
+      payload[m] = rnd();
+    }
+
+    int fragments = rnd_below(4) ? 1 : 1 + rnd_below(5);
+    unsigned int at = 0;
+    for (f = 0; f < fragments; f++) {
+      bool fin = f == fragments - 1;
+      unsigned int n = fin ? len - at : rnd_below(len - at + 1);
+      put_frame(w, f == 0 ? opCode : WS_OPCODE_CONTINUATION, fin, payload + at, n, masked);
+      at += n;
+      // the message is delivered once its last fragment is in, after the
+      // control frames between its fragments
+      if (fin) {
+        push_event(want, opCode, payload, len);
+      }
+
+      if (rnd_below(4) == 0) {
+        int op = rnd_below(3) == 0 ? WS_OPCODE_PONG : WS_OPCODE_PING;
+        unsigned int clen = rnd_below(WS_CONTROL_MAX + 1);
+        for (m = 0; m < (int) clen; m++) {
+          control[m] = rnd();
+        }
+        put_frame(w, op, true, control, clen, masked);
+        push_event(want, op, control, clen);
+      }
+    }
+    free(payload);
+  }
+}
+
+// Feeds the stream in random pieces: mostly TCP segment sized, sometimes
+// down to single bytes so headers get split everywhere
+static int feed_pieces(ws_parser *p, char *data, size_t len) {
+  int small = rnd_below(4) == 0;
+
+  while (len > 0) {
+    unsigned int n = small ? 1 + rnd_below(16) : 1 + rnd_below(1460);
+    if (n > len) {
+      n = len;
+    }
+    int result = ws_parserFeed(p, data, n);
+    if (result) {
+      return result;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int compare(const collector *want, const collector *got) {
+  int i;
+
+  if (got->failed) {
+    return 0;
+  }
+  if (got->count != want->count) {
+    fprintf(stderr, "%d events, expected %d\n", got->count, want->count);
+    return 0;
+  }
+  for (i = 0; i < want->count; i++) {
+    const event *a = &want->ev[i], *b = &got->ev[i];
+    if (a->opCode != b->opCode || a->len != b->len || memcmp(a->data, b->data, a->len)) {
+      fprintf(stderr, "event %d: op %d len %u, expected op %d len %u\n", i, b->opCode, b->len,
+              a->opCode, a->len);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int check_accept_key(void) {
+  // the example from RFC 6455 section 1.3
+  static const char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+  char *accept = ws_acceptKey(key, sizeof(key) - 1);
+  int ok = accept != NULL && strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == 0;
+
+  if (!ok) {
+    fprintf(stderr, "ws_acceptKey: got %s\n", accept ? accept : "NULL");
+  }
+  free(accept);
+  return ok;
+}
+
+// Valid streams must come out exactly as they went in, in every mode
+static int check_valid(unsigned int rounds) {
+  static collector want, got;
+  unsigned int round;
+  wire w = { 0 };
+
+  for (round = 0; round < rounds; round++) {
+    int flags = rnd_below(4);
+    bool masked = (flags & WS_PARSER_MASKED) || rnd_below(2);
+    ws_parser p;
+
+    w.len = 0;
+    build_stream(&w, &want, masked);
+
+    got.flags = flags;
+    got.maxMessage = 0;
+    ws_parserInit(&p, 0, flags, on_frame, &got);
+    int result = feed_pieces(&p, w.buf, w.len);
+    ws_parserFree(&p);
+
+    if (result != 0 || !compare(&want, &got)) {
+      fprintf(stderr, "round %u failed: result %d, flags %d, %zu bytes\n", round, result, flags,
+              w.len);
+      return 0;
+    }
+    clear_events(&want);
+    clear_events(&got);
+  }
+  free(w.buf);
+  return 1;
+}
+
+// Damaged streams may be rejected but must never be read or written out
+// of bounds, which the sanitizers check; whatever is delivered must still
+// obey the callback contract
+static int check_mutated(unsigned int rounds) {
+  static collector want, got;
+  unsigned int round;
+  wire w = { 0 };
+
+  for (round = 0; round < rounds; round++) {
+    int flags = rnd_below(4);
+    ws_parser p;
+    int i;
+
+    w.len = 0;
+    build_stream(&w, &want, rnd_below(2));
+    clear_events(&want);
+    for (i = rnd_below(8); i >= 0 && w.len; i--) {
+      switch (rnd_below(3)) {
+      case 0:
+        w.buf[rnd_below(w.len)] ^= 1 << rnd_below(8);
+        break;
+      case 1:
+        w.buf[rnd_below(w.len)] = rnd();
+        break;
+      default:
+        w.len = rnd_below(w.len);
+        break;
+      }
+    }
+
+    got.flags = flags;
+    got.maxMessage = rnd_below(2) ? 0 : rnd_below(4096);
+    ws_parserInit(&p, got.maxMessage, flags, on_frame, &got);
+    int result = feed_pieces(&p, w.buf, w.len);
+    ws_parserFree(&p);
+
+    if (got.failed || (result != 0 && result != WS_CLOSE_PROTOCOL_ERROR && result != WS_CLOSE_TOO_BIG)) {
+      fprintf(stderr, "mutated round %u failed: result %d\n", round, result);
+      return 0;
+    }
+    clear_events(&got);
+  }
+  free(w.buf);
+  return 1;
+}
+
+static int count_frame(void *arg, int opCode, char *data, unsigned int len, bool fin) {
+  (void) opCode;
+  (void) data;
+  (void) fin;
+  *(uint64_t *) arg += len;
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Masked client frames as a server receives them, cut into 1460 byte
+// segments like TCP delivers them
+static void bench(void) {
+  static const unsigned int sizes[] = { 16, 125, 1024, 16384, 65536 };
+  static const char *modes[] = { "messages", "stream" };
+  unsigned int s, mode;
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    wire w = { 0 };
+    char *payload = xrealloc(NULL, sizes[s]);
+    unsigned int i;
+
+    memset(payload, 'x', sizes[s]);
+    while (w.len < (4 << 20)) {
+      put_frame(&w, WS_OPCODE_BINARY, true, payload, sizes[s], true);
+    }
+    char *copy = xrealloc(NULL, w.len);
+
+    for (mode = 0; mode < 2; mode++) {
+      uint64_t delivered = 0;
+      double elapsed = 0;
+      int reps = 0;
+      ws_parser p;
+
+      ws_parserInit(&p, 0, WS_PARSER_MASKED | (mode ? WS_PARSER_STREAM : 0), count_frame, &delivered);
+      while (elapsed < 0.5) {
+        memcpy(copy, w.buf, w.len);
+        double start = now();
+        for (i = 0; i < w.len; i += 1460) {
+          ws_parserFeed(&p, copy + i, w.len - i < 1460 ? w.len - i : 1460);
+        }
+        elapsed += now() - start;
+        reps++;
+      }
+      ws_parserFree(&p);
+      printf("%6u byte frames, %-8s %8.1f MB/s\n", sizes[s], modes[mode],
+             (double) w.len * reps / elapsed / 1e6);
+    }
+    free(copy);
+    free(payload);
+    free(w.buf);
+  }
+}
+
+#ifdef WSFUZZ_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static collector got;
+  int flags;
+
+  for (flags = 0; flags < 4; flags++) {
+    char *copy = xrealloc(NULL, size);
+    ws_parser p;
+    size_t at = 0;
+
+    memcpy(copy, data, size);
+    got.flags = flags;
+    got.maxMessage = 4096;
+    ws_parserInit(&p, got.maxMessage, flags, on_frame, &got);
+    // split into uneven pieces so the header reassembly is exercised too
+    while (at < size) {
+      size_t n = 1 + (copy[at] & 0x3f);
+      if (n > size - at) {
+        n = size - at;
+      }
+      if (ws_parserFeed(&p, copy + at, n)) {
+        break;
+      }
+      at += n;
+    }
+    ws_parserFree(&p);
+    if (got.failed) {
+      abort();
+    }
+    clear_events(&got);
+    free(copy);
+  }
+  return 0;
+}
+#else
+int main(int argc, char **argv) {
+  unsigned int rounds = 2000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench();
+      return 0;
+    case 'n':
+      rounds = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n rounds] [-s seed] | -b\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (!check_accept_key() || !check_valid(rounds) || !check_mutated(rounds * 4)) {
+    return 1;
+  }
+  printf("wsfuzz: %u valid and %u mutated streams ok\n", rounds, rounds * 4);
+  return 0;
+}
+#endif